@@ -0,0 +1,170 @@
+/*
+ * Counts heap allocations made by gdns while answering queries. A fake upstream on the same loop
+ * answers every forwarded query at once, the calls to malloc and realloc from the gdns sources are
+ * intercepted with the linker's --wrap.
+ *
+ *   bench_alloc [queries] [concurrency] [proxies]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <resolv.h>
+#include "../src/common.h"
+#include "../src/session.h"
+#include "../src/upstream.h"
+#include "../src/cache.h"
+#include "../src/pool.h"
+#include "../src/rules.h"
+#include "../src/snapshot.h"
+#include "../src/wheel.h"
+
+void *__real_malloc(size_t size);
+
+void *__real_realloc(void *ptr, size_t size);
+
+static uint64_t malloc_count = 0;
+static uint64_t malloc_bytes = 0;
+
+void *__wrap_malloc(size_t size) {
+    malloc_count += 1;
+    malloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    malloc_count += 1;
+    malloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+static char upstream_buf[DNS_PACKET_SIZE];
+static char client_buf[DNS_PACKET_SIZE];
+static int replies = 0;
+static int expected_replies = 0;
+
+static void static_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = handle->data;
+    buf->len = DNS_PACKET_SIZE;
+}
+
+// answer with an empty NOERROR response, which every proxy forwards at once.
+static void on_upstream_query(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                              unsigned flags) {
+    uv_buf_t reply;
+
+    if (nread <= 0 || addr == NULL) {
+        return;
+    }
+    buf->base[2] |= 0x80; // QR
+    buf->base[3] |= 0x80; // RA
+    reply = uv_buf_init(buf->base, (unsigned int) nread);
+    uv_udp_try_send(handle, &reply, 1, addr);
+}
+
+static void on_client_reply(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                            unsigned flags) {
+    if (nread > 0 && ++replies == expected_replies) {
+        uv_stop(handle->loop);
+    }
+}
+
+static void bind_local(uv_loop_t *loop, uv_udp_t *handle, struct sockaddr_in *addr) {
+    int len = sizeof(*addr);
+
+    uv_udp_init(loop, handle);
+    uv_ip4_addr("127.0.0.1", 0, addr);
+    if (uv_udp_bind(handle, (struct sockaddr *) addr, 0) != 0) {
+        fprintf(stderr, "bind failed\n");
+        exit(1);
+    }
+    uv_udp_getsockname(handle, (struct sockaddr *) addr, &len);
+}
+
+int main(int argc, char **argv) {
+    int queries = argc > 1 ? atoi(argv[1]) : 100000;
+    int concurrency = argc > 2 ? atoi(argv[2]) : 64;
+    int proxy_count = argc > 3 ? atoi(argv[3]) : 2;
+    uv_loop_t *loop = uv_default_loop();
+    uv_udp_t upstream, client;
+    struct sockaddr_in upstream_addr, client_addr;
+    server_cfg_t cfg;
+    server_ctx_t *ctx;
+    rules_t rules;
+    snapshot_t snapshot;
+    unsigned char query[PACKETSZ];
+    int query_len, sent, i;
+    uint64_t count_start, bytes_start, start_time;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.proxies_count = proxy_count;
+    cfg.proxies = calloc((size_t) proxy_count, sizeof(upstream_proxy_t));
+    cfg.query_timeout = 1000;
+    cfg.upstream_sockets = 4;
+    cfg.workers = 1;
+
+    bind_local(loop, &upstream, &upstream_addr);
+    upstream.data = upstream_buf;
+    uv_udp_recv_start(&upstream, static_alloc_cb, on_upstream_query);
+    bind_local(loop, &client, &client_addr);
+    client.data = client_buf;
+    uv_udp_recv_start(&client, static_alloc_cb, on_client_reply);
+
+    for (i = 0; i < proxy_count; ++i) {
+        cfg.proxies[i].addr = (struct sockaddr *) &upstream_addr;
+        cfg.proxies[i].internal = true;
+        cfg.proxies[i].enabled = true;
+    }
+
+    // the same steps as a worker's server_ctx_init, without a subnet list, rules or cache.
+    ctx = TMALLOC(server_ctx_t);
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->cfg = &cfg;
+    ctx->handle = TMALLOC(uv_udp_t);
+    loop->data = ctx;
+    server_pools_init(ctx);
+    wheel_init(&ctx->wheel, loop);
+    cache_init(&ctx->cache, 0);
+    rules_init(&rules);
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.cfg = &cfg;
+    snapshot.rules = &rules;
+    snapshot.refs = 1; // never released.
+    uv_udp_init(loop, ctx->handle);
+    if ((ctx->generation = generation_create(loop, &snapshot)) == NULL) {
+        fprintf(stderr, "init upstreams failed\n");
+        return 1;
+    }
+    ctx->generation->proxy_stats = calloc((size_t) proxy_count, sizeof(proxy_stats_t));
+
+    query_len = res_mkquery(QUERY, "www.example.com", C_IN, T_A, NULL, 0, NULL, query, PACKETSZ);
+
+    count_start = bytes_start = start_time = 0;
+    for (sent = 0; sent < queries;) {
+        int batch = queries - sent < concurrency ? queries - sent : concurrency;
+
+        if (sent == concurrency) { // the first batch warms up pools and sockets.
+            count_start = malloc_count;
+            bytes_start = malloc_bytes;
+            start_time = uv_hrtime();
+        }
+        replies = 0;
+        expected_replies = batch;
+        for (i = 0; i < batch; ++i) {
+            ns_put16((uint16_t) (sent + i), query);
+            session_setup(ctx, (struct sockaddr *) &client_addr, NULL, (char *) query, query_len);
+        }
+        uv_run(loop, UV_RUN_DEFAULT);
+        sent += batch;
+    }
+
+    queries -= concurrency;
+    if (queries <= 0) {
+        fprintf(stderr, "need more queries than concurrency\n");
+        return 1;
+    }
+    printf("queries: %d, proxies: %d, concurrency: %d\n", queries, proxy_count, concurrency);
+    printf("allocations per query: %.2f\n", (double) (malloc_count - count_start) / queries);
+    printf("bytes allocated per query: %.0f\n", (double) (malloc_bytes - bytes_start) / queries);
+    printf("elapsed: %.1f ms\n", (uv_hrtime() - start_time) / 1e6);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Compares the zero copy parser of dns.c with libresolv's ns_initparse/ns_parserr on the work a response
+ * takes in gdns: find the question, then read type, ttl and rdata of every record.
+ *
+ *   bench_dns [iterations] [capture]
+ *
+ * capture holds responses framed as on tcp, a 2 bytes length before each message. Without it a few
+ * typical answers built in place are used.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <resolv.h>
+#include "../src/common.h"
+#include "../src/dns.h"
+
+#define MAX_SAMPLES 1024
+
+typedef struct {
+    unsigned char data[DNS_PACKET_SIZE];
+    int len;
+} sample_t;
+
+static sample_t samples[MAX_SAMPLES];
+static int sample_count = 0;
+static volatile uint32_t sink;
+
+static unsigned char *put_rr(unsigned char *p, uint16_t name, int type, uint32_t ttl, const void *rdata,
+                             int rdlength) {
+    ns_put16(name, p);
+    ns_put16((uint16_t) type, p + 2);
+    ns_put16(ns_c_in, p + 4);
+    ns_put32(ttl, p + 6);
+    ns_put16((uint16_t) rdlength, p + 10);
+    memcpy(p + 12, rdata, (size_t) rdlength);
+    return p + 12 + rdlength;
+}
+
+// response to a query for domain, an+ns+ar records follow with put_rr.
+static unsigned char *begin_response(sample_t *sample, const char *domain, int type, int an, int ns, int ar) {
+    int len = res_mkquery(ns_o_query, domain, ns_c_in, type, NULL, 0, NULL, sample->data, PACKETSZ);
+
+    sample->data[2] |= 0x80; // QR
+    sample->data[3] |= 0x80; // RA
+    ns_put16((uint16_t) an, sample->data + 6);
+    ns_put16((uint16_t) ns, sample->data + 8);
+    ns_put16((uint16_t) ar, sample->data + 10);
+    return sample->data + len;
+}
+
+static void builtin_samples(void) {
+    static const unsigned char opt[] = {0x00, 0x00, 0x29, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    static const unsigned char cname[] = {7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 7, 'e', 'd', 'g', 'e', 'k', 'e', 'y',
+                                          3, 'n', 'e', 't', 0};
+    static const unsigned char soa[] = {2, 'n', 's', 0xc0, 0x10, 4, 'r', 'o', 'o', 't', 0xc0, 0x10,
+                                        0, 0, 0, 1, 0, 0, 0x0e, 0x10, 0, 0, 0x03, 0x84, 0, 0x09, 0x3a, 0x80,
+                                        0, 0, 0x01, 0x2c};
+    static const unsigned char aaaa[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    unsigned char a[4] = {93, 184, 216, 34};
+    unsigned char *p;
+    uint16_t target;
+    sample_t *s;
+    int i;
+
+    // a CNAME to a cdn with a few A records and EDNS.
+    s = &samples[sample_count++];
+    p = begin_response(s, "www.example.com", ns_t_a, 4, 0, 1);
+    target = (uint16_t) (p - s->data + 12); // rdata of the CNAME.
+    p = put_rr(p, 0xc00c, ns_t_cname, 300, cname, sizeof(cname));
+    for (i = 0; i < 3; ++i, ++a[3]) {
+        p = put_rr(p, 0xc000 | target, ns_t_a, 20, a, 4);
+    }
+    memcpy(p, opt, sizeof(opt));
+    p += sizeof(opt);
+    s->len = (int) (p - s->data);
+
+    // the single A record a poisoned answer carries.
+    s = &samples[sample_count++];
+    p = begin_response(s, "www.facebook.com", ns_t_a, 1, 0, 0);
+    p = put_rr(p, 0xc00c, ns_t_a, 60, a, 4);
+    s->len = (int) (p - s->data);
+
+    // AAAA answer.
+    s = &samples[sample_count++];
+    p = begin_response(s, "ipv6.example.org", ns_t_aaaa, 2, 0, 0);
+    p = put_rr(p, 0xc00c, ns_t_aaaa, 3600, aaaa, 16);
+    p = put_rr(p, 0xc00c, ns_t_aaaa, 3600, aaaa, 16);
+    s->len = (int) (p - s->data);
+
+    // no data, the SOA in authority.
+    s = &samples[sample_count++];
+    p = begin_response(s, "mail.example.net", ns_t_mx, 0, 1, 0);
+    p = put_rr(p, 0xc011, ns_t_soa, 900, soa, sizeof(soa));
+    s->len = (int) (p - s->data);
+}
+
+static int load_capture(const char *path) {
+    FILE *file = fopen(path, "rb");
+    unsigned char prefix[2];
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (sample_count < MAX_SAMPLES && fread(prefix, 1, 2, file) == 2) {
+        sample_t *s = &samples[sample_count];
+        s->len = ns_get16(prefix);
+        if (s->len > DNS_PACKET_SIZE || fread(s->data, 1, (size_t) s->len, file) != (size_t) s->len) {
+            break;
+        }
+        sample_count += 1;
+    }
+    fclose(file);
+    return 0;
+}
+
+static uint32_t walk_resolv(const unsigned char *data, int len) {
+    ns_msg msg;
+    ns_rr rr;
+    uint32_t sum = 0;
+    int section, i;
+
+    if (ns_initparse(data, len, &msg)) {
+        return 0;
+    }
+    if (ns_parserr(&msg, ns_s_qd, 0, &rr) == 0) {
+        sum += ns_rr_type(rr) + ns_rr_class(rr);
+    }
+    for (section = ns_s_an; section <= ns_s_ar; ++section) {
+        for (i = 0; i < ns_msg_count(msg, (ns_sect) section); ++i) {
+            if (ns_parserr(&msg, (ns_sect) section, i, &rr)) {
+                return sum;
+            }
+            sum += ns_rr_type(rr) + ns_rr_ttl(rr) + ns_rr_rdlen(rr) + (ns_rr_rdlen(rr) ? ns_rr_rdata(rr)[0] : 0);
+        }
+    }
+    return sum;
+}
+
+static uint32_t walk_gdns(const unsigned char *data, int len) {
+    dns_question_t question;
+    dns_msg_t msg;
+    dns_rr_iter_t iter;
+    dns_rr_t rr;
+    uint32_t sum = 0;
+
+    if (dns_parse_question((const char *) data, len, &question) == 0) {
+        sum += question.qtype + question.qclass;
+    }
+    if (dns_msg_init(&msg, (const char *) data, len)) {
+        return sum;
+    }
+    dns_rr_iter_init(&iter, &msg);
+    while (dns_rr_next(&iter, &rr) > 0) {
+        sum += rr.type + rr.ttl + rr.rdlength + (rr.rdlength ? rr.rdata[0] : 0);
+    }
+    return sum;
+}
+
+static double run(uint32_t (*walk)(const unsigned char *, int), long iterations) {
+    uint64_t start = uv_hrtime();
+    uint32_t sum = 0;
+    long i;
+
+    for (i = 0; i < iterations; ++i) {
+        sample_t *s = &samples[i % sample_count];
+        sum += walk(s->data, s->len);
+    }
+    sink = sum;
+    return (double) (uv_hrtime() - start) / (double) iterations;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    double resolv_ns, gdns_ns;
+    int i;
+
+    if (argc > 2) {
+        if (load_capture(argv[2])) {
+            return 1;
+        }
+    } else {
+        builtin_samples();
+    }
+    if (sample_count == 0 || iterations <= 0) {
+        fprintf(stderr, "nothing to parse\n");
+        return 1;
+    }
+    for (i = 0; i < sample_count; ++i) {
+        if (walk_resolv(samples[i].data, samples[i].len) != walk_gdns(samples[i].data, samples[i].len)) {
+            fprintf(stderr, "sample %d: parsers disagree\n", i);
+        }
+    }
+
+    run(walk_resolv, iterations / 10); // warm up.
+    resolv_ns = run(walk_resolv, iterations);
+    gdns_ns = run(walk_gdns, iterations);
+
+    printf("samples: %d, iterations: %ld\n", sample_count, iterations);
+    printf("libresolv: %.1f ns per message\n", resolv_ns);
+    printf("gdns:      %.1f ns per message\n", gdns_ns);
+    printf("speedup:   %.2fx\n", resolv_ns / gdns_ns);
+    return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Drives a running gdns at a fixed rate of udp queries and reports throughput, latency percentiles and how
+ * the answers came out. Point gdns at fake_upstream for a run without network access, load.sh does both.
+ *
+ *   bench_load [-s ip:port] [-q qps] [-d seconds] [-n names] [-b blocked %] [-w wait ms] [-m stats ip:port]
+ *
+ * Queries go out on a schedule whatever the answers take. Names are drawn from a pool of n domestic and n
+ * blocked ones, 0 makes every name new so no answer comes from the cache. An answer is genuine when it
+ * carries the address fake_upstream gives the name, forged when it carries the injected one. With -m the
+ * counters of the stats endpoint before and after the run add how gdns decided.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <resolv.h>
+#include "../src/common.h"
+#include "../src/dns.h"
+#include "simulation.h"
+
+#define CLIENT_SOCKETS 16 // distinct source ports spread the load over the workers of gdns.
+#define IDS_PER_SOCKET 65536
+#define SLOTS (CLIENT_SOCKETS * IDS_PER_SOCKET)
+#define TICK_MS 1
+#define SCRAPE_SIZE (256 * 1024)
+
+typedef enum {
+    OUTCOME_GENUINE,
+    OUTCOME_FORGED,
+    OUTCOME_EMPTY,
+    OUTCOME_ERROR,
+    OUTCOME_OTHER,
+    OUTCOMES
+} outcome_t;
+
+typedef struct {
+    uint64_t answers[ANSWER_PATHS];
+    uint64_t queries;
+    uint64_t cache_hits;
+    uint64_t coalesced;
+    uint64_t upstream_queries;
+} scrape_t;
+
+static const char *outcome_names[OUTCOMES] = {"genuine", "forged", "empty", "error", "other"};
+
+// the order of answer_path_t, as stats.c labels them.
+static const char *answer_paths[ANSWER_PATHS] = {"tcp", "empty", "non_a", "in_subnet", "confident", "rule",
+                                                 "timeout_fallback", "dropped"};
+
+static uv_udp_t sockets[CLIENT_SOCKETS];
+static char recv_buf[DNS_PACKET_SIZE];
+static struct sockaddr_in server_addr;
+static uint64_t *sent_at; // hrtime of the query in flight per slot, 0 when free.
+static uint64_t *latencies; // us
+static size_t latency_count = 0;
+static size_t latency_capacity = 0;
+static uint64_t outcomes[OUTCOMES];
+static uint64_t sent = 0;
+static uint64_t send_errors = 0;
+static uint64_t overwritten = 0; // still unanswered when its slot came round again.
+static uint64_t start_time;
+static uint64_t send_end;
+
+static int qps = 1000;
+static int duration = 10;
+static int names = 10000;
+static int blocked_percent = 30;
+static int wait_ms = 3000;
+
+static void send_query(void);
+
+static void on_tick(uv_timer_t *timer);
+
+static void on_wait_done(uv_timer_t *timer);
+
+static void recv_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+
+static void on_answer(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                      unsigned flags);
+
+static outcome_t classify(const char *data, ssize_t len);
+
+static void add_latency(uint64_t us);
+
+static int compare_u64(const void *a, const void *b);
+
+static uint64_t percentile(double fraction);
+
+static int parse_addr(const char *spec, struct sockaddr_in *addr);
+
+static int scrape(const struct sockaddr_in *addr, scrape_t *scrape);
+
+static void print_decisions(const scrape_t *before, const scrape_t *after);
+
+static void print_usage(void);
+
+int main(int argc, char **argv) {
+    uv_loop_t *loop = uv_default_loop();
+    struct sockaddr_in local, stats_addr;
+    scrape_t before, after;
+    bool stats = false;
+    uv_timer_t tick;
+    uint64_t answered = 0, lost;
+    double send_seconds;
+    int opt, i;
+
+    uv_ip4_addr("127.0.0.1", 5555, &server_addr);
+    while ((opt = getopt(argc, argv, "s:q:d:n:b:w:m:h")) != -1) {
+        switch (opt) {
+            case 's':
+                if (parse_addr(optarg, &server_addr)) {
+                    return 1;
+                }
+                break;
+            case 'q':
+                qps = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'n':
+                names = atoi(optarg);
+                break;
+            case 'b':
+                blocked_percent = atoi(optarg);
+                break;
+            case 'w':
+                wait_ms = atoi(optarg);
+                break;
+            case 'm':
+                if (parse_addr(optarg, &stats_addr)) {
+                    return 1;
+                }
+                stats = true;
+                break;
+            default:
+                print_usage();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (qps <= 0 || duration <= 0 || names < 0 || blocked_percent < 0 || blocked_percent > 100 || wait_ms < 0) {
+        print_usage();
+        return 1;
+    }
+
+    sent_at = xmalloc(sizeof(uint64_t) * SLOTS);
+    memset(sent_at, 0, sizeof(uint64_t) * SLOTS);
+    uv_ip4_addr("127.0.0.1", 0, &local);
+    for (i = 0; i < CLIENT_SOCKETS; ++i) {
+        uv_udp_init(loop, &sockets[i]);
+        sockets[i].data = (void *) (intptr_t) i;
+        if (uv_udp_bind(&sockets[i], (const struct sockaddr *) &local, 0) ||
+            uv_udp_recv_start(&sockets[i], recv_alloc_cb, on_answer)) {
+            fprintf(stderr, "bind failed\n");
+            return 1;
+        }
+    }
+    if (stats && scrape(&stats_addr, &before)) {
+        return 1;
+    }
+
+    start_time = uv_hrtime();
+    uv_timer_init(loop, &tick);
+    uv_timer_start(&tick, on_tick, 0, TICK_MS);
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    if (stats && scrape(&stats_addr, &after)) {
+        return 1;
+    }
+    for (i = 0; i < OUTCOMES; ++i) {
+        answered += outcomes[i];
+    }
+    lost = sent - answered;
+    send_seconds = (double) (send_end - start_time) / 1e9;
+
+    printf("target: %d qps for %d s, %d names, %d%% blocked\n", qps, duration, names, blocked_percent);
+    printf("sent: %lu (%.0f qps), send errors: %lu\n", (unsigned long) sent, sent / send_seconds,
+           (unsigned long) send_errors);
+    printf("answered: %lu (%.0f qps), lost: %lu (%.2f%%)\n", (unsigned long) answered, answered / send_seconds,
+           (unsigned long) lost, sent ? 100.0 * lost / sent : 0.0);
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+    printf("latency: p50 %.2f ms, p99 %.2f ms, p999 %.2f ms, max %.2f ms\n", percentile(0.5) / 1e3,
+           percentile(0.99) / 1e3, percentile(0.999) / 1e3, percentile(1.0) / 1e3);
+    printf("answers:");
+    for (i = 0; i < OUTCOMES; ++i) {
+        printf(" %s %lu%s", outcome_names[i], (unsigned long) outcomes[i], i + 1 < OUTCOMES ? "," : "\n");
+    }
+    if (overwritten) {
+        printf("unanswered when their id was reused: %lu\n", (unsigned long) overwritten);
+    }
+    if (stats) {
+        print_decisions(&before, &after);
+    }
+    return 0;
+}
+
+// slots go round the sockets first, so consecutive queries leave from different ports.
+static void send_query(void) {
+    unsigned char query[PACKETSZ];
+    char name[64];
+    uint64_t slot = sent % SLOTS;
+    uv_udp_t *handle = &sockets[slot % CLIENT_SOCKETS];
+    uint64_t n = names > 0 ? (uint64_t) rand() % (uint64_t) names : sent;
+    bool blocked = rand() % 100 < blocked_percent;
+    uv_buf_t buf;
+    int len;
+
+    snprintf(name, sizeof(name), "www%lu.%s.test", (unsigned long) n, blocked ? BLOCKED_MARK : "domestic");
+    len = res_mkquery(ns_o_query, name, ns_c_in, ns_t_a, NULL, 0, NULL, query, sizeof(query));
+    dns_put16((uint16_t) (slot / CLIENT_SOCKETS), query);
+
+    if (sent_at[slot]) {
+        overwritten += 1;
+    }
+    sent_at[slot] = uv_hrtime();
+    sent += 1;
+    buf = uv_buf_init((char *) query, (unsigned int) len);
+    if (uv_udp_try_send(handle, &buf, 1, (const struct sockaddr *) &server_addr) < 0) {
+        sent_at[slot] = 0;
+        send_errors += 1;
+    }
+}
+
+// catch up to where the schedule says we should be, a late tick sends a burst.
+static void on_tick(uv_timer_t *timer) {
+    uint64_t elapsed = uv_hrtime() - start_time;
+    uint64_t due;
+
+    if (elapsed >= (uint64_t) duration * 1000000000) {
+        elapsed = (uint64_t) duration * 1000000000;
+    }
+    due = elapsed * (uint64_t) qps / 1000000000;
+    while (sent < due) {
+        send_query();
+    }
+    if (elapsed == (uint64_t) duration * 1000000000) {
+        send_end = uv_hrtime();
+        uv_timer_start(timer, on_wait_done, (uint64_t) wait_ms, 0);
+    }
+}
+
+static void on_wait_done(uv_timer_t *timer) {
+    uv_stop(timer->loop);
+}
+
+static void recv_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = recv_buf;
+    buf->len = sizeof(recv_buf);
+}
+
+static void on_answer(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                      unsigned flags) {
+    uint64_t slot;
+
+    if (nread < NS_HFIXEDSZ) {
+        return;
+    }
+    slot = (uint64_t) dns_get16((const unsigned char *) buf->base) * CLIENT_SOCKETS + (uintptr_t) handle->data;
+    if (sent_at[slot] == 0) { // a duplicate, or a late answer to a reused id.
+        return;
+    }
+    add_latency((uv_hrtime() - sent_at[slot]) / 1000);
+    sent_at[slot] = 0;
+    outcomes[classify(buf->base, nread)] += 1;
+}
+
+static outcome_t classify(const char *data, ssize_t len) {
+    dns_question_t question;
+    dns_msg_t msg;
+    dns_rr_iter_t iter;
+    dns_rr_t rr;
+    char ip[INET_ADDRSTRLEN];
+    const char *genuine;
+
+    if (dns_parse_question(data, len, &question) || dns_msg_init(&msg, data, len)) {
+        return OUTCOME_OTHER;
+    }
+    if (dns_msg_rcode(&msg) != ns_r_noerror) {
+        return OUTCOME_ERROR;
+    }
+    genuine = strstr(question.name, BLOCKED_MARK) ? FOREIGN_IP : DOMESTIC_IP;
+    dns_rr_iter_init(&iter, &msg);
+    while (dns_rr_next(&iter, &rr) > 0) {
+        if (rr.section != ns_s_an || rr.type != ns_t_a || rr.rdlength != 4) {
+            continue;
+        }
+        inet_ntop(AF_INET, rr.rdata, ip, sizeof(ip));
+        if (strcmp(ip, genuine) == 0) {
+            return OUTCOME_GENUINE;
+        }
+        return strcmp(ip, FORGED_IP) == 0 ? OUTCOME_FORGED : OUTCOME_OTHER;
+    }
+    return OUTCOME_EMPTY;
+}
+
+static void add_latency(uint64_t us) {
+    if (latency_count == latency_capacity) {
+        latency_capacity = latency_capacity ? latency_capacity * 2 : 65536;
+        latencies = xrealloc(latencies, sizeof(uint64_t) * latency_capacity);
+    }
+    latencies[latency_count++] = us;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// of the sorted latencies, 0 without any.
+static uint64_t percentile(double fraction) {
+    size_t rank;
+
+    if (latency_count == 0) {
+        return 0;
+    }
+    rank = (size_t) (fraction * latency_count);
+    return latencies[rank < latency_count ? rank : latency_count - 1];
+}
+
+static int parse_addr(const char *spec, struct sockaddr_in *addr) {
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strchr(spec, ':');
+
+    if (colon == NULL || (size_t) (colon - spec) >= sizeof(ip)) {
+        fprintf(stderr, "expected ip:port, got %s\n", spec);
+        return -1;
+    }
+    memcpy(ip, spec, (size_t) (colon - spec));
+    ip[colon - spec] = '\0';
+    if (uv_ip4_addr(ip, atoi(colon + 1), addr)) {
+        fprintf(stderr, "bad address %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+// a blocking GET before and after the run, the loop has nothing else to do then.
+static int scrape(const struct sockaddr_in *addr, scrape_t *scrape) {
+    static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    char *text = xmalloc(SCRAPE_SIZE);
+    char *line, *next;
+    size_t len = 0;
+    ssize_t n;
+    int fd, i;
+
+    memset(scrape, 0, sizeof(*scrape));
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) ||
+        write(fd, request, sizeof(request) - 1) < 0) {
+        perror("stats endpoint");
+        if (fd >= 0) {
+            close(fd);
+        }
+        xfree(text);
+        return -1;
+    }
+    while (len < SCRAPE_SIZE - 1 && (n = read(fd, text + len, SCRAPE_SIZE - 1 - len)) > 0) {
+        len += (size_t) n;
+    }
+    close(fd);
+    text[len] = '\0';
+
+    for (line = text; line && *line; line = next) {
+        char *value;
+
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        value = strrchr(line, ' ');
+        if (line[0] == '#' || value == NULL) {
+            continue;
+        }
+        if (strncmp(line, "gdns_answers_total{path=\"", 25) == 0) {
+            for (i = 0; i < ANSWER_PATHS; ++i) {
+                size_t path_len = strlen(answer_paths[i]);
+                if (strncmp(line + 25, answer_paths[i], path_len) == 0 && line[25 + path_len] == '"') {
+                    scrape->answers[i] = strtoull(value + 1, NULL, 10);
+                }
+            }
+        } else if (strncmp(line, "gdns_queries_total ", 19) == 0) {
+            scrape->queries = strtoull(value + 1, NULL, 10);
+        } else if (strncmp(line, "gdns_cache_hits_total ", 22) == 0) {
+            scrape->cache_hits = strtoull(value + 1, NULL, 10);
+        } else if (strncmp(line, "gdns_coalesced_total ", 21) == 0) {
+            scrape->coalesced = strtoull(value + 1, NULL, 10);
+        } else if (strncmp(line, "gdns_proxy_queries_total{", 25) == 0) {
+            scrape->upstream_queries += strtoull(value + 1, NULL, 10);
+        }
+    }
+    xfree(text);
+    return 0;
+}
+
+static void print_decisions(const scrape_t *before, const scrape_t *after) {
+    uint64_t queries = after->queries - before->queries;
+    int i;
+
+    printf("gdns: %lu queries, cache hits %lu, coalesced %lu, upstream queries per query %.2f\n",
+           (unsigned long) queries, (unsigned long) (after->cache_hits - before->cache_hits),
+           (unsigned long) (after->coalesced - before->coalesced),
+           queries ? (double) (after->upstream_queries - before->upstream_queries) / queries : 0.0);
+    printf("gdns decisions:");
+    for (i = 0; i < ANSWER_PATHS; ++i) {
+        printf(" %s %lu%s", answer_paths[i], (unsigned long) (after->answers[i] - before->answers[i]),
+               i + 1 < ANSWER_PATHS ? "," : "\n");
+    }
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "usage: bench_load [-s ip:port] [-q qps] [-d seconds] [-n names] [-b blocked %%] [-w wait ms]\n"
+                    "                  [-m stats ip:port]\n");
+}
@@ -0,0 +1,389 @@
+/*
+ * Local stand-ins for the resolvers gdns sits between, so it can be loaded without network access. Every
+ * kind:port argument serves one resolver on 127.0.0.1:
+ *
+ *   internal  udp resolver behind the firewall, answers after the local delay, blocked names with a forged
+ *             address.
+ *   external  udp resolver abroad, the firewall injects a forged answer for a blocked name after the local
+ *             delay and the genuine one follows after the remote delay. Domestic names take the remote delay.
+ *   tcp       tcp resolver abroad, queries may be pipelined, the genuine answer after the remote delay.
+ *
+ *   fake_upstream [-l local ms] [-r remote ms] [-j jitter %] [-t ttl] kind:port...
+ *
+ * A query that is not for an A record gets an empty answer. Queries served per resolver are printed on
+ * SIGINT or SIGTERM.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "../src/common.h"
+#include "../src/dns.h"
+#include "simulation.h"
+
+#define MAX_RESOLVERS 32
+#define TCP_BUFFER_SIZE (2 * (DNS_PACKET_SIZE + 2))
+
+typedef enum {
+    KIND_INTERNAL,
+    KIND_EXTERNAL,
+    KIND_TCP
+} resolver_kind_t;
+
+typedef struct {
+    union {
+        uv_udp_t udp;
+        uv_tcp_t tcp;
+    } handle;
+    resolver_kind_t kind;
+    int port;
+    uint64_t queries;
+} resolver_t;
+
+typedef struct {
+    uv_tcp_t handle;
+    resolver_t *resolver;
+    char buf[TCP_BUFFER_SIZE];
+    size_t len;
+    int refs; // the handle and every pending reply.
+    bool closed;
+} connection_t;
+
+typedef struct {
+    uv_timer_t timer;
+    uv_write_t write_req;
+    resolver_t *resolver;
+    connection_t *connection; // NULL over udp.
+    struct sockaddr_storage addr;
+    char data[DNS_PACKET_SIZE + 2]; // over tcp the length prefix comes first.
+    size_t len;
+} reply_t;
+
+static resolver_t resolvers[MAX_RESOLVERS];
+static int resolver_count = 0;
+static int local_delay = 2;
+static int remote_delay = 60;
+static int jitter = 20;
+static uint32_t ttl = 60;
+static char udp_buf[DNS_PACKET_SIZE];
+
+static int add_resolver(uv_loop_t *loop, const char *spec);
+
+static void udp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+
+static void on_udp_query(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                         unsigned flags);
+
+static void on_tcp_connection(uv_stream_t *server, int status);
+
+static void tcp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+
+static void on_tcp_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+static void on_connection_close(uv_handle_t *handle);
+
+static void connection_release(connection_t *connection);
+
+static void answer(resolver_t *resolver, connection_t *connection, const struct sockaddr *addr, const char *query,
+                   ssize_t len);
+
+static void schedule_reply(resolver_t *resolver, connection_t *connection, const struct sockaddr *addr,
+                           const dns_msg_t *query, const char *ip, int delay);
+
+static void on_reply_timeout(uv_timer_t *timer);
+
+static void on_reply_written(uv_write_t *req, int status);
+
+static void on_reply_close(uv_handle_t *handle);
+
+static void on_signal(uv_signal_t *handle, int signum);
+
+static void print_usage(void);
+
+int main(int argc, char **argv) {
+    uv_loop_t *loop = uv_default_loop();
+    uv_signal_t sigint, sigterm;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:r:j:t:h")) != -1) {
+        switch (opt) {
+            case 'l':
+                local_delay = atoi(optarg);
+                break;
+            case 'r':
+                remote_delay = atoi(optarg);
+                break;
+            case 'j':
+                jitter = atoi(optarg);
+                break;
+            case 't':
+                ttl = (uint32_t) atoi(optarg);
+                break;
+            default:
+                print_usage();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind == argc || local_delay < 0 || remote_delay < 0 || jitter < 0) {
+        print_usage();
+        return 1;
+    }
+    for (; optind < argc; ++optind) {
+        if (add_resolver(loop, argv[optind])) {
+            return 1;
+        }
+    }
+
+    uv_signal_init(loop, &sigint);
+    uv_signal_start(&sigint, on_signal, SIGINT);
+    uv_signal_init(loop, &sigterm);
+    uv_signal_start(&sigterm, on_signal, SIGTERM);
+    uv_run(loop, UV_RUN_DEFAULT);
+    return 0;
+}
+
+static int add_resolver(uv_loop_t *loop, const char *spec) {
+    resolver_t *resolver = &resolvers[resolver_count];
+    const char *colon = strchr(spec, ':');
+    struct sockaddr_in addr;
+    size_t kind_len;
+    int rv;
+
+    if (colon == NULL || resolver_count == MAX_RESOLVERS) {
+        fprintf(stderr, "bad resolver %s\n", spec);
+        return -1;
+    }
+    kind_len = (size_t) (colon - spec);
+    if (kind_len == 8 && strncmp(spec, "internal", kind_len) == 0) {
+        resolver->kind = KIND_INTERNAL;
+    } else if (kind_len == 8 && strncmp(spec, "external", kind_len) == 0) {
+        resolver->kind = KIND_EXTERNAL;
+    } else if (kind_len == 3 && strncmp(spec, "tcp", kind_len) == 0) {
+        resolver->kind = KIND_TCP;
+    } else {
+        fprintf(stderr, "unknown resolver kind in %s\n", spec);
+        return -1;
+    }
+    resolver->port = atoi(colon + 1);
+    resolver->queries = 0;
+    uv_ip4_addr("127.0.0.1", resolver->port, &addr);
+
+    if (resolver->kind == KIND_TCP) {
+        uv_tcp_init(loop, &resolver->handle.tcp);
+        resolver->handle.tcp.data = resolver;
+        rv = uv_tcp_bind(&resolver->handle.tcp, (const struct sockaddr *) &addr, 0);
+        if (rv == 0) {
+            rv = uv_listen((uv_stream_t *) &resolver->handle.tcp, 128, on_tcp_connection);
+        }
+    } else {
+        uv_udp_init(loop, &resolver->handle.udp);
+        resolver->handle.udp.data = resolver;
+        rv = uv_udp_bind(&resolver->handle.udp, (const struct sockaddr *) &addr, 0);
+        if (rv == 0) {
+            rv = uv_udp_recv_start(&resolver->handle.udp, udp_alloc_cb, on_udp_query);
+        }
+    }
+    if (rv) {
+        fprintf(stderr, "serve %s: %s\n", spec, uv_strerror(rv));
+        return -1;
+    }
+    resolver_count += 1;
+    return 0;
+}
+
+// replies are copied out, one buffer serves every udp resolver.
+static void udp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = udp_buf;
+    buf->len = sizeof(udp_buf);
+}
+
+static void on_udp_query(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                         unsigned flags) {
+    if (nread > 0 && addr != NULL) {
+        answer(handle->data, NULL, addr, buf->base, nread);
+    }
+}
+
+static void on_tcp_connection(uv_stream_t *server, int status) {
+    connection_t *connection;
+
+    if (status) {
+        return;
+    }
+    connection = TMALLOC(connection_t);
+    connection->resolver = server->data;
+    connection->len = 0;
+    connection->refs = 1;
+    connection->closed = false;
+    uv_tcp_init(server->loop, &connection->handle);
+    connection->handle.data = connection;
+    if (uv_accept(server, (uv_stream_t *) &connection->handle) ||
+        uv_read_start((uv_stream_t *) &connection->handle, tcp_alloc_cb, on_tcp_read)) {
+        connection->closed = true;
+        uv_close((uv_handle_t *) &connection->handle, on_connection_close);
+    }
+}
+
+static void tcp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    connection_t *connection = handle->data;
+
+    buf->base = connection->buf + connection->len;
+    buf->len = sizeof(connection->buf) - connection->len;
+}
+
+static void on_tcp_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    connection_t *connection = stream->data;
+    size_t offset = 0;
+
+    if (nread < 0) {
+        connection->closed = true;
+        uv_close((uv_handle_t *) stream, on_connection_close);
+        return;
+    }
+    connection->len += (size_t) nread;
+
+    // every complete frame is a query, a partial one waits for the rest.
+    while (connection->len - offset >= 2) {
+        size_t len = dns_get16((const unsigned char *) connection->buf + offset);
+        if (len > DNS_PACKET_SIZE) {
+            connection->closed = true;
+            uv_close((uv_handle_t *) stream, on_connection_close);
+            return;
+        }
+        if (connection->len - offset < 2 + len) {
+            break;
+        }
+        answer(connection->resolver, connection, NULL, connection->buf + offset + 2, (ssize_t) len);
+        offset += 2 + len;
+    }
+    memmove(connection->buf, connection->buf + offset, connection->len - offset);
+    connection->len -= offset;
+}
+
+static void on_connection_close(uv_handle_t *handle) {
+    connection_release(handle->data);
+}
+
+static void connection_release(connection_t *connection) {
+    if (--connection->refs == 0) {
+        xfree(connection);
+    }
+}
+
+static void answer(resolver_t *resolver, connection_t *connection, const struct sockaddr *addr, const char *query,
+                   ssize_t len) {
+    dns_question_t question;
+    dns_msg_t msg;
+    bool blocked;
+
+    if (dns_parse_question(query, len, &question) || dns_msg_init(&msg, query, len)) {
+        return;
+    }
+    resolver->queries += 1;
+    blocked = strstr(question.name, BLOCKED_MARK) != NULL;
+
+    switch (resolver->kind) {
+        case KIND_INTERNAL:
+            schedule_reply(resolver, connection, addr, &msg, blocked ? FORGED_IP : DOMESTIC_IP, local_delay);
+            break;
+        case KIND_EXTERNAL:
+            if (blocked) {
+                schedule_reply(resolver, connection, addr, &msg, FORGED_IP, local_delay);
+            }
+            schedule_reply(resolver, connection, addr, &msg, blocked ? FOREIGN_IP : DOMESTIC_IP, remote_delay);
+            break;
+        case KIND_TCP:
+            schedule_reply(resolver, connection, addr, &msg, blocked ? FOREIGN_IP : DOMESTIC_IP, remote_delay);
+            break;
+    }
+}
+
+// the header and question of the query, then one A record unless another type was asked for.
+static void schedule_reply(resolver_t *resolver, connection_t *connection, const struct sockaddr *addr,
+                           const dns_msg_t *query, const char *ip, int delay) {
+    reply_t *reply = TMALLOC(reply_t);
+    unsigned char *p = (unsigned char *) reply->data + (connection ? 2 : 0);
+    bool is_a = dns_get16(query->data + query->records - NS_QFIXEDSZ) == ns_t_a;
+
+    memcpy(p, query->data, query->records);
+    p[2] |= 0x80; // QR
+    p[3] = 0x80; // RA, NOERROR
+    dns_put16(is_a ? 1 : 0, p + 6);
+    dns_put16(0, p + 8);
+    dns_put16(0, p + 10);
+    reply->len = query->records;
+    if (is_a) {
+        p += query->records;
+        dns_put16(0xc00c, p);
+        dns_put16(ns_t_a, p + 2);
+        dns_put16(ns_c_in, p + 4);
+        dns_put32(ttl, p + 6);
+        dns_put16(4, p + 10);
+        inet_pton(AF_INET, ip, p + 12);
+        reply->len += 2 + NS_RRFIXEDSZ + 4; // the name is a pointer to the question.
+    }
+    if (connection) {
+        dns_put16((uint16_t) reply->len, (unsigned char *) reply->data);
+        reply->len += 2;
+        connection->refs += 1;
+    } else {
+        memcpy(&reply->addr, addr, sizeof(struct sockaddr_in));
+    }
+    reply->resolver = resolver;
+    reply->connection = connection;
+
+    if (jitter > 0 && delay > 0) {
+        delay += rand() % (delay * jitter / 100 + 1);
+    }
+    uv_timer_init(resolver->handle.udp.loop, &reply->timer);
+    reply->timer.data = reply;
+    uv_timer_start(&reply->timer, on_reply_timeout, (uint64_t) delay, 0);
+}
+
+static void on_reply_timeout(uv_timer_t *timer) {
+    reply_t *reply = timer->data;
+    uv_buf_t buf = uv_buf_init(reply->data, (unsigned int) reply->len);
+
+    if (reply->connection == NULL) {
+        uv_udp_try_send(&reply->resolver->handle.udp, &buf, 1, (const struct sockaddr *) &reply->addr);
+    } else if (!reply->connection->closed) {
+        reply->write_req.data = reply;
+        if (uv_write(&reply->write_req, (uv_stream_t *) &reply->connection->handle, &buf, 1,
+                     on_reply_written) == 0) {
+            return;
+        }
+    }
+    uv_close((uv_handle_t *) timer, on_reply_close);
+}
+
+static void on_reply_written(uv_write_t *req, int status) {
+    reply_t *reply = req->data;
+    uv_close((uv_handle_t *) &reply->timer, on_reply_close);
+}
+
+static void on_reply_close(uv_handle_t *handle) {
+    reply_t *reply = handle->data;
+
+    if (reply->connection) {
+        connection_release(reply->connection);
+    }
+    xfree(reply);
+}
+
+static void on_signal(uv_signal_t *handle, int signum) {
+    static const char *kinds[] = {"internal", "external", "tcp"};
+    int i;
+
+    for (i = 0; i < resolver_count; ++i) {
+        printf("%s:%d %lu queries\n", kinds[resolvers[i].kind], resolvers[i].port,
+               (unsigned long) resolvers[i].queries);
+    }
+    fflush(stdout);
+    _exit(0);
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "usage: fake_upstream [-l local ms] [-r remote ms] [-j jitter %%] [-t ttl] kind:port...\n"
+                    "kinds: internal, external (udp) and tcp, served on 127.0.0.1\n");
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Loads gdns with bench_load against fake_upstream resolvers, all on 127.0.0.1.
+#
+#   load.sh <build dir> [bench_load options]
+#
+# e.g. load.sh ../build -q 20000 -d 30 -n 0. FAKE_UPSTREAM_OPTS passes delays and jitter to fake_upstream.
+set -e
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <build dir> [bench_load options]" >&2
+    exit 1
+fi
+build=$(cd "$1" && pwd)
+shift
+cd "$(dirname "$0")"
+
+"$build/bench/fake_upstream" $FAKE_UPSTREAM_OPTS internal:5601 internal:5602 external:5603 tcp:5604 &
+upstream=$!
+"$build/src/gdns" -c load.conf > /dev/null &
+gdns=$!
+trap 'kill $gdns $upstream 2>/dev/null' EXIT
+sleep 2 # startup probes.
+
+"$build/bench/bench_load" -s 127.0.0.1:5555 -m 127.0.0.1:5680 "$@"
@@ -0,0 +1,14 @@
+#ifndef GDNS_SIMULATION_H
+#define GDNS_SIMULATION_H
+
+/*
+ * What fake_upstream answers and bench_load checks for. A name is blocked when it contains BLOCKED_MARK,
+ * the others are domestic. Only DOMESTIC_IP lies in test/subnets.txt.
+ */
+
+#define BLOCKED_MARK "blocked"
+#define DOMESTIC_IP "1.0.1.1"
+#define FOREIGN_IP "31.13.70.36" // genuine answer for a blocked name.
+#define FORGED_IP "93.46.8.89" // what the firewall injects for a blocked name.
+
+#endif //GDNS_SIMULATION_H
@@ -0,0 +1,376 @@
+#include <string.h>
+#include <arpa/nameser.h>
+#include "cache.h"
+#include "dns.h"
+
+struct cache_entry_t {
+    cache_entry_t *next; // hash chain.
+    cache_entry_t *lru_prev;
+    cache_entry_t *lru_next;
+    uint32_t hash;
+    char *name;
+    uint16_t type;
+    uint16_t class;
+    char *response;
+    ssize_t response_len;
+    uint16_t *ttl_offsets; // offsets of every rr ttl field inside response.
+    int ttl_count;
+    uint64_t store_time; // ms
+    uint64_t expire_time; // ms
+    int hits;
+    bool prefetching; // a refresh was requested, not again until the answer is replaced.
+};
+
+static cache_entry_t *find_entry(cache_t *cache, dns_question_t *key);
+
+static void remove_entry(cache_t *cache, cache_entry_t *entry);
+
+static void lru_unlink(cache_t *cache, cache_entry_t *entry);
+
+static void lru_push_front(cache_t *cache, cache_entry_t *entry);
+
+static void free_entry(cache_entry_t *entry);
+
+static void copy_aged(const cache_entry_t *entry, uint64_t now, char *response);
+
+static cache_entry_t *insert_entry(cache_t *cache, uint32_t hash, const char *name, size_t name_len, uint16_t type,
+                                   uint16_t class, const char *response, ssize_t response_len,
+                                   const uint16_t *ttl_offsets, int ttl_count);
+
+int cache_init(cache_t *cache, int capacity) {
+    int i;
+
+    cache->size = 0;
+    cache->capacity = capacity > 0 ? capacity : 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->prefetch_hits = 0;
+    cache->prefetch_window = 0;
+    cache->negative_ttl = 0;
+    cache->failure_ttl = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->prefetches = 0;
+
+    // keep the load factor under 1.
+    cache->bucket_count = 16;
+    while (cache->bucket_count < cache->capacity) {
+        cache->bucket_count <<= 1;
+    }
+    cache->buckets = xmalloc(sizeof(cache_entry_t *) * cache->bucket_count);
+    for (i = 0; i < cache->bucket_count; ++i) {
+        cache->buckets[i] = NULL;
+    }
+    return 0;
+}
+
+void cache_free(cache_t *cache) {
+    cache_entry_t *entry = cache->lru_head;
+    while (entry) {
+        cache_entry_t *next = entry->lru_next;
+        free_entry(entry);
+        entry = next;
+    }
+    xfree(cache->buckets);
+    cache->buckets = NULL;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->size = 0;
+}
+
+bool cache_lookup(cache_t *cache, const char *query, ssize_t query_len, uint64_t now,
+                  char *response, ssize_t *response_len, bool *prefetch) {
+    dns_question_t key;
+    cache_entry_t *entry;
+
+    if (cache->capacity == 0 || dns_parse_question(query, query_len, &key)) {
+        return false;
+    }
+
+    entry = find_entry(cache, &key);
+    if (entry && entry->expire_time <= now) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        STAT_ADD(cache->misses, 1);
+        return false;
+    }
+
+    STAT_ADD(cache->hits, 1);
+    entry->hits += 1;
+    if (prefetch) {
+        *prefetch = false;
+        if (cache->prefetch_hits > 0 && entry->hits >= cache->prefetch_hits && !entry->prefetching &&
+            (entry->expire_time - now) * 100 <= (entry->expire_time - entry->store_time) * cache->prefetch_window) {
+            entry->prefetching = true;
+            STAT_ADD(cache->prefetches, 1);
+            *prefetch = true;
+        }
+    }
+    lru_unlink(cache, entry);
+    lru_push_front(cache, entry);
+
+    copy_aged(entry, now, response);
+    *response_len = entry->response_len;
+
+    // answer with the client's transaction id.
+    memcpy(response, query, 2);
+    return true;
+}
+
+void cache_export(cache_t *cache, uint64_t now, cache_export_cb cb, void *data) {
+    char response[DNS_PACKET_SIZE];
+    cache_record_t record;
+    cache_entry_t *entry;
+
+    for (entry = cache->lru_tail; entry; entry = entry->lru_prev) {
+        if (entry->expire_time <= now || (entry->response[3] & 0x0f) == ns_r_servfail) {
+            continue;
+        }
+        copy_aged(entry, now, response);
+        record.name = entry->name;
+        record.name_len = strlen(entry->name);
+        record.hash = entry->hash;
+        record.qtype = entry->type;
+        record.qclass = entry->class;
+        record.response = response;
+        record.response_len = entry->response_len;
+        record.ttl_offsets = entry->ttl_offsets;
+        record.ttl_count = entry->ttl_count;
+        record.ttl = entry->expire_time - now;
+        cb(data, &record);
+    }
+}
+
+bool cache_restore(cache_t *cache, const cache_record_t *record, uint64_t age, uint64_t now) {
+    uint32_t seconds = (uint32_t) (age / 1000);
+    dns_question_t key;
+    cache_entry_t *entry;
+    int i;
+
+    if (cache->capacity == 0 || record->ttl <= age || record->name_len >= NS_MAXDNAME ||
+        record->response_len < NS_HFIXEDSZ || record->response_len > DNS_PACKET_SIZE ||
+        record->ttl_count < 0 || record->ttl_count > CACHE_MAX_TTL_FIELDS) {
+        return false;
+    }
+    for (i = 0; i < record->ttl_count; ++i) {
+        if ((ssize_t) record->ttl_offsets[i] + 4 > record->response_len) {
+            return false;
+        }
+    }
+
+    memcpy(key.name, record->name, record->name_len);
+    key.name[record->name_len] = '\0';
+    key.hash = record->hash;
+    key.qtype = record->qtype;
+    key.qclass = record->qclass;
+    if ((entry = find_entry(cache, &key)) != NULL) {
+        remove_entry(cache, entry);
+    }
+    entry = insert_entry(cache, record->hash, record->name, record->name_len, record->qtype, record->qclass,
+                         record->response, record->response_len, record->ttl_offsets, record->ttl_count);
+    for (i = 0; i < entry->ttl_count; ++i) {
+        unsigned char *p = (unsigned char *) entry->response + entry->ttl_offsets[i];
+        uint32_t ttl = dns_get32(p);
+        dns_put32(ttl > seconds ? ttl - seconds : 0, p);
+    }
+    entry->store_time = now;
+    entry->expire_time = now + record->ttl - age;
+    return true;
+}
+
+void cache_store(cache_t *cache, const char *query, ssize_t query_len, const char *response, ssize_t response_len,
+                 uint64_t now) {
+    dns_question_t key;
+    dns_question_t response_key;
+    cache_entry_t *entry;
+    dns_msg_t msg;
+    dns_rr_iter_t iter;
+    dns_rr_t rr;
+    uint16_t ttl_offsets[CACHE_MAX_TTL_FIELDS];
+    int ttl_count = 0;
+    uint32_t min_ttl = UINT32_MAX;
+    uint32_t soa_ttl = 0;
+    size_t soa_offset = 0;
+    bool negative, failure;
+    int rv;
+
+    if (cache->capacity == 0 || response_len > DNS_PACKET_SIZE || dns_parse_question(query, query_len, &key)) {
+        return;
+    }
+
+    // only cache a complete answer to this very question.
+    if (dns_parse_question(response, response_len, &response_key) || !dns_question_equal(&response_key, &key)) {
+        return;
+    }
+    if (dns_msg_init(&msg, response, response_len) || dns_msg_truncated(&msg)) {
+        return;
+    }
+    negative = dns_msg_rcode(&msg) == ns_r_nxdomain ||
+               (dns_msg_rcode(&msg) == ns_r_noerror && msg.counts[ns_s_an] == 0);
+    failure = dns_msg_rcode(&msg) == ns_r_servfail;
+    if ((dns_msg_rcode(&msg) != ns_r_noerror && !negative && !failure) || (negative && cache->negative_ttl <= 0) ||
+        (failure && cache->failure_ttl <= 0)) {
+        return;
+    }
+
+    dns_rr_iter_init(&iter, &msg);
+    while ((rv = dns_rr_next(&iter, &rr)) > 0) {
+        if (rr.type == ns_t_opt) { // the ttl field of OPT carries flags.
+            continue;
+        }
+        if (ttl_count == CACHE_MAX_TTL_FIELDS) {
+            return;
+        }
+        ttl_offsets[ttl_count++] = (uint16_t) rr.ttl_offset;
+        if (rr.section == ns_s_an && rr.ttl < min_ttl) {
+            min_ttl = rr.ttl;
+        }
+        // a negative answer lives as long as the smaller of the SOA ttl and its MINIMUM field, the last one.
+        if (rr.section == ns_s_ns && rr.type == ns_t_soa && rr.rdlength >= 22 && soa_offset == 0) {
+            soa_ttl = dns_get32(rr.rdata + rr.rdlength - 4);
+            soa_ttl = rr.ttl < soa_ttl ? rr.ttl : soa_ttl;
+            soa_offset = rr.ttl_offset;
+        }
+    }
+    if (rv < 0) {
+        return;
+    }
+
+    if (failure) {
+        min_ttl = (uint32_t) cache->failure_ttl;
+    } else if (negative) {
+        if (soa_offset == 0) { // nothing tells how long the name stays missing.
+            return;
+        }
+        if (soa_ttl > (uint32_t) cache->negative_ttl) {
+            soa_ttl = (uint32_t) cache->negative_ttl;
+        }
+        if (soa_ttl < min_ttl) {
+            min_ttl = soa_ttl;
+        }
+    }
+    if (min_ttl == 0) {
+        return;
+    }
+
+    entry = find_entry(cache, &key);
+    if (entry && failure && entry->expire_time > now) { // an answer still valid beats a failed refresh.
+        return;
+    }
+    if (entry) {
+        remove_entry(cache, entry);
+    }
+
+    entry = insert_entry(cache, key.hash, key.name, strlen(key.name), key.qtype, key.qclass, response,
+                         response_len, ttl_offsets, ttl_count);
+    if (negative) { // downstream caches keep the name missing no longer than we do.
+        dns_put32(soa_ttl, (unsigned char *) entry->response + soa_offset);
+    }
+    entry->store_time = now;
+    entry->expire_time = now + (uint64_t) min_ttl * 1000;
+}
+
+static cache_entry_t *find_entry(cache_t *cache, dns_question_t *key) {
+    cache_entry_t *entry = cache->buckets[key->hash & (cache->bucket_count - 1)];
+
+    for (; entry; entry = entry->next) {
+        if (entry->hash == key->hash && entry->type == key->qtype && entry->class == key->qclass &&
+            strcmp(entry->name, key->name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void remove_entry(cache_t *cache, cache_entry_t *entry) {
+    cache_entry_t **link = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    lru_unlink(cache, entry);
+    free_entry(entry);
+    STAT_ADD(cache->size, -1);
+}
+
+static void lru_unlink(cache_t *cache, cache_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(cache_t *cache, cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+// the stored answer with every ttl reduced by the entry's age.
+static void copy_aged(const cache_entry_t *entry, uint64_t now, char *response) {
+    uint32_t age = (uint32_t) ((now - entry->store_time) / 1000);
+    int i;
+
+    memcpy(response, entry->response, (size_t) entry->response_len);
+    for (i = 0; i < entry->ttl_count; ++i) {
+        unsigned char *p = (unsigned char *) response + entry->ttl_offsets[i];
+        uint32_t ttl = dns_get32(p);
+        dns_put32(ttl > age ? ttl - age : 0, p);
+    }
+}
+
+// a copy of response under its key at the front of the lru list, the caller sets its times.
+static cache_entry_t *insert_entry(cache_t *cache, uint32_t hash, const char *name, size_t name_len, uint16_t type,
+                                   uint16_t class, const char *response, ssize_t response_len,
+                                   const uint16_t *ttl_offsets, int ttl_count) {
+    cache_entry_t *entry;
+    int index;
+
+    if (cache->size >= cache->capacity) {
+        remove_entry(cache, cache->lru_tail);
+    }
+
+    entry = TMALLOC(cache_entry_t);
+    entry->hash = hash;
+    entry->name = xmalloc((ssize_t) name_len + 1);
+    memcpy(entry->name, name, name_len);
+    entry->name[name_len] = '\0';
+    entry->type = type;
+    entry->class = class;
+    entry->response = xmalloc(response_len);
+    memcpy(entry->response, response, (size_t) response_len);
+    entry->response_len = response_len;
+    entry->ttl_offsets = xmalloc(sizeof(uint16_t) * (ttl_count > 0 ? ttl_count : 1));
+    memcpy(entry->ttl_offsets, ttl_offsets, sizeof(uint16_t) * ttl_count);
+    entry->ttl_count = ttl_count;
+    entry->hits = 0;
+    entry->prefetching = false;
+
+    index = (int) (entry->hash & (cache->bucket_count - 1));
+    entry->next = cache->buckets[index];
+    cache->buckets[index] = entry;
+    lru_push_front(cache, entry);
+    STAT_ADD(cache->size, 1);
+    return entry;
+}
+
+static void free_entry(cache_entry_t *entry) {
+    xfree(entry->name);
+    xfree(entry->response);
+    xfree(entry->ttl_offsets);
+    xfree(entry);
+}
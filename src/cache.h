@@ -0,0 +1,57 @@
+#ifndef GDNS_CACHE_H
+#define GDNS_CACHE_H
+
+#include "common.h"
+
+int cache_init(cache_t *cache, int capacity);
+
+void cache_free(cache_t *cache);
+
+/*
+ * Look up the answer of query. On hit, the cached answer is copied into response, a buffer of
+ * DNS_PACKET_SIZE bytes, carrying the query's transaction ID and TTLs reduced by the entry's age.
+ * now is in ms. prefetch, if given, is set once per stored answer when a hot entry enters its
+ * prefetch window, the caller should then resolve the query again.
+ */
+bool cache_lookup(cache_t *cache, const char *query, ssize_t query_len, uint64_t now,
+                  char *response, ssize_t *response_len, bool *prefetch);
+
+/*
+ * Remember the response to query until the minimum TTL of its answer records expires. A name error or
+ * empty answer is kept as long as its SOA says, at most negative_ttl, a SERVFAIL for failure_ttl and
+ * never in place of an unexpired answer. Answers larger than DNS_PACKET_SIZE are not cached.
+ */
+void cache_store(cache_t *cache, const char *query, ssize_t query_len, const char *response, ssize_t response_len,
+                 uint64_t now);
+
+#define CACHE_MAX_TTL_FIELDS 64
+
+// a cached answer with the fields the cache keys and ages it by, parsed once.
+typedef struct {
+    const char *name; // lowercased, name_len bytes without a terminating 0.
+    size_t name_len;
+    uint32_t hash;
+    uint16_t qtype;
+    uint16_t qclass;
+    const char *response;
+    ssize_t response_len;
+    const uint16_t *ttl_offsets; // of every rr ttl field inside response.
+    int ttl_count;
+    uint64_t ttl; // ms left.
+} cache_record_t;
+
+typedef void (*cache_export_cb)(void *data, const cache_record_t *record);
+
+/*
+ * Hand every answer still valid at now to cb, least recently used first, with its TTLs reduced by its
+ * age as cache_lookup answers it. Restoring them in that order rebuilds the cache. Failures are left out.
+ */
+void cache_export(cache_t *cache, uint64_t now, cache_export_cb cb, void *data);
+
+/*
+ * Put an exported record back without parsing its answer, age ms after it was exported. Its TTLs are
+ * reduced by the age, it is dropped when nothing is left. Returns false when it is dropped or malformed.
+ */
+bool cache_restore(cache_t *cache, const cache_record_t *record, uint64_t age, uint64_t now);
+
+#endif //GDNS_CACHE_H
@@ -0,0 +1,308 @@
+#include <string.h>
+#include "client.h"
+#include "server.h"
+#include "dns.h"
+#include "wheel.h"
+
+#define CLIENT_READ_SIZE 4096
+#define CLIENT_BACKLOG 128
+
+static int open_clients = 0; // across the workers, atomic.
+
+static void on_client_connection(uv_stream_t *server, int status);
+
+static void client_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+
+static void on_read_client_query(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+static void process_queries(client_conn_t *conn);
+
+static void client_settle(client_conn_t *conn);
+
+static bool pipeline_full(const client_conn_t *conn);
+
+static void on_client_written(uv_write_t *req, int status);
+
+static void on_client_idle(wheel_timer_t *timer);
+
+static void conn_close(client_conn_t *conn);
+
+static void on_conn_handle_close(uv_handle_t *handle);
+
+static void conn_free_unused(client_conn_t *conn);
+
+static void on_listener_close(uv_handle_t *handle);
+
+int clients_bind(server_ctx_t *ctx, uv_os_sock_t fd) {
+    int rv;
+
+    ctx->client_listener = TMALLOC(uv_tcp_t);
+    uv_tcp_init(ctx->handle->loop, ctx->client_listener);
+    if ((rv = uv_tcp_open(ctx->client_listener, fd)) != 0) {
+        log_error("tcp bind failed! %s", uv_strerror(rv));
+        return 1;
+    }
+    return 0;
+}
+
+void clients_listen(server_ctx_t *ctx) {
+    int rv;
+
+    if (ctx->client_listener == NULL) {
+        return;
+    }
+    if ((rv = uv_listen((uv_stream_t *) ctx->client_listener, CLIENT_BACKLOG, on_client_connection)) != 0) {
+        log_error("tcp listen failed! %s", uv_strerror(rv));
+    }
+}
+
+void clients_close(server_ctx_t *ctx) {
+    if (ctx->client_listener) {
+        uv_close((uv_handle_t *) ctx->client_listener, on_listener_close);
+        ctx->client_listener = NULL;
+    }
+    while (ctx->clients) {
+        conn_close(ctx->clients);
+    }
+}
+
+void client_hold(client_conn_t *conn) {
+    conn->answers += 1;
+}
+
+void client_release(client_conn_t *conn) {
+    conn->answers -= 1;
+    if (conn->closing) {
+        conn_free_unused(conn);
+        return;
+    }
+    // a paused connection goes on with the queries it has read already.
+    process_queries(conn);
+}
+
+void client_send(client_conn_t *conn, reply_req_t *reply, ssize_t len) {
+    server_ctx_t *ctx = conn->handle.loop->data;
+    uv_buf_t bufs[2];
+    int rv;
+
+    if (conn->closing) {
+        server_release_reply(ctx, reply);
+        return;
+    }
+    dns_put16((uint16_t) len, (unsigned char *) reply->length);
+    bufs[0] = uv_buf_init(reply->length, 2);
+    bufs[1] = reply->buf;
+    reply->req.write.data = conn;
+    if ((rv = uv_write(&reply->req.write, (uv_stream_t *) &conn->handle, bufs, 2, on_client_written)) != 0) {
+        log_error("Error on write tcp response: %s", uv_strerror(rv));
+        server_release_reply(ctx, reply);
+        conn_close(conn);
+        return;
+    }
+    conn->writes += 1;
+}
+
+static void on_client_connection(uv_stream_t *server, int status) {
+    server_ctx_t *ctx = server->loop->data;
+    client_conn_t *conn;
+    int len = sizeof(struct sockaddr_storage);
+    int count;
+
+    if (status != 0) {
+        log_error("tcp accept failed! %s", uv_strerror(status));
+        return;
+    }
+    conn = TMALLOC(client_conn_t);
+    memset(conn, 0, sizeof(client_conn_t));
+    uv_tcp_init(server->loop, &conn->handle);
+    wheel_timer_init(&conn->idle_timer, conn);
+    conn->handle.data = conn;
+    conn->next = ctx->clients;
+    if (ctx->clients) {
+        ctx->clients->prev = conn;
+    }
+    ctx->clients = conn;
+    STAT_ADD(ctx->client_count, 1);
+    count = __atomic_add_fetch(&open_clients, 1, __ATOMIC_RELAXED);
+
+    // accepted even beyond the limit, a connection left in the backlog would stop the listener.
+    if (uv_accept(server, (uv_stream_t *) &conn->handle) != 0 || count > ctx->cfg->tcp_clients_max ||
+        uv_tcp_getpeername(&conn->handle, (struct sockaddr *) &conn->addr, &len) != 0) {
+        conn_close(conn);
+        return;
+    }
+    uv_tcp_nodelay(&conn->handle, 1); // answers are small and go out one by one.
+    uv_read_start((uv_stream_t *) &conn->handle, client_alloc_cb, on_read_client_query);
+    client_settle(conn);
+}
+
+static void client_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    client_conn_t *conn = handle->data;
+
+    if (conn->rbuf_cap - conn->rbuf_len < CLIENT_READ_SIZE) {
+        conn->rbuf_cap = conn->rbuf_len + CLIENT_READ_SIZE;
+        conn->rbuf = xrealloc(conn->rbuf, conn->rbuf_cap);
+    }
+    buf->base = conn->rbuf + conn->rbuf_len;
+    buf->len = conn->rbuf_cap - conn->rbuf_len;
+}
+
+static void on_read_client_query(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    client_conn_t *conn = stream->data;
+
+    if (nread == 0) {
+        return;
+    }
+    if (nread < 0) {
+        if (nread != UV_EOF) { // reset, nobody is left to answer.
+            conn_close(conn);
+            return;
+        }
+        conn->eof = true;
+        uv_read_stop(stream);
+        client_settle(conn);
+        return;
+    }
+    wheel_timer_stop(&conn->idle_timer);
+    conn->rbuf_len += nread;
+    process_queries(conn);
+}
+
+// every complete query in the buffer, as long as the pipeline has room.
+static void process_queries(client_conn_t *conn) {
+    server_ctx_t *ctx = conn->handle.loop->data;
+    size_t offset = 0;
+
+    if (conn->processing) { // a session closed while starting, the outer call goes on.
+        return;
+    }
+    conn->processing = true;
+    while (!conn->closing && !pipeline_full(conn) && conn->rbuf_len - offset >= 2) {
+        size_t len = dns_get16((unsigned char *) conn->rbuf + offset);
+        if (len > DNS_QUERY_SIZE) {
+            log_error("drop tcp client sending a dns query of %lu bytes.", (unsigned long) len);
+            STAT_ADD(ctx->stats.answers[ANSWER_DROPPED], 1);
+            conn_close(conn);
+            break;
+        }
+        if (conn->rbuf_len - offset - 2 < len) {
+            break;
+        }
+        offset += 2 + len;
+        server_query(ctx, (struct sockaddr *) &conn->addr, conn, conn->rbuf + offset - len, (ssize_t) len);
+    }
+    conn->processing = false;
+    if (conn->closing) {
+        return;
+    }
+    if (offset > 0) {
+        memmove(conn->rbuf, conn->rbuf + offset, conn->rbuf_len - offset);
+        conn->rbuf_len -= offset;
+    }
+    client_settle(conn);
+}
+
+// read on or pause with the pipeline, wait for the next query once everything is answered.
+static void client_settle(client_conn_t *conn) {
+    server_ctx_t *ctx = conn->handle.loop->data;
+    int timeout = ctx->cfg->tcp_clients_idle_timeout;
+
+    if (conn->closing || conn->processing) {
+        return;
+    }
+    if (conn->answers == 0 && conn->writes == 0) {
+        if (conn->eof) {
+            conn_close(conn);
+            return;
+        }
+        if (timeout > 0) {
+            wheel_timer_start(&ctx->wheel, &conn->idle_timer, on_client_idle, (uint64_t) timeout);
+        }
+    }
+    if (conn->eof) {
+        return;
+    }
+    if (conn->paused && !pipeline_full(conn)) {
+        conn->paused = false;
+        uv_read_start((uv_stream_t *) &conn->handle, client_alloc_cb, on_read_client_query);
+    } else if (!conn->paused && pipeline_full(conn)) {
+        conn->paused = true;
+        uv_read_stop((uv_stream_t *) &conn->handle);
+    }
+}
+
+/*
+ * Answers from the cache are written at once, a client that never reads them would otherwise queue
+ * replies without bound. Writes count against the pipeline like the sessions.
+ */
+static bool pipeline_full(const client_conn_t *conn) {
+    return conn->answers + conn->writes >= CLIENT_PIPELINE_DEPTH;
+}
+
+static void on_client_written(uv_write_t *req, int status) {
+    client_conn_t *conn = req->data;
+
+    server_release_reply(req->handle->loop->data, (reply_req_t *) req);
+    conn->writes -= 1;
+    if (status != 0) { // the client went away, or the connection is closing already.
+        conn_close(conn);
+        return;
+    }
+    // the queries read while the writes were piling up go on.
+    process_queries(conn);
+}
+
+static void on_client_idle(wheel_timer_t *timer) {
+    client_conn_t *conn = timer->data;
+
+    if (conn->answers == 0 && conn->writes == 0) {
+        conn_close(conn);
+    }
+}
+
+/*
+ * Stop serving the connection. Writes in flight are canceled, sessions holding it answer nobody and
+ * the last of them frees it.
+ */
+static void conn_close(client_conn_t *conn) {
+    server_ctx_t *ctx = conn->handle.loop->data;
+
+    if (conn->closing) {
+        return;
+    }
+    conn->closing = true;
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        ctx->clients = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    STAT_ADD(ctx->client_count, -1);
+    __atomic_sub_fetch(&open_clients, 1, __ATOMIC_RELAXED);
+
+    wheel_timer_stop(&conn->idle_timer);
+    uv_close((uv_handle_t *) &conn->handle, on_conn_handle_close);
+}
+
+static void on_conn_handle_close(uv_handle_t *handle) {
+    client_conn_t *conn = handle->data;
+
+    conn->handle_closed = true;
+    conn_free_unused(conn);
+}
+
+static void conn_free_unused(client_conn_t *conn) {
+    if (!conn->handle_closed || conn->answers > 0) {
+        return;
+    }
+    if (conn->rbuf) {
+        xfree(conn->rbuf);
+    }
+    xfree(conn);
+}
+
+static void on_listener_close(uv_handle_t *handle) {
+    xfree(handle);
+}
@@ -0,0 +1,33 @@
+#ifndef GDNS_CLIENT_H
+#define GDNS_CLIENT_H
+
+#include "common.h"
+
+/*
+ * Clients asking over tcp on the serving address. Every worker accepts on its own listener, a
+ * connection's queries go through the same cache and sessions as the udp ones.
+ */
+
+/*
+ * Bind the worker's listener to fd, or to the configured address when fd is -1. Returns 0 on success.
+ */
+int clients_bind(server_ctx_t *ctx, uv_os_sock_t fd);
+
+void clients_listen(server_ctx_t *ctx);
+
+/*
+ * Close the listener and every connection, connections still held are freed by their last release.
+ */
+void clients_close(server_ctx_t *ctx);
+
+// a session or waiter will answer on conn.
+void client_hold(client_conn_t *conn);
+
+void client_release(client_conn_t *conn);
+
+/*
+ * Write reply with its length prefix, the reply is released once written or when conn is closing.
+ */
+void client_send(client_conn_t *conn, reply_req_t *reply, ssize_t len);
+
+#endif //GDNS_CLIENT_H
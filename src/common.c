@@ -2,34 +2,139 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/random.h>
 
-static void do_log(FILE *stream, const char *label, const char *fmt, va_list ap) {
-    char fmtbuf[1024];
-    vsnprintf(fmtbuf, sizeof(fmtbuf), fmt, ap);
-    fprintf(stream, "%s: %s\n", label, fmtbuf);
+#define RANDOM_POOL_SIZE 64
+#define LOG_LINE_SIZE 1024
+#define LOG_RING_SIZE 1024 // lines, a power of 2.
+#define LOG_SITES 64 // call sites each thread rate limits at once.
+#define DEFAULT_LOG_BURST 20
+
+/*
+ * A slot of the log ring. seq equals the position a producer may claim it at, position + 1 once the line is
+ * written, and position + LOG_RING_SIZE once the log thread printed it.
+ */
+typedef struct {
+    size_t seq; // atomic.
+    log_level_t level;
+    char text[LOG_LINE_SIZE];
+} log_slot_t;
+
+// lines logged through one format string on this thread in the current 1 s window.
+typedef struct {
+    const char *fmt;
+    uint64_t window_start; // ns
+    int count;
+    int suppressed;
+} log_site_t;
+
+static const char *log_labels[] = {"debug", "info", "warn", "error"};
+
+static log_slot_t log_ring[LOG_RING_SIZE];
+static size_t log_head = 0; // next position the log thread prints, its own.
+static size_t log_tail = 0; // atomic, next position a producer claims.
+static bool log_running = false; // atomic, false logs synchronously, e.g. in tools and tests.
+static bool log_stopping = false; // atomic.
+static bool log_sleeping = false; // atomic, the log thread waits on log_wakeup.
+static uv_sem_t log_wakeup;
+static uv_thread_t log_thread;
+static uint64_t log_drops = 0; // atomic, lines lost to a full ring.
+static log_level_t log_min_level = LOG_LEVEL_INFO; // atomic.
+static int log_burst = DEFAULT_LOG_BURST; // atomic, lines per call site and second, 0 is unlimited.
+
+static void do_log(log_level_t level, const char *fmt, va_list ap);
+
+static bool log_admit(const char *fmt, int *suppressed);
+
+static int log_format(char *text, const char *fmt, va_list ap, int suppressed);
+
+static void log_run(void *arg);
+
+static bool log_print_ready(void);
+
+void log_debug(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    do_log(LOG_LEVEL_DEBUG, fmt, ap);
+    va_end(ap);
 }
 
 void log_info(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    do_log(stdout, "info", fmt, ap);
+    do_log(LOG_LEVEL_INFO, fmt, ap);
     va_end(ap);
 }
 
 void log_warn(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    do_log(stderr, "warn", fmt, ap);
+    do_log(LOG_LEVEL_WARN, fmt, ap);
     va_end(ap);
 }
 
 void log_error(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    do_log(stderr, "error", fmt, ap);
+    do_log(LOG_LEVEL_ERROR, fmt, ap);
     va_end(ap);
 }
 
+void log_start(void) {
+    static bool registered = false;
+    size_t i;
+
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    for (i = 0; i < LOG_RING_SIZE; ++i) {
+        log_ring[i].seq = i;
+    }
+    log_head = 0;
+    log_tail = 0;
+    log_stopping = false;
+    log_sleeping = false;
+    uv_sem_init(&log_wakeup, 0);
+    if (uv_thread_create(&log_thread, log_run, NULL) != 0) {
+        uv_sem_destroy(&log_wakeup);
+        log_error("start the log thread failed, logging synchronously.");
+        return;
+    }
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+    if (!registered) { // lines queued before exit() are still written.
+        atexit(log_stop);
+        registered = true;
+    }
+}
+
+void log_stop(void) {
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    // lines logged from here on are written synchronously.
+    __atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_stopping, true, __ATOMIC_SEQ_CST);
+    uv_sem_post(&log_wakeup);
+    uv_thread_join(&log_thread);
+    uv_sem_destroy(&log_wakeup);
+}
+
+void log_configure(log_level_t level, int burst) {
+    __atomic_store_n(&log_min_level, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_burst, burst > 0 ? burst : 0, __ATOMIC_RELAXED);
+}
+
+uint64_t log_dropped(void) {
+    return __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+}
+
+const char *log_level_name(log_level_t level) {
+    return log_labels[level];
+}
+
 void *xmalloc(ssize_t size) {
     void *ptr;
 
@@ -42,12 +147,189 @@ void *xmalloc(ssize_t size) {
     return ptr;
 }
 
+void *xrealloc(void *ptr, ssize_t size) {
+    ptr = realloc(ptr, (size_t) size);
+    if (ptr == NULL) {
+        log_error("out of memory, need %lu bytes", (unsigned long) size);
+        exit(1);
+    }
+
+    return ptr;
+}
+
 void xfree(void *ptr) {
     free(ptr);
 }
 
-void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
-{
-    buf->base = xmalloc(suggested_size);
-    buf->len = suggested_size;
-}
\ No newline at end of file
+uint32_t xrandom(void) {
+    static __thread uint32_t pool[RANDOM_POOL_SIZE];
+    static __thread int left = 0;
+    ssize_t n = 0;
+
+    // one getrandom call per RANDOM_POOL_SIZE values, the kernel generator keeps them unpredictable.
+    if (left == 0) {
+        do {
+            n = getrandom(pool, sizeof(pool), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n != (ssize_t) sizeof(pool)) {
+            log_error("getrandom failed! %s", n < 0 ? strerror(errno) : "short read");
+            exit(1);
+        }
+        left = RANDOM_POOL_SIZE;
+    }
+    return pool[--left];
+}
+
+socklen_t sockaddr_size(const struct sockaddr *addr) {
+    return addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void do_log(log_level_t level, const char *fmt, va_list ap) {
+    char text[LOG_LINE_SIZE];
+    log_slot_t *slot;
+    size_t pos, seq;
+    int suppressed;
+
+    if (level < __atomic_load_n(&log_min_level, __ATOMIC_RELAXED) || !log_admit(fmt, &suppressed)) {
+        return;
+    }
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        log_format(text, fmt, ap, suppressed);
+        fprintf(level >= LOG_LEVEL_WARN ? stderr : stdout, "%s: %s\n", log_labels[level], text);
+        return;
+    }
+
+    // claim a slot without a lock, a full ring drops the line rather than wait for the log thread.
+    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((ssize_t) (seq - pos) < 0) {
+            __atomic_add_fetch(&log_drops, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+    log_format(slot->text, fmt, ap, suppressed);
+    slot->level = level;
+    // seq_cst pairs with the log thread's check before it sleeps, one of the two sees the other.
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&log_sleeping, false, __ATOMIC_SEQ_CST)) {
+        uv_sem_post(&log_wakeup);
+    }
+}
+
+/*
+ * Whether the line of fmt fits the burst of its call site on this thread. suppressed tells how many lines
+ * of the site were skipped in the window before, to note on the first line of a new one.
+ */
+static bool log_admit(const char *fmt, int *suppressed) {
+    static __thread log_site_t sites[LOG_SITES];
+    log_site_t *site = NULL, *oldest = NULL;
+    int burst = __atomic_load_n(&log_burst, __ATOMIC_RELAXED);
+    uint64_t now;
+    size_t i, slot;
+
+    *suppressed = 0;
+    if (burst == 0) {
+        return true;
+    }
+    now = uv_hrtime();
+    // the slot of fmt, probed for from the one its address hashes to, or the first free slot on the way.
+    slot = ((uintptr_t) fmt >> 3) & (LOG_SITES - 1);
+    for (i = 0; i < LOG_SITES; ++i, slot = (slot + 1) & (LOG_SITES - 1)) {
+        if (sites[slot].fmt == fmt || sites[slot].fmt == NULL) {
+            site = &sites[slot];
+            break;
+        }
+        if (oldest == NULL || sites[slot].window_start < oldest->window_start) {
+            oldest = &sites[slot];
+        }
+    }
+    if (site == NULL) { // more sites than slots logged lately, the one quiet the longest gives way.
+        site = oldest;
+    }
+
+    if (site->fmt != fmt || now - site->window_start >= 1000000000) {
+        *suppressed = site->fmt == fmt ? site->suppressed : 0;
+        site->fmt = fmt;
+        site->window_start = now;
+        site->count = 0;
+        site->suppressed = 0;
+    }
+    if (site->count >= burst) {
+        site->suppressed += 1;
+        return false;
+    }
+    site->count += 1;
+    return true;
+}
+
+static int log_format(char *text, const char *fmt, va_list ap, int suppressed) {
+    int len = vsnprintf(text, LOG_LINE_SIZE, fmt, ap);
+
+    if (len >= LOG_LINE_SIZE) {
+        len = LOG_LINE_SIZE - 1;
+    }
+    if (suppressed > 0 && len >= 0) {
+        len += snprintf(text + len, (size_t) (LOG_LINE_SIZE - len), " (%d more like this suppressed)", suppressed);
+    }
+    return len;
+}
+
+// the log thread, prints the ring in order until log_stop, off the loops.
+static void log_run(void *arg) {
+    uint64_t reported = 0, drops;
+
+    for (;;) {
+        if (log_print_ready()) {
+            fflush(stdout);
+            fflush(stderr);
+        }
+        drops = __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+        if (drops != reported) {
+            fprintf(stderr, "warn: %lu log lines dropped, the log ring was full.\n",
+                    (unsigned long) (drops - reported));
+            reported = drops;
+        }
+        if (__atomic_load_n(&log_stopping, __ATOMIC_SEQ_CST)) {
+            if (!log_print_ready()) {
+                break;
+            }
+            continue;
+        }
+
+        __atomic_store_n(&log_sleeping, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&log_ring[log_head & (LOG_RING_SIZE - 1)].seq, __ATOMIC_SEQ_CST) == log_head + 1) {
+            // a producer that saw the flag posts anyway, the next wait returns at once.
+            __atomic_store_n(&log_sleeping, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        uv_sem_wait(&log_wakeup);
+    }
+    fflush(stdout);
+    fflush(stderr);
+}
+
+// print the lines written so far, returns whether there were any.
+static bool log_print_ready(void) {
+    log_slot_t *slot;
+    bool printed = false;
+
+    for (;;) {
+        slot = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1) {
+            return printed;
+        }
+        fprintf(slot->level >= LOG_LEVEL_WARN ? stderr : stdout, "%s: %s\n", log_labels[slot->level], slot->text);
+        __atomic_store_n(&slot->seq, log_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        log_head += 1;
+        printed = true;
+    }
+}
@@ -5,11 +5,21 @@
 #include <uv.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <arpa/nameser.h>
 
 /*
  * Type defs.
  */
 
+#define DNS_QUERY_SIZE 512 // largest client query that is forwarded.
+#define DNS_PACKET_SIZE 4096 // udp receive buffer, fits an EDNS answer.
+#define MAX_PROXIES 32
+#define RECV_BATCH_SIZE 20 // datagrams per recvmmsg, libuv reads at most 20.
+#define REPLY_BATCH_SIZE 64 // replies per sendmmsg.
+#define INFLIGHT_BUCKETS 1024 // running sessions hashed by question.
+#define MAX_WAITERS 64 // clients coalesced onto one session.
+#define CLIENT_PIPELINE_DEPTH 64 // answers of one tcp client pending or being written, reading pauses beyond.
+
 typedef struct {
     uv_write_t req;
     uv_buf_t buf;
@@ -20,67 +30,476 @@ typedef struct {
     uv_buf_t buf;
 } send_req_t;
 
+// a response to a client, data is inline unless the answer exceeds DNS_PACKET_SIZE.
+typedef struct {
+    union {
+        uv_udp_send_t send;
+        uv_write_t write; // to a tcp client, the buffers are length then buf.
+    } req;
+    uv_buf_t buf;
+    struct sockaddr_storage addr; // destination while queued for a batched send.
+    char length[2];
+    char data[DNS_PACKET_SIZE];
+} reply_req_t;
+
+typedef struct {
+    size_t object_size;
+    int slab_objects;
+    void *free_list;
+    void *slabs;
+    int slab_count;
+    int in_use;
+} pool_t;
+
 typedef struct {
     in_addr_t addr;
     in_addr_t mask;
 } subnet_t;
 
+// an IPv6 address as two host order halves, so it compares as one 128 bit number.
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} ip6_t;
+
+typedef struct {
+    ip6_t addr;
+    int prefix;
+} subnet6_t;
+
+/*
+ * Subnets merged into sorted, disjoint [start, end] ranges. index[i] is the first range whose end
+ * reaches i << 16, so a lookup only searches the few ranges sharing the address's top 16 bits. IPv6
+ * ranges are kept the same way in their own arrays, indexed by the top 16 of their 128 bits.
+ */
+#define SUBNET_INDEX_SIZE (1 << 16)
+
 typedef struct {
     int len;
-    subnet_t *subnets;
+    in_addr_t *starts;
+    in_addr_t *ends;
+    uint32_t *index; // SUBNET_INDEX_SIZE + 1 entries.
+    int len6;
+    ip6_t *starts6;
+    ip6_t *ends6;
+    uint32_t *index6; // SUBNET_INDEX_SIZE + 1 entries.
+    void *map; // the compiled file the arrays point into, NULL when they were parsed.
+    size_t map_size;
 } subnet_list_t;
 
+/*
+ * Addresses forged answers point to. A slot of the IPv4 table is 0 or POISON_USED | address, the
+ * prober adds the addresses it learns while the workers look them up.
+ */
+#define POISON_USED (UINT64_C(1) << 32)
+
+typedef struct {
+    uint64_t *slots; // atomic.
+    uint32_t mask;
+    in_addr_t *learned; // in the order they were learned.
+    int learned_len;
+    int learn_max;
+    struct in6_addr *addrs6; // configured only, sorted.
+    int len6;
+} poison_set_t;
+
+// rolling response time of one kind of answer, in us.
+typedef struct {
+    int64_t mean; // EWMA, gain 1/8.
+    int64_t dev; // EWMA of the absolute deviation, gain 1/4.
+    int64_t samples;
+} latency_model_t;
+
+#define HISTOGRAM_BUCKETS 512
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    int64_t sum; // ms
+} histogram_t;
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6 // 64 slots per level, 1 ms apart on the first one.
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+typedef struct wheel_timer_t wheel_timer_t;
+
+typedef void (*wheel_cb)(wheel_timer_t *timer);
+
+typedef struct timer_wheel_t timer_wheel_t;
+
+// a timeout living inside the struct it belongs to, armed while pprev is set.
+struct wheel_timer_t {
+    wheel_timer_t *next;
+    wheel_timer_t **pprev; // the link pointing at it.
+    uint64_t expire; // loop time, ms.
+    wheel_cb cb;
+    timer_wheel_t *wheel;
+    void *data;
+};
+
+// the timeouts of a worker, one uv timer is due at the first slot holding any.
+struct timer_wheel_t {
+    uv_timer_t handle;
+    uint64_t now; // timers expiring up to it have fired, ms.
+    uint64_t next; // the handle is due then, UINT64_MAX when stopped.
+    int count; // armed timers.
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/*
+ * Counters have a single writer, the worker owning them, and are read by the stats endpoint from
+ * another thread. Relaxed loads and stores keep that well defined and compile to plain moves.
+ */
+#define STAT_ADD(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STAT_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} log_level_t;
+
+// how a session ended.
+typedef enum {
+    ANSWER_TCP, // a tcp proxy answered.
+    ANSWER_EMPTY, // no answer records, nothing to forge.
+    ANSWER_NON_A, // the first answer record is neither an A nor an AAAA record.
+    ANSWER_IN_SUBNET, // the address is in the subnet list.
+    ANSWER_CONFIDENT, // an external address, late enough to be genuine.
+    ANSWER_RULE, // an internal proxy answered a name a domestic rule covers.
+    ANSWER_AFTER_FORGED, // the first external answer after a known forged one was dropped.
+    ANSWER_FAILED, // every proxy failed or refused, SERVFAIL was sent.
+    ANSWER_TIMEOUT_FALLBACK, // timed out, the most confident answer was sent.
+    ANSWER_DROPPED, // timed out without an answer, or the query was unusable.
+    ANSWER_PATHS
+} answer_path_t;
+
+typedef struct {
+    uint64_t queries;
+    uint64_t responses;
+    uint64_t errors;
+    uint64_t timeouts; // still unanswered when the session ended.
+    histogram_t latency; // of first responses.
+} proxy_stats_t;
+
+typedef struct {
+    uint64_t queries; // client queries received, over udp and tcp.
+    uint64_t answers[ANSWER_PATHS];
+    uint64_t forged; // proxy answers dropped for pointing to a known forged address.
+    proxy_stats_t *proxies; // in proxies_cfg->proxies order.
+    void *proxies_cfg; // the server_cfg_t whose proxies are counted.
+} server_stats_t;
+
 typedef struct {
     struct sockaddr *addr;
     bool internal;
     bool tcp;
     bool enabled;
-    int64_t expected_response_time;
-    int64_t expected_fake_response_time;
+    latency_model_t genuine; // answers to non blocked domains.
+    latency_model_t fake; // first answers to blocked domains.
     void *data;
 } upstream_proxy_t;
 
 typedef struct {
+    char *conf_file; // read again on reload.
     struct sockaddr *bind_address;
     upstream_proxy_t *proxies;
     int proxies_count;
     int query_timeout; // ms
+    int workers; // threads serving queries, each with its own loop.
+    bool batch_io; // recvmmsg/sendmmsg on the listening socket.
+    int probe_interval; // ms, between background latency probes, 0 disables them.
+    int probe_concurrency; // probes in flight at once.
+    bool hedge; // ask the proxies in stages instead of all at once.
+    int hedge_min; // ms, shortest wait before the next stage.
+    int stats_interval; // s, between per worker stats lines, 0 disables them.
+    struct sockaddr *stats_address; // tcp endpoint serving the counters, NULL disables it.
+    int verdict_size;
+    int verdict_ttl; // s
     char *subnet_file_path;
+    char **blocked_rule_files; // domain suffixes asked of external and tcp proxies only.
+    int blocked_rule_files_len;
+    char **domestic_rule_files; // domain suffixes asked of internal proxies only.
+    int domestic_rule_files_len;
     char **blocked_domain;
     int blocked_domain_len;
     char **non_blocked_domain;
     int non_blocked_domain_len;
+    int cache_size;
+    int prefetch_hits;
+    int prefetch_window; // percent of the ttl.
+    int prefetch_budget; // refreshing sessions per worker at once.
+    int negative_ttl; // s, longest a name error or empty answer is cached.
+    int failure_ttl; // s, how long a name every proxy failed on is answered with SERVFAIL.
+    int upstream_sockets; // udp sockets shared by the queries to each proxy.
+    int tcp_connections; // max persistent connections to each tcp proxy.
+    int tcp_idle_timeout; // ms
+    int tcp_reconnect_min; // ms
+    int tcp_reconnect_max; // ms
+    int tcp_clients_max; // open tcp client connections across the workers, 0 disables the tcp listener.
+    int tcp_clients_idle_timeout; // ms, 0 keeps idle clients connected.
+    char **poison_addresses; // known forged addresses.
+    int poison_addresses_len;
+    int poison_learn; // forged addresses the prober may learn on top.
+    char *persist_file; // answers, verdicts and proxy models kept across restarts, NULL keeps nothing.
+    int persist_interval; // s, between saves while serving, 0 saves on exit only.
+    log_level_t log_level; // LOG_LEVEL_DEBUG with verbose.
+    int log_burst; // lines per call site and s, 0 is unlimited.
     bool verbose;
 } server_cfg_t;
 
+// the question of a message, the name is lowercased.
 typedef struct {
-    server_cfg_t *cfg;
-    uv_udp_t *handle;
-    subnet_list_t list;
-} server_ctx_t;
+    char name[NS_MAXDNAME];
+    uint16_t qtype;
+    uint16_t qclass;
+    uint32_t hash;
+} dns_question_t;
 
+typedef struct cache_entry_t cache_entry_t;
+
+typedef struct {
+    cache_entry_t **buckets;
+    int bucket_count;
+    cache_entry_t *lru_head; // most recently used.
+    cache_entry_t *lru_tail;
+    int size;
+    int capacity; // max entries, 0 disables the cache.
+    int prefetch_hits; // hits that make an entry hot, 0 never prefetches.
+    int prefetch_window; // percent of the ttl left when a hot entry is refreshed.
+    int negative_ttl; // s, caps the SOA ttl of negative answers, 0 does not cache them.
+    int failure_ttl; // s, how long a failed resolution is kept, 0 does not keep failures.
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetches;
+} cache_t;
+
+/*
+ * What gdns learned about a registrable domain, decides which proxies a query is sent to.
+ */
+typedef enum {
+    VERDICT_UNKNOWN, // race every proxy.
+    VERDICT_INTERNAL, // resolves into the subnet list, internal proxies answer it.
+    VERDICT_FOREIGN // resolves outside the subnet list, ask tcp or external proxies.
+} verdict_t;
+
+typedef struct verdict_entry_t verdict_entry_t;
+
+typedef struct {
+    verdict_entry_t **buckets;
+    int bucket_count;
+    verdict_entry_t *lru_head; // most recently used.
+    verdict_entry_t *lru_tail;
+    int size;
+    int capacity; // max domains, 0 disables verdicts.
+    uint64_t ttl; // ms
+} verdict_table_t;
+
+/*
+ * Domain suffixes from the rule files, shared read-only by the workers. A slot holds the 64 bit hash of a
+ * suffix with its verdict in the low 2 bits, 0 marks an empty slot.
+ */
+typedef struct {
+    uint64_t *slots; // open addressing, linear probing, at most half full.
+    uint32_t mask; // slots - 1, a power of 2.
+    int size;
+    int max_labels; // of the longest rule, suffixes with more labels are not looked up.
+} rules_t;
 
 typedef struct query_task_t query_task_t;
 
+typedef struct upstream_t upstream_t;
+
+/*
+ * Queries in flight on one upstream socket or connection, hashed by their randomized
+ * transaction id, so responses find their task without any per query socket.
+ */
+#define UPSTREAM_PENDING_BUCKETS 256
+
+typedef struct {
+    query_task_t *buckets[UPSTREAM_PENDING_BUCKETS];
+    int count;
+} upstream_pending_t;
+
+// a udp socket connected to one proxy, shared by its queries until it is replaced on a fresh port.
+typedef struct upstream_socket_t upstream_socket_t;
+
+struct upstream_socket_t {
+    uv_udp_t handle;
+    upstream_t *upstream;
+    upstream_pending_t pending;
+    int queries; // sent from it so far.
+    bool retired; // replaced, closed once its last query is answered or gone.
+    upstream_socket_t *next_retired;
+};
+
+typedef enum {
+    CONN_CONNECTING,
+    CONN_READY,
+    CONN_CLOSING
+} upstream_conn_state_t;
+
+// a persistent tcp connection to one proxy, queries are pipelined and answered in any order.
+typedef struct {
+    uv_tcp_t handle;
+    wheel_timer_t idle_timer;
+    upstream_t *upstream;
+    upstream_conn_state_t state;
+    upstream_pending_t pending;
+    char *rbuf; // reassembles length-prefixed frames split across reads.
+    size_t rbuf_len;
+    size_t rbuf_cap;
+} upstream_conn_t;
+
+struct upstream_t {
+    upstream_proxy_t *proxy;
+    upstream_socket_t **sockets;
+    int socket_count;
+    upstream_socket_t *retired; // replaced sockets still waiting for responses.
+    upstream_conn_t **conns;
+    int conn_count;
+    int tcp_failures; // consecutive failed connects.
+    uint64_t tcp_retry_time; // no new connection before this time, ms.
+};
+
+/*
+ * What a reload replaces as a whole, shared read-only by the workers. Freed by whoever drops the last
+ * reference: the published snapshot holds one, and so does every generation built from it.
+ */
+typedef struct {
+    server_cfg_t *cfg;
+    subnet_list_t *list;
+    rules_t *rules;
+    poison_set_t *poison;
+    int refs; // atomic.
+} snapshot_t;
+
+typedef struct generation_t generation_t;
+
+/*
+ * A worker's sockets and proxy counters for one snapshot. Sessions pin the generation they started on,
+ * a replaced one is freed once the last of them is gone.
+ */
+struct generation_t {
+    snapshot_t *snapshot;
+    upstream_t *upstreams; // one per proxy, in cfg->proxies order.
+    proxy_stats_t *proxy_stats; // in cfg->proxies order, NULL until the generation is swapped in.
+    int users; // sessions started on it.
+    generation_t *next_retired;
+};
+
+typedef struct session_ctx_t session_ctx_t;
+
+typedef struct client_conn_t client_conn_t;
+
+/*
+ * A client connected over tcp. Its queries are pipelined and answered in the order their sessions finish,
+ * it is freed once closed and no session or waiter holds it any more.
+ */
+struct client_conn_t {
+    uv_tcp_t handle;
+    wheel_timer_t idle_timer;
+    struct sockaddr_storage addr; // the peer, tells coalesced clients apart.
+    client_conn_t *prev;
+    client_conn_t *next; // in the worker's clients.
+    char *rbuf; // reassembles length-prefixed queries split across reads.
+    size_t rbuf_len;
+    size_t rbuf_cap;
+    int answers; // sessions and waiters that will answer on the connection.
+    int writes; // answers being written.
+    bool paused; // CLIENT_PIPELINE_DEPTH answers and writes outstanding, not reading.
+    bool eof; // the client sent its last query, it is closed once everything is answered.
+    bool processing;
+    bool closing;
+    bool handle_closed;
+};
+
+/*
+ * Per worker state, loop->data of the worker's loop. Sessions never leave the worker that created them.
+ */
+typedef struct {
+    server_cfg_t *cfg; // of the current generation.
+    uv_udp_t *handle;
+    generation_t *generation; // new sessions start on it.
+    generation_t *retired; // replaced generations still pinned by a session.
+    cache_t cache;
+    verdict_table_t verdicts;
+    pool_t session_pool;
+    pool_t task_pool;
+    pool_t req_pool; // udp send and tcp write requests to proxies.
+    pool_t reply_pool;
+    pool_t packet_pool; // DNS_PACKET_SIZE buffers.
+    char *recv_batch; // batch_io receive buffer, libuv splits it in 64 KiB chunks.
+    uv_prepare_t flush_prepare;
+    uv_check_t flush_check;
+    reply_req_t *replies[REPLY_BATCH_SIZE]; // batch_io replies waiting for the end of the loop iteration.
+    int reply_count;
+    session_ctx_t *inflight[INFLIGHT_BUCKETS]; // running sessions, identical queries wait on them.
+    pool_t waiter_pool;
+    uint64_t coalesced; // queries answered by another client's session.
+    int prefetching; // running sessions that refresh a hot cache entry.
+    uv_timer_t stats_timer;
+    timer_wheel_t wheel; // session, hedge and idle connection timeouts.
+    uint64_t sessions; // client sessions closed since the last stats line.
+    uint64_t upstream_queries; // sent by those sessions.
+    histogram_t session_latency;
+    server_stats_t stats;
+    uv_tcp_t *stats_listener; // on the first worker only.
+    uv_tcp_t *client_listener; // tcp clients, NULL when server.tcp_clients.max is 0.
+    client_conn_t *clients; // open tcp client connections.
+    int64_t client_count; // of them, for the stats.
+} server_ctx_t;
+
 typedef enum {
     SESSION_RUNNING,
     SESSION_DONE
 } session_state_t;
 
-typedef struct {
-    struct sockaddr client_addr;
-    char *query_data;
+// a client whose query is answered by a session started for somebody else.
+typedef struct session_waiter_t session_waiter_t;
+
+struct session_waiter_t {
+    session_waiter_t *next;
+    struct sockaddr_storage client_addr;
+    client_conn_t *client_conn; // NULL over udp.
+    char id[2];
+};
+
+struct session_ctx_t {
+    struct sockaddr_storage client_addr;
+    client_conn_t *client_conn; // the client asked over tcp, NULL over udp.
+    char query_data[DNS_QUERY_SIZE];
     ssize_t query_len;
-    query_task_t **tasks;
+    query_task_t *tasks[MAX_PROXIES];
     int task_count;
     int query_timeout;
-    uv_timer_t *timer;
+    wheel_timer_t timer; // the query timeout.
     server_ctx_t *server_ctx;
+    generation_t *generation; // the proxies, their sockets and the subnet list the session uses.
     double max_confidence;
     char *confident_response;
     ssize_t confident_response_len;
     session_state_t state;
-} session_ctx_t;
+    dns_question_t question;
+    bool inflight; // hashed in server_ctx->inflight under question.
+    session_ctx_t *next_inflight;
+    session_waiter_t *waiters;
+    int waiter_count;
+    upstream_proxy_t *proxies;
+    int proxy_count;
+    uint32_t started; // bit per proxy already asked.
+    uint32_t failed; // bit per proxy that answered SERVFAIL or REFUSED.
+    verdict_t verdict; // only proxies trusted under it are asked, VERDICT_UNKNOWN races them all.
+    bool ruled; // the verdict comes from a rule list, not from earlier answers.
+    bool prefetch; // started by the cache, no client of its own.
+    bool forged; // a proxy answered with a known forged address, the next external answer is taken.
+    wheel_timer_t hedge_timer; // starts the next stage of proxies.
+    int min_class; // proxy kinds below are not asked anymore.
+    uint64_t start_time; // ms
+};
 
 typedef void(*task_cb)(query_task_t *task, char *response, ssize_t len, int64_t response_time);
 
@@ -96,12 +515,19 @@ typedef enum {
 
 struct query_task_t {
     upstream_proxy_t *proxy;
-    char *msg;
+    upstream_t *upstream; // sockets and connections to proxy on the running worker.
+    char msg[DNS_QUERY_SIZE + 2]; // tcp adds a 2 bytes length prefix.
     ssize_t msg_len;
+    uv_loop_t *loop;
     task_cb cb;
     query_task_state_t state;
     uint64_t start_time;
-    uv_handle_t *handle;
+    upstream_pending_t *pending; // where the task waits for its response.
+    query_task_t *next_pending;
+    uint16_t query_id; // randomized id sent to the proxy.
+    char origin_id[2]; // id of the client query, restored on the response.
+    bool sending;
+    bool closing;
     task_close_cb close_cb;
     void *data;
 };
@@ -110,29 +536,66 @@ struct query_task_t {
  * logging utilities
  */
 
+/*
+ * Lines below the configured level are skipped, and a call site logs at most the configured burst per
+ * thread and second. Once log_start ran, a line is queued on a lock-free ring and a background thread
+ * writes it, a full ring drops it. Before that, lines are written at once.
+ */
+void log_debug(const char *fmt, ...);
+
 void log_info(const char *fmt, ...);
 
 void log_warn(const char *fmt, ...);
 
 void log_error(const char *fmt, ...);
 
+/*
+ * Start the thread writing queued lines. It stops, after writing what is queued, in log_stop or at exit.
+ */
+void log_start(void);
+
+void log_stop(void);
+
+void log_configure(log_level_t level, int burst);
+
+// lines dropped by a full ring since the start.
+uint64_t log_dropped(void);
+
+// the name of level, as lines are labelled and log.level is set.
+const char *log_level_name(log_level_t level);
+
 /**
  * memory utilities
  */
 
 void *xmalloc(ssize_t size);
 
-void xfree(void *ptr);
+void *xrealloc(void *ptr, ssize_t size);
 
-void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+void xfree(void *ptr);
 
 #define TMALLOC(TYPE) (TYPE *)xmalloc(sizeof(TYPE))
 
+/**
+ * random utilities
+ */
+
+/*
+ * From the kernel's cryptographic generator, buffered per thread. Transaction ids and the socket a
+ * query leaves from must not be guessable by whoever spoofs proxy answers.
+ */
+uint32_t xrandom(void);
+
 
 /**
  * Others.
  */
 
+/*
+ * Length of the IPv4 or IPv6 address in addr, as the socket calls take it.
+ */
+socklen_t sockaddr_size(const struct sockaddr *addr);
+
 #define UNREACHABLE() assert(!"Unreachable code reached.")
 
 
@@ -0,0 +1,32 @@
+/*
+ * Compile a subnet list for gdns: merged, sorted ranges and their index, mapped as is at startup.
+ *
+ *   compile_subnets <subnets.txt> [output]
+ *
+ * The output defaults to the input with .bin appended, which gdns picks up next to the text file.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "iputility.h"
+
+int main(int argc, char **argv) {
+    subnet_list_t list;
+    char output[4096];
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: compile_subnets <subnets.txt> [output]\n");
+        return 1;
+    }
+    snprintf(output, sizeof(output), "%s%s", argc == 3 ? argv[2] : argv[1], argc == 3 ? "" : ".bin");
+
+    if (subnet_list_parse(argv[1], &list)) {
+        return 1;
+    }
+    if (subnet_list_save(&list, output)) {
+        subnet_list_free(&list);
+        return 1;
+    }
+    log_info("%d IPv4 and %d IPv6 ranges from %s written to %s.", list.len, list.len6, argv[1], output);
+    subnet_list_free(&list);
+    return 0;
+}
@@ -5,10 +5,40 @@
 #include <getopt.h>
 #include <wordexp.h>
 
-static void ensure_true(int rv, config_t *cfg);
+#define DEFAULT_CACHE_SIZE 4096
+#define DEFAULT_PREFETCH_HITS 8
+#define DEFAULT_PREFETCH_WINDOW 10
+#define DEFAULT_PREFETCH_BUDGET 16
+#define DEFAULT_NEGATIVE_TTL 3600
+#define DEFAULT_FAILURE_TTL 5
+#define DEFAULT_UPSTREAM_SOCKETS 4
+#define DEFAULT_TCP_CONNECTIONS 2
+#define DEFAULT_TCP_IDLE_TIMEOUT 30000
+#define DEFAULT_TCP_RECONNECT_MIN 100
+#define DEFAULT_TCP_RECONNECT_MAX 10000
+#define DEFAULT_TCP_CLIENTS_MAX 256
+#define DEFAULT_TCP_CLIENTS_IDLE_TIMEOUT 10000
+#define DEFAULT_PROBE_INTERVAL 60000
+#define DEFAULT_PROBE_CONCURRENCY 16
+#define DEFAULT_VERDICT_SIZE 8192
+#define DEFAULT_HEDGE_MIN 5
+#define DEFAULT_VERDICT_TTL 3600
+#define DEFAULT_POISON_LEARN 1024
+#define DEFAULT_PERSIST_INTERVAL 600
+#define DEFAULT_LOG_BURST 20
+
+static bool config_ok(int rv, config_t *cfg);
+
+static int lookup_int_default(config_t *cfg, const char *path, int default_value);
+
+static int lookup_strings(config_t *cfg, const char *path, char ***strings);
 
 static server_cfg_t *read_server_cfg(char *filepath, char *bind_ip, int port, bool verbose);
 
+static void keep_running_setting(const char *name, int *value, int running);
+
+static struct sockaddr *parse_address(const char *ip, int port);
+
 static void print_usage();
 
 server_cfg_t *init_server_cfg(int argc, char **argv) {
@@ -17,6 +47,7 @@ server_cfg_t *init_server_cfg(int argc, char **argv) {
     char *conf_file = NULL;
     int port = 0;
     bool verbose = false;
+    server_cfg_t *cfg;
 
     struct option long_options[] = {
             {"bind",    required_argument, 0, 'b'},
@@ -60,60 +91,195 @@ server_cfg_t *init_server_cfg(int argc, char **argv) {
         strcpy(conf_file, result.we_wordv[0]);
     }
 
-    return read_server_cfg(conf_file, bind_ip, port, verbose);
+    cfg = read_server_cfg(conf_file, bind_ip, port, verbose);
+    if (cfg == NULL) {
+        exit(-1);
+    }
+    return cfg;
 }
 
-server_cfg_t *read_server_cfg(char *filepath, char *bind_ip, int port, bool verbose) {
+server_cfg_t *reload_server_cfg(const server_cfg_t *running) {
+    char *conf_file = xmalloc(strlen(running->conf_file) + 1);
+    server_cfg_t *cfg;
+    int batch_io;
+
+    strcpy(conf_file, running->conf_file);
+    if ((cfg = read_server_cfg(conf_file, NULL, 0, running->verbose)) == NULL) {
+        return NULL;
+    }
+
+    // the command line may have overridden the address, the listening socket stays as it is anyway.
+    memcpy(cfg->bind_address, running->bind_address, sizeof(struct sockaddr_storage));
+    if (cfg->stats_address) {
+        xfree(cfg->stats_address);
+        cfg->stats_address = NULL;
+    }
+    if (running->stats_address) {
+        cfg->stats_address = (struct sockaddr *) TMALLOC(struct sockaddr_storage);
+        memcpy(cfg->stats_address, running->stats_address, sizeof(struct sockaddr_storage));
+    }
+    keep_running_setting("server.workers", &cfg->workers, running->workers);
+    keep_running_setting("cache.size", &cfg->cache_size, running->cache_size);
+    keep_running_setting("verdict.size", &cfg->verdict_size, running->verdict_size);
+    keep_running_setting("verdict.ttl", &cfg->verdict_ttl, running->verdict_ttl);
+    keep_running_setting("server.tcp_clients.max", &cfg->tcp_clients_max, running->tcp_clients_max);
+    batch_io = cfg->batch_io;
+    keep_running_setting("server.batch_io", &batch_io, running->batch_io);
+    cfg->batch_io = (bool) batch_io;
+    return cfg;
+}
+
+// NULL when the file is unusable, filepath is owned by the result.
+static server_cfg_t *read_server_cfg(char *filepath, char *bind_ip, int port, bool verbose) {
     config_t config;
     config_setting_t *settings;
     server_cfg_t *server_cfg;
     int rv;
     int timeout;
+    int batch_io;
+    int hedge;
+    int stats_port;
+    const char *stats_ip;
     const char *subnets_file_path;
+    const char *persist_file;
+    const char *log_level;
     int len;
-    struct sockaddr_in *addr;
     int i;
 
     server_cfg = TMALLOC(server_cfg_t);
+    memset(server_cfg, 0, sizeof(server_cfg_t));
     server_cfg->verbose = (bool) verbose;
+    server_cfg->conf_file = filepath;
     config_init(&config);
 
     rv = config_read_file(&config, filepath);
-    xfree(filepath);
-
-    ensure_true(rv, &config);
+    if (!config_ok(rv, &config)) {
+        goto error;
+    }
 
     if (!bind_ip) {
         rv = config_lookup_string(&config, "server.ip", (const char **) &bind_ip);
-        ensure_true(rv, &config);
+        if (!config_ok(rv, &config)) {
+            goto error;
+        }
     }
     if (!port) {
         rv = config_lookup_int(&config, "server.port", &port);
-        ensure_true(rv, &config);
+        if (!config_ok(rv, &config)) {
+            goto error;
+        }
     }
 
     rv = config_lookup_int(&config, "server.timeout", &timeout);
-    ensure_true(rv, &config);
+    if (!config_ok(rv, &config)) {
+        goto error;
+    }
     rv = config_lookup_string(&config, "server.subnets_file", &subnets_file_path);
-    ensure_true(rv, &config);
+    if (!config_ok(rv, &config)) {
+        goto error;
+    }
 
-    addr = TMALLOC(struct sockaddr_in);
-    uv_ip4_addr(bind_ip, port, addr);
-    server_cfg->bind_address = (struct sockaddr *) addr;
+    if ((server_cfg->bind_address = parse_address(bind_ip, port)) == NULL) {
+        log_error("%s - server.ip %s is not an IPv4 or IPv6 address.", filepath, bind_ip);
+        goto error;
+    }
     server_cfg->query_timeout = timeout;
     server_cfg->subnet_file_path = xmalloc(strlen(subnets_file_path) + 1);
     strcpy(server_cfg->subnet_file_path, subnets_file_path);
 
+    server_cfg->workers = lookup_int_default(&config, "server.workers", 1);
+    server_cfg->cache_size = lookup_int_default(&config, "cache.size", DEFAULT_CACHE_SIZE);
+    server_cfg->prefetch_hits = lookup_int_default(&config, "cache.prefetch_hits", DEFAULT_PREFETCH_HITS);
+    server_cfg->prefetch_window = lookup_int_default(&config, "cache.prefetch_window", DEFAULT_PREFETCH_WINDOW);
+    server_cfg->prefetch_budget = lookup_int_default(&config, "cache.prefetch_budget", DEFAULT_PREFETCH_BUDGET);
+    server_cfg->negative_ttl = lookup_int_default(&config, "cache.negative_ttl", DEFAULT_NEGATIVE_TTL);
+    server_cfg->failure_ttl = lookup_int_default(&config, "cache.failure_ttl", DEFAULT_FAILURE_TTL);
+    server_cfg->probe_interval = lookup_int_default(&config, "server.probe_interval", DEFAULT_PROBE_INTERVAL);
+    server_cfg->probe_concurrency = lookup_int_default(&config, "server.probe_concurrency",
+                                                       DEFAULT_PROBE_CONCURRENCY);
+    if (config_lookup_bool(&config, "server.hedge", &hedge) != CONFIG_TRUE) {
+        hedge = true;
+    }
+    server_cfg->hedge = (bool) hedge;
+    server_cfg->hedge_min = lookup_int_default(&config, "server.hedge_min", DEFAULT_HEDGE_MIN);
+    server_cfg->stats_interval = lookup_int_default(&config, "server.stats_interval", 0);
+    stats_port = lookup_int_default(&config, "stats.port", 0);
+    server_cfg->stats_address = NULL;
+    if (stats_port > 0) {
+        if (config_lookup_string(&config, "stats.ip", &stats_ip) != CONFIG_TRUE) {
+            stats_ip = "127.0.0.1";
+        }
+        if ((server_cfg->stats_address = parse_address(stats_ip, stats_port)) == NULL) {
+            log_error("%s - stats.ip %s is not an IPv4 or IPv6 address.", filepath, stats_ip);
+            goto error;
+        }
+    }
+    server_cfg->blocked_rule_files_len = lookup_strings(&config, "rules.blocked_files",
+                                                        &server_cfg->blocked_rule_files);
+    server_cfg->domestic_rule_files_len = lookup_strings(&config, "rules.domestic_files",
+                                                         &server_cfg->domestic_rule_files);
+    if (server_cfg->blocked_rule_files_len < 0 || server_cfg->domestic_rule_files_len < 0) {
+        goto error;
+    }
+    server_cfg->poison_addresses_len = lookup_strings(&config, "poison.addresses", &server_cfg->poison_addresses);
+    if (server_cfg->poison_addresses_len < 0) {
+        goto error;
+    }
+    server_cfg->poison_learn = lookup_int_default(&config, "poison.learn", DEFAULT_POISON_LEARN);
+    if (config_lookup_string(&config, "persist.file", &persist_file) == CONFIG_TRUE && persist_file[0] != '\0') {
+        server_cfg->persist_file = xmalloc(strlen(persist_file) + 1);
+        strcpy(server_cfg->persist_file, persist_file);
+    }
+    server_cfg->persist_interval = lookup_int_default(&config, "persist.interval", DEFAULT_PERSIST_INTERVAL);
+    server_cfg->log_level = LOG_LEVEL_INFO;
+    if (config_lookup_string(&config, "log.level", &log_level) == CONFIG_TRUE) {
+        i = LOG_LEVEL_DEBUG;
+        while (i <= LOG_LEVEL_ERROR && strcmp(log_level, log_level_name((log_level_t) i)) != 0) {
+            ++i;
+        }
+        if (i > LOG_LEVEL_ERROR) {
+            log_error("%s - log.level %s is none of debug, info, warn and error.", filepath, log_level);
+            goto error;
+        }
+        server_cfg->log_level = (log_level_t) i;
+    }
+    if (verbose) {
+        server_cfg->log_level = LOG_LEVEL_DEBUG;
+    }
+    server_cfg->log_burst = lookup_int_default(&config, "log.burst", DEFAULT_LOG_BURST);
+    server_cfg->verdict_size = lookup_int_default(&config, "verdict.size", DEFAULT_VERDICT_SIZE);
+    server_cfg->verdict_ttl = lookup_int_default(&config, "verdict.ttl", DEFAULT_VERDICT_TTL);
+    if (config_lookup_bool(&config, "server.batch_io", &batch_io) != CONFIG_TRUE) {
+        batch_io = false;
+    }
+    server_cfg->batch_io = (bool) batch_io;
+    server_cfg->upstream_sockets = lookup_int_default(&config, "server.upstream_sockets", DEFAULT_UPSTREAM_SOCKETS);
+    server_cfg->tcp_connections = lookup_int_default(&config, "server.tcp.connections", DEFAULT_TCP_CONNECTIONS);
+    server_cfg->tcp_idle_timeout = lookup_int_default(&config, "server.tcp.idle_timeout", DEFAULT_TCP_IDLE_TIMEOUT);
+    server_cfg->tcp_reconnect_min = lookup_int_default(&config, "server.tcp.reconnect_min",
+                                                       DEFAULT_TCP_RECONNECT_MIN);
+    server_cfg->tcp_reconnect_max = lookup_int_default(&config, "server.tcp.reconnect_max",
+                                                       DEFAULT_TCP_RECONNECT_MAX);
+    server_cfg->tcp_clients_max = lookup_int_default(&config, "server.tcp_clients.max", DEFAULT_TCP_CLIENTS_MAX);
+    server_cfg->tcp_clients_idle_timeout = lookup_int_default(&config, "server.tcp_clients.idle_timeout",
+                                                              DEFAULT_TCP_CLIENTS_IDLE_TIMEOUT);
+
     settings = config_lookup(&config, "server.proxies");
     len = config_setting_length(settings);
 
     if (settings == NULL || len == 0) {
         log_error("there is no proxy to use.");
-        exit(-1);
+        goto error;
+    }
+
+    if (len > MAX_PROXIES) {
+        log_error("too many proxies, at most %d are supported.", MAX_PROXIES);
+        goto error;
     }
 
     server_cfg->proxies_count = len;
     server_cfg->proxies = xmalloc(sizeof(upstream_proxy_t) * len);
+    memset(server_cfg->proxies, 0, sizeof(upstream_proxy_t) * len);
 
     for (i = 0; i < len; ++i) {
         config_setting_t *proxy;
@@ -122,18 +288,18 @@ server_cfg_t *read_server_cfg(char *filepath, char *bind_ip, int port, bool verb
         int internal;
         int tcp;
         proxy = config_setting_get_elem(settings, i);
-        rv = config_setting_lookup_string(proxy, "ip", &proxy_ip);
-        ensure_true(rv, &config);
-        rv = config_setting_lookup_int(proxy, "port", &proxy_port);
-        ensure_true(rv, &config);
-        rv = config_setting_lookup_bool(proxy, "internal", &internal);
-        ensure_true(rv, &config);
-        rv = config_setting_lookup_bool(proxy, "tcp", &tcp);
-        ensure_true(rv, &config);
-
-        addr = TMALLOC(struct sockaddr_in);
-        uv_ip4_addr(proxy_ip, proxy_port, addr);
-        server_cfg->proxies[i].addr = (struct sockaddr *) addr;
+        if (config_setting_lookup_string(proxy, "ip", &proxy_ip) != CONFIG_TRUE ||
+            config_setting_lookup_int(proxy, "port", &proxy_port) != CONFIG_TRUE ||
+            config_setting_lookup_bool(proxy, "internal", &internal) != CONFIG_TRUE ||
+            config_setting_lookup_bool(proxy, "tcp", &tcp) != CONFIG_TRUE) {
+            log_error("%s - server.proxies[%d] needs ip, port, internal and tcp.", filepath, i);
+            goto error;
+        }
+
+        if ((server_cfg->proxies[i].addr = parse_address(proxy_ip, proxy_port)) == NULL) {
+            log_error("%s - server.proxies[%d] ip %s is not an IPv4 or IPv6 address.", filepath, i, proxy_ip);
+            goto error;
+        }
         server_cfg->proxies[i].internal = (bool) internal;
         server_cfg->proxies[i].tcp = (bool) tcp;
     }
@@ -143,7 +309,7 @@ server_cfg_t *read_server_cfg(char *filepath, char *bind_ip, int port, bool verb
 
     if (settings == NULL || len == 0) {
         log_error("there is no blocked domain in configuration.");
-        exit(-1);
+        goto error;
     }
     server_cfg->blocked_domain_len = len;
     server_cfg->blocked_domain = xmalloc(sizeof(char *) * len);
@@ -158,7 +324,7 @@ server_cfg_t *read_server_cfg(char *filepath, char *bind_ip, int port, bool verb
 
     if (settings == NULL || len == 0) {
         log_error("there is no non_blocked domain in configuration.");
-        exit(-1);
+        goto error;
     }
     server_cfg->non_blocked_domain_len = len;
     server_cfg->non_blocked_domain = xmalloc(sizeof(char *) * len);
@@ -168,14 +334,22 @@ server_cfg_t *read_server_cfg(char *filepath, char *bind_ip, int port, bool verb
         strcpy(server_cfg->non_blocked_domain[i], domain);
     }
 
-
     config_destroy(&config);
     return server_cfg;
+
+error:
+    config_destroy(&config);
+    free_server_cfg(server_cfg);
+    return NULL;
 }
 
 void free_server_cfg(server_cfg_t *cfg) {
     int i = 0;
+    xfree(cfg->conf_file);
     xfree(cfg->bind_address);
+    if (cfg->stats_address) {
+        xfree(cfg->stats_address);
+    }
     xfree(cfg->subnet_file_path);
     for (i = 0; i < cfg->proxies_count; ++i) {
         xfree(cfg->proxies[i].addr);
@@ -188,15 +362,98 @@ void free_server_cfg(server_cfg_t *cfg) {
     }
     xfree(cfg->blocked_domain);
     xfree(cfg->non_blocked_domain);
+    for (i = 0; i < cfg->blocked_rule_files_len; ++i) {
+        xfree(cfg->blocked_rule_files[i]);
+    }
+    for (i = 0; i < cfg->domestic_rule_files_len; ++i) {
+        xfree(cfg->domestic_rule_files[i]);
+    }
+    if (cfg->blocked_rule_files) {
+        xfree(cfg->blocked_rule_files);
+    }
+    if (cfg->domestic_rule_files) {
+        xfree(cfg->domestic_rule_files);
+    }
+    for (i = 0; i < cfg->poison_addresses_len; ++i) {
+        xfree(cfg->poison_addresses[i]);
+    }
+    if (cfg->poison_addresses) {
+        xfree(cfg->poison_addresses);
+    }
+    if (cfg->persist_file) {
+        xfree(cfg->persist_file);
+    }
     xfree(cfg->proxies);
     xfree(cfg);
 }
 
-static void ensure_true(int rv, config_t *cfg) {
+static bool config_ok(int rv, config_t *cfg) {
     if (rv != CONFIG_TRUE) {
         log_error("%s:%d - %s", config_error_file(cfg), config_error_line(cfg), config_error_text(cfg));
-        exit(-1);
+        return false;
+    }
+    return true;
+}
+
+static void keep_running_setting(const char *name, int *value, int running) {
+    if (*value != running) {
+        log_warn("%s changed, it takes effect on restart.", name);
+        *value = running;
+    }
+}
+
+// an address any socket call takes, IPv6 when ip has a colon. NULL when ip is neither.
+static struct sockaddr *parse_address(const char *ip, int port) {
+    struct sockaddr_storage *addr = TMALLOC(struct sockaddr_storage);
+    int rv;
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    if (strchr(ip, ':')) {
+        rv = uv_ip6_addr(ip, port, (struct sockaddr_in6 *) addr);
+    } else {
+        rv = uv_ip4_addr(ip, port, (struct sockaddr_in *) addr);
+    }
+    if (rv) {
+        xfree(addr);
+        return NULL;
+    }
+    return (struct sockaddr *) addr;
+}
+
+static int lookup_int_default(config_t *cfg, const char *path, int default_value) {
+    int value;
+    if (config_lookup_int(cfg, path, &value) != CONFIG_TRUE) {
+        return default_value;
+    }
+    return value;
+}
+
+// a copy of the string array at path, NULL and 0 when it is missing, -1 when it holds anything else.
+static int lookup_strings(config_t *cfg, const char *path, char ***strings) {
+    config_setting_t *settings = config_lookup(cfg, path);
+    int len = settings ? config_setting_length(settings) : 0;
+    int i;
+
+    *strings = NULL;
+    if (len == 0) {
+        return 0;
+    }
+    *strings = xmalloc(sizeof(char *) * len);
+    for (i = 0; i < len; ++i) {
+        const char *value = config_setting_get_string_elem(settings, i);
+        if (value == NULL) {
+            log_error("%s must hold strings.", path);
+            while (i-- > 0) {
+                xfree((*strings)[i]);
+            }
+            xfree(*strings);
+            *strings = NULL;
+            return -1;
+        }
+        (*strings)[i] = xmalloc(strlen(value) + 1);
+        strcpy((*strings)[i], value);
     }
+    return len;
 }
 
 static void print_usage() {
@@ -205,6 +462,6 @@ static void print_usage() {
                    "  -b, --bind:     address that the server listens, overwrite configuration file setting.\n"
                    "  -p, --port:     port that the server listens, overwrite configuration file setting.\n"
                    "  -c, --conf:     the configuration file location, default: ${HOME}/.gdns/gdns.conf\n"
-                   "  -v, --verbose:  print verbose message, useful for debugging.\n"
+                   "  -v, --verbose:  log debug lines too, whatever log.level says.\n"
                    "  -h, --help:     help message\n");
 }
\ No newline at end of file
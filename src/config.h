@@ -5,6 +5,12 @@
 
 server_cfg_t * init_server_cfg(int argc, char ** argv);
 
+/*
+ * Read the file running was read from again, NULL when it is unusable. The listening address, workers,
+ * batch_io, the stats endpoint and the cache and verdict sizes keep their running values.
+ */
+server_cfg_t *reload_server_cfg(const server_cfg_t *running);
+
 void free_server_cfg(server_cfg_t *);
 
 #endif //GDNS_CONFIG_H
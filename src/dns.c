@@ -0,0 +1,268 @@
+#include <string.h>
+#include "dns.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// walks the labels of a name, through compression pointers.
+typedef struct {
+    size_t offset;
+    int total; // expanded length so far, bounds pointer loops.
+} name_cursor_t;
+
+static ssize_t skip_name(const unsigned char *data, size_t len, size_t offset);
+
+static int next_label(const unsigned char *data, size_t len, name_cursor_t *cursor, const unsigned char **label);
+
+static int read_name(const unsigned char *data, size_t len, size_t offset, char *name, uint32_t *hash);
+
+static char *put_name_char(char *p, unsigned char c, uint32_t *hash);
+
+static unsigned char lower(unsigned char c);
+
+int dns_msg_init(dns_msg_t *msg, const char *data, ssize_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    ssize_t offset = NS_HFIXEDSZ;
+    int i;
+
+    if (len < NS_HFIXEDSZ) {
+        return -1;
+    }
+    msg->data = p;
+    msg->len = (size_t) len;
+    msg->id = dns_get16(p);
+    msg->flags = dns_get16(p + 2);
+    for (i = 0; i < 4; ++i) {
+        msg->counts[i] = dns_get16(p + 4 + 2 * i);
+    }
+
+    msg->question = (size_t) offset;
+    for (i = 0; i < msg->counts[ns_s_qd]; ++i) {
+        offset = skip_name(p, msg->len, (size_t) offset);
+        if (offset < 0 || offset + NS_QFIXEDSZ > len) {
+            return -1;
+        }
+        offset += NS_QFIXEDSZ;
+    }
+    msg->records = (size_t) offset;
+    return 0;
+}
+
+void dns_rr_iter_init(dns_rr_iter_t *iter, const dns_msg_t *msg) {
+    iter->msg = msg;
+    iter->offset = msg->records;
+    iter->section = ns_s_an;
+    iter->remaining = msg->counts[ns_s_an];
+}
+
+int dns_rr_next(dns_rr_iter_t *iter, dns_rr_t *rr) {
+    const dns_msg_t *msg = iter->msg;
+    ssize_t offset;
+    size_t end;
+
+    while (iter->remaining == 0) {
+        if (iter->section == ns_s_ar) {
+            return 0;
+        }
+        iter->section = (ns_sect) (iter->section + 1);
+        iter->remaining = msg->counts[iter->section];
+    }
+
+    offset = skip_name(msg->data, msg->len, iter->offset);
+    if (offset < 0 || (size_t) offset + NS_RRFIXEDSZ > msg->len) {
+        return -1;
+    }
+    rr->section = iter->section;
+    rr->name = iter->offset;
+    rr->type = dns_get16(msg->data + offset);
+    rr->rclass = dns_get16(msg->data + offset + 2);
+    rr->ttl_offset = (size_t) offset + 4;
+    rr->ttl = dns_get32(msg->data + rr->ttl_offset);
+    rr->rdlength = dns_get16(msg->data + offset + 8);
+    rr->rdata = msg->data + offset + NS_RRFIXEDSZ;
+    end = (size_t) offset + NS_RRFIXEDSZ + rr->rdlength;
+    if (end > msg->len) {
+        return -1;
+    }
+
+    iter->offset = end;
+    iter->remaining -= 1;
+    return 1;
+}
+
+int dns_parse_question(const char *data, ssize_t len, dns_question_t *question) {
+    dns_msg_t msg;
+    uint32_t hash = FNV_OFFSET; // FNV-1a
+
+    if (dns_msg_init(&msg, data, len) || msg.counts[ns_s_qd] != 1 || dns_msg_opcode(&msg) != ns_o_query) {
+        return -1;
+    }
+    if (read_name(msg.data, msg.len, msg.question, question->name, &hash)) {
+        return -1;
+    }
+    // type and class close the only question.
+    question->qtype = dns_get16(msg.data + msg.records - NS_QFIXEDSZ);
+    question->qclass = dns_get16(msg.data + msg.records - NS_QFIXEDSZ + 2);
+    hash = (hash ^ question->qtype) * FNV_PRIME;
+    hash = (hash ^ question->qclass) * FNV_PRIME;
+    question->hash = hash;
+    return 0;
+}
+
+bool dns_question_equal(const dns_question_t *a, const dns_question_t *b) {
+    return a->hash == b->hash && a->qtype == b->qtype && a->qclass == b->qclass && strcmp(a->name, b->name) == 0;
+}
+
+bool dns_same_question(const char *query, ssize_t query_len, const char *response, ssize_t response_len) {
+    dns_msg_t q, r;
+    name_cursor_t qc, rc;
+    const unsigned char *ql, *rl;
+    int qn, rn, i;
+
+    if (dns_msg_init(&q, query, query_len) || dns_msg_init(&r, response, response_len) ||
+        q.counts[ns_s_qd] != 1 || r.counts[ns_s_qd] != 1) {
+        return false;
+    }
+
+    qc.offset = q.question;
+    qc.total = 0;
+    rc.offset = r.question;
+    rc.total = 0;
+    do {
+        qn = next_label(q.data, q.len, &qc, &ql);
+        rn = next_label(r.data, r.len, &rc, &rl);
+        if (qn < 0 || qn != rn) {
+            return false;
+        }
+        for (i = 0; i < qn; ++i) {
+            if (lower(ql[i]) != lower(rl[i])) {
+                return false;
+            }
+        }
+    } while (qn > 0);
+
+    // type and class follow the questions.
+    return memcmp(q.data + q.records - NS_QFIXEDSZ, r.data + r.records - NS_QFIXEDSZ, NS_QFIXEDSZ) == 0;
+}
+
+ssize_t dns_error_response(const char *query, ssize_t query_len, int rcode, char *response) {
+    dns_msg_t msg;
+    int i;
+
+    if (dns_msg_init(&msg, query, query_len)) {
+        return -1;
+    }
+    memcpy(response, query, msg.records);
+    // QR and RA, the opcode, RD and CD of the query stay.
+    dns_put16((uint16_t) ((msg.flags & 0x7910) | 0x8080 | (rcode & 0x000f)), (unsigned char *) response + 2);
+    for (i = ns_s_an; i <= ns_s_ar; ++i) {
+        dns_put16(0, (unsigned char *) response + 4 + 2 * i);
+    }
+    return (ssize_t) msg.records;
+}
+
+// offset past the name, -1 if it runs out of the message. Pointers are not followed.
+static ssize_t skip_name(const unsigned char *data, size_t len, size_t offset) {
+    int total = 1;
+
+    while (offset < len) {
+        unsigned char c = data[offset];
+        if ((c & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+            return offset + 2 <= len ? (ssize_t) offset + 2 : -1;
+        }
+        if (c & NS_CMPRSFLGS) { // extended label types are obsolete.
+            return -1;
+        }
+        if (c == 0) {
+            return (ssize_t) offset + 1;
+        }
+        total += c + 1;
+        if (total > NS_MAXCDNAME) {
+            return -1;
+        }
+        offset += c + 1;
+    }
+    return -1;
+}
+
+// length of the next label, 0 for the root, -1 when malformed. label points at its first byte.
+static int next_label(const unsigned char *data, size_t len, name_cursor_t *cursor, const unsigned char **label) {
+    size_t offset = cursor->offset;
+    unsigned char c;
+
+    for (;;) {
+        if (offset >= len) {
+            return -1;
+        }
+        c = data[offset];
+        if ((c & NS_CMPRSFLGS) != NS_CMPRSFLGS) {
+            break;
+        }
+        if (offset + 1 >= len) {
+            return -1;
+        }
+        // only backward pointers, a loop through labels is cut by the length limit.
+        if ((((size_t) c & 0x3f) << 8 | data[offset + 1]) >= offset) {
+            return -1;
+        }
+        offset = ((size_t) c & 0x3f) << 8 | data[offset + 1];
+    }
+
+    if (c & NS_CMPRSFLGS || offset + 1 + c > len) {
+        return -1;
+    }
+    cursor->total += c + 1;
+    if (cursor->total > NS_MAXCDNAME) {
+        return -1;
+    }
+    *label = data + offset + 1;
+    cursor->offset = offset + 1 + c;
+    return c;
+}
+
+// lowercased presentation form of a name, escaped as ns_name_ntop does. 255 wire bytes fit NS_MAXDNAME.
+static int read_name(const unsigned char *data, size_t len, size_t offset, char *name, uint32_t *hash) {
+    name_cursor_t cursor = {offset, 0};
+    const unsigned char *label;
+    char *p = name;
+    int n, i;
+
+    while ((n = next_label(data, len, &cursor, &label)) > 0) {
+        if (p != name) {
+            p = put_name_char(p, '.', hash);
+        }
+        for (i = 0; i < n; ++i) {
+            unsigned char c = lower(label[i]);
+            if (c <= 0x20 || c >= 0x7f) {
+                p = put_name_char(p, '\\', hash);
+                p = put_name_char(p, (unsigned char) ('0' + c / 100), hash);
+                p = put_name_char(p, (unsigned char) ('0' + c / 10 % 10), hash);
+                p = put_name_char(p, (unsigned char) ('0' + c % 10), hash);
+            } else if (c == '.' || c == ';' || c == '\\' || c == '(' || c == ')' || c == '@' || c == '$' || c == '"') {
+                p = put_name_char(p, '\\', hash);
+                p = put_name_char(p, c, hash);
+            } else {
+                p = put_name_char(p, c, hash);
+            }
+        }
+    }
+    if (n < 0) {
+        return -1;
+    }
+    if (p == name) {
+        p = put_name_char(p, '.', hash);
+    }
+    *p = '\0';
+    return 0;
+}
+
+static char *put_name_char(char *p, unsigned char c, uint32_t *hash) {
+    *hash = (*hash ^ c) * FNV_PRIME;
+    *p = (char) c;
+    return p + 1;
+}
+
+// ascii only, names are not locale dependent.
+static unsigned char lower(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? (unsigned char) (c - 'A' + 'a') : c;
+}
@@ -0,0 +1,94 @@
+#ifndef GDNS_DNS_H
+#define GDNS_DNS_H
+
+#include "common.h"
+
+/*
+ * Zero copy view of a DNS message. dns_msg_init validates the header and walks the question section in place,
+ * dns_rr_next then walks the records of the answer, authority and additional sections over the same buffer.
+ * Names are skipped but never expanded, every view points into the caller's buffer and lives as long as it.
+ */
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    uint16_t id;
+    uint16_t flags;
+    uint16_t counts[4]; // records per section, indexed by ns_sect.
+    size_t question; // offset of the first question.
+    size_t records; // offset of the first answer record, right after the questions.
+} dns_msg_t;
+
+typedef struct {
+    ns_sect section;
+    size_t name; // offset of the owner name, may be a compression pointer.
+    uint16_t type;
+    uint16_t rclass;
+    uint32_t ttl;
+    size_t ttl_offset; // for rewriting the ttl in place.
+    const unsigned char *rdata;
+    uint16_t rdlength;
+} dns_rr_t;
+
+typedef struct {
+    const dns_msg_t *msg;
+    size_t offset;
+    ns_sect section;
+    int remaining; // records left in section.
+} dns_rr_iter_t;
+
+#define dns_msg_rcode(msg) ((msg)->flags & 0x000f)
+#define dns_msg_opcode(msg) (((msg)->flags >> 11) & 0x000f)
+#define dns_msg_truncated(msg) (((msg)->flags & 0x0200) != 0)
+
+static inline uint16_t dns_get16(const unsigned char *p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static inline uint32_t dns_get32(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline void dns_put16(uint16_t value, unsigned char *p) {
+    p[0] = (unsigned char) (value >> 8);
+    p[1] = (unsigned char) value;
+}
+
+static inline void dns_put32(uint32_t value, unsigned char *p) {
+    p[0] = (unsigned char) (value >> 24);
+    p[1] = (unsigned char) (value >> 16);
+    p[2] = (unsigned char) (value >> 8);
+    p[3] = (unsigned char) value;
+}
+
+/*
+ * Returns 0 when the header fits and every question is well formed.
+ */
+int dns_msg_init(dns_msg_t *msg, const char *data, ssize_t len);
+
+void dns_rr_iter_init(dns_rr_iter_t *iter, const dns_msg_t *msg);
+
+/*
+ * Returns 1 and fills rr with the next record, 0 past the last one, -1 on a malformed record.
+ */
+int dns_rr_next(dns_rr_iter_t *iter, dns_rr_t *rr);
+
+/*
+ * Parse the single question of a standard query or its response. Returns 0 on success.
+ */
+int dns_parse_question(const char *msg, ssize_t len, dns_question_t *question);
+
+bool dns_question_equal(const dns_question_t *a, const dns_question_t *b);
+
+/*
+ * Whether a response carries the single question of query, names compare without case.
+ */
+bool dns_same_question(const char *query, ssize_t query_len, const char *response, ssize_t response_len);
+
+/*
+ * Write to response the answer with rcode to query, carrying its question and no records. response needs room
+ * for query_len bytes. Returns the length of the answer, -1 when query is malformed.
+ */
+ssize_t dns_error_response(const char *query, ssize_t query_len, int rcode, char *response);
+
+#endif //GDNS_DNS_H
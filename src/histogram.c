@@ -0,0 +1,63 @@
+#include <string.h>
+#include "histogram.h"
+
+#define EXACT_BUCKETS 256
+#define COARSE_STEP 16
+
+static int64_t bucket_bound(int i);
+
+void histogram_reset(histogram_t *histogram) {
+    memset(histogram, 0, sizeof(histogram_t));
+}
+
+void histogram_add(histogram_t *histogram, int64_t ms) {
+    int64_t index = ms;
+
+    if (index < 0) {
+        index = 0;
+    } else if (index >= EXACT_BUCKETS) {
+        index = EXACT_BUCKETS + (ms - EXACT_BUCKETS) / COARSE_STEP;
+        if (index >= HISTOGRAM_BUCKETS) {
+            index = HISTOGRAM_BUCKETS - 1;
+        }
+    }
+    STAT_ADD(histogram->counts[index], 1);
+    STAT_ADD(histogram->total, 1);
+    STAT_ADD(histogram->sum, ms);
+}
+
+int64_t histogram_percentile(const histogram_t *histogram, double fraction) {
+    uint64_t total = STAT_READ(histogram->total);
+    uint64_t rank = (uint64_t) (fraction * (double) total + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (total == 0) {
+        return 0;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1; ++i) {
+        seen += STAT_READ(histogram->counts[i]);
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return bucket_bound(i);
+}
+
+uint64_t histogram_count_below(const histogram_t *histogram, int64_t ms) {
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1 && bucket_bound(i) <= ms; ++i) {
+        count += STAT_READ(histogram->counts[i]);
+    }
+    return count;
+}
+
+// largest ms counted in bucket i.
+static int64_t bucket_bound(int i) {
+    return i < EXACT_BUCKETS ? i : EXACT_BUCKETS + (int64_t) (i - EXACT_BUCKETS + 1) * COARSE_STEP - 1;
+}
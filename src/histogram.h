@@ -0,0 +1,25 @@
+#ifndef GDNS_HISTOGRAM_H
+#define GDNS_HISTOGRAM_H
+
+#include "common.h"
+
+/*
+ * Latency histogram in ms, exact up to 255 ms then in 16 ms steps up to the last bucket. Every worker
+ * keeps its own, other threads may only read it.
+ */
+
+void histogram_reset(histogram_t *histogram);
+
+void histogram_add(histogram_t *histogram, int64_t ms);
+
+/*
+ * Upper bound of the bucket holding the given fraction of the samples, 0.99 for p99. 0 when empty.
+ */
+int64_t histogram_percentile(const histogram_t *histogram, double fraction);
+
+/*
+ * Samples of at most ms, counted by whole buckets. Exact for bucket bounds, every ms up to 255.
+ */
+uint64_t histogram_count_below(const histogram_t *histogram, int64_t ms);
+
+#endif //GDNS_HISTOGRAM_H
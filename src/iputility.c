@@ -2,17 +2,85 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#define SUBNET_FILE_MAGIC "GDNSNET"
+#define SUBNET_FILE_VERSION 2
+#define SUBNET_FILE_BYTE_ORDER 0x01020304u
+#define SUBNET_FILE_SUFFIX ".bin"
+
+/*
+ * A compiled subnet list is this header followed by the arrays of subnet_list_t as they are in memory:
+ * starts6[len6], ends6[len6], starts[len], ends[len], index[index_size + 1] and index6[index_size + 1],
+ * all in host byte order. The IPv6 ranges come first to keep their 64 bit halves aligned.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // SUBNET_FILE_BYTE_ORDER as written, rejects a file from another architecture.
+    uint32_t len;
+    uint32_t len6;
+    uint32_t index_size;
+    uint32_t reserved;
+} subnet_file_header_t;
+
+static int parse_subnet(char *line, subnet_t *subnet, subnet6_t *subnet6);
 
 static int cmp_subnet(const void *s1, const void *s2);
 
+static int cmp_subnet6(const void *s1, const void *s2);
+
+static void build_ranges(subnet_list_t *list, subnet_t *subnets, int len);
+
+static void build_ranges6(subnet_list_t *list, subnet6_t *subnets, int len);
+
+static ip6_t ip6_from(const struct in6_addr *addr);
+
+static bool ip6_less(ip6_t a, ip6_t b);
+
+static bool ip6_adjoins(ip6_t end, ip6_t start);
+
+static bool valid_index(const uint32_t *index, uint32_t len);
+
+static int map_compiled(const char *path, subnet_list_t *list);
+
+static void list_reset(subnet_list_t *list);
+
 int subnet_list_init(const char *path, subnet_list_t *list) {
+    char compiled[4096];
+    struct stat text_stat, compiled_stat;
+
+    list_reset(list);
+    if (map_compiled(path, list) == 0) {
+        return 0;
+    }
+
+    // a compiled companion is used unless the text was edited after it was built.
+    snprintf(compiled, sizeof(compiled), "%s%s", path, SUBNET_FILE_SUFFIX);
+    if (stat(compiled, &compiled_stat) == 0) {
+        if (stat(path, &text_stat) == 0 && text_stat.st_mtime > compiled_stat.st_mtime) {
+            log_warn("%s is older than %s, parsing the text.", compiled, path);
+        } else if (map_compiled(compiled, list) == 0) {
+            return 0;
+        }
+    }
+    return subnet_list_parse(path, list);
+}
+
+int subnet_list_parse(const char *path, subnet_list_t *list) {
     FILE *fp;
-    struct in_addr addr;
-    char buf[24];
+    char buf[64];
     char *line;
-    int i = 0;
-    list->len = 0;
+    subnet_t *subnets;
+    subnet6_t *subnets6;
+    int len = 0;
+    int i = 0, n = 0, n6 = 0;
+
+    list_reset(list);
 
     fp = fopen(path, "rb");
     if (fp == NULL) {
@@ -21,66 +89,389 @@ int subnet_list_init(const char *path, subnet_list_t *list) {
     }
 
     while ((line = fgets(buf, sizeof(buf), fp))) {
-        list->len += 1;
+        len += 1;
     }
 
-    list->subnets = xmalloc(sizeof(subnet_t) * list->len);
+    subnets = xmalloc(sizeof(subnet_t) * (len > 0 ? len : 1));
+    subnets6 = xmalloc(sizeof(subnet6_t) * (len > 0 ? len : 1));
 
     fseek(fp, 0, SEEK_SET);
 
     while ((line = fgets(buf, sizeof(buf), fp))) {
-        char *delimiter;
-        delimiter = strchr(line, '/');
-        if (delimiter) {
-            list->subnets[i].mask = ~(~(uint32_t) 0 >> atoi(delimiter + 1));
+        int family = parse_subnet(line, &subnets[n], &subnets6[n6]);
+        i++;
+        if (family == AF_INET) {
+            n++;
+        } else if (family == AF_INET6) {
+            n6++;
         } else {
-            log_error("parse subnet file error!");
-            return -1;
-        }
-        *delimiter = 0;
-        if (!inet_aton(line, &addr)) {
-            log_error("invalid addr %s in %s:%d", line, path, i + 1);
+            log_error("invalid subnet %s in %s:%d", line, path, i);
+            xfree(subnets);
+            xfree(subnets6);
+            fclose(fp);
             return -1;
         }
-        list->subnets[i].addr = ntohl(addr.s_addr) & list->subnets[i].mask;
-        i++;
     }
 
-    qsort(list->subnets, (size_t) list->len, sizeof(subnet_t), cmp_subnet);
+    qsort(subnets, (size_t) n, sizeof(subnet_t), cmp_subnet);
+    build_ranges(list, subnets, n);
+    qsort(subnets6, (size_t) n6, sizeof(subnet6_t), cmp_subnet6);
+    build_ranges6(list, subnets6, n6);
+    xfree(subnets);
+    xfree(subnets6);
 
     fclose(fp);
     return 0;
 }
 
 void subnet_list_free(subnet_list_t *list) {
-    if (list->subnets) {
-        xfree(list->subnets);
+    if (list->map) {
+        munmap(list->map, list->map_size);
+    } else if (list->starts) {
+        xfree(list->starts);
+        xfree(list->ends);
+        xfree(list->index);
+        xfree(list->starts6);
+        xfree(list->ends6);
+        xfree(list->index6);
     }
+    list_reset(list);
+}
+
+int subnet_list_save(const subnet_list_t *list, const char *path) {
+    subnet_file_header_t header;
+    char tmp_path[4096];
+    FILE *fp;
+    bool ok;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SUBNET_FILE_MAGIC, sizeof(SUBNET_FILE_MAGIC));
+    header.version = SUBNET_FILE_VERSION;
+    header.byte_order = SUBNET_FILE_BYTE_ORDER;
+    header.len = (uint32_t) list->len;
+    header.len6 = (uint32_t) list->len6;
+    header.index_size = SUBNET_INDEX_SIZE;
+
+    // written aside and renamed, so a running gdns never maps half a file.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        log_error("Can not open file %s", tmp_path);
+        return -1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(list->starts6, sizeof(ip6_t), (size_t) list->len6, fp) == (size_t) list->len6 &&
+         fwrite(list->ends6, sizeof(ip6_t), (size_t) list->len6, fp) == (size_t) list->len6 &&
+         fwrite(list->starts, sizeof(in_addr_t), (size_t) list->len, fp) == (size_t) list->len &&
+         fwrite(list->ends, sizeof(in_addr_t), (size_t) list->len, fp) == (size_t) list->len &&
+         fwrite(list->index, sizeof(uint32_t), SUBNET_INDEX_SIZE + 1, fp) == SUBNET_INDEX_SIZE + 1 &&
+         fwrite(list->index6, sizeof(uint32_t), SUBNET_INDEX_SIZE + 1, fp) == SUBNET_INDEX_SIZE + 1;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path, path)) {
+        log_error("write %s failed! %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
 }
 
 bool ip_in_subnet_list(subnet_list_t *list, struct in_addr *addr) {
-    int i = 0;
     in_addr_t ip = ntohl(addr->s_addr);
+    uint32_t top = ip >> 16;
+    int lo, hi;
+
+    if (list->len == 0) {
+        return false;
+    }
 
-    for (i = 0; i < list->len; ++i) {
-        if (ip < list->subnets[i].addr)
-            break;
+    // the first range ending at or after ip lies in [index[top], index[top + 1]].
+    lo = (int) list->index[top];
+    hi = (int) list->index[top + 1];
+    if (hi >= list->len) {
+        hi = list->len - 1;
+    }
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (list->ends[mid] < ip) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    if (i == 0) {
+
+    return lo < list->len && list->starts[lo] <= ip && ip <= list->ends[lo];
+}
+
+bool ip6_in_subnet_list(subnet_list_t *list, struct in6_addr *addr) {
+    ip6_t ip = ip6_from(addr);
+    uint32_t top = (uint32_t) (ip.hi >> 48);
+    int lo, hi;
+
+    if (list->len6 == 0) {
         return false;
-    } else {
-        i -= 1;
-        if ((ip & list->subnets[i].mask) == list->subnets[i].addr) {
-            return true;
+    }
+
+    // same search as ip_in_subnet_list over the 128 bit ranges.
+    lo = (int) list->index6[top];
+    hi = (int) list->index6[top + 1];
+    if (hi >= list->len6) {
+        hi = list->len6 - 1;
+    }
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ip6_less(list->ends6[mid], ip)) {
+            lo = mid + 1;
         } else {
-            return false;
+            hi = mid;
+        }
+    }
+
+    return lo < list->len6 && !ip6_less(ip, list->starts6[lo]) && !ip6_less(list->ends6[lo], ip);
+}
+
+/*
+ * Parse "address/prefix" into subnet or subnet6, returns the address family or -1.
+ */
+static int parse_subnet(char *line, subnet_t *subnet, subnet6_t *subnet6) {
+    struct in_addr addr;
+    struct in6_addr addr6;
+    char *delimiter;
+    int prefix;
+
+    delimiter = strchr(line, '/');
+    if (delimiter == NULL) {
+        return -1;
+    }
+    *delimiter = 0;
+    prefix = atoi(delimiter + 1);
+    if (prefix < 0) {
+        prefix = 0;
+    }
+
+    if (inet_pton(AF_INET, line, &addr) == 1) {
+        subnet->mask = prefix == 0 ? 0 : ~(uint32_t) 0 << (32 - (prefix > 32 ? 32 : prefix));
+        subnet->addr = ntohl(addr.s_addr) & subnet->mask;
+        return AF_INET;
+    }
+    if (inet_pton(AF_INET6, line, &addr6) == 1) {
+        subnet6->prefix = prefix > 128 ? 128 : prefix;
+        subnet6->addr = ip6_from(&addr6);
+        if (subnet6->prefix <= 64) {
+            subnet6->addr.lo = 0;
+            subnet6->addr.hi &= subnet6->prefix == 0 ? 0 : ~(uint64_t) 0 << (64 - subnet6->prefix);
+        } else {
+            subnet6->addr.lo &= ~(uint64_t) 0 << (128 - subnet6->prefix);
         }
+        return AF_INET6;
     }
+    return -1;
+}
+
+/*
+ * Merge sorted subnets into disjoint ranges, so nested, overlapping and adjacent prefixes collapse
+ * into a single range.
+ */
+static void build_ranges(subnet_list_t *list, subnet_t *subnets, int len) {
+    int i, n = 0;
+    uint32_t h;
+
+    list->starts = xmalloc(sizeof(in_addr_t) * (len > 0 ? len : 1));
+    list->ends = xmalloc(sizeof(in_addr_t) * (len > 0 ? len : 1));
+    list->index = xmalloc(sizeof(uint32_t) * (SUBNET_INDEX_SIZE + 1));
+
+    for (i = 0; i < len; ++i) {
+        in_addr_t start = subnets[i].addr;
+        in_addr_t end = subnets[i].addr | ~subnets[i].mask;
+
+        if (n > 0 && (uint64_t) start <= (uint64_t) list->ends[n - 1] + 1) {
+            if (end > list->ends[n - 1]) {
+                list->ends[n - 1] = end;
+            }
+        } else {
+            list->starts[n] = start;
+            list->ends[n] = end;
+            n++;
+        }
+    }
+    list->len = n;
+
+    for (h = 0, i = 0; h <= SUBNET_INDEX_SIZE; ++h) {
+        uint64_t base = (uint64_t) h << 16;
+        while (i < n && list->ends[i] < base) {
+            i++;
+        }
+        list->index[h] = (uint32_t) i;
+    }
+}
+
+/*
+ * build_ranges for IPv6, the end of a range is its start with every bit past the prefix set.
+ */
+static void build_ranges6(subnet_list_t *list, subnet6_t *subnets, int len) {
+    int i, n = 0;
+    uint32_t h;
+
+    list->starts6 = xmalloc(sizeof(ip6_t) * (len > 0 ? len : 1));
+    list->ends6 = xmalloc(sizeof(ip6_t) * (len > 0 ? len : 1));
+    list->index6 = xmalloc(sizeof(uint32_t) * (SUBNET_INDEX_SIZE + 1));
+
+    for (i = 0; i < len; ++i) {
+        ip6_t start = subnets[i].addr;
+        ip6_t end = start;
+
+        if (subnets[i].prefix < 64) {
+            end.hi |= subnets[i].prefix == 0 ? ~(uint64_t) 0 : ~(uint64_t) 0 >> subnets[i].prefix;
+            end.lo = ~(uint64_t) 0;
+        } else if (subnets[i].prefix < 128) {
+            end.lo |= ~(uint64_t) 0 >> (subnets[i].prefix - 64);
+        }
+
+        if (n > 0 && ip6_adjoins(list->ends6[n - 1], start)) {
+            if (ip6_less(list->ends6[n - 1], end)) {
+                list->ends6[n - 1] = end;
+            }
+        } else {
+            list->starts6[n] = start;
+            list->ends6[n] = end;
+            n++;
+        }
+    }
+    list->len6 = n;
+
+    for (h = 0, i = 0; h < SUBNET_INDEX_SIZE; ++h) {
+        ip6_t base = {(uint64_t) h << 48, 0};
+        while (i < n && ip6_less(list->ends6[i], base)) {
+            i++;
+        }
+        list->index6[h] = (uint32_t) i;
+    }
+    list->index6[SUBNET_INDEX_SIZE] = (uint32_t) n;
 }
 
 static int cmp_subnet(const void *s1, const void *s2) {
     const subnet_t *s_1 = s1;
     const subnet_t *s_2 = s2;
 
-    return s_1->addr - s_2->addr;
-}
\ No newline at end of file
+    if (s_1->addr != s_2->addr) {
+        return s_1->addr < s_2->addr ? -1 : 1;
+    }
+    // wider prefix first.
+    return s_1->mask < s_2->mask ? -1 : (s_1->mask > s_2->mask ? 1 : 0);
+}
+
+static int cmp_subnet6(const void *s1, const void *s2) {
+    const subnet6_t *s_1 = s1;
+    const subnet6_t *s_2 = s2;
+
+    if (ip6_less(s_1->addr, s_2->addr)) {
+        return -1;
+    }
+    if (ip6_less(s_2->addr, s_1->addr)) {
+        return 1;
+    }
+    // wider prefix first.
+    return s_1->prefix < s_2->prefix ? -1 : (s_1->prefix > s_2->prefix ? 1 : 0);
+}
+
+static ip6_t ip6_from(const struct in6_addr *addr) {
+    ip6_t ip = {0, 0};
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        ip.hi = ip.hi << 8 | addr->s6_addr[i];
+        ip.lo = ip.lo << 8 | addr->s6_addr[i + 8];
+    }
+    return ip;
+}
+
+static bool ip6_less(ip6_t a, ip6_t b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+// whether start lies at or before the address right after end.
+static bool ip6_adjoins(ip6_t end, ip6_t start) {
+    ip6_t next = {end.hi + (end.lo == ~(uint64_t) 0), end.lo + 1};
+
+    return (next.hi == 0 && next.lo == 0) || !ip6_less(next, start);
+}
+
+// lookups trust the index, so it has to stay within the ranges.
+static bool valid_index(const uint32_t *index, uint32_t len) {
+    uint32_t i;
+
+    for (i = 0; i <= SUBNET_INDEX_SIZE; ++i) {
+        if (index[i] > len || (i > 0 && index[i] < index[i - 1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Point list into the mapped file. Returns -1 when path is not a compiled list, with a warning when it
+ * looks like one that this build can not use.
+ */
+static int map_compiled(const char *path, subnet_list_t *list) {
+    subnet_file_header_t header;
+    struct stat st;
+    size_t expected;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) ||
+        memcmp(header.magic, SUBNET_FILE_MAGIC, sizeof(SUBNET_FILE_MAGIC)) != 0) {
+        close(fd);
+        return -1;
+    }
+    expected = sizeof(header) + sizeof(ip6_t) * 2 * (size_t) header.len6 + sizeof(in_addr_t) * 2 * (size_t) header.len +
+               sizeof(uint32_t) * 2 * ((size_t) header.index_size + 1);
+    if (header.version != SUBNET_FILE_VERSION || header.byte_order != SUBNET_FILE_BYTE_ORDER ||
+        header.index_size != SUBNET_INDEX_SIZE || header.len > INT32_MAX || header.len6 > INT32_MAX ||
+        (size_t) st.st_size != expected) {
+        log_warn("%s is not a compiled subnet list this build reads, recompile it.", path);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_warn("mmap %s failed! %s", path, strerror(errno));
+        return -1;
+    }
+    list->map = map;
+    list->map_size = expected;
+    list->len6 = (int) header.len6;
+    list->starts6 = (ip6_t *) (map + sizeof(header));
+    list->ends6 = list->starts6 + header.len6;
+    list->len = (int) header.len;
+    list->starts = (in_addr_t *) (list->ends6 + header.len6);
+    list->ends = list->starts + header.len;
+    list->index = (uint32_t *) (list->ends + header.len);
+    list->index6 = list->index + SUBNET_INDEX_SIZE + 1;
+
+    if (!valid_index(list->index, header.len) || !valid_index(list->index6, header.len6)) {
+        log_warn("%s is corrupted, recompile it.", path);
+        subnet_list_free(list);
+        return -1;
+    }
+    return 0;
+}
+
+static void list_reset(subnet_list_t *list) {
+    list->len = 0;
+    list->starts = NULL;
+    list->ends = NULL;
+    list->index = NULL;
+    list->len6 = 0;
+    list->starts6 = NULL;
+    list->ends6 = NULL;
+    list->index6 = NULL;
+    list->map = NULL;
+    list->map_size = 0;
+}
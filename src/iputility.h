@@ -3,10 +3,26 @@
 
 #include "common.h"
 
+/*
+ * Map path when it is a compiled list, else path.bin unless the text is newer, else parse the text.
+ * Returns 0 on success.
+ */
 int subnet_list_init(const char *path, subnet_list_t *list);
 
+/*
+ * Parse a text list, one IPv4 or IPv6 address/prefix per line.
+ */
+int subnet_list_parse(const char *path, subnet_list_t *list);
+
+/*
+ * Write list in the compiled format, replacing path atomically.
+ */
+int subnet_list_save(const subnet_list_t *list, const char *path);
+
 void subnet_list_free(subnet_list_t *list);
 
 bool ip_in_subnet_list(subnet_list_t *list, struct in_addr *addr);
 
+bool ip6_in_subnet_list(subnet_list_t *list, struct in6_addr *addr);
+
 #endif //GDNS_IPUTILITY_H
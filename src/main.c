@@ -3,10 +3,13 @@
 
 
 int main(int argc, char **argv) {
-    server_cfg_t *cfg = init_server_cfg(argc, argv);
-    uv_loop_t *loop = uv_default_loop();
-    run_server(loop, cfg);
+    server_cfg_t *cfg;
+    uv_loop_t *loop;
+
+    log_start();
+    cfg = init_server_cfg(argc, argv);
+    loop = uv_default_loop();
+    run_server(loop, cfg); // owns cfg, a reload replaces it.
     uv_loop_close(loop);
-    free_server_cfg(cfg);
     return 0;
 }
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/nameser.h>
+#include "persist.h"
+#include "cache.h"
+#include "verdict.h"
+#include "proxy.h"
+
+#define PERSIST_FILE_MAGIC "GDNSWRM"
+#define PERSIST_FILE_VERSION 2
+#define PERSIST_FILE_BYTE_ORDER 0x01020304u
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/*
+ * The header is followed by the proxies as persist_proxy_t, the answers, each a persist_answer_t, the name,
+ * the ttl offsets and the answer, and the verdicts, each a persist_verdict_t and the domain. Every question
+ * and domain is there once. All in host byte order, unaligned.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // PERSIST_FILE_BYTE_ORDER as written, rejects a file from another architecture.
+    int64_t saved_at; // s since the epoch.
+    uint32_t proxies;
+    uint32_t answers;
+    uint32_t verdicts;
+    uint32_t checksum; // FNV-1a of everything after the header.
+} persist_file_header_t;
+
+typedef struct {
+    latency_model_t genuine;
+    latency_model_t fake;
+    struct sockaddr_storage addr;
+    uint8_t internal;
+    uint8_t tcp;
+    uint8_t enabled;
+    uint8_t reserved[5];
+} persist_proxy_t;
+
+// an answer as the cache keys it, restored without parsing it again.
+typedef struct {
+    uint32_t hash; // of the question.
+    uint32_t ttl; // ms left.
+    uint16_t response_len;
+    uint16_t ttl_count;
+    uint16_t reserved;
+    uint16_t qtype; // the question from here on to the end of the name.
+    uint16_t qclass;
+    uint16_t name_len; // of the lowercased name that follows, without a terminating 0.
+} persist_answer_t;
+
+typedef struct {
+    uint32_t ttl; // ms left.
+    uint8_t verdict;
+    uint8_t reserved;
+    uint16_t len; // of the domain that follows, without a terminating 0, the key from here on.
+} persist_verdict_t;
+
+// a record of a part, located to find the copies other workers hold.
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t key_offset; // the bytes that tell records apart.
+    size_t key_len;
+    uint32_t hash;
+    uint32_t ttl;
+} persist_record_t;
+
+static void buffer_append(persist_buffer_t *buffer, const void *data, size_t len);
+
+static void on_export_answer(void *data, const cache_record_t *record);
+
+static void on_export_verdict(void *data, const char *domain, verdict_t verdict, uint64_t ttl);
+
+static uint32_t checksum(uint32_t hash, const void *data, size_t len);
+
+static int map_file(const char *path, char **map, size_t *size);
+
+static bool valid_records(const char *map, size_t size, const persist_file_header_t *header);
+
+static int restore_proxies(server_cfg_t *cfg, const char *data, uint32_t count);
+
+static persist_record_t *unique_records(persist_part_t *parts, int count, bool answers, uint32_t *kept);
+
+static void locate_answer(const char *data, persist_record_t *record);
+
+static void locate_verdict(const char *data, persist_record_t *record);
+
+static void restore_answer(cache_t *cache, const char *data, uint64_t age, uint64_t now);
+
+static void model_copy(latency_model_t *to, const latency_model_t *from);
+
+void persist_collect(persist_part_t *part, cache_t *cache, verdict_table_t *verdicts, uint64_t now) {
+    cache_export(cache, now, on_export_answer, &part->answers);
+    verdict_export(verdicts, now, on_export_verdict, &part->verdicts);
+}
+
+void persist_part_free(persist_part_t *part) {
+    if (part->answers.data) {
+        xfree(part->answers.data);
+    }
+    if (part->verdicts.data) {
+        xfree(part->verdicts.data);
+    }
+    memset(part, 0, sizeof(persist_part_t));
+}
+
+int persist_write(const char *path, const server_cfg_t *cfg, persist_part_t *parts, int count, int64_t saved_at) {
+    persist_file_header_t header;
+    persist_proxy_t *proxies = xmalloc(sizeof(persist_proxy_t) * cfg->proxies_count);
+    persist_record_t *answers, *verdicts;
+    char tmp_path[4096];
+    FILE *fp;
+    bool ok;
+    uint32_t i;
+
+    memset(proxies, 0, sizeof(persist_proxy_t) * cfg->proxies_count);
+    for (i = 0; i < (uint32_t) cfg->proxies_count; ++i) {
+        model_copy(&proxies[i].genuine, &cfg->proxies[i].genuine);
+        model_copy(&proxies[i].fake, &cfg->proxies[i].fake);
+        memcpy(&proxies[i].addr, cfg->proxies[i].addr, sockaddr_size(cfg->proxies[i].addr));
+        proxies[i].internal = cfg->proxies[i].internal;
+        proxies[i].tcp = cfg->proxies[i].tcp;
+        proxies[i].enabled = __atomic_load_n(&cfg->proxies[i].enabled, __ATOMIC_RELAXED);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PERSIST_FILE_MAGIC, sizeof(PERSIST_FILE_MAGIC));
+    header.version = PERSIST_FILE_VERSION;
+    header.byte_order = PERSIST_FILE_BYTE_ORDER;
+    header.saved_at = saved_at;
+    header.proxies = (uint32_t) cfg->proxies_count;
+    // the workers resolve popular names alike, every worker loads the file, so each is written once.
+    answers = unique_records(parts, count, true, &header.answers);
+    verdicts = unique_records(parts, count, false, &header.verdicts);
+    header.checksum = checksum(FNV_OFFSET, proxies, sizeof(persist_proxy_t) * cfg->proxies_count);
+    for (i = 0; i < header.answers; ++i) {
+        header.checksum = checksum(header.checksum, answers[i].data, answers[i].len);
+    }
+    for (i = 0; i < header.verdicts; ++i) {
+        header.checksum = checksum(header.checksum, verdicts[i].data, verdicts[i].len);
+    }
+
+    // written aside and renamed, so a crash never leaves half a file to start from.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        log_error("Can not open file %s", tmp_path);
+        xfree(proxies);
+        xfree(answers);
+        xfree(verdicts);
+        return -1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(proxies, sizeof(persist_proxy_t), (size_t) cfg->proxies_count, fp) == (size_t) cfg->proxies_count;
+    for (i = 0; i < header.answers && ok; ++i) {
+        ok = fwrite(answers[i].data, 1, answers[i].len, fp) == answers[i].len;
+    }
+    for (i = 0; i < header.verdicts && ok; ++i) {
+        ok = fwrite(verdicts[i].data, 1, verdicts[i].len, fp) == verdicts[i].len;
+    }
+    ok = fclose(fp) == 0 && ok;
+    xfree(proxies);
+    xfree(answers);
+    xfree(verdicts);
+    if (!ok || rename(tmp_path, path)) {
+        log_error("write %s failed! %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int persist_load(const char *path, server_cfg_t *cfg, cache_t *cache, verdict_table_t *verdicts, uint64_t now,
+                 int64_t wall_now) {
+    persist_file_header_t header;
+    persist_verdict_t verdict;
+    char domain[NS_MAXDNAME];
+    persist_record_t record;
+    const char *p;
+    char *map;
+    size_t size;
+    int64_t elapsed;
+    uint32_t i;
+    int measured = 0;
+
+    if (map_file(path, &map, &size)) {
+        return -1;
+    }
+    memcpy(&header, map, sizeof(header));
+    elapsed = wall_now > header.saved_at ? wall_now - header.saved_at : 0; // the clock may have been set back.
+
+    p = map + sizeof(header);
+    if (cfg) {
+        measured = restore_proxies(cfg, p, header.proxies);
+    }
+    p += sizeof(persist_proxy_t) * header.proxies;
+    for (i = 0; i < header.answers; ++i) {
+        locate_answer(p, &record);
+        restore_answer(cache, p, (uint64_t) elapsed * 1000, now);
+        p += record.len;
+    }
+    for (i = 0; i < header.verdicts; ++i) {
+        memcpy(&verdict, p, sizeof(verdict));
+        memcpy(domain, p + sizeof(verdict), verdict.len);
+        domain[verdict.len] = '\0';
+        if (verdict.ttl > elapsed * 1000 &&
+            (verdict.verdict == VERDICT_INTERNAL || verdict.verdict == VERDICT_FOREIGN)) {
+            verdict_restore(verdicts, domain, (verdict_t) verdict.verdict, verdict.ttl - (uint64_t) elapsed * 1000,
+                            now);
+        }
+        p += sizeof(verdict) + verdict.len;
+    }
+    munmap(map, size);
+
+    if (cfg) {
+        log_info("warm start from %s saved %ld s ago: %d answers, %d verdicts, %d of %d proxies measured.", path,
+                 (long) elapsed, cache->size, verdicts->size, measured, cfg->proxies_count);
+    }
+    return 0;
+}
+
+static void buffer_append(persist_buffer_t *buffer, const void *data, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (buffer->len + len > buffer->capacity) {
+            buffer->capacity *= 2;
+        }
+        buffer->data = xrealloc(buffer->data, (ssize_t) buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+static void on_export_answer(void *data, const cache_record_t *record) {
+    persist_buffer_t *buffer = data;
+    persist_answer_t answer;
+
+    memset(&answer, 0, sizeof(answer));
+    answer.hash = record->hash;
+    answer.ttl = record->ttl < UINT32_MAX ? (uint32_t) record->ttl : UINT32_MAX;
+    answer.response_len = (uint16_t) record->response_len; // answers are cached up to DNS_PACKET_SIZE.
+    answer.ttl_count = (uint16_t) record->ttl_count;
+    answer.qtype = record->qtype;
+    answer.qclass = record->qclass;
+    answer.name_len = (uint16_t) record->name_len;
+    buffer_append(buffer, &answer, sizeof(answer));
+    buffer_append(buffer, record->name, record->name_len);
+    buffer_append(buffer, record->ttl_offsets, sizeof(uint16_t) * record->ttl_count);
+    buffer_append(buffer, record->response, (size_t) record->response_len);
+    buffer->count += 1;
+}
+
+static void on_export_verdict(void *data, const char *domain, verdict_t verdict, uint64_t ttl) {
+    persist_buffer_t *buffer = data;
+    persist_verdict_t record;
+    size_t len = strlen(domain);
+
+    if (len >= NS_MAXDNAME) {
+        return;
+    }
+    memset(&record, 0, sizeof(record));
+    record.ttl = ttl < UINT32_MAX ? (uint32_t) ttl : UINT32_MAX;
+    record.verdict = (uint8_t) verdict;
+    record.len = (uint16_t) len;
+    buffer_append(buffer, &record, sizeof(record));
+    buffer_append(buffer, domain, len);
+    buffer->count += 1;
+}
+
+/*
+ * The answers or the verdicts of all parts in order, each question or domain once with the most time left
+ * any worker had for it. Returns an array of *kept records to free.
+ */
+static persist_record_t *unique_records(persist_part_t *parts, int count, bool answers, uint32_t *kept) {
+    persist_record_t *records, *record, *other;
+    persist_buffer_t *buffer;
+    uint32_t total = 0, slot_count = 1, slot, n = 0, i;
+    uint32_t *slots; // 1 + index of a record kept, 0 is empty.
+    size_t offset;
+    int j;
+
+    for (j = 0; j < count; ++j) {
+        total += answers ? parts[j].answers.count : parts[j].verdicts.count;
+    }
+    while (slot_count < total * 2) {
+        slot_count *= 2;
+    }
+    records = xmalloc(sizeof(persist_record_t) * (total > 0 ? total : 1));
+    slots = xmalloc(sizeof(uint32_t) * slot_count);
+    memset(slots, 0, sizeof(uint32_t) * slot_count);
+
+    for (j = 0; j < count; ++j) {
+        buffer = answers ? &parts[j].answers : &parts[j].verdicts;
+        for (offset = 0; offset < buffer->len; offset += record->len) {
+            record = &records[n];
+            if (answers) {
+                locate_answer(buffer->data + offset, record);
+            } else {
+                locate_verdict(buffer->data + offset, record);
+            }
+            for (slot = record->hash & (slot_count - 1); slots[slot]; slot = (slot + 1) & (slot_count - 1)) {
+                other = &records[slots[slot] - 1];
+                if (other->hash == record->hash && other->key_len == record->key_len &&
+                    memcmp(other->data + other->key_offset, record->data + record->key_offset, record->key_len) == 0) {
+                    break;
+                }
+            }
+            if (slots[slot] == 0) {
+                slots[slot] = ++n;
+            } else if (records[slots[slot] - 1].ttl < record->ttl) {
+                records[slots[slot] - 1].data = NULL; // superseded, dropped below.
+                slots[slot] = ++n;
+            } else {
+                record->data = NULL;
+                n += 1;
+            }
+        }
+    }
+    xfree(slots);
+
+    for (i = 0, *kept = 0; i < n; ++i) {
+        if (records[i].data) {
+            records[(*kept)++] = records[i];
+        }
+    }
+    return records;
+}
+
+static void locate_answer(const char *data, persist_record_t *record) {
+    persist_answer_t answer;
+
+    memcpy(&answer, data, sizeof(answer));
+    record->data = data;
+    record->len = sizeof(answer) + answer.name_len + sizeof(uint16_t) * answer.ttl_count + answer.response_len;
+    record->key_offset = offsetof(persist_answer_t, qtype);
+    record->key_len = sizeof(answer) - record->key_offset + answer.name_len;
+    record->hash = answer.hash;
+    record->ttl = answer.ttl;
+}
+
+static void locate_verdict(const char *data, persist_record_t *record) {
+    persist_verdict_t verdict;
+
+    memcpy(&verdict, data, sizeof(verdict));
+    record->data = data;
+    record->len = sizeof(verdict) + verdict.len;
+    record->key_offset = offsetof(persist_verdict_t, len);
+    record->key_len = sizeof(verdict.len) + verdict.len;
+    record->hash = checksum(FNV_OFFSET, data + record->key_offset, record->key_len);
+    record->ttl = verdict.ttl;
+}
+
+static uint32_t checksum(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Map path once it proved to be a whole file this build wrote. Returns -1 when it is not, with a warning
+ * unless it is missing.
+ */
+static int map_file(const char *path, char **map, size_t *size) {
+    persist_file_header_t header;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_warn("open %s failed! %s", path, strerror(errno));
+        }
+        return -1;
+    }
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) ||
+        memcmp(header.magic, PERSIST_FILE_MAGIC, sizeof(PERSIST_FILE_MAGIC)) != 0 ||
+        header.version != PERSIST_FILE_VERSION || header.byte_order != PERSIST_FILE_BYTE_ORDER) {
+        log_warn("%s was not saved by this build, starting cold.", path);
+        close(fd);
+        return -1;
+    }
+
+    *size = (size_t) st.st_size;
+    *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED) {
+        log_warn("mmap %s failed! %s", path, strerror(errno));
+        return -1;
+    }
+    if (checksum(FNV_OFFSET, *map + sizeof(header), *size - sizeof(header)) != header.checksum ||
+        !valid_records(*map, *size, &header)) {
+        log_warn("%s is corrupted, starting cold.", path);
+        munmap(*map, *size);
+        return -1;
+    }
+    return 0;
+}
+
+// every record lies inside the file, and the last one ends it.
+static bool valid_records(const char *map, size_t size, const persist_file_header_t *header) {
+    size_t offset = sizeof(persist_file_header_t);
+    persist_answer_t answer;
+    persist_verdict_t verdict;
+    uint32_t i;
+
+    if ((size - offset) / sizeof(persist_proxy_t) < header->proxies) {
+        return false;
+    }
+    offset += sizeof(persist_proxy_t) * header->proxies;
+    for (i = 0; i < header->answers; ++i) {
+        if (size - offset < sizeof(answer)) {
+            return false;
+        }
+        memcpy(&answer, map + offset, sizeof(answer));
+        offset += sizeof(answer);
+        if (answer.name_len >= NS_MAXDNAME || answer.ttl_count > CACHE_MAX_TTL_FIELDS ||
+            answer.response_len > DNS_PACKET_SIZE ||
+            size - offset < answer.name_len + sizeof(uint16_t) * answer.ttl_count + answer.response_len) {
+            return false;
+        }
+        offset += answer.name_len + sizeof(uint16_t) * answer.ttl_count + answer.response_len;
+    }
+    for (i = 0; i < header->verdicts; ++i) {
+        if (size - offset < sizeof(verdict)) {
+            return false;
+        }
+        memcpy(&verdict, map + offset, sizeof(verdict));
+        offset += sizeof(verdict);
+        if (verdict.len >= NS_MAXDNAME || size - offset < verdict.len) {
+            return false;
+        }
+        offset += verdict.len;
+    }
+    return offset == size;
+}
+
+// the proxies still configured go on with their saved models, returns how many of them were measured.
+static int restore_proxies(server_cfg_t *cfg, const char *data, uint32_t count) {
+    persist_proxy_t saved;
+    upstream_proxy_t proxy;
+    uint32_t i;
+    int j, measured = 0;
+
+    for (i = 0; i < count; ++i) {
+        memcpy(&saved, data + sizeof(saved) * i, sizeof(saved));
+        if (saved.addr.ss_family != AF_INET && saved.addr.ss_family != AF_INET6) {
+            continue;
+        }
+        memset(&proxy, 0, sizeof(proxy));
+        proxy.addr = (struct sockaddr *) &saved.addr;
+        proxy.internal = saved.internal;
+        proxy.tcp = saved.tcp;
+        for (j = 0; j < cfg->proxies_count; ++j) {
+            if (proxy_same(&proxy, &cfg->proxies[j])) {
+                cfg->proxies[j].genuine = saved.genuine;
+                cfg->proxies[j].fake = saved.fake;
+                cfg->proxies[j].enabled = saved.enabled;
+                measured += saved.genuine.samples > 0 && saved.fake.samples > 0;
+                break;
+            }
+        }
+    }
+    return measured;
+}
+
+// the answer with its ttls reduced by age, the ms since it was saved, the cache checks it is whole.
+static void restore_answer(cache_t *cache, const char *data, uint64_t age, uint64_t now) {
+    uint16_t ttl_offsets[CACHE_MAX_TTL_FIELDS];
+    persist_answer_t answer;
+    cache_record_t record;
+
+    memcpy(&answer, data, sizeof(answer));
+    data += sizeof(answer);
+    memcpy(ttl_offsets, data + answer.name_len, sizeof(uint16_t) * answer.ttl_count); // unaligned in the file.
+    record.name = data;
+    record.name_len = answer.name_len;
+    record.hash = answer.hash;
+    record.qtype = answer.qtype;
+    record.qclass = answer.qclass;
+    record.response = data + answer.name_len + sizeof(uint16_t) * answer.ttl_count;
+    record.response_len = answer.response_len;
+    record.ttl_offsets = ttl_offsets;
+    record.ttl_count = answer.ttl_count;
+    record.ttl = answer.ttl;
+    cache_restore(cache, &record, age, now);
+}
+
+// the workers keep updating from.
+static void model_copy(latency_model_t *to, const latency_model_t *from) {
+    to->mean = __atomic_load_n(&from->mean, __ATOMIC_RELAXED);
+    to->dev = __atomic_load_n(&from->dev, __ATOMIC_RELAXED);
+    to->samples = __atomic_load_n(&from->samples, __ATOMIC_RELAXED);
+}
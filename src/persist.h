@@ -0,0 +1,45 @@
+#ifndef GDNS_PERSIST_H
+#define GDNS_PERSIST_H
+
+#include "common.h"
+
+/*
+ * The warm restart file: the latency models of the proxies, then the answers and verdicts of every worker.
+ * Each worker collects its part on its own loop, the parts are written aside and renamed, and the file is
+ * mapped at startup to rebuild the caches with their ttls reduced by the time gdns was away.
+ */
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    uint32_t count; // records in data.
+} persist_buffer_t;
+
+typedef struct {
+    persist_buffer_t answers;
+    persist_buffer_t verdicts;
+} persist_part_t;
+
+/*
+ * Append what cache and verdicts hold at now, in ms of their loop, to an initially zeroed part.
+ */
+void persist_collect(persist_part_t *part, cache_t *cache, verdict_table_t *verdicts, uint64_t now);
+
+void persist_part_free(persist_part_t *part);
+
+/*
+ * Write the latency models of cfg's proxies and the parts to path. saved_at is the wall clock in s when
+ * the first part was collected. Returns 0 on success.
+ */
+int persist_write(const char *path, const server_cfg_t *cfg, persist_part_t *parts, int count, int64_t saved_at);
+
+/*
+ * Rebuild cache and verdicts from path, and with cfg the latency models of its proxies that were saved.
+ * now is in ms of the loop, wall_now the wall clock in s. Returns -1 and loads nothing when path is
+ * missing, corrupt or written by an incompatible build.
+ */
+int persist_load(const char *path, server_cfg_t *cfg, cache_t *cache, verdict_table_t *verdicts, uint64_t now,
+                 int64_t wall_now);
+
+#endif //GDNS_PERSIST_H
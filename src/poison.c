@@ -0,0 +1,123 @@
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include "poison.h"
+
+#define POISON_MIN_SLOTS 16
+
+static uint32_t slot_of(const poison_set_t *set, uint64_t key);
+
+static bool insert(poison_set_t *set, in_addr_t addr);
+
+static int cmp_addr6(const void *a, const void *b);
+
+int poison_init(poison_set_t *set, char **addresses, int len, int learn) {
+    struct in_addr addr;
+    uint32_t capacity = POISON_MIN_SLOTS;
+    int i, len4 = 0;
+
+    memset(set, 0, sizeof(poison_set_t));
+    set->addrs6 = xmalloc(sizeof(struct in6_addr) * (len > 0 ? len : 1));
+    for (i = 0; i < len; ++i) {
+        if (inet_pton(AF_INET6, addresses[i], &set->addrs6[set->len6]) == 1) {
+            set->len6 += 1;
+        } else if (inet_pton(AF_INET, addresses[i], &addr) == 1) {
+            len4 += 1;
+        } else {
+            log_error("poison address %s is not an IPv4 or IPv6 address.", addresses[i]);
+            poison_free(set);
+            return -1;
+        }
+    }
+    qsort(set->addrs6, (size_t) set->len6, sizeof(struct in6_addr), cmp_addr6);
+
+    set->learn_max = learn > 0 ? learn : 0;
+    if (set->learn_max > 0) {
+        set->learned = xmalloc(sizeof(in_addr_t) * set->learn_max);
+    }
+    // at most half full, a miss ends on an empty slot after a probe or two.
+    while (capacity < 2 * (uint32_t) (len4 + set->learn_max)) {
+        capacity *= 2;
+    }
+    set->slots = xmalloc(sizeof(uint64_t) * capacity);
+    memset(set->slots, 0, sizeof(uint64_t) * capacity);
+    set->mask = capacity - 1;
+    for (i = 0; i < len; ++i) {
+        if (inet_pton(AF_INET, addresses[i], &addr) == 1) {
+            insert(set, addr.s_addr);
+        }
+    }
+    return 0;
+}
+
+void poison_free(poison_set_t *set) {
+    if (set->slots) {
+        xfree(set->slots);
+    }
+    if (set->learned) {
+        xfree(set->learned);
+    }
+    if (set->addrs6) {
+        xfree(set->addrs6);
+    }
+    memset(set, 0, sizeof(poison_set_t));
+}
+
+bool ip_in_poison_set(const poison_set_t *set, const struct in_addr *addr) {
+    uint64_t key = POISON_USED | addr->s_addr;
+    uint32_t i = slot_of(set, key);
+    uint64_t slot;
+
+    while ((slot = __atomic_load_n(&set->slots[i], __ATOMIC_RELAXED)) != 0) {
+        if (slot == key) {
+            return true;
+        }
+        i = (i + 1) & set->mask;
+    }
+    return false;
+}
+
+bool ip6_in_poison_set(const poison_set_t *set, const struct in6_addr *addr) {
+    return set->len6 > 0 && bsearch(addr, set->addrs6, (size_t) set->len6, sizeof(struct in6_addr), cmp_addr6);
+}
+
+bool poison_learn(poison_set_t *set, const struct in_addr *addr) {
+    if (set->learned_len >= set->learn_max || !insert(set, addr->s_addr)) {
+        return false;
+    }
+    set->learned[set->learned_len++] = addr->s_addr;
+    return true;
+}
+
+void poison_inherit(poison_set_t *set, const poison_set_t *running) {
+    struct in_addr addr;
+    int i;
+
+    for (i = 0; i < running->learned_len; ++i) {
+        addr.s_addr = running->learned[i];
+        poison_learn(set, &addr);
+    }
+}
+
+static uint32_t slot_of(const poison_set_t *set, uint64_t key) {
+    return (uint32_t) ((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & set->mask;
+}
+
+// a lookup racing the store sees either an empty slot or the whole key.
+static bool insert(poison_set_t *set, in_addr_t addr) {
+    uint64_t key = POISON_USED | addr;
+    uint32_t i = slot_of(set, key);
+
+    while (set->slots[i] != 0) {
+        if (set->slots[i] == key) {
+            return false;
+        }
+        i = (i + 1) & set->mask;
+    }
+    __atomic_store_n(&set->slots[i], key, __ATOMIC_RELAXED);
+    return true;
+}
+
+static int cmp_addr6(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(struct in6_addr));
+}
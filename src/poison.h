@@ -0,0 +1,33 @@
+#ifndef GDNS_POISON_H
+#define GDNS_POISON_H
+
+#include "common.h"
+
+/*
+ * Known forged addresses: the configured ones, and up to learn more the prober saw in forged answers.
+ * Lookups are safe from every worker while one thread adds, they cost one hash probe like the subnet
+ * list's index.
+ */
+
+/*
+ * Returns 0 on success, -1 when an address is neither IPv4 nor IPv6.
+ */
+int poison_init(poison_set_t *set, char **addresses, int len, int learn);
+
+void poison_free(poison_set_t *set);
+
+bool ip_in_poison_set(const poison_set_t *set, const struct in_addr *addr);
+
+bool ip6_in_poison_set(const poison_set_t *set, const struct in6_addr *addr);
+
+/*
+ * Add a forged address, returns true when it was not known yet and there was room for it.
+ */
+bool poison_learn(poison_set_t *set, const struct in_addr *addr);
+
+/*
+ * Learn what running learned, a reload keeps it.
+ */
+void poison_inherit(poison_set_t *set, const poison_set_t *running);
+
+#endif //GDNS_POISON_H
@@ -0,0 +1,88 @@
+#include "pool.h"
+
+#define POOL_ALIGN 16
+#define SLAB_HEADER_SIZE POOL_ALIGN
+
+void pool_init(pool_t *pool, size_t object_size, int slab_objects) {
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+    pool->object_size = (object_size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+    pool->slab_objects = slab_objects > 0 ? slab_objects : 1;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->in_use = 0;
+}
+
+void pool_destroy(pool_t *pool) {
+    void *slab = pool->slabs;
+    while (slab) {
+        void *next = *(void **) slab;
+        xfree(slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->slab_count = 0;
+    pool->in_use = 0;
+}
+
+void *pool_alloc(pool_t *pool) {
+    void *ptr;
+
+    if (pool->free_list == NULL) {
+        char *slab = xmalloc(SLAB_HEADER_SIZE + pool->object_size * pool->slab_objects);
+        int i;
+
+        *(void **) slab = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_count += 1;
+        for (i = pool->slab_objects - 1; i >= 0; --i) {
+            void *object = slab + SLAB_HEADER_SIZE + pool->object_size * i;
+            *(void **) object = pool->free_list;
+            pool->free_list = object;
+        }
+    }
+
+    ptr = pool->free_list;
+    pool->free_list = *(void **) ptr;
+    STAT_ADD(pool->in_use, 1);
+    return ptr;
+}
+
+void pool_free(pool_t *pool, void *ptr) {
+    *(void **) ptr = pool->free_list;
+    pool->free_list = ptr;
+    STAT_ADD(pool->in_use, -1);
+}
+
+void server_pools_init(server_ctx_t *ctx) {
+    pool_init(&ctx->session_pool, sizeof(session_ctx_t), 64);
+    pool_init(&ctx->task_pool, sizeof(query_task_t), 256);
+    pool_init(&ctx->req_pool, sizeof(send_req_t) > sizeof(write_req_t) ? sizeof(send_req_t) : sizeof(write_req_t),
+              256);
+    pool_init(&ctx->reply_pool, sizeof(reply_req_t), 32);
+    pool_init(&ctx->packet_pool, DNS_PACKET_SIZE, 32);
+    pool_init(&ctx->waiter_pool, sizeof(session_waiter_t), 64);
+}
+
+void server_pools_destroy(server_ctx_t *ctx) {
+    pool_destroy(&ctx->session_pool);
+    pool_destroy(&ctx->task_pool);
+    pool_destroy(&ctx->req_pool);
+    pool_destroy(&ctx->reply_pool);
+    pool_destroy(&ctx->packet_pool);
+    pool_destroy(&ctx->waiter_pool);
+}
+
+void packet_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    server_ctx_t *ctx = handle->loop->data;
+    buf->base = pool_alloc(&ctx->packet_pool);
+    buf->len = DNS_PACKET_SIZE;
+}
+
+void packet_free(uv_loop_t *loop, char *base) {
+    server_ctx_t *ctx = loop->data;
+    pool_free(&ctx->packet_pool, base);
+}
@@ -0,0 +1,34 @@
+#ifndef GDNS_POOL_H
+#define GDNS_POOL_H
+
+#include "common.h"
+
+/*
+ * Fixed size object pool. Objects are carved from slabs and recycled through a free list, they
+ * only go back to malloc when the pool is destroyed. Not thread safe, every worker owns its pools.
+ */
+
+void pool_init(pool_t *pool, size_t object_size, int slab_objects);
+
+void pool_destroy(pool_t *pool);
+
+void *pool_alloc(pool_t *pool);
+
+void pool_free(pool_t *pool, void *ptr);
+
+/*
+ * Pools of a worker, reached through loop->data.
+ */
+
+void server_pools_init(server_ctx_t *ctx);
+
+void server_pools_destroy(server_ctx_t *ctx);
+
+/*
+ * A uv_alloc_cb handing out DNS_PACKET_SIZE receive buffers from the worker's packet pool.
+ */
+void packet_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+
+void packet_free(uv_loop_t *loop, char *base);
+
+#endif //GDNS_POOL_H
@@ -1,145 +1,424 @@
 #include "proxy.h"
 #include "common.h"
 #include "task.h"
+#include "dns.h"
+#include "iputility.h"
+#include "poison.h"
 #include <resolv.h>
+#include <arpa/inet.h>
+#include <string.h>
 
+#define PROBE_TIMEOUT 3000 // ms
+#define STARTUP_DEADLINE 3000 // ms, serving starts then while the rest of the startup round goes on.
 
 typedef struct {
-    uv_timer_t *timer;
-    query_task_t **tasks;
-    int tasks_len;
-    server_ctx_t *server_ctx;
-    proxies_init_cb cb;
-} pinit_ctx_t;
+    char *domain;
+    bool blocked;
+} probe_domain_t;
 
 typedef struct {
-    int blocked_count;
-    int non_blocked_count;
-    uint64_t blocked_time;
-    uint64_t non_blocked_time;
-} pinit_req_t;
+    prober_t *prober;
+    query_task_t *task;
+    uv_timer_t timer;
+    bool blocked;
+} probe_slot_t;
 
-static void init_req(pinit_req_t *req, upstream_proxy_t *proxy) {
-    req->blocked_count = 0;
-    req->non_blocked_count = 0;
-    req->blocked_time = 0;
-    req->non_blocked_time = 0;
-}
+/*
+ * A round queries every domain of the round through every proxy, at most slot_count at once.
+ */
+struct prober_t {
+    server_ctx_t *server_ctx;
+    generation_t *generation; // the proxies probed and the sockets they are asked through.
+    uv_loop_t *loop;
+    probe_domain_t *domains;
+    int domain_count;
+    int next_job;
+    int job_count;
+    int running;
+    probe_slot_t *slots;
+    int slot_count;
+    int *answered; // per proxy, in the startup round.
+    uv_timer_t round_timer; // the startup deadline first.
+    int round;
+    bool startup;
+    proxies_init_cb cb; // NULL once called.
+    int closing_handles;
+};
+
+static void probe_fill(prober_t *prober);
+
+static void probe_start(prober_t *prober, probe_slot_t *slot, int job);
+
+static void probe_finish(probe_slot_t *slot);
+
+static void on_probe_done(query_task_t *task, char *response, ssize_t len, int64_t response_time);
+
+static void on_probe_timeout(uv_timer_t *timer);
+
+static void learn_forged(prober_t *prober, char *response, ssize_t len);
+
+static void on_probe_round(uv_timer_t *timer);
+
+static void on_startup_deadline(uv_timer_t *timer);
+
+static void on_startup_done(prober_t *prober);
+
+static void start_rounds(prober_t *prober);
+
+static void prober_ready(prober_t *prober);
+
+static bool proxies_calibrated(server_cfg_t *cfg);
+
+static void latency_copy(latency_model_t *to, latency_model_t *from);
+
+static void on_prober_handle_close(uv_handle_t *handle);
 
 static void on_task_close(query_task_t *task) {
     xfree(task);
 }
 
-static void on_timer_close(uv_handle_t *timer) {
-    xfree(timer);
+prober_t *proxies_init(server_ctx_t *ctx, generation_t *generation, uv_loop_t *loop, proxies_init_cb cb) {
+    server_cfg_t *cfg = generation->snapshot->cfg;
+    prober_t *prober = TMALLOC(prober_t);
+    int i, j = 0;
+
+    prober->server_ctx = ctx;
+    prober->generation = generation;
+    prober->loop = loop;
+    prober->cb = cb;
+    prober->startup = true;
+    prober->round = 0;
+    prober->running = 0;
+
+    prober->slot_count = cfg->probe_concurrency > 0 ? cfg->probe_concurrency : 1;
+    prober->slots = xmalloc(sizeof(probe_slot_t) * prober->slot_count);
+    for (i = 0; i < prober->slot_count; ++i) {
+        prober->slots[i].prober = prober;
+        prober->slots[i].task = NULL;
+        uv_timer_init(loop, &prober->slots[i].timer);
+        prober->slots[i].timer.data = &prober->slots[i];
+    }
+    uv_timer_init(loop, &prober->round_timer);
+    prober->round_timer.data = prober;
+
+    prober->answered = xmalloc(sizeof(int) * cfg->proxies_count);
+    for (i = 0; i < cfg->proxies_count; ++i) {
+        prober->answered[i] = 0;
+    }
+
+    // the startup round measures all domains, later rounds one of each kind.
+    prober->domain_count = cfg->blocked_domain_len + cfg->non_blocked_domain_len;
+    prober->domains = xmalloc(sizeof(probe_domain_t) * (prober->domain_count > 2 ? prober->domain_count : 2));
+    for (i = 0; i < cfg->blocked_domain_len; ++i, ++j) {
+        prober->domains[j].domain = cfg->blocked_domain[i];
+        prober->domains[j].blocked = true;
+    }
+    for (i = 0; i < cfg->non_blocked_domain_len; ++i, ++j) {
+        prober->domains[j].domain = cfg->non_blocked_domain[i];
+        prober->domains[j].blocked = false;
+    }
+    prober->next_job = 0;
+    prober->job_count = prober->domain_count * cfg->proxies_count;
+
+    if (proxies_calibrated(cfg)) { // e.g. a reload that kept every proxy.
+        prober->startup = false;
+        prober->job_count = 0;
+        start_rounds(prober);
+        return prober;
+    }
+    uv_timer_start(&prober->round_timer, on_startup_deadline, STARTUP_DEADLINE, 0);
+    probe_fill(prober);
+    return prober;
 }
 
-static void on_timeout(uv_timer_t *timer) {
-    pinit_ctx_t *pctx = timer->data;
-    server_ctx_t *ctx = pctx->server_ctx;
-    server_cfg_t *cfg = ctx->cfg;
+void proxies_stop(prober_t *prober) {
     int i;
-    int domains_len = cfg->non_blocked_domain_len + cfg->blocked_domain_len;
 
-    uv_timer_stop(timer);
-    uv_close((uv_handle_t *) timer, on_timer_close);
-
-    for (i = 0; i < pctx->tasks_len; ++i) {
-        task_close(pctx->tasks[i], on_task_close);
+    uv_timer_stop(&prober->round_timer);
+    prober->closing_handles = prober->slot_count + 1;
+    for (i = 0; i < prober->slot_count; ++i) {
+        if (prober->slots[i].task) {
+            task_close(prober->slots[i].task, on_task_close);
+            prober->slots[i].task = NULL;
+        }
+        prober->slots[i].timer.data = prober;
+        uv_close((uv_handle_t *) &prober->slots[i].timer, on_prober_handle_close);
     }
-    for (i = 0; i < cfg->proxies_count; ++i) {
-        upstream_proxy_t *proxy = &cfg->proxies[i];
-        pinit_req_t *req = proxy->data;
+    uv_close((uv_handle_t *) &prober->round_timer, on_prober_handle_close);
+}
 
-        if (req->blocked_count + req->non_blocked_count < 0.8 * (domains_len)) {
-            proxy->enabled = false;
-        } else {
-            proxy->enabled = true;
-            proxy->expected_response_time = req->non_blocked_time / req->non_blocked_count;
-            proxy->expected_fake_response_time = req->blocked_time / req->blocked_count;
+void proxies_inherit(server_cfg_t *cfg, server_cfg_t *running) {
+    int i, j;
 
-            log_info("proxy[%d] - %d/%d %d %d", i, req->blocked_count + req->non_blocked_count, domains_len,
-                     proxy->expected_fake_response_time, proxy->expected_response_time);
+    for (i = 0; i < cfg->proxies_count; ++i) {
+        for (j = 0; j < running->proxies_count; ++j) {
+            if (proxy_same(&cfg->proxies[i], &running->proxies[j])) {
+                latency_copy(&cfg->proxies[i].genuine, &running->proxies[j].genuine);
+                latency_copy(&cfg->proxies[i].fake, &running->proxies[j].fake);
+                cfg->proxies[i].enabled = running->proxies[j].enabled;
+                break;
+            }
         }
-        xfree(req);
     }
-    xfree(pctx->tasks);
+}
+
+bool proxy_same(const upstream_proxy_t *a, const upstream_proxy_t *b) {
+    return a->internal == b->internal && a->tcp == b->tcp && a->addr->sa_family == b->addr->sa_family &&
+           memcmp(a->addr, b->addr, sockaddr_size(a->addr)) == 0;
+}
+
+void latency_update(latency_model_t *model, int64_t response_time) {
+    int64_t sample = response_time * 1000;
+    int64_t mean = __atomic_load_n(&model->mean, __ATOMIC_RELAXED);
+    int64_t dev = __atomic_load_n(&model->dev, __ATOMIC_RELAXED);
+    int64_t diff;
 
-    if (pctx->cb) {
-        pctx->cb(ctx);
+    if (__atomic_fetch_add(&model->samples, 1, __ATOMIC_RELAXED) == 0) {
+        mean = sample;
+        dev = sample / 2;
+    } else {
+        diff = sample - mean;
+        mean += diff / 8;
+        dev += ((diff < 0 ? -diff : diff) - dev) / 4;
     }
+    __atomic_store_n(&model->mean, mean, __ATOMIC_RELAXED);
+    __atomic_store_n(&model->dev, dev, __ATOMIC_RELAXED);
 }
 
-static void on_blocked_done(query_task_t *task, char *response, ssize_t len, int64_t response_time) {
-    if (task->state == TASK_DONE) {
-        pinit_req_t *req = task->proxy->data;
-        req->blocked_count += 1;
-        req->blocked_time += response_time;
+double proxy_confidence(upstream_proxy_t *proxy, int64_t response_time) {
+    int64_t fake = __atomic_load_n(&proxy->fake.mean, __ATOMIC_RELAXED);
+    int64_t fake_dev = __atomic_load_n(&proxy->fake.dev, __ATOMIC_RELAXED);
+    int64_t genuine = __atomic_load_n(&proxy->genuine.mean, __ATOMIC_RELAXED);
+    int64_t threshold = fake + 4 * fake_dev; // later than nearly every fake answer.
+
+    if (threshold > genuine) { // the two overlap, settle between the means.
+        threshold = fake + (genuine - fake) * 4 / 5;
     }
+    if (threshold <= fake) { // fake answers are not faster, timing tells nothing.
+        return 1.0;
+    }
+    return (double) (response_time * 1000 - fake) / (double) (threshold - fake);
 }
 
-static void on_non_blocked_done(query_task_t *task, char *response, ssize_t len, int64_t response_time) {
-    if (task->state == TASK_DONE) {
-        pinit_req_t *req = task->proxy->data;
-        req->non_blocked_count += 1;
-        req->non_blocked_time += response_time;
+bool proxy_forged(upstream_proxy_t *proxy, int64_t response_time) {
+    int64_t fake = __atomic_load_n(&proxy->fake.mean, __ATOMIC_RELAXED);
+    int64_t fake_dev = __atomic_load_n(&proxy->fake.dev, __ATOMIC_RELAXED);
+    int64_t genuine = __atomic_load_n(&proxy->genuine.mean, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&proxy->fake.samples, __ATOMIC_RELAXED) == 0 ||
+        __atomic_load_n(&proxy->genuine.samples, __ATOMIC_RELAXED) == 0) {
+        return false;
     }
+    // without a gap between the two, the blocked domains are answered like any other.
+    return fake + 4 * fake_dev < genuine && response_time * 1000 <= fake + 4 * fake_dev;
 }
 
-static void mkquery(char *domain, char **msg, ssize_t *len) {
-    static char buf[PACKETSZ];
-    *len = res_mkquery(QUERY, domain, C_IN, T_A, NULL, 0, NULL, buf, PACKETSZ);
-    *msg = buf;
+int64_t proxy_hedge_delay(upstream_proxy_t *proxy) {
+    int64_t mean = __atomic_load_n(&proxy->genuine.mean, __ATOMIC_RELAXED);
+    int64_t dev = __atomic_load_n(&proxy->genuine.dev, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&proxy->genuine.samples, __ATOMIC_RELAXED) == 0) {
+        return -1;
+    }
+    return (mean + 4 * dev + 999) / 1000;
 }
 
-static void create_task(query_task_t *task, upstream_proxy_t *proxy, char *domain) {
-    char *msg;
-    ssize_t len;
-    mkquery(domain, &msg, &len);
-    task_init(task, proxy, msg, len);
+static void probe_fill(prober_t *prober) {
+    int i;
+
+    for (i = 0; i < prober->slot_count; ++i) {
+        while (prober->slots[i].task == NULL && prober->next_job < prober->job_count) {
+            probe_start(prober, &prober->slots[i], prober->next_job++);
+        }
+    }
+    if (prober->running == 0 && prober->startup) {
+        on_startup_done(prober);
+    }
 }
 
-void proxies_init(server_ctx_t *ctx, uv_loop_t *loop, proxies_init_cb cb) {
-    int init_timeout = 3000; //ms
-    int i, j, k;
-    int len;
-    int index = 0;
-    int current = 0;
-    server_cfg_t *cfg = ctx->cfg;
+static void probe_start(prober_t *prober, probe_slot_t *slot, int job) {
+    server_cfg_t *cfg = prober->generation->snapshot->cfg;
+    probe_domain_t *domain = &prober->domains[job / cfg->proxies_count];
+    static char msg[PACKETSZ];
+    int len = res_mkquery(QUERY, domain->domain, C_IN, T_A, NULL, 0, NULL, (unsigned char *) msg, PACKETSZ);
 
-    pinit_ctx_t *pctx = TMALLOC(pinit_ctx_t);
-    pctx->server_ctx = ctx;
-    pctx->cb = cb;
-    pctx->timer = TMALLOC(uv_timer_t);
-    pctx->timer->data = pctx;
+    if (len < 0) {
+        return;
+    }
+    slot->task = TMALLOC(query_task_t);
+    slot->blocked = domain->blocked;
+    task_init(slot->task, &prober->generation->upstreams[job % cfg->proxies_count], msg, len);
+    slot->task->data = slot;
+    task_run(prober->loop, slot->task, on_probe_done);
+    if (slot->task->state == TASK_ERROR) { // failed at once, e.g. a backed off tcp proxy.
+        task_close(slot->task, on_task_close);
+        slot->task = NULL;
+        return;
+    }
+    prober->running += 1;
+    uv_timer_start(&slot->timer, on_probe_timeout, PROBE_TIMEOUT, 0);
+}
+
+static void probe_finish(probe_slot_t *slot) {
+    prober_t *prober = slot->prober;
+
+    uv_timer_stop(&slot->timer);
+    task_close(slot->task, on_task_close);
+    slot->task = NULL;
+    prober->running -= 1;
+    probe_fill(prober);
+}
+
+static void on_probe_done(query_task_t *task, char *response, ssize_t len, int64_t response_time) {
+    probe_slot_t *slot = task->data;
+    upstream_proxy_t *proxy = task->proxy;
+
+    if (task->state == TASK_DONE) {
+        if (slot->blocked && !proxy->tcp && proxy_forged(proxy, response_time)) {
+            learn_forged(slot->prober, response, len);
+        }
+        latency_update(slot->blocked ? &proxy->fake : &proxy->genuine, response_time);
+        if (slot->prober->startup) {
+            slot->prober->answered[task->upstream - slot->prober->generation->upstreams] += 1;
+        }
+        probe_finish(slot);
+    } else if (task->state == TASK_ERROR) {
+        probe_finish(slot);
+    }
+}
+
+static void on_probe_timeout(uv_timer_t *timer) {
+    probe_finish(timer->data);
+}
 
-    uv_timer_init(loop, pctx->timer);
+// the foreign addresses of a forged answer, later answers pointing there are dropped at once.
+static void learn_forged(prober_t *prober, char *response, ssize_t len) {
+    snapshot_t *snapshot = prober->generation->snapshot;
+    dns_msg_t msg;
+    dns_rr_iter_t iter;
+    dns_rr_t rr;
+    struct in_addr addr;
+    char ip[INET_ADDRSTRLEN];
 
-    len = (cfg->non_blocked_domain_len + cfg->blocked_domain_len) * cfg->proxies_count;
+    if (dns_msg_init(&msg, response, len)) {
+        return;
+    }
+    dns_rr_iter_init(&iter, &msg);
+    while (dns_rr_next(&iter, &rr) > 0 && rr.section == ns_s_an) {
+        if (rr.type != ns_t_a || rr.rdlength != NS_INADDRSZ) {
+            continue;
+        }
+        memcpy(&addr, rr.rdata, sizeof(addr));
+        if (!ip_in_subnet_list(snapshot->list, &addr) && poison_learn(snapshot->poison, &addr)) {
+            log_info("learned forged address %s.", inet_ntop(AF_INET, &addr, ip, sizeof(ip)));
+        }
+    }
+}
 
-    pctx->tasks = xmalloc(sizeof(query_task_t *) * len);
-    pctx->tasks_len = len;
+// a dead proxy holds its probes for PROBE_TIMEOUT, serving does not wait for the whole round.
+static void on_startup_deadline(uv_timer_t *timer) {
+    prober_t *prober = timer->data;
 
+    log_info("serving while the proxies are still measured, %d of %d startup probes left.",
+             prober->job_count - prober->next_job + prober->running, prober->job_count);
+    prober_ready(prober);
+}
+
+static void on_startup_done(prober_t *prober) {
+    server_cfg_t *cfg = prober->generation->snapshot->cfg;
+    int i;
+
+    prober->startup = false;
     for (i = 0; i < cfg->proxies_count; ++i) {
         upstream_proxy_t *proxy = &cfg->proxies[i];
-        pinit_req_t *req = TMALLOC(pinit_req_t);
-        init_req(req, proxy);
-        proxy->data = req;
-
-        for (j = 0; j < cfg->blocked_domain_len; ++j) {
-            current = index++;
-            pctx->tasks[current] = TMALLOC(query_task_t);
-            create_task(pctx->tasks[current], proxy, cfg->blocked_domain[j]);
-            task_run(loop, pctx->tasks[current], on_blocked_done);
+
+        // the workers may be serving already, persist_write reads it on the thread pool.
+        if (prober->answered[i] < 0.8 * prober->domain_count) {
+            __atomic_store_n(&proxy->enabled, false, __ATOMIC_RELAXED);
+        } else {
+            __atomic_store_n(&proxy->enabled, true, __ATOMIC_RELAXED);
+            log_info("proxy[%d] - %d/%d %d %d", i, prober->answered[i], prober->domain_count,
+                     (int) (proxy->fake.mean / 1000), (int) (proxy->genuine.mean / 1000));
         }
+    }
+    start_rounds(prober);
+}
+
+static void start_rounds(prober_t *prober) {
+    server_cfg_t *cfg = prober->generation->snapshot->cfg;
+
+    xfree(prober->answered);
+    prober->answered = NULL;
+
+    uv_timer_stop(&prober->round_timer);
+    if (cfg->probe_interval > 0 && cfg->blocked_domain_len > 0 && cfg->non_blocked_domain_len > 0) {
+        uv_timer_start(&prober->round_timer, on_probe_round, (uint64_t) cfg->probe_interval,
+                       (uint64_t) cfg->probe_interval);
+        uv_unref((uv_handle_t *) &prober->round_timer);
+    }
+    prober_ready(prober);
+}
+
+// call cb once, at the startup deadline or when the startup round ends before it.
+static void prober_ready(prober_t *prober) {
+    proxies_init_cb cb = prober->cb;
+
+    if (cb) {
+        prober->cb = NULL;
+        cb(prober->server_ctx, prober);
+    }
+}
+
+// one blocked and one non blocked domain, taking turns through both lists.
+static void on_probe_round(uv_timer_t *timer) {
+    prober_t *prober = timer->data;
+    server_cfg_t *cfg = prober->generation->snapshot->cfg;
+
+    if (prober->running > 0 || prober->next_job < prober->job_count) { // the last round is still going.
+        return;
+    }
+    prober->domains[0].domain = cfg->blocked_domain[prober->round % cfg->blocked_domain_len];
+    prober->domains[0].blocked = true;
+    prober->domains[1].domain = cfg->non_blocked_domain[prober->round % cfg->non_blocked_domain_len];
+    prober->domains[1].blocked = false;
+    prober->domain_count = 2;
+    prober->round += 1;
 
-        for (k = 0; k < cfg->non_blocked_domain_len; ++k) {
-            current = index++;
-            pctx->tasks[current] = TMALLOC(query_task_t);
-            create_task(pctx->tasks[current], proxy, cfg->non_blocked_domain[k]);
-            task_run(loop, pctx->tasks[current], on_non_blocked_done);
+    prober->next_job = 0;
+    prober->job_count = prober->domain_count * cfg->proxies_count;
+    probe_fill(prober);
+}
+
+// every proxy has a model of both kinds of answers, measured before a reload.
+static bool proxies_calibrated(server_cfg_t *cfg) {
+    int i;
+
+    for (i = 0; i < cfg->proxies_count; ++i) {
+        if (__atomic_load_n(&cfg->proxies[i].genuine.samples, __ATOMIC_RELAXED) == 0 ||
+            __atomic_load_n(&cfg->proxies[i].fake.samples, __ATOMIC_RELAXED) == 0) {
+            return false;
         }
     }
+    return true;
+}
 
-    uv_timer_start(pctx->timer, on_timeout, init_timeout, 0);
-}
\ No newline at end of file
+// from is still updated by the workers on the running snapshot.
+static void latency_copy(latency_model_t *to, latency_model_t *from) {
+    to->mean = __atomic_load_n(&from->mean, __ATOMIC_RELAXED);
+    to->dev = __atomic_load_n(&from->dev, __ATOMIC_RELAXED);
+    to->samples = __atomic_load_n(&from->samples, __ATOMIC_RELAXED);
+}
+
+static void on_prober_handle_close(uv_handle_t *handle) {
+    prober_t *prober = handle->data;
+
+    if (--prober->closing_handles > 0) {
+        return;
+    }
+    if (prober->answered) {
+        xfree(prober->answered);
+    }
+    xfree(prober->domains);
+    xfree(prober->slots);
+    xfree(prober);
+}
@@ -2,8 +2,53 @@
 #define GDNS_PROXY_H
 #include "common.h"
 
-typedef void(*proxies_init_cb)(server_ctx_t * ctx);
+typedef struct prober_t prober_t;
 
-void proxies_init(server_ctx_t * ctx, uv_loop_t * loop, proxies_init_cb cb);
+typedef void(*proxies_init_cb)(server_ctx_t * ctx, prober_t * prober);
+
+/*
+ * Measure every proxy of generation with the configured domains, call cb once done or after 3 s at most
+ * while the rest of the round goes on, then keep probing them in the background every cfg->probe_interval.
+ * When every proxy was measured already, cb is called before this returns.
+ */
+prober_t *proxies_init(server_ctx_t * ctx, generation_t * generation, uv_loop_t * loop, proxies_init_cb cb);
+
+/*
+ * Abandon the probes in flight and free prober. Nothing waits on the generation's sockets afterwards.
+ */
+void proxies_stop(prober_t *prober);
+
+/*
+ * Start the proxies of cfg with the latency models of the same proxies in running.
+ */
+void proxies_inherit(server_cfg_t *cfg, server_cfg_t *running);
+
+/*
+ * The same address, transport and kind.
+ */
+bool proxy_same(const upstream_proxy_t *a, const upstream_proxy_t *b);
+
+/*
+ * The latency models are shared by all workers and updated without locks, a lost sample only
+ * makes the average move a little slower. response_time is in ms.
+ */
+void latency_update(latency_model_t *model, int64_t response_time);
+
+/*
+ * How sure an answer of proxy arriving after response_time ms is genuine, 1.0 or more once it comes
+ * later than nearly all fake answers do.
+ */
+double proxy_confidence(upstream_proxy_t *proxy, int64_t response_time);
+
+/*
+ * Whether an answer of proxy to a blocked domain arriving after response_time ms is forged: nearly all
+ * its fake answers come before the genuine ones do, and so did this one.
+ */
+bool proxy_forged(upstream_proxy_t *proxy, int64_t response_time);
+
+/*
+ * ms by which nearly every genuine answer of proxy has arrived, -1 before any was measured.
+ */
+int64_t proxy_hedge_delay(upstream_proxy_t *proxy);
 
 #endif //GDNS_PROXY_H
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+#include "rules.h"
+
+#define FNV64_OFFSET 14695981039346656037ull
+#define FNV64_PRIME 1099511628211ull
+#define VERDICT_BITS 3ull
+#define MIN_SLOTS 64
+#define LINE_SIZE 1024
+
+static int add_domain(rules_t *rules, const char *domain, size_t len, verdict_t verdict);
+
+static int normalize(const char *domain, size_t len, char *name);
+
+static uint64_t suffix_key(uint64_t hash);
+
+static verdict_t probe(const rules_t *rules, uint64_t key);
+
+static void grow(rules_t *rules);
+
+static bool escaped(const char *name, const char *p);
+
+void rules_init(rules_t *rules) {
+    rules->slots = NULL;
+    rules->mask = 0;
+    rules->size = 0;
+    rules->max_labels = 0;
+}
+
+void rules_free(rules_t *rules) {
+    if (rules->slots) {
+        xfree(rules->slots);
+    }
+    rules_init(rules);
+}
+
+int rules_load(rules_t *rules, const char *path, verdict_t verdict) {
+    FILE *fp;
+    char buf[LINE_SIZE];
+    int skipped = 0, before = rules->size;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        log_error("Can not open file %s", path);
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        char *line = buf + strspn(buf, " \t");
+        char *end;
+
+        if (*line == '#' || *line == '!' || *line == '\r' || *line == '\n' || *line == '\0') {
+            continue;
+        }
+        if (strncmp(line, "server=/", 8) == 0 || strncmp(line, "ipset=/", 7) == 0) {
+            // every field between the slashes but the last is a domain.
+            line = strchr(line, '/') + 1;
+            while ((end = strchr(line, '/'))) {
+                skipped += add_domain(rules, line, (size_t) (end - line), verdict) ? 1 : 0;
+                line = end + 1;
+            }
+        } else {
+            skipped += add_domain(rules, line, strcspn(line, " \t\r\n#"), verdict) ? 1 : 0;
+        }
+    }
+    fclose(fp);
+
+    if (skipped) {
+        log_warn("skipped %d malformed rules in %s", skipped, path);
+    }
+    log_info("%d domain rules from %s.", rules->size - before, path);
+    return 0;
+}
+
+int rules_add(rules_t *rules, const char *domain, verdict_t verdict) {
+    return add_domain(rules, domain, strlen(domain), verdict);
+}
+
+verdict_t rules_lookup(const rules_t *rules, const char *name) {
+    const char *p = name + strlen(name);
+    uint64_t hash = FNV64_OFFSET;
+    verdict_t verdict = VERDICT_UNKNOWN, found;
+    int labels = 0;
+
+    if (rules->size == 0 || strcmp(name, ".") == 0) {
+        return VERDICT_UNKNOWN;
+    }
+    // hash from the last character backwards, each label boundary completes a suffix. The longest match wins.
+    for (; p > name; --p) {
+        if (p[-1] == '.' && !escaped(name, p - 1)) {
+            if (++labels > rules->max_labels) {
+                return verdict;
+            }
+            if ((found = probe(rules, suffix_key(hash))) != VERDICT_UNKNOWN) {
+                verdict = found;
+            }
+        }
+        hash = (hash ^ (unsigned char) p[-1]) * FNV64_PRIME;
+    }
+    if (++labels <= rules->max_labels && (found = probe(rules, suffix_key(hash))) != VERDICT_UNKNOWN) {
+        verdict = found;
+    }
+    return verdict;
+}
+
+static int add_domain(rules_t *rules, const char *domain, size_t len, verdict_t verdict) {
+    char name[NS_MAXDNAME];
+    uint64_t hash = FNV64_OFFSET, key;
+    uint32_t i;
+    int n, labels = 1;
+
+    if ((n = normalize(domain, len, name)) < 0) {
+        return -1;
+    }
+    while (n-- > 0) {
+        labels += name[n] == '.';
+        hash = (hash ^ (unsigned char) name[n]) * FNV64_PRIME;
+    }
+    key = suffix_key(hash);
+
+    if ((uint32_t) (rules->size + 1) * 2 > (rules->slots ? rules->mask + 1 : 0)) {
+        grow(rules);
+    }
+    for (i = (uint32_t) (key >> 32) & rules->mask; rules->slots[i]; i = (i + 1) & rules->mask) {
+        if ((rules->slots[i] & ~VERDICT_BITS) == key) {
+            if (verdict == VERDICT_FOREIGN) { // listed both ways, poisoning is the costlier mistake.
+                rules->slots[i] = key | VERDICT_FOREIGN;
+            }
+            return 0;
+        }
+    }
+    rules->slots[i] = key | verdict;
+    rules->size += 1;
+    if (labels > rules->max_labels) {
+        rules->max_labels = labels;
+    }
+    return 0;
+}
+
+// lowercase, without a leading "*." or "." and a trailing dot. Returns the length, -1 if not a plain name.
+static int normalize(const char *domain, size_t len, char *name) {
+    size_t i;
+
+    if (len >= 2 && domain[0] == '*' && domain[1] == '.') {
+        domain += 2;
+        len -= 2;
+    }
+    if (len > 0 && domain[0] == '.') {
+        domain += 1;
+        len -= 1;
+    }
+    if (len > 0 && domain[len - 1] == '.') {
+        len -= 1;
+    }
+    if (len == 0 || len >= NS_MAXDNAME) {
+        return -1;
+    }
+    for (i = 0; i < len; ++i) {
+        char c = domain[i];
+        if (c >= 'A' && c <= 'Z') {
+            c = (char) (c - 'A' + 'a');
+        } else if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' ||
+                     (c == '.' && i > 0 && domain[i - 1] != '.'))) {
+            return -1;
+        }
+        name[i] = c;
+    }
+    name[len] = '\0';
+    return (int) len;
+}
+
+static uint64_t suffix_key(uint64_t hash) {
+    hash &= ~VERDICT_BITS;
+    return hash ? hash : VERDICT_BITS + 1;
+}
+
+static verdict_t probe(const rules_t *rules, uint64_t key) {
+    uint32_t i;
+
+    for (i = (uint32_t) (key >> 32) & rules->mask; rules->slots[i]; i = (i + 1) & rules->mask) {
+        if ((rules->slots[i] & ~VERDICT_BITS) == key) {
+            return (verdict_t) (rules->slots[i] & VERDICT_BITS);
+        }
+    }
+    return VERDICT_UNKNOWN;
+}
+
+static void grow(rules_t *rules) {
+    uint64_t *old = rules->slots;
+    uint32_t old_count = old ? rules->mask + 1 : 0;
+    uint32_t count = old_count ? old_count * 2 : MIN_SLOTS;
+    uint32_t i, j;
+
+    rules->slots = xmalloc(sizeof(uint64_t) * count);
+    memset(rules->slots, 0, sizeof(uint64_t) * count);
+    rules->mask = count - 1;
+    for (i = 0; i < old_count; ++i) {
+        if (old[i] == 0) {
+            continue;
+        }
+        for (j = (uint32_t) (old[i] >> 32) & rules->mask; rules->slots[j]; j = (j + 1) & rules->mask) {
+        }
+        rules->slots[j] = old[i];
+    }
+    if (old) {
+        xfree(old);
+    }
+}
+
+// names keep a dot inside a label as "\.".
+static bool escaped(const char *name, const char *p) {
+    int backslashes = 0;
+
+    while (p > name && p[-1] == '\\') {
+        backslashes += 1;
+        p -= 1;
+    }
+    return backslashes % 2 == 1;
+}
@@ -0,0 +1,28 @@
+#ifndef GDNS_RULES_H
+#define GDNS_RULES_H
+
+#include "common.h"
+
+void rules_init(rules_t *rules);
+
+void rules_free(rules_t *rules);
+
+/*
+ * Add one rule per line of a domain list, returns 0 on success. A line holds a domain, or a dnsmasq
+ * server=/domain/... or ipset=/domain/... entry. Comments start with # or !.
+ */
+int rules_load(rules_t *rules, const char *path, verdict_t verdict);
+
+/*
+ * Cover domain and every name under it, returns -1 when domain is not a plain name. A domain in both
+ * lists is blocked.
+ */
+int rules_add(rules_t *rules, const char *domain, verdict_t verdict);
+
+/*
+ * Verdict of the longest rule covering name, VERDICT_UNKNOWN when none does. Probes one slot per
+ * label up to the deepest rule.
+ */
+verdict_t rules_lookup(const rules_t *rules, const char *name);
+
+#endif //GDNS_RULES_H
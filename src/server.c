@@ -1,9 +1,100 @@
+#define _GNU_SOURCE // sendmmsg
 #include "server.h"
 #include "session.h"
 #include "iputility.h"
+#include "cache.h"
+#include "verdict.h"
+#include "snapshot.h"
+#include "config.h"
+#include "pool.h"
+#include "histogram.h"
+#include "stats.h"
+#include "client.h"
+#include "wheel.h"
+#include "poison.h"
+#include "persist.h"
 #include "common.h"
 
 #include "proxy.h"
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// libuv hands recvmmsg datagrams out in chunks of this size.
+#define RECV_CHUNK_SIZE (64 * 1024)
+
+/*
+ * Every worker runs its own loop and listening sockets, the kernel spreads clients across the
+ * sockets with SO_REUSEPORT. The published snapshot, config, proxy calibration, subnet list and rules,
+ * is shared read-only.
+ */
+typedef struct {
+    uv_thread_t thread;
+    uv_loop_t loop;
+    uv_async_t reload; // pick up the published snapshot.
+    uv_async_t persist; // collect this worker's part of the warm restart file.
+    uv_os_sock_t fd;
+    uv_os_sock_t tcp_fd; // -1 without a tcp listener.
+} worker_t;
+
+/*
+ * A SIGHUP reload. The files are read on the thread pool, then the first worker calibrates the new
+ * proxies while the running snapshot keeps serving, and publishes it.
+ */
+typedef struct {
+    uv_work_t req;
+    server_cfg_t *running;
+    snapshot_t *snapshot;
+    generation_t *generation; // the first worker's, probed before it is swapped in.
+} reload_t;
+
+/*
+ * A save of the warm restart file. Every worker collects its part on its own loop, the last one done
+ * wakes the first worker, which writes the file on the thread pool.
+ */
+typedef struct {
+    uv_work_t req;
+    snapshot_t *snapshot; // whose proxies and file are saved.
+    persist_part_t *parts; // one per worker.
+    int pending; // atomic, parts not collected yet.
+    int64_t saved_at; // s since the epoch.
+    bool exiting; // a SIGTERM or SIGINT waits for the file.
+    int rv;
+} persist_round_t;
+
+static worker_t *workers = NULL;
+static int worker_count = 0;
+
+static uv_mutex_t snapshot_lock;
+static snapshot_t *current_snapshot = NULL; // published, holds a reference.
+static prober_t *prober = NULL; // keeps the current proxies' latency models up to date.
+static uv_signal_t reload_signal;
+static reload_t *reloading = NULL;
+static bool serving = false;
+static persist_round_t *saving = NULL; // published to the workers with release.
+static uv_timer_t persist_timer;
+static uv_async_t persist_collected;
+static uv_signal_t terminate_signal;
+static uv_signal_t interrupt_signal;
+
+static server_ctx_t *server_ctx_init(uv_loop_t *loop, snapshot_t *snapshot);
+
+static snapshot_t *snapshot_acquire(void);
+
+static int server_bind(server_ctx_t *ctx, worker_t *worker);
+
+static int open_server_socket(const struct sockaddr *addr, int type, bool reuseport, uv_os_sock_t *fd);
+
+static void worker_run(void *arg);
+
+static void start_listening(server_ctx_t *ctx);
+
+static void batch_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
 
 static void on_read_dns_query(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
                               unsigned flags);
@@ -12,64 +103,666 @@ static void server_close(server_ctx_t *ctx);
 
 static void on_close(uv_handle_t *handle);
 
-static void on_proxies_init(server_ctx_t * ctx);
+static void on_proxies_init(server_ctx_t *ctx, prober_t *calibrated);
+
+static void on_sighup(uv_signal_t *handle, int signum);
+
+static void reload_load(uv_work_t *req);
+
+static void on_reload_loaded(uv_work_t *req, int status);
+
+static void on_reload_calibrated(server_ctx_t *ctx, prober_t *calibrated);
+
+static void on_reload(uv_async_t *handle);
+
+static void send_reply(server_ctx_t *ctx, const struct sockaddr *addr, client_conn_t *conn, reply_req_t *reply,
+                       ssize_t len);
+
+static void on_send_response(uv_udp_send_t *req, int status);
+
+static void flush_replies(server_ctx_t *ctx);
+
+static void on_flush_prepare(uv_prepare_t *handle);
+
+static void on_flush_check(uv_check_t *handle);
+
+static void on_stats_timer(uv_timer_t *handle);
+
+static void persist_schedule(server_ctx_t *ctx);
+
+static void persist_start(uv_loop_t *loop, bool exiting);
+
+static void on_persist_timer(uv_timer_t *handle);
+
+static void on_persist(uv_async_t *handle);
+
+static void persist_part_done(persist_round_t *round);
+
+static void on_persist_collected(uv_async_t *handle);
+
+static void persist_run(uv_work_t *req);
+
+static void on_persisted(uv_work_t *req, int status);
+
+static void on_terminate(uv_signal_t *handle, int signum);
 
 int run_server(uv_loop_t *loop, server_cfg_t *cfg) {
+    server_ctx_t *ctx;
+    int i, rv;
+
+    log_configure(cfg->log_level, cfg->log_burst);
+    if ((current_snapshot = snapshot_load(cfg)) == NULL) {
+        return 1;
+    }
+    uv_mutex_init(&snapshot_lock);
+
+    if ((ctx = server_ctx_init(loop, current_snapshot)) == NULL) {
+        return 1;
+    }
+    // restored latency models spare the calibration round.
+    if (cfg->persist_file) {
+        persist_load(cfg->persist_file, cfg, &ctx->cache, &ctx->verdicts, uv_now(loop), time(NULL));
+    }
+
+    worker_count = cfg->workers > 1 ? cfg->workers : 1;
+    workers = xmalloc(sizeof(worker_t) * worker_count);
+    for (i = 0; i < worker_count; ++i) {
+        workers[i].fd = -1;
+        workers[i].tcp_fd = -1;
+        // bind every socket now, so a bad address fails before calibration.
+        if (worker_count > 1 && open_server_socket(cfg->bind_address, SOCK_DGRAM, true, &workers[i].fd)) {
+            return 1;
+        }
+        if (cfg->tcp_clients_max > 0 &&
+            open_server_socket(cfg->bind_address, SOCK_STREAM, worker_count > 1, &workers[i].tcp_fd)) {
+            return 1;
+        }
+    }
+
+    if (server_bind(ctx, &workers[0])) {
+        return 1;
+    }
+    if (cfg->stats_address && stats_listen(ctx)) {
+        return 1;
+    }
+
+    // a tcp peer gone before its answer is written must not end the process.
+    signal(SIGPIPE, SIG_IGN);
+    uv_signal_init(loop, &reload_signal);
+    uv_signal_start(&reload_signal, on_sighup, SIGHUP);
+    uv_unref((uv_handle_t *) &reload_signal);
+    uv_signal_init(loop, &terminate_signal);
+    uv_signal_start(&terminate_signal, on_terminate, SIGTERM);
+    uv_unref((uv_handle_t *) &terminate_signal);
+    uv_signal_init(loop, &interrupt_signal);
+    uv_signal_start(&interrupt_signal, on_terminate, SIGINT);
+    uv_unref((uv_handle_t *) &interrupt_signal);
+    uv_timer_init(loop, &persist_timer);
+    uv_unref((uv_handle_t *) &persist_timer);
+    uv_async_init(loop, &persist_collected, on_persist_collected);
+    uv_unref((uv_handle_t *) &persist_collected);
+
+    // measure the proxies' latency, serving starts after 3 s at most, then keep it current.
+    prober = proxies_init(ctx, ctx->generation, loop, on_proxies_init);
+
+    rv = uv_run(loop, UV_RUN_DEFAULT);
+    uv_close((uv_handle_t *) &reload_signal, NULL);
+    uv_close((uv_handle_t *) &terminate_signal, NULL);
+    uv_close((uv_handle_t *) &interrupt_signal, NULL);
+    uv_close((uv_handle_t *) &persist_timer, NULL);
+    uv_close((uv_handle_t *) &persist_collected, NULL);
+    server_close(ctx);
+    return rv;
+}
+
+static server_ctx_t *server_ctx_init(uv_loop_t *loop, snapshot_t *snapshot) {
     server_ctx_t *ctx = TMALLOC(server_ctx_t);
-    uv_udp_t *handle = TMALLOC(uv_udp_t);
-    int rv;
+    server_cfg_t *cfg = snapshot->cfg;
 
     ctx->cfg = cfg;
+    ctx->handle = TMALLOC(uv_udp_t);
     loop->data = ctx;
-    ctx->handle = handle;
 
-    if (subnet_list_init(cfg->subnet_file_path, &ctx->list)) {
-        log_error("parse subnet file failed!");
-        return 1;
+    server_pools_init(ctx);
+    stats_init(ctx);
+    cache_init(&ctx->cache, cfg->cache_size);
+    ctx->cache.prefetch_hits = cfg->prefetch_hits;
+    ctx->cache.prefetch_window = cfg->prefetch_window;
+    ctx->cache.negative_ttl = cfg->negative_ttl;
+    ctx->cache.failure_ttl = cfg->failure_ttl;
+    ctx->prefetching = 0;
+    ctx->sessions = 0;
+    ctx->upstream_queries = 0;
+    histogram_reset(&ctx->session_latency);
+    wheel_init(&ctx->wheel, loop);
+    uv_timer_init(loop, &ctx->stats_timer);
+    if (cfg->stats_interval > 0) {
+        uint64_t interval = (uint64_t) cfg->stats_interval * 1000;
+        uv_timer_start(&ctx->stats_timer, on_stats_timer, interval, interval);
+        uv_unref((uv_handle_t *) &ctx->stats_timer);
+    }
+    verdict_init(&ctx->verdicts, cfg->verdict_size, cfg->verdict_ttl);
+    ctx->recv_batch = NULL;
+    ctx->reply_count = 0;
+    memset(ctx->inflight, 0, sizeof(ctx->inflight));
+    ctx->coalesced = 0;
+    ctx->client_listener = NULL;
+    ctx->clients = NULL;
+    ctx->client_count = 0;
+    if (cfg->batch_io) {
+        uv_udp_init_ex(loop, ctx->handle, AF_UNSPEC | UV_UDP_RECVMMSG);
+        ctx->recv_batch = xmalloc(RECV_BATCH_SIZE * RECV_CHUNK_SIZE);
+        // replies queued in the timer phase go out before polling, the ones queued while polling right after it.
+        uv_prepare_init(loop, &ctx->flush_prepare);
+        uv_prepare_start(&ctx->flush_prepare, on_flush_prepare);
+        uv_unref((uv_handle_t *) &ctx->flush_prepare);
+        uv_check_init(loop, &ctx->flush_check);
+        uv_check_start(&ctx->flush_check, on_flush_check);
+        uv_unref((uv_handle_t *) &ctx->flush_check);
+    } else {
+        uv_udp_init(loop, ctx->handle);
     }
 
-    uv_udp_init(loop, handle);
+    ctx->retired = NULL;
+    if ((ctx->generation = generation_create(loop, snapshot)) == NULL) {
+        return NULL;
+    }
+    ctx->generation->proxy_stats = ctx->stats.proxies;
+    return ctx;
+}
+
+static snapshot_t *snapshot_acquire(void) {
+    snapshot_t *snapshot;
 
-    if ((rv = uv_udp_bind(handle, cfg->bind_address, 0)) != 0) {
+    uv_mutex_lock(&snapshot_lock);
+    snapshot = current_snapshot;
+    snapshot_retain(snapshot);
+    uv_mutex_unlock(&snapshot_lock);
+    return snapshot;
+}
+
+static int server_bind(server_ctx_t *ctx, worker_t *worker) {
+    int rv;
+
+    if (worker->fd >= 0) {
+        rv = uv_udp_open(ctx->handle, worker->fd);
+    } else {
+        rv = uv_udp_bind(ctx->handle, ctx->cfg->bind_address, 0);
+    }
+    if (rv != 0) {
         log_error("bind failed! %s", uv_strerror(rv));
-        uv_close((uv_handle_t *) handle, NULL);
         return 1;
-    } else {
+    }
+    if (worker->tcp_fd >= 0 && clients_bind(ctx, worker->tcp_fd)) {
+        return 1;
+    }
+    return 0;
+}
 
-        proxies_init(ctx, loop, on_proxies_init); // init proxy's expected_xx_time.
+static int open_server_socket(const struct sockaddr *addr, int type, bool reuseport, uv_os_sock_t *fd) {
+    int on = 1, off = 0;
 
-        rv = uv_run(loop, UV_RUN_DEFAULT);
-        server_close(ctx);
-        return rv;
+    *fd = socket(addr->sa_family, type, 0);
+    if (*fd < 0) {
+        log_error("create socket failed! %s", strerror(errno));
+        return 1;
     }
+    // an IPv6 wildcard serves IPv4 clients too, whatever the system default is.
+    if ((reuseport && setsockopt(*fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) ||
+        (type == SOCK_STREAM && setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) ||
+        (addr->sa_family == AF_INET6 && setsockopt(*fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off))) ||
+        bind(*fd, addr, sockaddr_size(addr))) {
+        log_error("bind failed! %s", strerror(errno));
+        close(*fd);
+        *fd = -1;
+        return 1;
+    }
+    return 0;
+}
 
+static void worker_run(void *arg) {
+    worker_t *worker = arg;
+    snapshot_t *snapshot = snapshot_acquire();
+    server_ctx_t *ctx;
+
+    if ((ctx = server_ctx_init(&worker->loop, snapshot)) == NULL || server_bind(ctx, worker)) {
+        log_error("worker failed to start.");
+        exit(1);
+    }
+    if (snapshot->cfg->persist_file) {
+        persist_load(snapshot->cfg->persist_file, NULL, &ctx->cache, &ctx->verdicts, uv_now(&worker->loop),
+                     time(NULL));
+    }
+    snapshot_release(snapshot);
+    start_listening(ctx);
+
+    uv_run(&worker->loop, UV_RUN_DEFAULT);
+    uv_close((uv_handle_t *) &worker->reload, NULL);
+    uv_close((uv_handle_t *) &worker->persist, NULL);
+    server_close(ctx);
+    uv_run(&worker->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&worker->loop);
+}
+
+static void start_listening(server_ctx_t *ctx) {
+    clients_listen(ctx);
+    if (ctx->recv_batch == NULL) {
+        uv_udp_recv_start(ctx->handle, packet_alloc_cb, on_read_dns_query); // starting service
+        return;
+    }
+    uv_udp_recv_start(ctx->handle, batch_alloc_cb, on_read_dns_query);
+    if (!uv_udp_using_recvmmsg(ctx->handle)) {
+        log_warn("recvmmsg is not available, client queries are read one at a time.");
+    }
+}
+
+// every read of a worker reuses its batch buffer, queries are copied out before the callback returns.
+static void batch_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    server_ctx_t *ctx = handle->loop->data;
+    buf->base = ctx->recv_batch;
+    buf->len = RECV_BATCH_SIZE * RECV_CHUNK_SIZE;
 }
 
 static void on_read_dns_query(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
                               unsigned flags) {
+    server_ctx_t *ctx = handle->loop->data;
+
     if (nread < 0) {
         log_error("error read client dns query. %s", uv_strerror((int) nread));
+    } else if (nread > DNS_QUERY_SIZE || (flags & UV_UDP_PARTIAL)) {
+        STAT_ADD(ctx->stats.queries, 1);
+        log_error("drop oversized dns query of %ld bytes.", (long) nread);
+        STAT_ADD(ctx->stats.answers[ANSWER_DROPPED], 1);
     } else if (nread > 0) {
-        server_ctx_t *ctx = handle->loop->data;
-        server_cfg_t *cfg = ctx->cfg;
-        session_setup(ctx, addr, buf->base, nread, cfg->proxies, cfg->proxies_count, cfg->query_timeout);
+        server_query(ctx, addr, NULL, buf->base, nread);
+    }
+    if (buf->base && ctx->recv_batch == NULL)
+        packet_free(handle->loop, buf->base);
+}
+
+void server_query(server_ctx_t *ctx, const struct sockaddr *addr, client_conn_t *conn, char *data, ssize_t len) {
+    server_cfg_t *cfg = ctx->cfg;
+    reply_req_t *reply;
+    ssize_t response_len;
+    bool prefetch = false;
+
+    if (len <= 0) {
+        return;
+    }
+    STAT_ADD(ctx->stats.queries, 1);
+    reply = pool_alloc(&ctx->reply_pool);
+
+    // within budget, ask the cache whether this hit should refresh its entry.
+    if (cache_lookup(&ctx->cache, data, len, uv_now(ctx->handle->loop), reply->data, &response_len,
+                     ctx->prefetching < cfg->prefetch_budget ? &prefetch : NULL)) {
+        reply->buf = uv_buf_init(reply->data, (unsigned int) response_len);
+        send_reply(ctx, addr, conn, reply, response_len);
+        if (prefetch) {
+            session_setup(ctx, NULL, NULL, data, len);
+        }
+    } else {
+        pool_free(&ctx->reply_pool, reply);
+        session_setup(ctx, addr, conn, data, len);
     }
-    if (buf->base)
-        xfree(buf->base);
+}
+
+void server_send_response(server_ctx_t *ctx, const struct sockaddr *addr, client_conn_t *conn, const char *data,
+                          ssize_t len) {
+    reply_req_t *reply = pool_alloc(&ctx->reply_pool);
+
+    if (len > DNS_PACKET_SIZE) { // rare, tcp proxies may answer with more than fits inline.
+        reply->buf = uv_buf_init(xmalloc(len), (unsigned int) len);
+    } else {
+        reply->buf = uv_buf_init(reply->data, (unsigned int) len);
+    }
+    memcpy(reply->buf.base, data, (size_t) len);
+    send_reply(ctx, addr, conn, reply, len);
+}
+
+static void send_reply(server_ctx_t *ctx, const struct sockaddr *addr, client_conn_t *conn, reply_req_t *reply,
+                       ssize_t len) {
+    int rv;
+
+    if (conn != NULL) {
+        client_send(conn, reply, len);
+        return;
+    }
+
+    if (ctx->recv_batch != NULL) { // batch_io, hold the reply until the loop iteration ends.
+        memcpy(&reply->addr, addr, sockaddr_size(addr));
+        ctx->replies[ctx->reply_count++] = reply;
+        if (ctx->reply_count == REPLY_BATCH_SIZE) {
+            flush_replies(ctx);
+        }
+        return;
+    }
+
+    if ((rv = uv_udp_send(&reply->req.send, ctx->handle, &reply->buf, 1, addr, on_send_response)) != 0) {
+        log_error("Error on send udp response: %s", uv_strerror(rv));
+        server_release_reply(ctx, reply);
+    }
+}
+
+static void on_send_response(uv_udp_send_t *req, int status) {
+    if (status != 0) {
+        log_error("Error on send udp response: %s", uv_strerror(status));
+    }
+    server_release_reply(req->handle->loop->data, (reply_req_t *) req);
+}
+
+void server_release_reply(server_ctx_t *ctx, reply_req_t *reply) {
+    if (reply->buf.base != reply->data) {
+        xfree(reply->buf.base);
+    }
+    pool_free(&ctx->reply_pool, reply);
+}
+
+static void flush_replies(server_ctx_t *ctx) {
+    struct mmsghdr msgs[REPLY_BATCH_SIZE];
+    int count = ctx->reply_count;
+    int sent = 0;
+    int i, rv;
+
+    if (count == 0) {
+        return;
+    }
+    ctx->reply_count = 0;
+
+    // once libuv queues sends the socket is not writable, keep the order and let libuv retry.
+    if (uv_udp_get_send_queue_count(ctx->handle) == 0) {
+        uv_os_fd_t fd;
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * count);
+        for (i = 0; i < count; ++i) {
+            reply_req_t *reply = ctx->replies[i];
+            msgs[i].msg_hdr.msg_name = &reply->addr;
+            msgs[i].msg_hdr.msg_namelen = sockaddr_size((struct sockaddr *) &reply->addr);
+            msgs[i].msg_hdr.msg_iov = (struct iovec *) &reply->buf;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        uv_fileno((uv_handle_t *) ctx->handle, &fd);
+        do {
+            sent = sendmmsg(fd, msgs, (unsigned int) count, 0);
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0) {
+            sent = 0;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        reply_req_t *reply = ctx->replies[i];
+        if (i < sent) {
+            server_release_reply(ctx, reply);
+        } else if ((rv = uv_udp_send(&reply->req.send, ctx->handle, &reply->buf, 1, (struct sockaddr *) &reply->addr,
+                                     on_send_response)) != 0) {
+            log_error("Error on send udp response: %s", uv_strerror(rv));
+            server_release_reply(ctx, reply);
+        }
+    }
+}
+
+static void on_flush_prepare(uv_prepare_t *handle) {
+    flush_replies(handle->loop->data);
+}
+
+static void on_flush_check(uv_check_t *handle) {
+    flush_replies(handle->loop->data);
 }
 
 static void server_close(server_ctx_t *ctx) {
+    if (ctx->recv_batch != NULL) {
+        flush_replies(ctx);
+    }
+    // close callbacks run in reverse order, so on_close frees ctx after the other handles are gone.
     uv_close((uv_handle_t *) ctx->handle, on_close);
+    uv_close((uv_handle_t *) &ctx->stats_timer, NULL);
+    wheel_close(&ctx->wheel);
+    stats_close(ctx);
+    clients_close(ctx);
+    if (ctx->recv_batch != NULL) {
+        uv_close((uv_handle_t *) &ctx->flush_prepare, NULL);
+        uv_close((uv_handle_t *) &ctx->flush_check, NULL);
+    }
+    generations_close(ctx);
 }
 
 static void on_close(uv_handle_t *handle) {
     server_ctx_t *ctx = handle->loop->data;
-    subnet_list_free(&ctx->list);
+    log_info("cache hits: %lu, misses: %lu, prefetches: %lu, coalesced: %lu", (unsigned long) ctx->cache.hits,
+             (unsigned long) ctx->cache.misses, (unsigned long) ctx->cache.prefetches, (unsigned long) ctx->coalesced);
+    cache_free(&ctx->cache);
+    verdict_free(&ctx->verdicts);
+    stats_free(ctx);
+    server_pools_destroy(ctx);
+    if (ctx->recv_batch != NULL) {
+        xfree(ctx->recv_batch);
+    }
     xfree(ctx->handle);
     xfree(ctx);
 }
 
-static void on_proxies_init(server_ctx_t * ctx)
-{
-    uv_udp_recv_start(ctx->handle, alloc_cb, on_read_dns_query); // starting service
+static void on_proxies_init(server_ctx_t *ctx, prober_t *calibrated) {
+    int i;
+
+    start_listening(ctx);
+
+    // the workers share the proxies from here on, only their latency models keep changing, through
+    // latency_update, and whether they are enabled once a startup round still going ends.
+    for (i = 1; i < worker_count; ++i) {
+        // initialized here, so a reload can signal a worker that is still starting.
+        uv_loop_init(&workers[i].loop);
+        uv_async_init(&workers[i].loop, &workers[i].reload, on_reload);
+        uv_unref((uv_handle_t *) &workers[i].reload);
+        uv_async_init(&workers[i].loop, &workers[i].persist, on_persist);
+        uv_unref((uv_handle_t *) &workers[i].persist);
+        if (uv_thread_create(&workers[i].thread, worker_run, &workers[i]) != 0) {
+            log_error("start worker %d failed!", i);
+            exit(1);
+        }
+    }
+    if (worker_count > 1) {
+        log_info("serving with %d workers.", worker_count);
+    }
+    serving = true;
+    persist_schedule(ctx);
+}
+
+static void on_sighup(uv_signal_t *handle, int signum) {
+    server_ctx_t *ctx = handle->loop->data;
+
+    if (!serving || reloading) {
+        log_warn("SIGHUP ignored, %s.", serving ? "a reload is running" : "the proxies are being calibrated");
+        return;
+    }
+    log_info("reloading %s.", ctx->cfg->conf_file);
+    reloading = TMALLOC(reload_t);
+    reloading->running = ctx->cfg;
+    reloading->snapshot = NULL;
+    reloading->generation = NULL;
+    uv_queue_work(handle->loop, &reloading->req, reload_load, on_reload_loaded);
+}
+
+// on the thread pool, parsing the files does not hold up the first worker.
+static void reload_load(uv_work_t *req) {
+    reload_t *reload = (reload_t *) req;
+    server_cfg_t *cfg = reload_server_cfg(reload->running);
+
+    if (cfg != NULL) {
+        reload->snapshot = snapshot_load(cfg);
+    }
+}
+
+static void on_reload_loaded(uv_work_t *req, int status) {
+    reload_t *reload = (reload_t *) req;
+    server_ctx_t *ctx = req->loop->data;
+
+    if (reload->snapshot == NULL || (reload->generation = generation_create(req->loop, reload->snapshot)) == NULL) {
+        log_error("reload failed, still serving the previous configuration.");
+        if (reload->snapshot) {
+            snapshot_release(reload->snapshot);
+        }
+        xfree(reload);
+        reloading = NULL;
+        return;
+    }
+    // proxies the reload kept go on with their models, the startup round only runs for new ones.
+    proxies_inherit(reload->snapshot->cfg, ctx->cfg);
+    proxies_init(ctx, reload->generation, req->loop, on_reload_calibrated);
+}
+
+static void on_reload_calibrated(server_ctx_t *ctx, prober_t *calibrated) {
+    reload_t *reload = reloading;
+    snapshot_t *replaced;
+    int i;
+
+    uv_mutex_lock(&snapshot_lock);
+    replaced = current_snapshot;
+    current_snapshot = reload->snapshot; // with the loader's reference.
+    uv_mutex_unlock(&snapshot_lock);
+
+    proxies_stop(prober);
+    prober = calibrated;
+    // the prober runs on this loop alone, nothing else adds to either set.
+    poison_inherit(reload->snapshot->poison, replaced->poison);
+    generation_swap(ctx, reload->generation);
+    snapshot_release(replaced);
+    for (i = 1; i < worker_count; ++i) {
+        uv_async_send(&workers[i].reload);
+    }
+    log_configure(ctx->cfg->log_level, ctx->cfg->log_burst);
+    log_info("reloaded with %d proxies.", ctx->cfg->proxies_count);
+    xfree(reload);
+    reloading = NULL;
+    persist_schedule(ctx);
+}
+
+// running sessions finish on the generation they started on.
+static void on_reload(uv_async_t *handle) {
+    server_ctx_t *ctx = handle->loop->data;
+    snapshot_t *snapshot = snapshot_acquire();
+    generation_t *generation;
+
+    if (snapshot != ctx->generation->snapshot) {
+        if ((generation = generation_create(handle->loop, snapshot)) == NULL) {
+            log_error("worker keeps serving the previous configuration.");
+        } else {
+            generation_swap(ctx, generation);
+        }
+    }
+    snapshot_release(snapshot);
+}
+
+// what the proxy stages cost and gave since the last line.
+static void on_stats_timer(uv_timer_t *handle) {
+    server_ctx_t *ctx = handle->loop->data;
+
+    if (ctx->sessions == 0) {
+        return;
+    }
+    log_info("sessions: %lu, upstream queries per session: %.2f, latency p50: %ld ms, p99: %ld ms",
+             (unsigned long) ctx->sessions,
+             ctx->sessions ? (double) ctx->upstream_queries / (double) ctx->sessions : 0.0,
+             (long) histogram_percentile(&ctx->session_latency, 0.5),
+             (long) histogram_percentile(&ctx->session_latency, 0.99));
+    ctx->sessions = 0;
+    ctx->upstream_queries = 0;
+    histogram_reset(&ctx->session_latency);
+}
+
+static void persist_schedule(server_ctx_t *ctx) {
+    uint64_t interval = (uint64_t) ctx->cfg->persist_interval * 1000;
+
+    if (ctx->cfg->persist_file == NULL || interval == 0) {
+        uv_timer_stop(&persist_timer);
+    } else if (!uv_is_active((uv_handle_t *) &persist_timer) || uv_timer_get_repeat(&persist_timer) != interval) {
+        uv_timer_start(&persist_timer, on_persist_timer, interval, interval);
+    }
+}
+
+// on the first worker, which owns part 0.
+static void persist_start(uv_loop_t *loop, bool exiting) {
+    server_ctx_t *ctx = loop->data;
+    persist_round_t *round = TMALLOC(persist_round_t);
+    int i;
+
+    round->snapshot = snapshot_acquire();
+    round->parts = xmalloc(sizeof(persist_part_t) * worker_count);
+    memset(round->parts, 0, sizeof(persist_part_t) * worker_count);
+    round->pending = worker_count;
+    round->saved_at = time(NULL);
+    round->exiting = exiting;
+    round->rv = 0;
+    __atomic_store_n(&saving, round, __ATOMIC_RELEASE);
+    for (i = 1; i < worker_count; ++i) {
+        uv_async_send(&workers[i].persist);
+    }
+    persist_collect(&round->parts[0], &ctx->cache, &ctx->verdicts, uv_now(loop));
+    persist_part_done(round);
+}
+
+static void on_persist_timer(uv_timer_t *handle) {
+    if (saving == NULL) { // a slow disk skips a round rather than queuing them.
+        persist_start(handle->loop, false);
+    }
+}
+
+static void on_persist(uv_async_t *handle) {
+    server_ctx_t *ctx = handle->loop->data;
+    worker_t *worker = (worker_t *) ((char *) handle - offsetof(worker_t, persist));
+    persist_round_t *round = __atomic_load_n(&saving, __ATOMIC_ACQUIRE);
+
+    persist_collect(&round->parts[worker - workers], &ctx->cache, &ctx->verdicts, uv_now(handle->loop));
+    persist_part_done(round);
+}
+
+static void persist_part_done(persist_round_t *round) {
+    if (__atomic_sub_fetch(&round->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        uv_async_send(&persist_collected);
+    }
+}
+
+static void on_persist_collected(uv_async_t *handle) {
+    uv_queue_work(handle->loop, &saving->req, persist_run, on_persisted);
+}
+
+static void persist_run(uv_work_t *req) {
+    persist_round_t *round = (persist_round_t *) req;
+    server_cfg_t *cfg = round->snapshot->cfg;
+
+    round->rv = persist_write(cfg->persist_file, cfg, round->parts, worker_count, round->saved_at);
+}
+
+static void on_persisted(uv_work_t *req, int status) {
+    persist_round_t *round = (persist_round_t *) req;
+    int i;
+
+    for (i = 0; i < worker_count; ++i) {
+        persist_part_free(&round->parts[i]);
+    }
+    xfree(round->parts);
+    if (round->exiting) {
+        log_info("%s %s, exiting.", round->rv == 0 ? "saved" : "could not save", round->snapshot->cfg->persist_file);
+        exit(0);
+    }
+    snapshot_release(round->snapshot);
+    xfree(round);
+    __atomic_store_n(&saving, NULL, __ATOMIC_RELEASE);
+}
+
+// the warm restart file is saved before the process ends, a second signal does not wait for it.
+static void on_terminate(uv_signal_t *handle, int signum) {
+    server_ctx_t *ctx = handle->loop->data;
+
+    if (saving) {
+        if (saving->exiting) {
+            exit(0);
+        }
+        saving->exiting = true;
+        return;
+    }
+    if (!serving || ctx->cfg->persist_file == NULL) {
+        exit(0);
+    }
+    log_info("saving %s.", ctx->cfg->persist_file);
+    persist_start(handle->loop, true);
 }
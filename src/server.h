@@ -3,6 +3,24 @@
 
 #include "common.h"
 
+/*
+ * Serve until the loop stops, cfg is owned by the server. SIGHUP reloads the configuration file, the
+ * subnet list and the rules without stopping to serve.
+ */
 int run_server(uv_loop_t *loop, server_cfg_t *cfg);
 
+/*
+ * Answer a client query from the cache or start a session for it. conn is the client's tcp connection,
+ * NULL for a datagram from addr.
+ */
+void server_query(server_ctx_t *ctx, const struct sockaddr *addr, client_conn_t *conn, char *data, ssize_t len);
+
+/*
+ * Send a response to client, data is copied into a pooled request.
+ */
+void server_send_response(server_ctx_t *ctx, const struct sockaddr *addr, client_conn_t *conn, const char *data,
+                          ssize_t len);
+
+void server_release_reply(server_ctx_t *ctx, reply_req_t *reply);
+
 #endif //GDNS_SERVER_H
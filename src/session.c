@@ -6,208 +6,710 @@
 #include "task.h"
 #include "server.h"
 #include "iputility.h"
+#include "cache.h"
+#include "pool.h"
+#include "dns.h"
+#include "verdict.h"
+#include "rules.h"
+#include "proxy.h"
+#include "histogram.h"
+#include "snapshot.h"
+#include "client.h"
+#include "wheel.h"
+#include "poison.h"
+
+// kinds of proxies, in the order the stages reach them.
+#define CLASS_INTERNAL 0
+#define CLASS_EXTERNAL 1
+#define CLASS_TCP 2
+#define PROXY_CLASSES 3
 
 static void session_close(session_ctx_t *ctx);
 
 static void on_task_done(query_task_t *task, char *response, ssize_t len, int64_t response_time);
 
-static void on_query_timeout(uv_timer_t *handle);
+static void on_query_timeout(wheel_timer_t *timer);
+
+static void session_fail(session_ctx_t *ctx);
+
+static ssize_t remember_failure(session_ctx_t *ctx, char *response);
 
 static void write_response(session_ctx_t *ctx, char *response, ssize_t len);
 
-static void on_close(uv_handle_t *handle);
+static int forward_action(query_task_t *task, char *response, ssize_t len, int64_t response_time,
+                          verdict_t *observed);
+
+static verdict_t answer_verdict(session_ctx_t *ctx, char *response, ssize_t len);
+
+static verdict_t address_verdict(session_ctx_t *ctx, const dns_rr_t *rr);
+
+static bool address_forged(session_ctx_t *ctx, const dns_rr_t *rr);
+
+static void learn_verdict(session_ctx_t *ctx, verdict_t observed);
+
+static bool proxy_trusted(session_ctx_t *ctx, upstream_proxy_t *proxy);
+
+static void start_tasks(session_ctx_t *ctx);
+
+static int start_stage(session_ctx_t *ctx);
+
+static bool stage_member(session_ctx_t *ctx, int index, int class);
 
-static int forward_action(query_task_t *task, char *response, ssize_t len, int64_t response_time);
+static int fastest_proxy(session_ctx_t *ctx, int class);
+
+static int proxy_class(upstream_proxy_t *proxy);
+
+static void on_hedge_timeout(wheel_timer_t *timer);
+
+static bool tasks_running(session_ctx_t *ctx);
+
+static void session_escalate(session_ctx_t *ctx, bool forget);
 
 static void on_task_close(query_task_t *task);
 
-static void on_timer_close(uv_handle_t *handle);
+static bool session_attach(server_ctx_t *server_ctx, const dns_question_t *question,
+                           const struct sockaddr *client_addr, client_conn_t *conn, const char *data);
+
+static void inflight_remove(session_ctx_t *ctx);
 
-void session_setup(server_ctx_t *server_ctx, const struct sockaddr *client_addr, char *data, ssize_t len,
-                   upstream_proxy_t *proxys, int proxy_count, int query_timeout) {
+void session_setup(server_ctx_t *server_ctx, const struct sockaddr *client_addr, client_conn_t *conn, char *data,
+                   ssize_t len) {
+    generation_t *generation = server_ctx->generation;
+    upstream_proxy_t *proxys = generation->snapshot->cfg->proxies;
+    int proxy_count = generation->snapshot->cfg->proxies_count;
     int i = 0;
+    session_ctx_t *ctx;
+    dns_question_t question;
+    bool coalesce = dns_parse_question(data, len, &question) == 0;
+
+    if (coalesce && session_attach(server_ctx, &question, client_addr, conn, data)) {
+        return;
+    }
+    if (client_addr == NULL && !coalesce) { // a refresh could not replace the entry.
+        return;
+    }
 
     // initial session
-    session_ctx_t *ctx = TMALLOC(session_ctx_t);
-    memcpy(&(ctx->client_addr), client_addr, sizeof(struct sockaddr));
+    ctx = pool_alloc(&server_ctx->session_pool);
+    ctx->prefetch = client_addr == NULL;
+    if (ctx->prefetch) {
+        memset(&ctx->client_addr, 0, sizeof(ctx->client_addr));
+        server_ctx->prefetching += 1;
+    } else {
+        memcpy(&(ctx->client_addr), client_addr, sockaddr_size(client_addr));
+    }
+    ctx->client_conn = conn;
+    if (conn) {
+        client_hold(conn);
+    }
 
-    ctx->query_data = xmalloc(len);
     memcpy(ctx->query_data, data, len);
     ctx->query_len = len;
 
-    ctx->query_timeout = query_timeout;
+    ctx->query_timeout = generation->snapshot->cfg->query_timeout;
 
-    ctx->timer = TMALLOC(uv_timer_t);
-    uv_timer_init(server_ctx->handle->loop, ctx->timer);
-    ctx->timer->data = ctx;
+    wheel_timer_init(&ctx->timer, ctx);
+    wheel_timer_init(&ctx->hedge_timer, ctx);
+    ctx->start_time = uv_now(server_ctx->handle->loop);
 
     ctx->server_ctx = server_ctx;
+    ctx->generation = generation;
+    generation->users += 1;
 
     ctx->max_confidence = 0.0;
     ctx->confident_response = NULL;
     ctx->confident_response_len = 0;
 
+    ctx->waiters = NULL;
+    ctx->waiter_count = 0;
+    ctx->inflight = coalesce;
+    if (coalesce) {
+        session_ctx_t **bucket = &server_ctx->inflight[question.hash & (INFLIGHT_BUCKETS - 1)];
+        ctx->question = question;
+        ctx->next_inflight = *bucket;
+        *bucket = ctx;
+    }
+
     // start task
-    ctx->tasks = xmalloc(sizeof(query_task_t *) * proxy_count);
-    ctx->task_count = proxy_count;
+    ctx->task_count = 0;
+    ctx->proxies = proxys;
+    ctx->proxy_count = proxy_count;
+    ctx->started = 0;
+    ctx->failed = 0;
+    ctx->forged = false;
+    ctx->min_class = CLASS_INTERNAL;
+    ctx->verdict = VERDICT_UNKNOWN;
+    if (coalesce) {
+        ctx->verdict = rules_lookup(generation->snapshot->rules, question.name);
+    }
+    ctx->ruled = ctx->verdict != VERDICT_UNKNOWN;
+    if (coalesce && !ctx->ruled) {
+        ctx->verdict = verdict_lookup(&server_ctx->verdicts, question.name, uv_now(server_ctx->handle->loop));
+    }
+    if (ctx->verdict != VERDICT_UNKNOWN) {
+        for (i = 0; i < proxy_count; ++i) {
+            if (proxy_trusted(ctx, &proxys[i])) {
+                break;
+            }
+        }
+        if (i == proxy_count) { // no proxy of the trusted kind is configured.
+            ctx->verdict = VERDICT_UNKNOWN;
+            ctx->ruled = false;
+        }
+    }
 
-    for (i = 0; i < proxy_count; ++i) {
-        ctx->tasks[i] = TMALLOC(query_task_t);
-        task_init(ctx->tasks[i], &(proxys[i]), ctx->query_data, ctx->query_len);
-        ctx->tasks[i]->data = ctx;
+    ctx->state = SESSION_RUNNING;
+    wheel_timer_start(&ctx->server_ctx->wheel, &ctx->timer, on_query_timeout, (uint64_t) ctx->query_timeout);
+    start_tasks(ctx);
+    if (ctx->verdict != VERDICT_UNKNOWN && !tasks_running(ctx)) { // e.g. the tcp proxies are backed off.
+        session_escalate(ctx, false);
     }
+    session_fail(ctx);
+}
 
-    for (i = 0; i < proxy_count; ++i) {
-        task_run(server_ctx->handle->loop, ctx->tasks[i], on_task_done);
+// start the next stage of proxies, and the ones after it while nothing of the stage is left running.
+static void start_tasks(session_ctx_t *ctx) {
+    server_cfg_t *cfg = ctx->server_ctx->cfg;
+    int first, i;
+    int64_t delay, stage_delay;
+
+    do {
+        first = ctx->task_count;
+        if (start_stage(ctx) == 0) { // every proxy the session may ask was asked.
+            wheel_timer_stop(&ctx->hedge_timer);
+            return;
+        }
+    } while (cfg->hedge && !tasks_running(ctx));
+
+    if (!cfg->hedge) {
+        return;
+    }
+    // the next stage waits until the quickest proxy of this one should have answered.
+    stage_delay = ctx->query_timeout;
+    for (i = first; i < ctx->task_count; ++i) {
+        delay = proxy_hedge_delay(ctx->tasks[i]->proxy);
+        if (delay < cfg->hedge_min) {
+            delay = cfg->hedge_min;
+        }
+        if (delay < stage_delay) {
+            stage_delay = delay;
+        }
     }
+    wheel_timer_start(&ctx->server_ctx->wheel, &ctx->hedge_timer, on_hedge_timeout, (uint64_t) stage_delay);
+}
 
-    uv_timer_start(ctx->timer, on_query_timeout, (uint64_t) ctx->query_timeout, 0);
-    ctx->state = SESSION_RUNNING;
+/*
+ * With hedging a stage is the fastest proxy of the first kind alone, then the rest of its kind, then each
+ * later kind in turn. Without it every proxy is asked at once. Returns the number of tasks started.
+ */
+static int start_stage(session_ctx_t *ctx) {
+    bool hedge = ctx->server_ctx->cfg->hedge;
+    int first = ctx->task_count;
+    int class, lead, i;
+
+    for (class = ctx->min_class; class < PROXY_CLASSES; ++class) {
+        lead = hedge && ctx->started == 0 ? fastest_proxy(ctx, class) : -1;
+        for (i = 0; i < ctx->proxy_count; ++i) {
+            if (!stage_member(ctx, i, class) || (lead >= 0 && i != lead)) {
+                continue;
+            }
+            ctx->started |= 1u << i;
+            STAT_ADD(ctx->generation->proxy_stats[i].queries, 1);
+            ctx->tasks[ctx->task_count] = pool_alloc(&ctx->server_ctx->task_pool);
+            task_init(ctx->tasks[ctx->task_count], &ctx->generation->upstreams[i], ctx->query_data, ctx->query_len);
+            ctx->tasks[ctx->task_count]->data = ctx;
+            ctx->task_count += 1;
+        }
+        if (hedge && ctx->task_count > first) {
+            break;
+        }
+    }
+
+    for (i = first; i < ctx->task_count; ++i) {
+        task_run(ctx->server_ctx->handle->loop, ctx->tasks[i], on_task_done);
+        if (ctx->tasks[i]->state == TASK_ERROR) { // failed at once, e.g. a backed off tcp proxy.
+            STAT_ADD(ctx->generation->proxy_stats[ctx->tasks[i]->proxy - ctx->proxies].errors, 1);
+        }
+    }
+    return ctx->task_count - first;
+}
+
+static bool stage_member(session_ctx_t *ctx, int index, int class) {
+    upstream_proxy_t *proxy = &ctx->proxies[index];
+    return !(ctx->started & (1u << index)) && proxy_class(proxy) == class && proxy_trusted(ctx, proxy);
+}
+
+// the one answering genuine queries quickest, proxies not measured yet come last.
+static int fastest_proxy(session_ctx_t *ctx, int class) {
+    int64_t best_delay = -1, delay;
+    int best = -1;
+    int i;
+
+    for (i = 0; i < ctx->proxy_count; ++i) {
+        if (!stage_member(ctx, i, class)) {
+            continue;
+        }
+        delay = proxy_hedge_delay(&ctx->proxies[i]);
+        if (best < 0 || (delay >= 0 && (best_delay < 0 || delay < best_delay))) {
+            best = i;
+            best_delay = delay;
+        }
+    }
+    return best;
+}
+
+static int proxy_class(upstream_proxy_t *proxy) {
+    if (proxy->tcp) {
+        return CLASS_TCP;
+    }
+    return proxy->internal ? CLASS_INTERNAL : CLASS_EXTERNAL;
+}
+
+static void on_hedge_timeout(wheel_timer_t *timer) {
+    session_ctx_t *ctx = timer->data;
+
+    if (ctx->state == SESSION_RUNNING) {
+        start_tasks(ctx);
+        session_fail(ctx);
+    }
+}
+
+static bool proxy_trusted(session_ctx_t *ctx, upstream_proxy_t *proxy) {
+    int i;
+
+    switch (ctx->verdict) {
+        case VERDICT_INTERNAL:
+            return proxy->internal && !proxy->tcp;
+        case VERDICT_FOREIGN:
+            // tcp answers are not poisoned, external udp ones still go through the confidence check.
+            for (i = 0; i < ctx->proxy_count; ++i) {
+                if (ctx->proxies[i].tcp) {
+                    return proxy->tcp;
+                }
+            }
+            return !proxy->internal;
+        default:
+            return true;
+    }
+}
+
+// tasks that may still bring an acceptable answer, proxies of a kind no longer asked do not count.
+static bool tasks_running(session_ctx_t *ctx) {
+    query_task_t *task;
+    int i;
+
+    for (i = 0; i < ctx->task_count; ++i) {
+        task = ctx->tasks[i];
+        if (proxy_class(task->proxy) < ctx->min_class || (ctx->failed & (1u << (task->proxy - ctx->proxies)))) {
+            continue;
+        }
+        // a poisoned external proxy sends the genuine answer after the fake one.
+        if (task->state == TASK_RUNING || (proxy_class(task->proxy) == CLASS_EXTERNAL &&
+                                           (task->state == TASK_DONE || task->state == TASK_MULTI_RESULT))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// fall back to the stages over every proxy, forget the verdict when an answer contradicted it.
+static void session_escalate(session_ctx_t *ctx, bool forget) {
+    if (forget) {
+        verdict_forget(&ctx->server_ctx->verdicts, ctx->question.name);
+    }
+    ctx->verdict = VERDICT_UNKNOWN;
+    ctx->ruled = false;
+    start_tasks(ctx);
+}
+
+// wait on the running session asking the same question, if any. A retransmit is dropped.
+static bool session_attach(server_ctx_t *server_ctx, const dns_question_t *question,
+                           const struct sockaddr *client_addr, client_conn_t *conn, const char *data) {
+    session_ctx_t *ctx = server_ctx->inflight[question->hash & (INFLIGHT_BUCKETS - 1)];
+    session_waiter_t *waiter;
+
+    while (ctx && !dns_question_equal(&ctx->question, question)) {
+        ctx = ctx->next_inflight;
+    }
+    if (ctx == NULL) {
+        return false;
+    }
+    if (client_addr == NULL) { // a refresh, the running session will update the cache.
+        return true;
+    }
+
+    if (ctx->client_conn == conn && memcmp(&ctx->client_addr, client_addr, sockaddr_size(client_addr)) == 0 &&
+        memcmp(ctx->query_data, data, 2) == 0) {
+        return true;
+    }
+    for (waiter = ctx->waiters; waiter; waiter = waiter->next) {
+        if (waiter->client_conn == conn && memcmp(&waiter->client_addr, client_addr, sockaddr_size(client_addr)) == 0 &&
+            memcmp(waiter->id, data, 2) == 0) {
+            return true;
+        }
+    }
+    if (ctx->waiter_count == MAX_WAITERS) {
+        return false;
+    }
+
+    waiter = pool_alloc(&server_ctx->waiter_pool);
+    memcpy(&waiter->client_addr, client_addr, sockaddr_size(client_addr));
+    waiter->client_conn = conn;
+    if (conn) {
+        client_hold(conn);
+    }
+    memcpy(waiter->id, data, 2);
+    waiter->next = ctx->waiters;
+    ctx->waiters = waiter;
+    ctx->waiter_count += 1;
+    STAT_ADD(server_ctx->coalesced, 1);
+    return true;
+}
+
+static void inflight_remove(session_ctx_t *ctx) {
+    session_ctx_t **p = &ctx->server_ctx->inflight[ctx->question.hash & (INFLIGHT_BUCKETS - 1)];
+
+    while (*p != ctx) {
+        p = &(*p)->next_inflight;
+    }
+    *p = ctx->next_inflight;
+    ctx->inflight = false;
 }
 
 
 static void session_close(session_ctx_t *ctx) {
+    client_conn_t *conn = ctx->client_conn;
     int i = 0;
     for (i = 0; i < ctx->task_count; ++i) {
+        if (ctx->tasks[i]->state == TASK_RUNING) {
+            STAT_ADD(ctx->generation->proxy_stats[ctx->tasks[i]->proxy - ctx->proxies].timeouts, 1);
+        }
         task_close(ctx->tasks[i], on_task_close);
     }
-    uv_close((uv_handle_t *) ctx->timer, on_timer_close);
+    wheel_timer_stop(&ctx->timer);
+    wheel_timer_stop(&ctx->hedge_timer);
+    if (!ctx->prefetch) {
+        ctx->server_ctx->sessions += 1;
+        ctx->server_ctx->upstream_queries += (uint64_t) ctx->task_count;
+        histogram_add(&ctx->server_ctx->session_latency,
+                      (int64_t) (uv_now(ctx->server_ctx->handle->loop) - ctx->start_time));
+    }
 
-    xfree(ctx->query_data);
-    xfree(ctx->tasks);
+    if (ctx->inflight) {
+        inflight_remove(ctx);
+    }
+    while (ctx->waiters) {
+        session_waiter_t *next = ctx->waiters->next;
+        if (ctx->waiters->client_conn) {
+            client_release(ctx->waiters->client_conn);
+        }
+        pool_free(&ctx->server_ctx->waiter_pool, ctx->waiters);
+        ctx->waiters = next;
+    }
     if (ctx->confident_response) {
-        xfree(ctx->confident_response);
+        pool_free(&ctx->server_ctx->packet_pool, ctx->confident_response);
+    }
+    if (ctx->prefetch) {
+        ctx->server_ctx->prefetching -= 1;
+    }
+    generation_release(ctx->server_ctx, ctx->generation);
+    pool_free(&ctx->server_ctx->session_pool, ctx);
+    // last, releasing may start the next queries the connection has read.
+    if (conn) {
+        client_release(conn);
     }
-    xfree(ctx);
 }
 
-static void on_query_timeout(uv_timer_t *handle) {
-    session_ctx_t *ctx = handle->data;
-    uv_timer_stop(handle);
+static void on_query_timeout(wheel_timer_t *timer) {
+    session_ctx_t *ctx = timer->data;
 
     if (ctx->state == SESSION_RUNNING) { // still running.
         if (ctx->confident_response != NULL) {
+            STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_TIMEOUT_FALLBACK], 1);
+            log_debug("%s timed out, answered with the most confident response.", ctx->question.name);
             write_response(ctx, ctx->confident_response, ctx->confident_response_len);
         } else {
-            // just close session
+            // just close session, the clients asking again get the failure at once.
+            char response[DNS_QUERY_SIZE];
+
+            remember_failure(ctx, response);
+            STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_DROPPED], 1);
+            log_debug("%s timed out without a response.", ctx->question.name);
             session_close(ctx);
         }
     }
 
 }
 
+// answer SERVFAIL once no proxy is left to start or wait for, the timeout would not bring an answer either.
+static void session_fail(session_ctx_t *ctx) {
+    char response[DNS_QUERY_SIZE];
+    ssize_t len;
+
+    if (tasks_running(ctx) || ctx->confident_response != NULL) {
+        return;
+    }
+    if ((len = remember_failure(ctx, response)) < 0) { // not a query to answer, left to the timeout.
+        return;
+    }
+    wheel_timer_stop(&ctx->timer);
+    ctx->state = SESSION_DONE;
+    STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_FAILED], 1);
+    log_debug("every proxy failed %s, answered SERVFAIL.", ctx->question.name);
+    write_response(ctx, response, len);
+}
+
+// build the SERVFAIL answer to the query into response, the cache keeps it for failure_ttl.
+static ssize_t remember_failure(session_ctx_t *ctx, char *response) {
+    ssize_t len = dns_error_response(ctx->query_data, ctx->query_len, ns_r_servfail, response);
+
+    if (len > 0) {
+        cache_store(&ctx->server_ctx->cache, ctx->query_data, ctx->query_len, response, len,
+                    uv_now(ctx->server_ctx->handle->loop));
+    }
+    return len;
+}
+
 static void on_task_done(query_task_t *task, char *response, ssize_t len, int64_t response_time) {
-    if (task->state == TASK_DONE) {
-        session_ctx_t *ctx = task->data;
-        if (ctx->state == SESSION_RUNNING && forward_action(task, response, len, response_time) == 1) {
-            uv_timer_stop(ctx->timer);
+    session_ctx_t *ctx = task->data;
+    proxy_stats_t *stats = &ctx->generation->proxy_stats[task->proxy - ctx->proxies];
+    verdict_t observed = VERDICT_UNKNOWN;
+
+    if (task->state == TASK_ERROR) {
+        STAT_ADD(stats->errors, 1);
+    } else {
+        STAT_ADD(stats->responses, 1);
+        if (task->state == TASK_DONE) {
+            histogram_add(&stats->latency, response_time);
+        }
+    }
+    if (ctx->state != SESSION_RUNNING) {
+        return;
+    }
+    // a poisoned udp proxy answers twice, the genuine answer comes second.
+    if (task->state == TASK_DONE || task->state == TASK_MULTI_RESULT) {
+        if (forward_action(task, response, len, response_time, &observed) == 1) {
+            wheel_timer_stop(&ctx->timer);
             ctx->state = SESSION_DONE;
+            learn_verdict(ctx, observed);
+            cache_store(&ctx->server_ctx->cache, ctx->query_data, ctx->query_len, response, len,
+                        uv_now(ctx->server_ctx->handle->loop));
             write_response(ctx, response, len);
+            return;
+        }
+    } else if (task->state != TASK_ERROR) {
+        return;
+    }
+
+    // an internal proxy pointing outside may be poisoned for this name, so are the other internal ones.
+    if (observed == VERDICT_FOREIGN && proxy_class(task->proxy) == CLASS_INTERNAL) {
+        ctx->min_class = CLASS_EXTERNAL;
+    }
+
+    // the trusted proxies contradict a learned verdict, or none of them is left to answer.
+    if (ctx->verdict != VERDICT_UNKNOWN) {
+        if (!ctx->ruled && observed != VERDICT_UNKNOWN && observed != ctx->verdict) {
+            session_escalate(ctx, true);
+        } else if (!tasks_running(ctx)) {
+            session_escalate(ctx, false);
         }
+    } else if (!tasks_running(ctx)) { // no need to wait for the hedge delay.
+        start_tasks(ctx);
     }
+    session_fail(ctx);
 }
 
-static void on_send_query_response(uv_udp_send_t *req, int status) {
-    session_ctx_t * ctx = req->data;
-    if (status != 0) {
-        log_error("Error on send udp response: %s", uv_strerror(status));
-        uv_timer_stop(ctx->timer);
+// only a full race teaches a verdict, so a verdict is checked against every proxy once it expires.
+static void learn_verdict(session_ctx_t *ctx, verdict_t observed) {
+    if (!ctx->inflight || observed == VERDICT_UNKNOWN) { // no parsed question, or nothing learned.
+        return;
+    }
+    if (ctx->verdict == VERDICT_UNKNOWN) {
+        verdict_store(&ctx->server_ctx->verdicts, ctx->question.name, observed, uv_now(ctx->server_ctx->handle->loop));
+    } else if (observed != ctx->verdict) {
+        verdict_forget(&ctx->server_ctx->verdicts, ctx->question.name);
     }
-    session_close(ctx);
-    xfree(req);
 }
 
 static void write_response(session_ctx_t *ctx, char *response, ssize_t len) {
-    char *data = xmalloc(len);
-    memcpy(data, response, len);
-
-    send_req_t *req = TMALLOC(send_req_t);
-
-    req->buf = uv_buf_init(data, len);
-    req->req.data = ctx;
-    uv_udp_send((uv_udp_send_t *) req, ctx->server_ctx->handle, &req->buf, 1, &ctx->client_addr,
-                on_send_query_response);
+    session_waiter_t *waiter;
 
+    if (!ctx->prefetch) {
+        server_send_response(ctx->server_ctx, (struct sockaddr *) &ctx->client_addr, ctx->client_conn, response,
+                             len);
+    }
+    for (waiter = ctx->waiters; waiter; waiter = waiter->next) {
+        memcpy(response, waiter->id, 2); // the reply is copied, so the id is patched in place.
+        server_send_response(ctx->server_ctx, (struct sockaddr *) &waiter->client_addr, waiter->client_conn,
+                             response, len);
+    }
+    session_close(ctx);
 }
 
 
 static void on_task_close(query_task_t *task) {
-    xfree(task);
-}
-
-static void on_timer_close(uv_handle_t *handle) {
-    xfree(handle);
+    server_ctx_t *server_ctx = task->loop->data;
+    pool_free(&server_ctx->task_pool, task);
 }
 
 
-// 1 forward. 0 ignore.
-static int forward_action(query_task_t *task, char *response, ssize_t len, int64_t response_time) {
+// 1 forward. 0 ignore. observed tells whether the answer points into the subnet list.
+static int forward_action(query_task_t *task, char *response, ssize_t len, int64_t response_time,
+                          verdict_t *observed) {
 
     upstream_proxy_t *proxy = task->proxy;
     session_ctx_t *ctx = task->data;
-    ns_msg msg;
-    ns_rr rr;
-    ns_type rr_type;
-    int rr_count, i;
+    dns_msg_t msg;
+    dns_rr_iter_t iter;
+    dns_rr_t rr;
+    int rv;
+
+    if (dns_msg_init(&msg, response, len)) {
+        log_error("error in parse dns response.");
+        return 0;
+    }
+
+    // 1. a failing proxy, the others may still answer.
+    if (dns_msg_rcode(&msg) == ns_r_servfail || dns_msg_rcode(&msg) == ns_r_refused) {
+        ctx->failed |= 1u << (proxy - ctx->proxies);
+        return 0;
+    }
 
-    // 1. forward tcp result.
+    // 2. forward tcp result.
     if(task->proxy->tcp){
+        *observed = answer_verdict(ctx, response, len);
+        STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_TCP], 1);
         return 1;
     }
 
-    ns_initparse(response, len, &msg);
-    rr_count = ns_msg_count(msg, ns_s_an);
-
-    // 2. fake result will have A record.
-    if (rr_count == 0) {
+    // 3. a domestic rule trusts the internal proxies, whatever they answer.
+    if (ctx->ruled && ctx->verdict == VERDICT_INTERNAL) {
+        STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_RULE], 1);
         return 1;
     }
 
-    for (i = 0; i < rr_count; ++i) {
-        if (ns_parserr(&msg, ns_s_an, i, &rr)) {
-            log_error("error in parse resource record.");
-            continue;
-        }
-
-        rr_type = ns_rr_type(rr);
+    // 4. fake result will have A or AAAA record.
+    if (msg.counts[ns_s_an] == 0) {
+        STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_EMPTY], 1);
+        return 1;
+    }
 
-        // 3. fake result will only have one A record.
-        if (rr_type != ns_t_a) {
+    dns_rr_iter_init(&iter, &msg);
+    while ((rv = dns_rr_next(&iter, &rr)) > 0 && rr.section == ns_s_an) {
+        // 5. fake result will only have one A or AAAA record.
+        if (rr.type != ns_t_a && rr.type != ns_t_aaaa) {
+            STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_NON_A], 1);
             return 1;
         }
+        verdict_t verdict = address_verdict(ctx, &rr);
+        if (verdict == VERDICT_UNKNOWN) {
+            break;
+        }
 
-        // 4. internal ip is reliable.
+        // 6. a known forged address, the name is blocked.
         server_ctx_t *server_ctx = ctx->server_ctx;
-        if (ip_in_subnet_list(&server_ctx->list, (struct in_addr *) (ns_rr_rdata(rr)))) {
+        if (address_forged(ctx, &rr)) {
+            *observed = VERDICT_FOREIGN;
+            ctx->forged = true;
+            STAT_ADD(server_ctx->stats.forged, 1);
+            return 0;
+        }
+
+        // 7. internal ip is reliable.
+        if (verdict == VERDICT_INTERNAL) {
+            *observed = VERDICT_INTERNAL;
+            latency_update(&proxy->genuine, response_time); // a fake answer never points inside.
+            STAT_ADD(server_ctx->stats.answers[ANSWER_IN_SUBNET], 1);
             return 1;
         }
 
         if (proxy->internal) { // external ip using external dns server only.
+            *observed = VERDICT_FOREIGN;
             return 0;
         }
 
-        // 5. for external ip. calc result confidence.
-        double confidence = ( 1.0 * response_time - proxy->expected_fake_response_time) /
-                            (proxy->expected_response_time - proxy->expected_fake_response_time);
+        // 8. the forged answer came first, so this one is genuine.
+        if (ctx->forged) {
+            *observed = VERDICT_FOREIGN;
+            STAT_ADD(server_ctx->stats.answers[ANSWER_AFTER_FORGED], 1);
+            return 1;
+        }
+
+        // 9. for external ip. calc result confidence.
+        double confidence = proxy_confidence(proxy, response_time);
 
         // if we are confident enough.
-        if (confidence > 0.8) {
+        if (confidence >= 1.0) {
+            *observed = VERDICT_FOREIGN;
+            STAT_ADD(ctx->server_ctx->stats.answers[ANSWER_CONFIDENT], 1);
             return 1;
         }
 
         // else update the max confident response in case of timeout.
-        if (confidence > ctx->max_confidence) {
+        if (confidence > ctx->max_confidence && len <= DNS_PACKET_SIZE) {
             ctx->max_confidence = confidence;
-            if (ctx->confident_response != NULL) {
-                xfree(ctx->confident_response);
+            if (ctx->confident_response == NULL) {
+                ctx->confident_response = pool_alloc(&ctx->server_ctx->packet_pool);
             }
-            ctx->confident_response = xmalloc(len);
             memcpy(ctx->confident_response, response, len);
             ctx->confident_response_len = len;
         }
         break;
     }
+    if (rv < 0) {
+        log_error("error in parse resource record.");
+    }
 
     return 0;
 
-}
\ No newline at end of file
+}
+
+// where the first A or AAAA record of an answer points, an answer without one tells nothing.
+static verdict_t answer_verdict(session_ctx_t *ctx, char *response, ssize_t len) {
+    dns_msg_t msg;
+    dns_rr_iter_t iter;
+    dns_rr_t rr;
+    verdict_t verdict;
+
+    if (dns_msg_init(&msg, response, len)) {
+        return VERDICT_UNKNOWN;
+    }
+    dns_rr_iter_init(&iter, &msg);
+    while (dns_rr_next(&iter, &rr) > 0 && rr.section == ns_s_an) {
+        if ((verdict = address_verdict(ctx, &rr)) != VERDICT_UNKNOWN) {
+            return verdict;
+        }
+    }
+    return VERDICT_UNKNOWN;
+}
+
+// whether an A or AAAA record points into the subnet list, VERDICT_UNKNOWN for any other record.
+static verdict_t address_verdict(session_ctx_t *ctx, const dns_rr_t *rr) {
+    subnet_list_t *list = ctx->generation->snapshot->list;
+    struct in_addr addr;
+    struct in6_addr addr6;
+
+    if (rr->type == ns_t_a && rr->rdlength == NS_INADDRSZ) {
+        memcpy(&addr, rr->rdata, sizeof(addr));
+        return ip_in_subnet_list(list, &addr) ? VERDICT_INTERNAL : VERDICT_FOREIGN;
+    }
+    if (rr->type == ns_t_aaaa && rr->rdlength == NS_IN6ADDRSZ) {
+        memcpy(&addr6, rr->rdata, sizeof(addr6));
+        return ip6_in_subnet_list(list, &addr6) ? VERDICT_INTERNAL : VERDICT_FOREIGN;
+    }
+    return VERDICT_UNKNOWN;
+}
+
+// whether a record address_verdict placed points to a known forged address.
+static bool address_forged(session_ctx_t *ctx, const dns_rr_t *rr) {
+    poison_set_t *poison = ctx->generation->snapshot->poison;
+    struct in_addr addr;
+    struct in6_addr addr6;
+
+    if (rr->type == ns_t_a) {
+        memcpy(&addr, rr->rdata, sizeof(addr));
+        return ip_in_poison_set(poison, &addr);
+    }
+    memcpy(&addr6, rr->rdata, sizeof(addr6));
+    return ip6_in_poison_set(poison, &addr6);
+}
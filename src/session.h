@@ -3,7 +3,12 @@
 
 #include "common.h"
 
-void session_setup(server_ctx_t * server_ctx, const struct sockaddr * client_addr, char * data, ssize_t len,
-                   upstream_proxy_t * proxys, int proxy_count, int query_timeout);
+/*
+ * Resolve the query for client_addr with the worker's current generation, answering on conn when the
+ * client asked over tcp. Without a client the session only refreshes the cache, it is skipped when the
+ * same question is already being resolved.
+ */
+void session_setup(server_ctx_t * server_ctx, const struct sockaddr * client_addr, client_conn_t * conn, char * data,
+                   ssize_t len);
 
 #endif //GDNS_SESSION_H
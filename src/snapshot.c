@@ -0,0 +1,142 @@
+#include <string.h>
+#include "snapshot.h"
+#include "config.h"
+#include "iputility.h"
+#include "rules.h"
+#include "upstream.h"
+#include "stats.h"
+#include "poison.h"
+
+static int load_rules(server_cfg_t *cfg, rules_t *rules);
+
+static void generation_free(generation_t *generation);
+
+snapshot_t *snapshot_load(server_cfg_t *cfg) {
+    snapshot_t *snapshot = TMALLOC(snapshot_t);
+
+    snapshot->cfg = cfg;
+    snapshot->list = TMALLOC(subnet_list_t);
+    snapshot->rules = TMALLOC(rules_t);
+    snapshot->poison = TMALLOC(poison_set_t);
+    snapshot->refs = 1;
+    rules_init(snapshot->rules);
+    memset(snapshot->poison, 0, sizeof(poison_set_t));
+    if (subnet_list_init(cfg->subnet_file_path, snapshot->list)) {
+        log_error("parse subnet file failed!");
+        snapshot_release(snapshot);
+        return NULL;
+    }
+    if (load_rules(cfg, snapshot->rules) ||
+        poison_init(snapshot->poison, cfg->poison_addresses, cfg->poison_addresses_len, cfg->poison_learn)) {
+        snapshot_release(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void snapshot_retain(snapshot_t *snapshot) {
+    __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+}
+
+void snapshot_release(snapshot_t *snapshot) {
+    if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    subnet_list_free(snapshot->list);
+    rules_free(snapshot->rules);
+    poison_free(snapshot->poison);
+    free_server_cfg(snapshot->cfg);
+    xfree(snapshot->list);
+    xfree(snapshot->rules);
+    xfree(snapshot->poison);
+    xfree(snapshot);
+}
+
+generation_t *generation_create(uv_loop_t *loop, snapshot_t *snapshot) {
+    generation_t *generation = TMALLOC(generation_t);
+
+    if ((generation->upstreams = upstreams_init(loop, snapshot->cfg)) == NULL) {
+        log_error("init upstream sockets failed!");
+        xfree(generation);
+        return NULL;
+    }
+    snapshot_retain(snapshot);
+    generation->snapshot = snapshot;
+    generation->proxy_stats = NULL;
+    generation->users = 0;
+    generation->next_retired = NULL;
+    return generation;
+}
+
+void generation_swap(server_ctx_t *ctx, generation_t *generation) {
+    generation_t *replaced = ctx->generation;
+    server_cfg_t *cfg = generation->snapshot->cfg;
+
+    generation->proxy_stats = stats_swap(ctx, cfg);
+    ctx->generation = generation;
+    ctx->cfg = cfg;
+    ctx->cache.prefetch_hits = cfg->prefetch_hits;
+    ctx->cache.prefetch_window = cfg->prefetch_window;
+    ctx->cache.negative_ttl = cfg->negative_ttl;
+    ctx->cache.failure_ttl = cfg->failure_ttl;
+
+    if (replaced->users == 0) {
+        generation_free(replaced);
+        return;
+    }
+    replaced->next_retired = ctx->retired;
+    ctx->retired = replaced;
+}
+
+void generation_release(server_ctx_t *ctx, generation_t *generation) {
+    generation_t **link;
+
+    if (--generation->users > 0 || generation == ctx->generation) {
+        return;
+    }
+    for (link = &ctx->retired; *link; link = &(*link)->next_retired) {
+        if (*link == generation) {
+            *link = generation->next_retired;
+            generation_free(generation);
+            return;
+        }
+    }
+}
+
+void generations_close(server_ctx_t *ctx) {
+    generation_t *generation;
+
+    while ((generation = ctx->retired)) {
+        ctx->retired = generation->next_retired;
+        generation_free(generation);
+    }
+    // the current counters are freed with the rest of ctx->stats.
+    ctx->generation->proxy_stats = NULL;
+    generation_free(ctx->generation);
+    ctx->generation = NULL;
+}
+
+static int load_rules(server_cfg_t *cfg, rules_t *rules) {
+    int i;
+
+    for (i = 0; i < cfg->domestic_rule_files_len; ++i) {
+        if (rules_load(rules, cfg->domestic_rule_files[i], VERDICT_INTERNAL)) {
+            return 1;
+        }
+    }
+    for (i = 0; i < cfg->blocked_rule_files_len; ++i) {
+        if (rules_load(rules, cfg->blocked_rule_files[i], VERDICT_FOREIGN)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void generation_free(generation_t *generation) {
+    upstreams_close(generation->upstreams, generation->snapshot->cfg->proxies_count);
+    if (generation->proxy_stats) {
+        xfree(generation->proxy_stats);
+    }
+    snapshot_release(generation->snapshot);
+    xfree(generation);
+}
@@ -0,0 +1,39 @@
+#ifndef GDNS_SNAPSHOT_H
+#define GDNS_SNAPSHOT_H
+
+#include "common.h"
+
+/*
+ * The subnet list and rules cfg names, with one reference for the caller. The snapshot owns cfg, it is
+ * freed along when loading fails and NULL is returned.
+ */
+snapshot_t *snapshot_load(server_cfg_t *cfg);
+
+void snapshot_retain(snapshot_t *snapshot);
+
+/*
+ * Drop a reference from any thread, the last one frees the snapshot.
+ */
+void snapshot_release(snapshot_t *snapshot);
+
+/*
+ * Sockets on loop to the proxies of snapshot, holding a reference to it. Returns NULL on failure.
+ */
+generation_t *generation_create(uv_loop_t *loop, snapshot_t *snapshot);
+
+/*
+ * Start new sessions of ctx's worker on generation. The replaced one is freed once no session pins it.
+ */
+void generation_swap(server_ctx_t *ctx, generation_t *generation);
+
+/*
+ * Unpin generation, a session that started on it is done.
+ */
+void generation_release(server_ctx_t *ctx, generation_t *generation);
+
+/*
+ * Free the worker's generations, the current one and those still pinned.
+ */
+void generations_close(server_ctx_t *ctx);
+
+#endif //GDNS_SNAPSHOT_H
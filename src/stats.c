@@ -0,0 +1,356 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+#include "histogram.h"
+#include "proxy.h"
+
+#define STATS_REQUEST_SIZE 1024
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} text_t;
+
+typedef struct {
+    uv_write_t req;
+    uv_buf_t buf;
+} stats_write_t;
+
+static const char *answer_paths[ANSWER_PATHS] = {"tcp", "empty", "non_a", "in_subnet", "confident", "rule",
+                                                 "after_forged", "failed", "timeout_fallback", "dropped"};
+
+static const int64_t latency_bounds[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+
+static uv_once_t registry_once = UV_ONCE_INIT;
+static uv_mutex_t registry_lock;
+static server_ctx_t **registry = NULL;
+static int registry_count = 0;
+static int registry_capacity = 0;
+
+static void registry_init(void);
+
+static void append(text_t *text, const char *fmt, ...);
+
+static void render_counter(text_t *text, const char *name, const char *help, uint64_t value);
+
+static void render_proxies(text_t *text, server_cfg_t *cfg);
+
+static void proxy_labels(upstream_proxy_t *proxy, char *labels, size_t size);
+
+static void on_stats_connection(uv_stream_t *server, int status);
+
+static void stats_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+
+static void on_stats_request(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+static void on_stats_written(uv_write_t *req, int status);
+
+static void on_stats_client_close(uv_handle_t *handle);
+
+void stats_init(server_ctx_t *ctx) {
+    int count = ctx->cfg->proxies_count;
+
+    memset(&ctx->stats, 0, sizeof(server_stats_t));
+    ctx->stats.proxies = xmalloc(sizeof(proxy_stats_t) * (count > 0 ? count : 1));
+    memset(ctx->stats.proxies, 0, sizeof(proxy_stats_t) * count);
+    ctx->stats.proxies_cfg = ctx->cfg;
+    ctx->stats_listener = NULL;
+
+    uv_once(&registry_once, registry_init);
+    uv_mutex_lock(&registry_lock);
+    if (registry_count == registry_capacity) {
+        registry_capacity = registry_capacity ? registry_capacity * 2 : 8;
+        registry = xrealloc(registry, sizeof(server_ctx_t *) * registry_capacity);
+    }
+    registry[registry_count++] = ctx;
+    uv_mutex_unlock(&registry_lock);
+}
+
+void stats_free(server_ctx_t *ctx) {
+    int i;
+
+    uv_mutex_lock(&registry_lock);
+    for (i = 0; i < registry_count; ++i) {
+        if (registry[i] == ctx) {
+            registry[i] = registry[--registry_count];
+            break;
+        }
+    }
+    uv_mutex_unlock(&registry_lock);
+    xfree(ctx->stats.proxies);
+    ctx->stats.proxies = NULL;
+}
+
+proxy_stats_t *stats_swap(server_ctx_t *ctx, server_cfg_t *cfg) {
+    server_cfg_t *running = ctx->stats.proxies_cfg;
+    int count = cfg->proxies_count;
+    proxy_stats_t *proxies = xmalloc(sizeof(proxy_stats_t) * (count > 0 ? count : 1));
+    int i, j;
+
+    memset(proxies, 0, sizeof(proxy_stats_t) * count);
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < running->proxies_count; ++j) {
+            if (proxy_same(&cfg->proxies[i], &running->proxies[j])) {
+                memcpy(&proxies[i], &ctx->stats.proxies[j], sizeof(proxy_stats_t));
+                break;
+            }
+        }
+    }
+
+    uv_mutex_lock(&registry_lock);
+    ctx->stats.proxies = proxies;
+    ctx->stats.proxies_cfg = cfg;
+    uv_mutex_unlock(&registry_lock);
+    return proxies;
+}
+
+int stats_listen(server_ctx_t *ctx) {
+    uv_loop_t *loop = ctx->handle->loop;
+    int rv;
+
+    ctx->stats_listener = TMALLOC(uv_tcp_t);
+    uv_tcp_init(loop, ctx->stats_listener);
+    if ((rv = uv_tcp_bind(ctx->stats_listener, ctx->cfg->stats_address, 0)) != 0 ||
+        (rv = uv_listen((uv_stream_t *) ctx->stats_listener, 16, on_stats_connection)) != 0) {
+        log_error("stats endpoint failed! %s", uv_strerror(rv));
+        return 1;
+    }
+    // the endpoint alone does not keep the server running.
+    uv_unref((uv_handle_t *) ctx->stats_listener);
+    return 0;
+}
+
+void stats_close(server_ctx_t *ctx) {
+    if (ctx->stats_listener) {
+        uv_close((uv_handle_t *) ctx->stats_listener, on_stats_client_close);
+        ctx->stats_listener = NULL;
+    }
+}
+
+char *stats_render(server_cfg_t *cfg, size_t *len) {
+    text_t text = {NULL, 0, 0};
+    uint64_t queries = 0, forged = 0, hits = 0, misses = 0, prefetches = 0, coalesced = 0;
+    uint64_t answers[ANSWER_PATHS] = {0};
+    int64_t in_flight = 0, entries = 0, clients = 0;
+    int i, j;
+
+    uv_once(&registry_once, registry_init);
+    uv_mutex_lock(&registry_lock);
+    for (i = 0; i < registry_count; ++i) {
+        server_ctx_t *ctx = registry[i];
+        queries += STAT_READ(ctx->stats.queries);
+        for (j = 0; j < ANSWER_PATHS; ++j) {
+            answers[j] += STAT_READ(ctx->stats.answers[j]);
+        }
+        forged += STAT_READ(ctx->stats.forged);
+        hits += STAT_READ(ctx->cache.hits);
+        misses += STAT_READ(ctx->cache.misses);
+        prefetches += STAT_READ(ctx->cache.prefetches);
+        entries += STAT_READ(ctx->cache.size);
+        coalesced += STAT_READ(ctx->coalesced);
+        in_flight += STAT_READ(ctx->session_pool.in_use);
+        clients += STAT_READ(ctx->client_count);
+    }
+
+    render_counter(&text, "gdns_queries_total", "Client queries received.", queries);
+    append(&text, "# HELP gdns_answers_total Sessions by the way their answer was chosen.\n"
+                  "# TYPE gdns_answers_total counter\n");
+    for (j = 0; j < ANSWER_PATHS; ++j) {
+        append(&text, "gdns_answers_total{path=\"%s\"} %lu\n", answer_paths[j], (unsigned long) answers[j]);
+    }
+    render_counter(&text, "gdns_forged_answers_total", "Proxy answers dropped for a known forged address.", forged);
+    append(&text, "# HELP gdns_sessions_in_flight Sessions waiting for proxies.\n"
+                  "# TYPE gdns_sessions_in_flight gauge\ngdns_sessions_in_flight %ld\n", (long) in_flight);
+    render_counter(&text, "gdns_cache_hits_total", "Queries answered from the cache.", hits);
+    render_counter(&text, "gdns_cache_misses_total", "Cache lookups without a usable answer.", misses);
+    render_counter(&text, "gdns_cache_prefetches_total", "Hot cache entries refreshed ahead.", prefetches);
+    append(&text, "# HELP gdns_cache_entries Answers in the cache.\n"
+                  "# TYPE gdns_cache_entries gauge\ngdns_cache_entries %ld\n", (long) entries);
+    render_counter(&text, "gdns_coalesced_total", "Queries answered by a session started for another client.",
+                   coalesced);
+    append(&text, "# HELP gdns_tcp_clients Open tcp client connections.\n"
+                  "# TYPE gdns_tcp_clients gauge\ngdns_tcp_clients %ld\n", (long) clients);
+    render_counter(&text, "gdns_log_dropped_total", "Log lines lost to a full log ring.", log_dropped());
+    render_proxies(&text, cfg);
+    uv_mutex_unlock(&registry_lock);
+
+    *len = text.len;
+    return text.data;
+}
+
+static void registry_init(void) {
+    uv_mutex_init(&registry_lock);
+}
+
+static void append(text_t *text, const char *fmt, ...) {
+    va_list args;
+    int n;
+
+    for (;;) {
+        size_t room = text->capacity - text->len;
+        va_start(args, fmt);
+        n = vsnprintf(text->data ? text->data + text->len : NULL, room, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t) n < room) {
+            text->len += (size_t) n;
+            return;
+        }
+        text->capacity = text->capacity ? text->capacity * 2 : 4096;
+        if (text->capacity < text->len + (size_t) n + 1) {
+            text->capacity = text->len + (size_t) n + 1;
+        }
+        text->data = xrealloc(text->data, text->capacity);
+    }
+}
+
+static void render_counter(text_t *text, const char *name, const char *help, uint64_t value) {
+    append(text, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, (unsigned long) value);
+}
+
+static void render_proxies(text_t *text, server_cfg_t *cfg) {
+    static const char *names[] = {"gdns_proxy_queries_total", "gdns_proxy_responses_total",
+                                  "gdns_proxy_errors_total", "gdns_proxy_timeouts_total"};
+    static const char *helps[] = {"Queries sent to the proxy.", "Responses of the proxy, a poisoned one answers twice.",
+                                  "Queries that failed to send or connect.",
+                                  "Queries still unanswered when their session ended."};
+    static const size_t offsets[] = {offsetof(proxy_stats_t, queries), offsetof(proxy_stats_t, responses),
+                                     offsetof(proxy_stats_t, errors), offsetof(proxy_stats_t, timeouts)};
+    char labels[128];
+    uint64_t value;
+    int64_t sum;
+    int metric, p, i, b;
+
+    for (metric = 0; metric < 4; ++metric) {
+        append(text, "# HELP %s %s\n# TYPE %s counter\n", names[metric], helps[metric], names[metric]);
+        for (p = 0; p < cfg->proxies_count; ++p) {
+            proxy_labels(&cfg->proxies[p], labels, sizeof(labels));
+            value = 0;
+            for (i = 0; i < registry_count; ++i) {
+                if (registry[i]->stats.proxies_cfg != cfg) { // the worker is still on another snapshot.
+                    continue;
+                }
+                uint64_t *counter = (uint64_t *) ((char *) &registry[i]->stats.proxies[p] + offsets[metric]);
+                value += STAT_READ(*counter);
+            }
+            append(text, "%s{%s} %lu\n", names[metric], labels, (unsigned long) value);
+        }
+    }
+
+    append(text, "# HELP gdns_proxy_latency_ms Time to the first response of the proxy.\n"
+                 "# TYPE gdns_proxy_latency_ms histogram\n");
+    for (p = 0; p < cfg->proxies_count; ++p) {
+        proxy_labels(&cfg->proxies[p], labels, sizeof(labels));
+        for (b = 0; b < (int) (sizeof(latency_bounds) / sizeof(latency_bounds[0])); ++b) {
+            value = 0;
+            for (i = 0; i < registry_count; ++i) {
+                if (registry[i]->stats.proxies_cfg != cfg) {
+                    continue;
+                }
+                value += histogram_count_below(&registry[i]->stats.proxies[p].latency, latency_bounds[b]);
+            }
+            append(text, "gdns_proxy_latency_ms_bucket{%s,le=\"%ld\"} %lu\n", labels, (long) latency_bounds[b],
+                   (unsigned long) value);
+        }
+        value = 0;
+        sum = 0;
+        for (i = 0; i < registry_count; ++i) {
+            if (registry[i]->stats.proxies_cfg != cfg) {
+                continue;
+            }
+            value += STAT_READ(registry[i]->stats.proxies[p].latency.total);
+            sum += STAT_READ(registry[i]->stats.proxies[p].latency.sum);
+        }
+        append(text, "gdns_proxy_latency_ms_bucket{%s,le=\"+Inf\"} %lu\n", labels, (unsigned long) value);
+        append(text, "gdns_proxy_latency_ms_sum{%s} %ld\n", labels, (long) sum);
+        append(text, "gdns_proxy_latency_ms_count{%s} %lu\n", labels, (unsigned long) value);
+    }
+}
+
+static void proxy_labels(upstream_proxy_t *proxy, char *labels, size_t size) {
+    char ip[INET6_ADDRSTRLEN] = "";
+    int port;
+
+    if (proxy->addr->sa_family == AF_INET6) {
+        uv_ip6_name((struct sockaddr_in6 *) proxy->addr, ip, sizeof(ip));
+        port = ntohs(((struct sockaddr_in6 *) proxy->addr)->sin6_port);
+    } else {
+        uv_ip4_name((struct sockaddr_in *) proxy->addr, ip, sizeof(ip));
+        port = ntohs(((struct sockaddr_in *) proxy->addr)->sin_port);
+    }
+    snprintf(labels, size, "proxy=\"%s:%d\",transport=\"%s\",kind=\"%s\"", ip, port, proxy->tcp ? "tcp" : "udp",
+             proxy->internal ? "internal" : "external");
+}
+
+static void on_stats_connection(uv_stream_t *server, int status) {
+    uv_tcp_t *client;
+
+    if (status != 0) {
+        log_error("stats endpoint accept failed! %s", uv_strerror(status));
+        return;
+    }
+    client = TMALLOC(uv_tcp_t);
+    uv_tcp_init(server->loop, client);
+    if (uv_accept(server, (uv_stream_t *) client) != 0) {
+        uv_close((uv_handle_t *) client, on_stats_client_close);
+        return;
+    }
+    uv_read_start((uv_stream_t *) client, stats_alloc_cb, on_stats_request);
+}
+
+static void stats_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = xmalloc(STATS_REQUEST_SIZE);
+    buf->len = STATS_REQUEST_SIZE;
+}
+
+static void on_stats_request(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    server_ctx_t *ctx = stream->loop->data;
+    stats_write_t *write;
+    char header[128];
+    char *body;
+    size_t body_len;
+    int header_len;
+
+    if (buf->base) {
+        xfree(buf->base);
+    }
+    if (nread == 0) {
+        return;
+    }
+    uv_read_stop(stream);
+    if (nread < 0) {
+        uv_close((uv_handle_t *) stream, on_stats_client_close);
+        return;
+    }
+
+    body = stats_render(ctx->cfg, &body_len);
+    header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                  "Content-Length: %lu\r\n\r\n", (unsigned long) body_len);
+    write = TMALLOC(stats_write_t);
+    write->buf = uv_buf_init(xmalloc((size_t) header_len + body_len), (unsigned int) (header_len + body_len));
+    memcpy(write->buf.base, header, (size_t) header_len);
+    memcpy(write->buf.base + header_len, body, body_len);
+    xfree(body);
+    if (uv_write(&write->req, stream, &write->buf, 1, on_stats_written) != 0) {
+        xfree(write->buf.base);
+        xfree(write);
+        uv_close((uv_handle_t *) stream, on_stats_client_close);
+    }
+}
+
+static void on_stats_written(uv_write_t *req, int status) {
+    stats_write_t *write = (stats_write_t *) req;
+
+    uv_close((uv_handle_t *) req->handle, on_stats_client_close);
+    xfree(write->buf.base);
+    xfree(write);
+}
+
+static void on_stats_client_close(uv_handle_t *handle) {
+    xfree(handle);
+}
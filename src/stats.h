@@ -0,0 +1,35 @@
+#ifndef GDNS_STATS_H
+#define GDNS_STATS_H
+
+#include "common.h"
+
+/*
+ * Every worker counts into its own server_stats_t, the endpoint sums the registered workers when it
+ * is asked. Nothing on the query path locks or allocates.
+ */
+
+void stats_init(server_ctx_t *ctx);
+
+void stats_free(server_ctx_t *ctx);
+
+/*
+ * Count into fresh counters for the proxies of cfg, which start from the totals of the same proxies
+ * so far. Returns them, the replaced ones stay with the sessions still counting into them.
+ */
+proxy_stats_t *stats_swap(server_ctx_t *ctx, server_cfg_t *cfg);
+
+/*
+ * Serve the counters on cfg->stats_address from ctx's loop. Any request, an http GET or a single line,
+ * is answered with the Prometheus text format and the connection is closed. Returns 0 on success.
+ */
+int stats_listen(server_ctx_t *ctx);
+
+void stats_close(server_ctx_t *ctx);
+
+/*
+ * The counters of every registered worker in the Prometheus text format, per proxy only those of the workers
+ * already serving cfg. The result is malloced.
+ */
+char *stats_render(server_cfg_t *cfg, size_t *len);
+
+#endif //GDNS_STATS_H
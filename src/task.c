@@ -1,5 +1,7 @@
 #include <string.h>
 #include "task.h"
+#include "upstream.h"
+#include "pool.h"
 
 static void run_udp_task(uv_loop_t *loop, query_task_t *task);
 
@@ -7,32 +9,31 @@ static void run_tcp_task(uv_loop_t *loop, query_task_t *task);
 
 static void on_send_udp_query(uv_udp_send_t *req, int status);
 
-static void bind_task_to_handle(query_task_t *task, uv_handle_t *handle);
-
-static query_task_t *get_task_from_handle(uv_handle_t *handle);
-
-static void on_recv_udp_response(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
-                                 const struct sockaddr *addr, unsigned flags);
-
 static void on_write_tcp_query(uv_write_t *req, int status);
 
-static void on_read_tcp_response(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+static void on_query_sent(query_task_t *task, int status);
 
 static int64_t time_diff(uint64_t start_time);
 
-static void on_close(uv_handle_t *handle);
+static void finish_close(query_task_t *task);
+
+void task_init(query_task_t *task, upstream_t *upstream, char *msg, ssize_t len) {
+    upstream_proxy_t *proxy = upstream->proxy;
 
-void task_init(query_task_t *task, upstream_proxy_t *proxy, char *msg, ssize_t len) {
     task->proxy = proxy;
+    task->upstream = upstream;
     task->start_time = 0;
+    task->pending = NULL;
+    task->next_pending = NULL;
+    task->sending = false;
+    task->closing = false;
+    task->close_cb = NULL;
     if (proxy->tcp) {
         // tcp request add 2 bytes data length in header.
-        task->msg = xmalloc(len + 2);
         *((uint16_t *) task->msg) = htons(len);
         memcpy(task->msg + 2, msg, len);
         task->msg_len = len + 2;
     } else {
-        task->msg = xmalloc(len);
         memcpy(task->msg, msg, len);
         task->msg_len = len;
     }
@@ -41,141 +42,108 @@ void task_init(query_task_t *task, upstream_proxy_t *proxy, char *msg, ssize_t l
 
 void task_run(uv_loop_t *loop, query_task_t *task, task_cb cb) {
     task->cb = cb;
+    task->loop = loop;
+    task->start_time = uv_hrtime();
+    task->state = TASK_RUNING;
     if (task->proxy->tcp) {
         run_tcp_task(loop, task);
     } else {
         run_udp_task(loop, task);
     }
-    task->start_time = uv_hrtime();
-    task->state = TASK_RUNING;
 }
 
 void task_close(query_task_t *task, task_close_cb close_cb) {
     task->close_cb = close_cb;
-    uv_close(task->handle, on_close);
+    task->closing = true;
+    upstream_detach(task);
+    if (!task->sending) { // else the query buffer is released once the send completes.
+        finish_close(task);
+    }
 }
 
-static void run_udp_task(uv_loop_t *loop, query_task_t *task) {
-    uv_udp_t *handle = TMALLOC(uv_udp_t);
-
-    uv_udp_init(loop, handle);
-    task->handle = (uv_handle_t *) handle;
-    bind_task_to_handle(task, task->handle);
+void task_response(query_task_t *task, char *response, ssize_t len) {
+    if (task->state == TASK_RUNING) {
+        task->state = TASK_DONE;
+    } else if (task->state == TASK_DONE || task->state == TASK_MULTI_RESULT) {
+        task->state = TASK_MULTI_RESULT;
+    } else {
+        UNREACHABLE();
+    }
+    task->cb(task, response, len, time_diff(task->start_time));
+}
 
-    send_req_t *req = TMALLOC(send_req_t);
-    req->buf = uv_buf_init(task->msg, (unsigned int) task->msg_len);
-    uv_udp_send((uv_udp_send_t *) req, handle, &req->buf, 1, task->proxy->addr, on_send_udp_query);
+void task_error(query_task_t *task) {
+    task->state = TASK_ERROR;
+    task->cb(task, NULL, 0, 0);
 }
 
-static void on_tcp_connect(uv_connect_t *req, int status) {
-    query_task_t *task = get_task_from_handle((uv_handle_t *) req->handle);
-    if (status != 0) {
-        log_error("Error when connecting to remote: %s", uv_strerror(status));
-        task->state = TASK_ERROR;
-        task->cb(task, NULL, 0, 0);
-    }
-    else {
-        write_req_t *write_req = TMALLOC(write_req_t);
-        write_req->buf = uv_buf_init(task->msg, (unsigned int) task->msg_len);
+static void run_udp_task(uv_loop_t *loop, query_task_t *task) {
+    uv_udp_t *handle = upstream_udp_attach(task->upstream, task);
+    send_req_t *req = pool_alloc(&((server_ctx_t *) loop->data)->req_pool);
+    int rv;
 
-        uv_write((uv_write_t *) write_req, req->handle, &write_req->buf, 1, on_write_tcp_query);
+    req->buf = uv_buf_init(task->msg, (unsigned int) task->msg_len);
+    req->req.data = task;
+    if ((rv = uv_udp_send((uv_udp_send_t *) req, handle, &req->buf, 1, NULL, on_send_udp_query)) != 0) {
+        log_error("Error on forward udp query: %s", uv_strerror(rv));
+        pool_free(&((server_ctx_t *) loop->data)->req_pool, req);
+        upstream_detach(task);
+        task->state = TASK_ERROR;
+    } else {
+        task->sending = true;
     }
-    xfree(req);
 }
 
 static void run_tcp_task(uv_loop_t *loop, query_task_t *task) {
-    uv_tcp_t *handle = TMALLOC(uv_tcp_t);
-
-    uv_tcp_init(loop, handle);
-    task->handle = (uv_handle_t *) handle;
-    bind_task_to_handle(task, task->handle);
-
-    uv_connect_t *req = TMALLOC(uv_connect_t);
-    uv_tcp_connect(req, handle, task->proxy->addr, on_tcp_connect);
-}
-
-static void bind_task_to_handle(query_task_t *task, uv_handle_t *handle) {
-    handle->data = task;
-}
-
-static query_task_t *get_task_from_handle(uv_handle_t *handle) {
-    return (query_task_t *) handle->data;
-}
+    uv_stream_t *stream = upstream_tcp_attach(task->upstream, loop, task);
+    write_req_t *req;
+    int rv;
 
+    if (stream == NULL) {
+        task->state = TASK_ERROR;
+        return;
+    }
 
-static void on_send_udp_query(uv_udp_send_t *req, int status) {
-    query_task_t *task = get_task_from_handle((uv_handle_t *) req->handle);
-    if (status != 0) {
-        log_error("Error on forward udp query: %s", uv_strerror(status));
+    req = pool_alloc(&((server_ctx_t *) loop->data)->req_pool);
+    req->buf = uv_buf_init(task->msg, (unsigned int) task->msg_len);
+    req->req.data = task;
+    if ((rv = uv_write((uv_write_t *) req, stream, &req->buf, 1, on_write_tcp_query)) != 0) {
+        log_error("Error on forward tcp query: %s", uv_strerror(rv));
+        pool_free(&((server_ctx_t *) loop->data)->req_pool, req);
+        upstream_detach(task);
         task->state = TASK_ERROR;
-        task->cb(task, NULL, 0, 0);
     } else {
-        uv_udp_recv_start(req->handle, alloc_cb, on_recv_udp_response);
+        task->sending = true;
     }
-    xfree(req);
 }
 
-static void on_recv_udp_response(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
-                                 const struct sockaddr *addr, unsigned flags) {
-    query_task_t *task = get_task_from_handle((uv_handle_t *) handle);
-    if (nread < 0) {
-        log_error("Error on read udp proxy response: %s", uv_strerror((int) nread));
-        task->state = TASK_ERROR;
-        task->cb(task, NULL, 0, 0);
-    } else if (nread > 0) {
-        if (task->state == TASK_RUNING) {
-            task->state = TASK_DONE;
-        } else if (task->state == TASK_DONE || task->state == TASK_MULTI_RESULT) {
-            task->state = TASK_MULTI_RESULT;
-        } else {
-            UNREACHABLE();
-        }
-        task->cb(task, buf->base, nread, time_diff(task->start_time));
+static void on_send_udp_query(uv_udp_send_t *req, int status) {
+    if (status != 0 && status != UV_ECANCELED) {
+        log_error("Error on forward udp query: %s", uv_strerror(status));
     }
-
-    if (buf->base)
-        xfree(buf->base);
+    on_query_sent(req->data, status);
+    pool_free(&((server_ctx_t *) req->handle->loop->data)->req_pool, req);
 }
 
 static void on_write_tcp_query(uv_write_t *req, int status) {
-    query_task_t *task = get_task_from_handle((uv_handle_t *) req->handle);
-    if (status != 0) {
+    if (status != 0 && status != UV_ECANCELED) {
         log_error("Error on forward tcp query: %s", uv_strerror(status));
-        task->state = TASK_ERROR;
-        task->cb(task, NULL, 0, 0);
-    } else {
-        uv_read_start(req->handle, alloc_cb, on_read_tcp_response);
     }
-    xfree(req);
+    on_query_sent(req->data, status);
+    pool_free(&((server_ctx_t *) req->handle->loop->data)->req_pool, req);
 }
 
-static void on_read_tcp_response(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
-    query_task_t *task = get_task_from_handle((uv_handle_t *) stream);
-    if (nread < 0) {
-        log_error("Error on read tcp proxy response: %s", uv_strerror((int) nread));
-        task->state = TASK_ERROR;
-        task->cb(task, NULL, 0, 0);
-    } else if (nread > 0) {
-        if (task->state == TASK_RUNING) {
-            task->state = TASK_DONE;
-        } else if (task->state == TASK_DONE || task->state == TASK_MULTI_RESULT) {
-            task->state = TASK_MULTI_RESULT;
-        } else {
-            UNREACHABLE();
-        }
-        task->cb(task, buf->base + 2, nread - 2,
-                 time_diff(task->start_time)); // tcp response add 2 bytes data length in header.
-        uv_read_stop(stream);
+static void on_query_sent(query_task_t *task, int status) {
+    task->sending = false;
+    if (task->closing) {
+        finish_close(task);
+    } else if (status != 0 && task->state == TASK_RUNING) {
+        upstream_detach(task);
+        task_error(task);
     }
-
-    if (buf->base)
-        xfree(buf->base);
 }
 
-static void on_close(uv_handle_t *handle) {
-    query_task_t *task = get_task_from_handle(handle);
-    xfree(handle);
-    xfree(task->msg);
+static void finish_close(query_task_t *task) {
     if (task->close_cb) {
         task->close_cb(task);
     }
@@ -183,4 +151,4 @@ static void on_close(uv_handle_t *handle) {
 
 static int64_t time_diff(uint64_t start_time) {
     return (int64_t) ((uv_hrtime() - start_time) / 1e6);
-}
\ No newline at end of file
+}
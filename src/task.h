@@ -3,10 +3,20 @@
 
 #include "common.h"
 
-void task_init(query_task_t *task, upstream_proxy_t *proxy, char *msg, ssize_t len);
+/*
+ * A query to upstream->proxy, sent through the upstream's sockets or connections.
+ */
+void task_init(query_task_t *task, upstream_t *upstream, char *msg, ssize_t len);
 
 void task_run(uv_loop_t *loop, query_task_t *task, task_cb cb);
 
 void task_close(query_task_t *task, task_close_cb close_cb);
 
+/*
+ * Transport callbacks, deliver a proxy response or a failure to the task.
+ */
+void task_response(query_task_t *task, char *response, ssize_t len);
+
+void task_error(query_task_t *task);
+
 #endif //GDNS_PROXY_H
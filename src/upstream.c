@@ -0,0 +1,440 @@
+#include <string.h>
+#include <stddef.h>
+#include <arpa/nameser.h>
+#include "upstream.h"
+#include "task.h"
+#include "pool.h"
+#include "dns.h"
+#include "wheel.h"
+
+// open another connection once every connection has this many queries outstanding.
+#define TCP_PIPELINE_DEPTH 16
+#define TCP_READ_SIZE 4096
+/*
+ * A udp socket is replaced after this many queries. The kernel picks the new one's source port at random,
+ * so a spoofer that learned the ports of the pool has to learn them again.
+ */
+#define UDP_SOCKET_QUERIES 1024
+
+static void on_recv_udp_response(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
+                                 const struct sockaddr *addr, unsigned flags);
+
+static upstream_socket_t *socket_open(upstream_t *upstream, uv_loop_t *loop);
+
+static void socket_retire(upstream_socket_t *sock);
+
+static void pending_add(upstream_pending_t *pending, query_task_t *task, int id_offset);
+
+static query_task_t *find_pending(upstream_pending_t *pending, uint16_t id);
+
+static void dispatch_response(upstream_pending_t *pending, char *response, ssize_t len);
+
+static upstream_conn_t *conn_open(upstream_t *upstream, uv_loop_t *loop);
+
+static void conn_close(upstream_conn_t *conn);
+
+static void on_tcp_connect(uv_connect_t *req, int status);
+
+static void conn_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+
+static void on_read_tcp_response(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+static void on_idle_timeout(wheel_timer_t *timer);
+
+static void on_conn_handle_close(uv_handle_t *handle);
+
+static void on_socket_close(uv_handle_t *handle);
+
+upstream_t *upstreams_init(uv_loop_t *loop, server_cfg_t *cfg) {
+    int socket_count = cfg->upstream_sockets > 0 ? cfg->upstream_sockets : 1;
+    int conn_count = cfg->tcp_connections > 0 ? cfg->tcp_connections : 1;
+    upstream_t *upstreams = xmalloc(sizeof(upstream_t) * cfg->proxies_count);
+    int i, j;
+
+    for (i = 0; i < cfg->proxies_count; ++i) {
+        upstream_t *upstream = &upstreams[i];
+        upstream->proxy = &cfg->proxies[i];
+        upstream->socket_count = 0;
+        upstream->sockets = NULL;
+        upstream->retired = NULL;
+        upstream->conn_count = 0;
+        upstream->conns = NULL;
+        upstream->tcp_failures = 0;
+        upstream->tcp_retry_time = 0;
+    }
+
+    for (i = 0; i < cfg->proxies_count; ++i) {
+        upstream_t *upstream = &upstreams[i];
+
+        if (upstream->proxy->tcp) { // connections are opened on demand.
+            upstream->conns = xmalloc(sizeof(upstream_conn_t *) * conn_count);
+            continue;
+        }
+
+        upstream->sockets = xmalloc(sizeof(upstream_socket_t *) * socket_count);
+
+        for (j = 0; j < socket_count; ++j) {
+            if ((upstream->sockets[j] = socket_open(upstream, loop)) == NULL) {
+                log_error("connect to udp proxy[%d] failed.", i);
+                upstreams_close(upstreams, cfg->proxies_count);
+                return NULL;
+            }
+            upstream->socket_count += 1;
+        }
+    }
+    return upstreams;
+}
+
+void upstreams_close(upstream_t *upstreams, int count) {
+    int i, j;
+
+    for (i = 0; i < count; ++i) {
+        upstream_t *upstream = &upstreams[i];
+        for (j = 0; j < upstream->socket_count; ++j) {
+            uv_close((uv_handle_t *) &upstream->sockets[j]->handle, on_socket_close);
+        }
+        while (upstream->retired) {
+            upstream_socket_t *sock = upstream->retired;
+            upstream->retired = sock->next_retired;
+            uv_close((uv_handle_t *) &sock->handle, on_socket_close);
+        }
+        while (upstream->conn_count > 0) {
+            conn_close(upstream->conns[0]);
+        }
+        if (upstream->sockets) {
+            xfree(upstream->sockets);
+        }
+        if (upstream->conns) {
+            xfree(upstream->conns);
+        }
+    }
+    xfree(upstreams);
+}
+
+uv_udp_t *upstream_udp_attach(upstream_t *upstream, query_task_t *task) {
+    int slot = (int) (xrandom() % (uint32_t) upstream->socket_count);
+    upstream_socket_t *sock = upstream->sockets[slot];
+    upstream_socket_t *fresh;
+
+    // when no socket can be opened the worn one goes on, the next query tries again.
+    if (sock->queries >= UDP_SOCKET_QUERIES && (fresh = socket_open(upstream, sock->handle.loop)) != NULL) {
+        socket_retire(sock);
+        upstream->sockets[slot] = fresh;
+        sock = fresh;
+    }
+    sock->queries += 1;
+    pending_add(&sock->pending, task, 0);
+    return &sock->handle;
+}
+
+uv_stream_t *upstream_tcp_attach(upstream_t *upstream, uv_loop_t *loop, query_task_t *task) {
+    server_cfg_t *cfg = ((server_ctx_t *) loop->data)->cfg;
+    upstream_conn_t *conn = NULL;
+    int max_conns = cfg->tcp_connections > 0 ? cfg->tcp_connections : 1;
+    int i;
+
+    for (i = 0; i < upstream->conn_count; ++i) {
+        if (conn == NULL || upstream->conns[i]->pending.count < conn->pending.count) {
+            conn = upstream->conns[i];
+        }
+    }
+
+    if ((conn == NULL || conn->pending.count >= TCP_PIPELINE_DEPTH) && upstream->conn_count < max_conns &&
+        uv_now(loop) >= upstream->tcp_retry_time) {
+        upstream_conn_t *fresh = conn_open(upstream, loop);
+        if (fresh) {
+            conn = fresh;
+        }
+    }
+    if (conn == NULL) { // the proxy is unreachable, back off.
+        return NULL;
+    }
+
+    if (conn->pending.count == 0) {
+        wheel_timer_stop(&conn->idle_timer);
+    }
+    pending_add(&conn->pending, task, 2); // skip the 2 bytes length prefix.
+    return (uv_stream_t *) &conn->handle;
+}
+
+void upstream_detach(query_task_t *task) {
+    upstream_pending_t *pending = task->pending;
+    query_task_t **link;
+
+    if (pending == NULL) {
+        return;
+    }
+    for (link = &pending->buckets[task->query_id % UPSTREAM_PENDING_BUCKETS]; *link; link = &(*link)->next_pending) {
+        if (*link == task) {
+            *link = task->next_pending;
+            pending->count -= 1;
+            break;
+        }
+    }
+    task->pending = NULL;
+    task->next_pending = NULL;
+
+    if (!task->proxy->tcp && pending->count == 0) {
+        upstream_socket_t *sock = (upstream_socket_t *) ((char *) pending - offsetof(upstream_socket_t, pending));
+        upstream_socket_t **retired = &sock->upstream->retired;
+        if (sock->retired) {
+            while (*retired != sock) {
+                retired = &(*retired)->next_retired;
+            }
+            *retired = sock->next_retired;
+            uv_close((uv_handle_t *) &sock->handle, on_socket_close);
+        }
+    }
+    if (task->proxy->tcp && pending->count == 0) {
+        upstream_conn_t *conn = (upstream_conn_t *) ((char *) pending - offsetof(upstream_conn_t, pending));
+        server_ctx_t *ctx = conn->handle.loop->data;
+        if (conn->state == CONN_READY && ctx->cfg->tcp_idle_timeout > 0) {
+            wheel_timer_start(&ctx->wheel, &conn->idle_timer, on_idle_timeout,
+                              (uint64_t) ctx->cfg->tcp_idle_timeout);
+        }
+    }
+}
+
+// a udp socket connected to the upstream's proxy on a fresh ephemeral port, NULL on failure.
+static upstream_socket_t *socket_open(upstream_t *upstream, uv_loop_t *loop) {
+    upstream_socket_t *sock = TMALLOC(upstream_socket_t);
+    int rv;
+
+    memset(sock, 0, sizeof(upstream_socket_t));
+    sock->upstream = upstream;
+    uv_udp_init(loop, &sock->handle);
+    sock->handle.data = sock;
+    // a connected socket only accepts datagrams from the proxy itself.
+    if ((rv = uv_udp_connect(&sock->handle, upstream->proxy->addr)) != 0) {
+        log_error("connect udp socket failed: %s", uv_strerror(rv));
+        uv_close((uv_handle_t *) &sock->handle, on_socket_close);
+        return NULL;
+    }
+    uv_udp_recv_start(&sock->handle, packet_alloc_cb, on_recv_udp_response);
+    return sock;
+}
+
+// no query leaves from sock any more, it receives until the queries waiting on it are answered or gone.
+static void socket_retire(upstream_socket_t *sock) {
+    if (sock->pending.count == 0) {
+        uv_close((uv_handle_t *) &sock->handle, on_socket_close);
+        return;
+    }
+    sock->retired = true;
+    sock->next_retired = sock->upstream->retired;
+    sock->upstream->retired = sock;
+}
+
+static void pending_add(upstream_pending_t *pending, query_task_t *task, int id_offset) {
+    char *header = task->msg + id_offset;
+    uint16_t id;
+    int bucket;
+
+    do {
+        id = (uint16_t) xrandom();
+    } while (find_pending(pending, id));
+
+    memcpy(task->origin_id, header, 2);
+    dns_put16(id, (unsigned char *) header);
+    task->query_id = id;
+    task->pending = pending;
+
+    bucket = id % UPSTREAM_PENDING_BUCKETS;
+    task->next_pending = pending->buckets[bucket];
+    pending->buckets[bucket] = task;
+    pending->count += 1;
+}
+
+static query_task_t *find_pending(upstream_pending_t *pending, uint16_t id) {
+    query_task_t *task = pending->buckets[id % UPSTREAM_PENDING_BUCKETS];
+    while (task && task->query_id != id) {
+        task = task->next_pending;
+    }
+    return task;
+}
+
+static void dispatch_response(upstream_pending_t *pending, char *response, ssize_t len) {
+    query_task_t *task;
+    int prefix;
+
+    if (len < NS_HFIXEDSZ) {
+        return;
+    }
+    task = find_pending(pending, dns_get16((unsigned char *) response));
+    if (task == NULL) {
+        return;
+    }
+    prefix = task->proxy->tcp ? 2 : 0;
+    // the id alone is only 16 bits, a spoofed answer must also echo the question.
+    if (dns_same_question(task->msg + prefix, task->msg_len - prefix, response, len)) {
+        memcpy(response, task->origin_id, 2);
+        task_response(task, response, len);
+    }
+}
+
+static void on_recv_udp_response(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
+                                 const struct sockaddr *addr, unsigned flags) {
+    upstream_socket_t *sock = handle->data;
+
+    if (nread < 0) {
+        log_error("Error on read udp proxy response: %s", uv_strerror((int) nread));
+    } else if (flags & UV_UDP_PARTIAL) { // cut short by the buffer, it must not be taken or cached as whole.
+        log_warn("drop udp proxy response larger than %d bytes.", DNS_PACKET_SIZE);
+    } else if (nread > 0) {
+        dispatch_response(&sock->pending, buf->base, nread);
+    }
+
+    if (buf->base)
+        packet_free(handle->loop, buf->base);
+}
+
+static upstream_conn_t *conn_open(upstream_t *upstream, uv_loop_t *loop) {
+    upstream_conn_t *conn = TMALLOC(upstream_conn_t);
+    uv_connect_t *req = TMALLOC(uv_connect_t);
+    int rv;
+
+    memset(conn, 0, sizeof(upstream_conn_t));
+    conn->upstream = upstream;
+    conn->state = CONN_CONNECTING;
+    uv_tcp_init(loop, &conn->handle);
+    wheel_timer_init(&conn->idle_timer, conn);
+    conn->handle.data = conn;
+    upstream->conns[upstream->conn_count++] = conn;
+
+    // queries written meanwhile are flushed by libuv once connected.
+    req->data = conn;
+    if ((rv = uv_tcp_connect(req, &conn->handle, upstream->proxy->addr, on_tcp_connect)) != 0) {
+        log_error("Error when connecting to remote: %s", uv_strerror(rv));
+        xfree(req);
+        conn_close(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+static void on_tcp_connect(uv_connect_t *req, int status) {
+    upstream_conn_t *conn = req->data;
+    upstream_t *upstream = conn->upstream;
+    server_ctx_t *ctx;
+    server_cfg_t *cfg;
+
+    xfree(req);
+    if (conn->state == CONN_CLOSING) {
+        return;
+    }
+    ctx = conn->handle.loop->data;
+    cfg = ctx->cfg;
+
+    if (status != 0) {
+        int shift = upstream->tcp_failures < 16 ? upstream->tcp_failures : 16;
+        uint64_t backoff = (uint64_t) cfg->tcp_reconnect_min << shift;
+        if (backoff > (uint64_t) cfg->tcp_reconnect_max) {
+            backoff = (uint64_t) cfg->tcp_reconnect_max;
+        }
+        upstream->tcp_failures += 1;
+        upstream->tcp_retry_time = uv_now(conn->handle.loop) + backoff;
+        log_error("Error when connecting to remote: %s, retry in %lu ms", uv_strerror(status),
+                  (unsigned long) backoff);
+        conn_close(conn);
+        return;
+    }
+
+    upstream->tcp_failures = 0;
+    upstream->tcp_retry_time = 0;
+    conn->state = CONN_READY;
+    uv_read_start((uv_stream_t *) &conn->handle, conn_alloc_cb, on_read_tcp_response);
+    if (conn->pending.count == 0 && cfg->tcp_idle_timeout > 0) {
+        wheel_timer_start(&ctx->wheel, &conn->idle_timer, on_idle_timeout, (uint64_t) cfg->tcp_idle_timeout);
+    }
+}
+
+static void conn_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    upstream_conn_t *conn = handle->data;
+
+    if (conn->rbuf_cap - conn->rbuf_len < TCP_READ_SIZE) {
+        conn->rbuf_cap = conn->rbuf_len + TCP_READ_SIZE;
+        conn->rbuf = xrealloc(conn->rbuf, conn->rbuf_cap);
+    }
+    buf->base = conn->rbuf + conn->rbuf_len;
+    buf->len = conn->rbuf_cap - conn->rbuf_len;
+}
+
+static void on_read_tcp_response(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    upstream_conn_t *conn = stream->data;
+    size_t offset = 0;
+
+    if (nread < 0) {
+        if (nread != UV_EOF || conn->pending.count > 0) {
+            log_error("Error on read tcp proxy response: %s", uv_strerror((int) nread));
+        }
+        conn_close(conn);
+        return;
+    }
+
+    conn->rbuf_len += nread;
+    // tcp response add 2 bytes data length in header.
+    while (conn->rbuf_len - offset >= 2) {
+        size_t frame_len = dns_get16((unsigned char *) conn->rbuf + offset);
+        if (conn->rbuf_len - offset - 2 < frame_len) {
+            break;
+        }
+        dispatch_response(&conn->pending, conn->rbuf + offset + 2, (ssize_t) frame_len);
+        offset += 2 + frame_len;
+    }
+    if (offset > 0) {
+        memmove(conn->rbuf, conn->rbuf + offset, conn->rbuf_len - offset);
+        conn->rbuf_len -= offset;
+    }
+}
+
+static void on_idle_timeout(wheel_timer_t *timer) {
+    upstream_conn_t *conn = timer->data;
+    if (conn->pending.count == 0) {
+        conn_close(conn);
+    }
+}
+
+/*
+ * Remove the connection from its upstream and fail every query still waiting on it.
+ */
+static void conn_close(upstream_conn_t *conn) {
+    upstream_t *upstream = conn->upstream;
+    int i;
+
+    if (conn->state == CONN_CLOSING) {
+        return;
+    }
+    conn->state = CONN_CLOSING;
+
+    for (i = 0; i < upstream->conn_count; ++i) {
+        if (upstream->conns[i] == conn) {
+            upstream->conns[i] = upstream->conns[--upstream->conn_count];
+            break;
+        }
+    }
+
+    for (i = 0; i < UPSTREAM_PENDING_BUCKETS && conn->pending.count > 0; ++i) {
+        while (conn->pending.buckets[i]) {
+            query_task_t *task = conn->pending.buckets[i];
+            upstream_detach(task);
+            if (task->state == TASK_RUNING) {
+                task_error(task);
+            }
+        }
+    }
+
+    wheel_timer_stop(&conn->idle_timer);
+    uv_close((uv_handle_t *) &conn->handle, on_conn_handle_close);
+}
+
+static void on_conn_handle_close(uv_handle_t *handle) {
+    upstream_conn_t *conn = handle->data;
+    if (conn->rbuf) {
+        xfree(conn->rbuf);
+    }
+    xfree(conn);
+}
+
+static void on_socket_close(uv_handle_t *handle) {
+    xfree(handle->data);
+}
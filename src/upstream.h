@@ -0,0 +1,33 @@
+#ifndef GDNS_UPSTREAM_H
+#define GDNS_UPSTREAM_H
+
+#include "common.h"
+
+/*
+ * Sockets to every proxy of cfg on loop, in cfg->proxies order. Returns NULL on failure.
+ */
+upstream_t *upstreams_init(uv_loop_t *loop, server_cfg_t *cfg);
+
+/*
+ * Close the sockets and connections, queries still waiting on a connection fail.
+ */
+void upstreams_close(upstream_t *upstreams, int count);
+
+/*
+ * Register task on one of the upstream's sockets under a fresh random transaction id, which is
+ * written into task->msg. Returns the socket to send the query with.
+ */
+uv_udp_t *upstream_udp_attach(upstream_t *upstream, query_task_t *task);
+
+/*
+ * Register task on a persistent connection to the upstream, opening one when all of them are busy.
+ * Returns the stream to write the query to, or NULL while reconnecting is backed off.
+ */
+uv_stream_t *upstream_tcp_attach(upstream_t *upstream, uv_loop_t *loop, query_task_t *task);
+
+/*
+ * Stop delivering responses to task.
+ */
+void upstream_detach(query_task_t *task);
+
+#endif //GDNS_UPSTREAM_H
@@ -0,0 +1,231 @@
+#include <string.h>
+#include "verdict.h"
+
+struct verdict_entry_t {
+    verdict_entry_t *next; // hash chain.
+    verdict_entry_t *lru_prev;
+    verdict_entry_t *lru_next;
+    uint32_t hash;
+    char *name;
+    verdict_t verdict;
+    uint64_t expire_time; // ms
+};
+
+// second level suffixes open to public registration, a small stand-in for the public suffix list.
+static const char *second_level_suffixes[] = {
+        "com.cn", "net.cn", "org.cn", "gov.cn", "edu.cn", "ac.cn",
+        "com.hk", "net.hk", "org.hk", "com.tw", "net.tw", "org.tw", "idv.tw",
+        "co.jp", "ne.jp", "or.jp", "ac.jp", "co.kr", "or.kr",
+        "co.uk", "org.uk", "ac.uk", "gov.uk", "me.uk",
+        "com.au", "net.au", "org.au", "edu.au", "co.nz", "com.sg", "com.my",
+        "com.br", "com.mx", "com.ar", "co.in", "co.za", "com.tr", "com.ru",
+        NULL
+};
+
+static uint32_t hash_name(const char *name);
+
+static verdict_entry_t *find_entry(verdict_table_t *table, const char *name, uint32_t hash);
+
+static void remove_entry(verdict_table_t *table, verdict_entry_t *entry);
+
+static void lru_unlink(verdict_table_t *table, verdict_entry_t *entry);
+
+static void lru_push_front(verdict_table_t *table, verdict_entry_t *entry);
+
+static void store_entry(verdict_table_t *table, const char *name, verdict_t verdict, uint64_t expire_time);
+
+int verdict_init(verdict_table_t *table, int capacity, int ttl) {
+    int i;
+
+    table->size = 0;
+    table->capacity = capacity > 0 ? capacity : 0;
+    table->ttl = (uint64_t) (ttl > 0 ? ttl : 0) * 1000;
+    table->lru_head = NULL;
+    table->lru_tail = NULL;
+
+    table->bucket_count = 16;
+    while (table->bucket_count < table->capacity) {
+        table->bucket_count <<= 1;
+    }
+    table->buckets = xmalloc(sizeof(verdict_entry_t *) * table->bucket_count);
+    for (i = 0; i < table->bucket_count; ++i) {
+        table->buckets[i] = NULL;
+    }
+    return 0;
+}
+
+void verdict_free(verdict_table_t *table) {
+    verdict_entry_t *entry = table->lru_head;
+    while (entry) {
+        verdict_entry_t *next = entry->lru_next;
+        xfree(entry->name);
+        xfree(entry);
+        entry = next;
+    }
+    xfree(table->buckets);
+    table->buckets = NULL;
+    table->lru_head = NULL;
+    table->lru_tail = NULL;
+    table->size = 0;
+}
+
+verdict_t verdict_lookup(verdict_table_t *table, const char *name, uint64_t now) {
+    const char *domain;
+    verdict_entry_t *entry;
+
+    if (table->capacity == 0) {
+        return VERDICT_UNKNOWN;
+    }
+    domain = registrable_domain(name);
+    entry = find_entry(table, domain, hash_name(domain));
+    if (entry == NULL) {
+        return VERDICT_UNKNOWN;
+    }
+    if (entry->expire_time <= now) {
+        remove_entry(table, entry);
+        return VERDICT_UNKNOWN;
+    }
+    lru_unlink(table, entry);
+    lru_push_front(table, entry);
+    return entry->verdict;
+}
+
+void verdict_store(verdict_table_t *table, const char *name, verdict_t verdict, uint64_t now) {
+    store_entry(table, name, verdict, now + table->ttl);
+}
+
+void verdict_restore(verdict_table_t *table, const char *name, verdict_t verdict, uint64_t ttl, uint64_t now) {
+    store_entry(table, name, verdict, now + (ttl < table->ttl ? ttl : table->ttl));
+}
+
+void verdict_export(verdict_table_t *table, uint64_t now, verdict_export_cb cb, void *data) {
+    verdict_entry_t *entry;
+
+    for (entry = table->lru_tail; entry; entry = entry->lru_prev) {
+        if (entry->expire_time > now) {
+            cb(data, entry->name, entry->verdict, entry->expire_time - now);
+        }
+    }
+}
+
+void verdict_forget(verdict_table_t *table, const char *name) {
+    const char *domain;
+    verdict_entry_t *entry;
+
+    if (table->capacity == 0) {
+        return;
+    }
+    domain = registrable_domain(name);
+    if ((entry = find_entry(table, domain, hash_name(domain))) != NULL) {
+        remove_entry(table, entry);
+    }
+}
+
+const char *registrable_domain(const char *name) {
+    const char *labels[3] = {name, NULL, NULL}; // starts of the last three labels, last one first.
+    const char *p;
+    int i;
+
+    for (p = name; *p; ++p) {
+        if (*p == '.' && p[1]) {
+            labels[2] = labels[1];
+            labels[1] = labels[0];
+            labels[0] = p + 1;
+        }
+    }
+    if (labels[1] == NULL) { // a single label.
+        return name;
+    }
+    for (i = 0; second_level_suffixes[i]; ++i) {
+        if (strcmp(labels[1], second_level_suffixes[i]) == 0) {
+            return labels[2] ? labels[2] : labels[1];
+        }
+    }
+    return labels[1];
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *name; ++name) {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+    return hash;
+}
+
+static verdict_entry_t *find_entry(verdict_table_t *table, const char *name, uint32_t hash) {
+    verdict_entry_t *entry = table->buckets[hash & (table->bucket_count - 1)];
+
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void remove_entry(verdict_table_t *table, verdict_entry_t *entry) {
+    verdict_entry_t **link = &table->buckets[entry->hash & (table->bucket_count - 1)];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    lru_unlink(table, entry);
+    xfree(entry->name);
+    xfree(entry);
+    table->size -= 1;
+}
+
+static void lru_unlink(verdict_table_t *table, verdict_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        table->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        table->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(verdict_table_t *table, verdict_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = table->lru_head;
+    if (table->lru_head) {
+        table->lru_head->lru_prev = entry;
+    } else {
+        table->lru_tail = entry;
+    }
+    table->lru_head = entry;
+}
+
+static void store_entry(verdict_table_t *table, const char *name, verdict_t verdict, uint64_t expire_time) {
+    const char *domain;
+    uint32_t hash;
+    verdict_entry_t *entry;
+
+    if (table->capacity == 0 || table->ttl == 0 || verdict == VERDICT_UNKNOWN) {
+        return;
+    }
+    domain = registrable_domain(name);
+    hash = hash_name(domain);
+    entry = find_entry(table, domain, hash);
+    if (entry) {
+        lru_unlink(table, entry);
+    } else {
+        if (table->size >= table->capacity) {
+            remove_entry(table, table->lru_tail);
+        }
+        entry = TMALLOC(verdict_entry_t);
+        entry->hash = hash;
+        entry->name = xmalloc(strlen(domain) + 1);
+        strcpy(entry->name, domain);
+        entry->next = table->buckets[hash & (table->bucket_count - 1)];
+        table->buckets[hash & (table->bucket_count - 1)] = entry;
+        table->size += 1;
+    }
+    entry->verdict = verdict;
+    entry->expire_time = expire_time;
+    lru_push_front(table, entry);
+}
@@ -0,0 +1,40 @@
+#ifndef GDNS_VERDICT_H
+#define GDNS_VERDICT_H
+
+#include "common.h"
+
+int verdict_init(verdict_table_t *table, int capacity, int ttl);
+
+void verdict_free(verdict_table_t *table);
+
+/*
+ * Verdict of the registrable domain of name, VERDICT_UNKNOWN once it expired. now is in ms.
+ */
+verdict_t verdict_lookup(verdict_table_t *table, const char *name, uint64_t now);
+
+/*
+ * Remember the verdict for the registrable domain of name for the table's ttl.
+ */
+void verdict_store(verdict_table_t *table, const char *name, verdict_t verdict, uint64_t now);
+
+/*
+ * Remember a verdict saved with ttl ms left, at most for the table's ttl.
+ */
+void verdict_restore(verdict_table_t *table, const char *name, verdict_t verdict, uint64_t ttl, uint64_t now);
+
+void verdict_forget(verdict_table_t *table, const char *name);
+
+typedef void (*verdict_export_cb)(void *data, const char *domain, verdict_t verdict, uint64_t ttl);
+
+/*
+ * Hand every verdict still valid at now to cb with the ms it has left, least recently used first.
+ */
+void verdict_export(verdict_table_t *table, uint64_t now, verdict_export_cb cb, void *data);
+
+/*
+ * The part of name a single owner registers: the last two labels, or three under a known
+ * second level suffix such as com.cn.
+ */
+const char *registrable_domain(const char *name);
+
+#endif //GDNS_VERDICT_H
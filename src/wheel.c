@@ -0,0 +1,169 @@
+#include <string.h>
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE (UINT64_C(1) << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) // ms, about 4.6 hours.
+
+static void on_wheel_tick(uv_timer_t *handle);
+
+static void wheel_insert(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+static void wheel_cascade(timer_wheel_t *wheel, int level);
+
+static void wheel_schedule(timer_wheel_t *wheel);
+
+static void take_list(wheel_timer_t **slot, wheel_timer_t **head);
+
+void wheel_init(timer_wheel_t *wheel, uv_loop_t *loop) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    uv_timer_init(loop, &wheel->handle);
+    wheel->handle.data = wheel;
+    wheel->now = uv_now(loop);
+    wheel->next = UINT64_MAX;
+    wheel->count = 0;
+}
+
+void wheel_close(timer_wheel_t *wheel) {
+    uv_close((uv_handle_t *) &wheel->handle, NULL);
+}
+
+void wheel_timer_init(wheel_timer_t *timer, void *data) {
+    memset(timer, 0, sizeof(wheel_timer_t));
+    timer->data = data;
+}
+
+void wheel_timer_start(timer_wheel_t *wheel, wheel_timer_t *timer, wheel_cb cb, uint64_t timeout) {
+    uint64_t now = uv_now(wheel->handle.loop);
+
+    wheel_timer_stop(timer);
+    if (wheel->count == 0 && now > wheel->now) { // nothing to catch up with.
+        wheel->now = now;
+    }
+    timer->cb = cb;
+    timer->wheel = wheel;
+    timer->expire = now + timeout;
+    if (timer->expire <= wheel->now) { // the slot of now has fired already.
+        timer->expire = wheel->now + 1;
+    }
+    wheel_insert(wheel, timer);
+    wheel->count += 1;
+    if (timer->expire < wheel->next) {
+        wheel->next = timer->expire;
+        uv_timer_start(&wheel->handle, on_wheel_tick, timer->expire - now, 0);
+    }
+}
+
+void wheel_timer_stop(wheel_timer_t *timer) {
+    if (timer->pprev == NULL) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->wheel->count -= 1;
+}
+
+void wheel_advance(timer_wheel_t *wheel, uint64_t now) {
+    wheel_timer_t *due, *timer;
+    int level;
+
+    wheel->next = UINT64_MAX;
+    while (wheel->now < now && wheel->count > 0) {
+        wheel->now += 1;
+        // every level whose slot turned over hands its timers down, the higher ones first.
+        for (level = 1; level < WHEEL_LEVELS; ++level) {
+            if (wheel->now & ((UINT64_C(1) << (WHEEL_SLOT_BITS * level)) - 1)) {
+                break;
+            }
+        }
+        while (--level > 0) {
+            wheel_cascade(wheel, level);
+        }
+
+        // callbacks may stop any timer of the slot, or arm new ones, which never land in it.
+        take_list(&wheel->slots[0][wheel->now & WHEEL_MASK], &due);
+        while ((timer = due)) {
+            wheel_timer_stop(timer);
+            if (timer->expire > wheel->now) { // beyond the last level when armed.
+                wheel_insert(wheel, timer);
+                wheel->count += 1;
+                continue;
+            }
+            timer->cb(timer);
+        }
+    }
+    wheel_schedule(wheel);
+}
+
+static void on_wheel_tick(uv_timer_t *handle) {
+    wheel_advance(handle->data, uv_now(handle->loop));
+}
+
+static void wheel_insert(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    uint64_t when = timer->expire < wheel->now ? wheel->now : timer->expire;
+    wheel_timer_t **slot;
+    int level = 0;
+
+    if (when - wheel->now >= WHEEL_RANGE) {
+        when = wheel->now + WHEEL_RANGE - 1;
+    }
+    while (when - wheel->now >= UINT64_C(1) << (WHEEL_SLOT_BITS * (level + 1))) {
+        level += 1;
+    }
+    slot = &wheel->slots[level][(when >> (WHEEL_SLOT_BITS * level)) & WHEEL_MASK];
+    timer->next = *slot;
+    timer->pprev = slot;
+    if (*slot) {
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+}
+
+// the timers of the slot the level has reached expire within a slot of the level below.
+static void wheel_cascade(timer_wheel_t *wheel, int level) {
+    wheel_timer_t *list, *timer;
+
+    take_list(&wheel->slots[level][(wheel->now >> (WHEEL_SLOT_BITS * level)) & WHEEL_MASK], &list);
+    while ((timer = list)) {
+        list = timer->next;
+        wheel_insert(wheel, timer);
+    }
+}
+
+// due at the first timer of the first level or the first cascade, whichever comes earlier.
+static void wheel_schedule(timer_wheel_t *wheel) {
+    uint64_t next = UINT64_MAX, when, now = uv_now(wheel->handle.loop);
+    int level, i, shift;
+
+    if (wheel->count == 0) {
+        uv_timer_stop(&wheel->handle);
+        return;
+    }
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+        shift = WHEEL_SLOT_BITS * level;
+        for (i = 1; i <= WHEEL_SLOTS; ++i) {
+            when = ((wheel->now >> shift) + (uint64_t) i) << shift;
+            if (when >= next) {
+                break;
+            }
+            if (wheel->slots[level][(when >> shift) & WHEEL_MASK]) {
+                next = when;
+                break;
+            }
+        }
+    }
+    wheel->next = next;
+    uv_timer_start(&wheel->handle, on_wheel_tick, next > now ? next - now : 0, 0);
+}
+
+// move the list of slot to head, its links stay valid for wheel_timer_stop.
+static void take_list(wheel_timer_t **slot, wheel_timer_t **head) {
+    *head = *slot;
+    *slot = NULL;
+    if (*head) {
+        (*head)->pprev = head;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef GDNS_WHEEL_H
+#define GDNS_WHEEL_H
+
+#include "common.h"
+
+/*
+ * Hierarchical timing wheel of a worker. Timers are embedded in their owners, arming and stopping one
+ * only relinks it. Level n holds the timers due within 64^(n+1) ms, they move down a level as the wheel
+ * turns, timers beyond the last level wait there and move down again later.
+ */
+
+void wheel_init(timer_wheel_t *wheel, uv_loop_t *loop);
+
+// armed timers never fire once closed.
+void wheel_close(timer_wheel_t *wheel);
+
+void wheel_timer_init(wheel_timer_t *timer, void *data);
+
+/*
+ * Call cb timeout ms from the loop time, rearms timer when armed already.
+ */
+void wheel_timer_start(timer_wheel_t *wheel, wheel_timer_t *timer, wheel_cb cb, uint64_t timeout);
+
+void wheel_timer_stop(wheel_timer_t *timer);
+
+/*
+ * Fire every timer expired by now and schedule the handle for the next one, the handle does it with the
+ * loop time.
+ */
+void wheel_advance(timer_wheel_t *wheel, uint64_t now);
+
+#endif //GDNS_WHEEL_H
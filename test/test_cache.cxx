@@ -0,0 +1,218 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <string.h>
+#include <resolv.h>
+extern "C" {
+#include "../src/cache.h"
+}
+#include "test_util.h"
+
+namespace TestCache {
+
+    using TestUtil::make_query;
+    using TestUtil::make_response;
+
+    class CacheTest : public ::testing::Test {
+    protected:
+        cache_t cache;
+
+        virtual void SetUp() {
+            cache_init(&cache, 2);
+        }
+
+        virtual void TearDown() {
+            cache_free(&cache);
+        }
+
+        // answer the query with rcode and an SOA in the authority section.
+        static ssize_t make_negative(const unsigned char *query, ssize_t len, int rcode, uint32_t ttl,
+                                     uint32_t minimum, unsigned char *buf) {
+            unsigned char *p = buf + len;
+            memcpy(buf, query, (size_t) len);
+            buf[2] |= 0x80; // QR
+            buf[3] = (unsigned char) rcode;
+            ns_put16(1, buf + 8); // NSCOUNT
+            ns_put16(0xc00c, p);
+            ns_put16(ns_t_soa, p + 2);
+            ns_put16(ns_c_in, p + 4);
+            ns_put32(ttl, p + 6);
+            ns_put16(24, p + 10);
+            ns_put16(0xc00c, p + 12); // MNAME
+            ns_put16(0xc00c, p + 14); // RNAME
+            memset(p + 16, 0, 16); // SERIAL, REFRESH, RETRY, EXPIRE
+            ns_put32(minimum, p + 32);
+            return len + 36;
+        }
+
+        static uint32_t answer_ttl(const char *response, ssize_t len) {
+            return ns_get32((const unsigned char *) response + len - 10);
+        }
+    };
+
+    TEST_F(CacheTest, HitRewritesIdAndTtl) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len = make_query("example.com", 0x1111, query);
+        ssize_t response_len = make_response(query, query_len, 300, response);
+        char cached[DNS_PACKET_SIZE];
+        ssize_t cached_len;
+
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 1000);
+
+        query_len = make_query("EXAMPLE.com", 0x2222, query);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 11000, cached, &cached_len, NULL));
+        ASSERT_EQ(response_len, cached_len);
+        EXPECT_EQ(0x2222, ns_get16((unsigned char *) cached));
+        EXPECT_EQ(290u, answer_ttl(cached, cached_len));
+        EXPECT_EQ(1u, cache.hits);
+    }
+
+    TEST_F(CacheTest, ExpiresAfterTtl) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len = make_query("example.com", 1, query);
+        ssize_t response_len = make_response(query, query_len, 5, response);
+        char cached[DNS_PACKET_SIZE];
+        ssize_t cached_len;
+
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        EXPECT_FALSE(cache_lookup(&cache, (char *) query, query_len, 5000, cached, &cached_len, NULL));
+        EXPECT_EQ(0, cache.size);
+        EXPECT_EQ(1u, cache.misses);
+    }
+
+    TEST_F(CacheTest, EvictsLeastRecentlyUsed) {
+        const char *domains[] = {"a.com", "b.com", "c.com"};
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len, response_len;
+        char cached[DNS_PACKET_SIZE];
+        ssize_t cached_len;
+        int i;
+
+        for (i = 0; i < 3; ++i) {
+            query_len = make_query(domains[i], 1, query);
+            response_len = make_response(query, query_len, 60, response);
+            cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        }
+        EXPECT_EQ(2, cache.size);
+
+        query_len = make_query("a.com", 1, query);
+        EXPECT_FALSE(cache_lookup(&cache, (char *) query, query_len, 0, cached, &cached_len, NULL));
+        query_len = make_query("c.com", 1, query);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 0, cached, &cached_len, NULL));
+    }
+
+    TEST_F(CacheTest, IgnoresMismatchedResponse) {
+        unsigned char query[PACKETSZ], other[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len = make_query("example.com", 1, query);
+        ssize_t other_len = make_query("example.org", 1, other);
+        ssize_t response_len = make_response(other, other_len, 60, response);
+
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        EXPECT_EQ(0, cache.size);
+    }
+
+    TEST_F(CacheTest, PrefetchesHotEntryOnce) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len = make_query("example.com", 1, query);
+        ssize_t response_len = make_response(query, query_len, 100, response);
+        char cached[DNS_PACKET_SIZE];
+        ssize_t cached_len;
+        bool prefetch;
+        int i;
+
+        cache.prefetch_hits = 3;
+        cache.prefetch_window = 10;
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+
+        for (i = 0; i < 3; ++i) { // hot, but most of the ttl is left.
+            ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 1000, cached, &cached_len, &prefetch));
+            EXPECT_FALSE(prefetch);
+        }
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 91000, cached, &cached_len, &prefetch));
+        EXPECT_TRUE(prefetch);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 92000, cached, &cached_len, &prefetch));
+        EXPECT_FALSE(prefetch);
+        EXPECT_EQ(1u, cache.prefetches);
+
+        // the refreshed answer starts cold again.
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 93000);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 185000, cached, &cached_len, &prefetch));
+        EXPECT_FALSE(prefetch);
+    }
+
+    TEST_F(CacheTest, ColdEntryIsNotPrefetched) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len = make_query("example.com", 1, query);
+        ssize_t response_len = make_response(query, query_len, 100, response);
+        char cached[DNS_PACKET_SIZE];
+        ssize_t cached_len;
+        bool prefetch;
+
+        cache.prefetch_hits = 3;
+        cache.prefetch_window = 10;
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 95000, cached, &cached_len, &prefetch));
+        EXPECT_FALSE(prefetch);
+    }
+
+    TEST_F(CacheTest, NegativeAnswerLivesAsLongAsItsSoa) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len = make_query("nx.example.com", 1, query);
+        ssize_t response_len = make_negative(query, query_len, ns_r_nxdomain, 600, 60, response);
+        char cached[DNS_PACKET_SIZE];
+        ssize_t cached_len;
+
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        EXPECT_EQ(0, cache.size); // negative answers are off.
+
+        cache.negative_ttl = 3600;
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 10000, cached, &cached_len, NULL));
+        EXPECT_EQ(ns_r_nxdomain, cached[3] & 0x0f);
+        EXPECT_EQ(50u, ns_get32((unsigned char *) cached + cached_len - 30)); // the SOA ttl, its MINIMUM aged.
+        EXPECT_FALSE(cache_lookup(&cache, (char *) query, query_len, 60000, cached, &cached_len, NULL));
+
+        // an empty answer is negative too, its ttl capped.
+        cache.negative_ttl = 30;
+        response_len = make_negative(query, query_len, ns_r_noerror, 600, 900, response);
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 29000, cached, &cached_len, NULL));
+        EXPECT_EQ(1u, ns_get32((unsigned char *) cached + cached_len - 30));
+        EXPECT_FALSE(cache_lookup(&cache, (char *) query, query_len, 30000, cached, &cached_len, NULL));
+
+        // without an SOA nothing tells how long the name is missing.
+        response_len = make_negative(query, query_len, ns_r_nxdomain, 600, 60, response);
+        ns_put16(0, response + 8);
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len - 36, 0);
+        EXPECT_EQ(0, cache.size);
+    }
+
+    TEST_F(CacheTest, FailureNeverReplacesAValidAnswer) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        ssize_t query_len = make_query("example.com", 1, query);
+        ssize_t response_len = make_response(query, query_len, 10, response);
+        char cached[DNS_PACKET_SIZE];
+        char failure[DNS_PACKET_SIZE];
+        ssize_t cached_len;
+
+        memcpy(failure, query, (size_t) query_len);
+        failure[2] |= 0x80;
+        failure[3] = ns_r_servfail;
+        cache.failure_ttl = 5;
+
+        cache_store(&cache, (char *) query, query_len, (char *) response, response_len, 0);
+        cache_store(&cache, (char *) query, query_len, failure, query_len, 5000);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 6000, cached, &cached_len, NULL));
+        EXPECT_EQ(response_len, cached_len);
+
+        cache_store(&cache, (char *) query, query_len, failure, query_len, 10000);
+        ASSERT_TRUE(cache_lookup(&cache, (char *) query, query_len, 14000, cached, &cached_len, NULL));
+        EXPECT_EQ(query_len, cached_len);
+        EXPECT_EQ(ns_r_servfail, cached[3] & 0x0f);
+        EXPECT_FALSE(cache_lookup(&cache, (char *) query, query_len, 15000, cached, &cached_len, NULL));
+
+        cache.failure_ttl = 0;
+        cache_store(&cache, (char *) query, query_len, failure, query_len, 20000);
+        EXPECT_EQ(0, cache.size);
+    }
+
+}
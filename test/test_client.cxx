@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <resolv.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+extern "C" {
+#include "../src/client.h"
+#include "../src/server.h"
+#include "../src/wheel.h"
+}
+
+namespace TestClient {
+
+    static int queries = 0; // seen by server_query.
+    static int outstanding = 0; // replies not released yet.
+    static int most_outstanding = 0;
+
+    class ClientTest : public ::testing::Test {
+    protected:
+        uv_loop_t loop;
+        server_cfg_t cfg;
+        server_ctx_t *ctx;
+        uv_udp_t handle;
+        int fd;
+
+        virtual void SetUp() {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            int size = 4096;
+            uv_os_sock_t listen_fd;
+
+            queries = 0;
+            outstanding = 0;
+            most_outstanding = 0;
+            uv_loop_init(&loop);
+            memset(&cfg, 0, sizeof(cfg));
+            cfg.tcp_clients_max = 16;
+            ctx = (server_ctx_t *) calloc(1, sizeof(server_ctx_t));
+            ctx->cfg = &cfg;
+            ctx->handle = &handle;
+            uv_udp_init(&loop, &handle);
+            wheel_init(&ctx->wheel, &loop);
+            loop.data = ctx;
+
+            // accepted connections inherit the small send buffer, replies back up after a few.
+            listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            setsockopt(listen_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            uv_ip4_addr("127.0.0.1", 0, &addr);
+            ASSERT_EQ(0, bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)));
+            ASSERT_EQ(0, clients_bind(ctx, listen_fd));
+            clients_listen(ctx);
+            getsockname(listen_fd, (struct sockaddr *) &addr, &len);
+
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            ASSERT_EQ(0, connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+        }
+
+        virtual void TearDown() {
+            close(fd);
+            clients_close(ctx);
+            wheel_close(&ctx->wheel);
+            uv_close((uv_handle_t *) &handle, NULL);
+            uv_run(&loop, UV_RUN_DEFAULT);
+            uv_loop_close(&loop);
+            free(ctx);
+        }
+
+        void run_for(uint64_t ms) {
+            uint64_t end = uv_now(&loop) + ms;
+
+            while (uv_now(&loop) < end) {
+                uv_run(&loop, UV_RUN_NOWAIT);
+                usleep(1000);
+                uv_update_time(&loop);
+            }
+        }
+    };
+
+    TEST_F(ClientTest, PausesAClientThatDoesNotReadItsAnswers) {
+        unsigned char query[2 + PACKETSZ];
+        char reply[8192];
+        int len = res_mkquery(QUERY, "example.com", C_IN, T_A, NULL, 0, NULL, query + 2, PACKETSZ);
+        ssize_t n, received = 0;
+        int i;
+
+        ns_put16((uint16_t) len, query);
+        for (i = 0; i < 200; ++i) {
+            ASSERT_EQ(len + 2, send(fd, query, (size_t) len + 2, 0));
+        }
+        run_for(200);
+        // every query is answered at once, like a cache hit, but the answers can not leave.
+        EXPECT_LE(most_outstanding, CLIENT_PIPELINE_DEPTH);
+        EXPECT_LT(queries, 200);
+
+        // reading again lets the rest through.
+        for (i = 0; i < 2000 && received < 200 * 4002; ++i) {
+            while ((n = recv(fd, reply, sizeof(reply), 0)) > 0) {
+                received += n;
+            }
+            run_for(1);
+        }
+        EXPECT_EQ(200, queries);
+        EXPECT_EQ(200 * 4002, received);
+        EXPECT_LE(most_outstanding, CLIENT_PIPELINE_DEPTH);
+    }
+}
+
+// the server's side, every query answered at once with 4000 bytes.
+extern "C" void server_query(server_ctx_t *ctx, const struct sockaddr *addr, client_conn_t *conn, char *data,
+                             ssize_t len) {
+    reply_req_t *reply = (reply_req_t *) malloc(sizeof(reply_req_t));
+
+    TestClient::queries += 1;
+    TestClient::outstanding += 1;
+    if (TestClient::outstanding > TestClient::most_outstanding) {
+        TestClient::most_outstanding = TestClient::outstanding;
+    }
+    memset(reply->data, 0, 4000);
+    memcpy(reply->data, data, (size_t) len);
+    reply->buf = uv_buf_init(reply->data, 4000);
+    client_send(conn, reply, 4000);
+}
+
+extern "C" void server_release_reply(server_ctx_t *ctx, reply_req_t *reply) {
+    TestClient::outstanding -= 1;
+    free(reply);
+}
@@ -0,0 +1,208 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <resolv.h>
+#include <stdlib.h>
+#include <string.h>
+extern "C" {
+#include "../src/dns.h"
+}
+
+namespace TestDns {
+
+    static int make_query(const char *domain, int type, unsigned char *buf) {
+        return res_mkquery(QUERY, domain, C_IN, type, NULL, 0, NULL, buf, PACKETSZ);
+    }
+
+    TEST(DnsTest, QuestionIgnoresCaseAndId) {
+        unsigned char buf[PACKETSZ];
+        dns_question_t a, b;
+        int len;
+
+        len = make_query("WWW.Example.com", T_A, buf);
+        ASSERT_EQ(0, dns_parse_question((char *) buf, len, &a));
+        EXPECT_STREQ("www.example.com", a.name);
+        EXPECT_EQ(T_A, a.qtype);
+        EXPECT_EQ(C_IN, a.qclass);
+
+        len = make_query("www.example.COM", T_A, buf);
+        ns_put16(0x4242, buf);
+        ASSERT_EQ(0, dns_parse_question((char *) buf, len, &b));
+        EXPECT_TRUE(dns_question_equal(&a, &b));
+
+        len = make_query("www.example.com", T_AAAA, buf);
+        ASSERT_EQ(0, dns_parse_question((char *) buf, len, &b));
+        EXPECT_FALSE(dns_question_equal(&a, &b));
+    }
+
+    TEST(DnsTest, RejectsMalformedQuestion) {
+        unsigned char buf[PACKETSZ];
+        dns_question_t question;
+        int len = make_query("example.com", T_A, buf);
+
+        EXPECT_NE(0, dns_parse_question((char *) buf, len - 3, &question));
+        EXPECT_NE(0, dns_parse_question((char *) buf, 5, &question));
+        ns_put16(2, buf + 4); // QDCOUNT
+        EXPECT_NE(0, dns_parse_question((char *) buf, len, &question));
+    }
+
+    // a response to make_query with an A record, a CNAME and an OPT, owner names compressed.
+    static int make_response(const char *domain, unsigned char *buf) {
+        static const unsigned char records[] = {
+                0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x05, // CNAME ttl 60
+                0x02, 'c', 'n', 0xc0, 0x0c,
+                0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, // A ttl 300
+                10, 0, 0, 1,
+                0x00, 0x00, 0x29, 0x10, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, // OPT
+        };
+        int len = make_query(domain, T_A, buf);
+
+        buf[2] |= 0x80; // QR
+        ns_put16(2, buf + 6); // ANCOUNT
+        ns_put16(1, buf + 10); // ARCOUNT
+        memcpy(buf + len, records, sizeof(records));
+        return len + (int) sizeof(records);
+    }
+
+    TEST(DnsTest, IteratesRecordsInPlace) {
+        unsigned char buf[PACKETSZ];
+        int len = make_response("example.com", buf);
+        dns_msg_t msg;
+        dns_rr_iter_t iter;
+        dns_rr_t rr;
+
+        ASSERT_EQ(0, dns_msg_init(&msg, (char *) buf, len));
+        EXPECT_EQ(2, msg.counts[ns_s_an]);
+        EXPECT_EQ(0, dns_msg_rcode(&msg));
+        dns_rr_iter_init(&iter, &msg);
+
+        ASSERT_EQ(1, dns_rr_next(&iter, &rr));
+        EXPECT_EQ(ns_s_an, rr.section);
+        EXPECT_EQ(T_CNAME, rr.type);
+        EXPECT_EQ(60u, rr.ttl);
+        EXPECT_EQ(5, rr.rdlength);
+
+        ASSERT_EQ(1, dns_rr_next(&iter, &rr));
+        EXPECT_EQ(T_A, rr.type);
+        EXPECT_EQ(C_IN, rr.rclass);
+        EXPECT_EQ(300u, rr.ttl);
+        EXPECT_EQ(300u, ns_get32(buf + rr.ttl_offset));
+        ASSERT_EQ(4, rr.rdlength);
+        EXPECT_EQ(buf + len - 15, rr.rdata); // a view, not a copy.
+        EXPECT_EQ(10, rr.rdata[0]);
+
+        ASSERT_EQ(1, dns_rr_next(&iter, &rr));
+        EXPECT_EQ(ns_s_ar, rr.section);
+        EXPECT_EQ(ns_t_opt, rr.type);
+        EXPECT_EQ(0, dns_rr_next(&iter, &rr));
+
+        ASSERT_EQ(0, dns_msg_init(&msg, (char *) buf, len - 12));
+        dns_rr_iter_init(&iter, &msg);
+        EXPECT_EQ(1, dns_rr_next(&iter, &rr));
+        EXPECT_EQ(-1, dns_rr_next(&iter, &rr)); // rdata runs past the end.
+    }
+
+    TEST(DnsTest, SameQuestion) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        int query_len = make_query("Example.com", T_A, query);
+        int response_len = make_response("eXample.COM", response);
+
+        EXPECT_TRUE(dns_same_question((char *) query, query_len, (char *) response, response_len));
+        response_len = make_response("example.org", response);
+        EXPECT_FALSE(dns_same_question((char *) query, query_len, (char *) response, response_len));
+        response_len = make_query("example.com", T_AAAA, response);
+        EXPECT_FALSE(dns_same_question((char *) query, query_len, (char *) response, response_len));
+        EXPECT_FALSE(dns_same_question((char *) query, query_len, (char *) response, 11));
+    }
+
+    TEST(DnsTest, RejectsCompressionLoop) {
+        unsigned char buf[PACKETSZ];
+        dns_question_t question;
+        int len = make_query("example.com", T_A, buf);
+
+        // the question name points at itself.
+        buf[12] = 0xc0;
+        buf[13] = 0x0c;
+        EXPECT_NE(0, dns_parse_question((char *) buf, len, &question));
+
+        // a label followed by a pointer back to it.
+        len = make_query("a", T_A, buf);
+        buf[14] = 0xc0;
+        buf[15] = 0x0c;
+        EXPECT_NE(0, dns_parse_question((char *) buf, len + 1, &question));
+    }
+
+    TEST(DnsTest, EscapesSpecialCharacters) {
+        unsigned char buf[PACKETSZ];
+        dns_question_t question;
+        int len = make_query("a.b", T_A, buf);
+
+        buf[12] = 3; // one label "a.b" instead of two.
+        buf[14] = '.';
+        ASSERT_EQ(0, dns_parse_question((char *) buf, len, &question));
+        EXPECT_STREQ("a\\.b", question.name);
+    }
+
+    TEST(DnsTest, ErrorResponseKeepsTheQuestion) {
+        unsigned char query[PACKETSZ], response[PACKETSZ];
+        int len = make_query("example.com", T_AAAA, query);
+        dns_question_t asked, answered;
+        dns_msg_t msg;
+
+        query[2] |= 0x01; // RD
+        ASSERT_EQ(len, dns_error_response((char *) query, len, ns_r_servfail, (char *) response));
+        ASSERT_EQ(0, dns_msg_init(&msg, (char *) response, len));
+        EXPECT_EQ(ns_get16(query), msg.id);
+        EXPECT_EQ(0x8182, msg.flags); // QR, RD, RA and SERVFAIL.
+        EXPECT_EQ(1, msg.counts[ns_s_qd]);
+        EXPECT_EQ(0, msg.counts[ns_s_an] + msg.counts[ns_s_ns] + msg.counts[ns_s_ar]);
+        ASSERT_EQ(0, dns_parse_question((char *) query, len, &asked));
+        ASSERT_EQ(0, dns_parse_question((char *) response, len, &answered));
+        EXPECT_TRUE(dns_question_equal(&asked, &answered));
+
+        EXPECT_EQ(-1, dns_error_response((char *) query, len - 1, ns_r_servfail, (char *) response));
+    }
+
+    // random mutations of valid messages must never read out of bounds, run under a sanitizer to be sure.
+    TEST(DnsTest, SurvivesGarbage) {
+        unsigned char origin[PACKETSZ], buf[PACKETSZ];
+        int origin_len = make_response("www.example.com", origin);
+        dns_question_t question;
+        dns_msg_t msg;
+        dns_rr_iter_t iter;
+        dns_rr_t rr;
+        int round, i, len, records;
+
+        srand(42);
+        for (round = 0; round < 100000; ++round) {
+            if (round % 4 == 0) { // random bytes.
+                len = rand() % 64;
+                for (i = 0; i < len; ++i) {
+                    buf[i] = (unsigned char) rand();
+                }
+            } else { // flipped bytes and truncation.
+                memcpy(buf, origin, origin_len);
+                len = round % 4 == 1 ? rand() % (origin_len + 1) : origin_len;
+                for (i = rand() % 4; i >= 0; --i) {
+                    buf[rand() % origin_len] = (unsigned char) rand();
+                }
+            }
+            // the copy stops at len, reading further is caught by asan.
+            unsigned char *exact = (unsigned char *) malloc(len > 0 ? len : 1);
+            memcpy(exact, buf, len);
+
+            dns_parse_question((char *) exact, len, &question);
+            dns_same_question((char *) origin, origin_len, (char *) exact, len);
+            if (dns_msg_init(&msg, (char *) exact, len) == 0) {
+                dns_rr_iter_init(&iter, &msg);
+                records = 0;
+                while (dns_rr_next(&iter, &rr) > 0) {
+                    ASSERT_LE(rr.rdata + rr.rdlength, exact + len);
+                    ASSERT_LE(rr.ttl_offset + 4, (size_t) len);
+                    ASSERT_LE(++records, 3 * 65535);
+                }
+            }
+            free(exact);
+        }
+    }
+
+}
@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+extern "C" {
+#include "../src/histogram.h"
+}
+
+namespace TestHistogram {
+
+    TEST(HistogramTest, ExactBelow256) {
+        histogram_t histogram;
+        int i;
+
+        histogram_reset(&histogram);
+        EXPECT_EQ(0, histogram_percentile(&histogram, 0.99));
+        for (i = 1; i <= 100; ++i) {
+            histogram_add(&histogram, i);
+        }
+        EXPECT_EQ(100u, histogram.total);
+        EXPECT_EQ(50, histogram_percentile(&histogram, 0.5));
+        EXPECT_EQ(99, histogram_percentile(&histogram, 0.99));
+        EXPECT_EQ(1, histogram_percentile(&histogram, 0.0));
+        EXPECT_EQ(10u, histogram_count_below(&histogram, 10));
+        EXPECT_EQ(100u, histogram_count_below(&histogram, 1000));
+        EXPECT_EQ(5050, histogram.sum);
+    }
+
+    TEST(HistogramTest, CoarseAboveAndClamped) {
+        histogram_t histogram;
+        int i;
+
+        histogram_reset(&histogram);
+        for (i = 0; i < 98; ++i) {
+            histogram_add(&histogram, 10);
+        }
+        histogram_add(&histogram, 300); // bucket [288, 303].
+        histogram_add(&histogram, 1000000);
+        EXPECT_EQ(10, histogram_percentile(&histogram, 0.5));
+        EXPECT_EQ(303, histogram_percentile(&histogram, 0.99));
+        EXPECT_GT(histogram_percentile(&histogram, 1.0), 4000);
+    }
+
+}
@@ -1,5 +1,9 @@
 #include <gtest/gtest.h>
 #include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
 extern "C" {
 #include "../src/iputility.h"
 }
@@ -52,4 +56,194 @@ namespace TestIPUtility {
         }
     }
 
+    TEST_F(IPUtilityTest, MatchesLinearScan) {
+        FILE *fp = fopen("subnets.txt", "rb");
+        char line[24];
+        uint32_t addrs[8192], masks[8192];
+        int len = 0, i, j;
+
+        ASSERT_TRUE(fp != NULL);
+        while (len < 8192 && fgets(line, sizeof(line), fp)) {
+            char *delimiter = strchr(line, '/');
+            struct in_addr addr;
+            int prefix = atoi(delimiter + 1);
+            *delimiter = 0;
+            inet_aton(line, &addr);
+            masks[len] = prefix == 0 ? 0 : ~(uint32_t) 0 << (32 - prefix);
+            addrs[len] = ntohl(addr.s_addr) & masks[len];
+            len++;
+        }
+        fclose(fp);
+
+        srand(42);
+        for (i = 0; i < 20000; ++i) {
+            uint32_t ip = i % 2 ? ((uint32_t) rand() << 16) ^ (uint32_t) rand() : addrs[rand() % len] + rand() % 512;
+            struct in_addr addr;
+            bool expected = false;
+            addr.s_addr = htonl(ip);
+            for (j = 0; j < len && !expected; ++j) {
+                expected = (ip & masks[j]) == addrs[j];
+            }
+            EXPECT_EQ(expected, ip_in_subnet_list(&list, &addr)) << inet_ntoa(addr);
+        }
+    }
+
+    TEST(IPUtilityNestedTest, NestedAndOverlappingPrefixes) {
+        const char *path = "nested_subnets.txt";
+        subnet_list_t nested;
+        struct in_addr addr;
+        FILE *fp = fopen(path, "wb");
+
+        ASSERT_TRUE(fp != NULL);
+        fputs("10.200.0.0/16\n10.0.0.0/8\n10.1.0.0/16\n11.0.0.0/24\n11.0.1.0/24\n255.255.255.0/24\n", fp);
+        fclose(fp);
+        ASSERT_EQ(0, subnet_list_init(path, &nested));
+        remove(path);
+
+        inet_aton("10.250.1.1", &addr);
+        EXPECT_TRUE(ip_in_subnet_list(&nested, &addr));
+        inet_aton("11.0.1.255", &addr);
+        EXPECT_TRUE(ip_in_subnet_list(&nested, &addr));
+        inet_aton("11.0.2.0", &addr);
+        EXPECT_FALSE(ip_in_subnet_list(&nested, &addr));
+        inet_aton("255.255.255.255", &addr);
+        EXPECT_TRUE(ip_in_subnet_list(&nested, &addr));
+        inet_aton("9.255.255.255", &addr);
+        EXPECT_FALSE(ip_in_subnet_list(&nested, &addr));
+
+        subnet_list_free(&nested);
+    }
+
+    TEST(IPUtilityNestedTest, IPv6PrefixesBesideIPv4) {
+        const char *path = "ipv6_subnets.txt";
+        subnet_list_t mixed, compiled;
+        struct in_addr addr;
+        struct in6_addr addr6;
+        FILE *fp = fopen(path, "wb");
+
+        ASSERT_TRUE(fp != NULL);
+        fputs("240e::/20\n240e:100::/24\n2408:8000::/20\n2408:9000::/20\n10.0.0.0/8\n"
+              "2001:da8:8000::/48\n2001:da8:8000::1/128\nffff:ffff:ffff:ffff::/64\n", fp);
+        fclose(fp);
+        ASSERT_EQ(0, subnet_list_parse(path, &mixed));
+        remove(path);
+
+        EXPECT_EQ(1, mixed.len);
+        EXPECT_EQ(4, mixed.len6); // nested prefixes merge into one range, so do adjacent ones.
+        inet_aton("10.1.1.1", &addr);
+        EXPECT_TRUE(ip_in_subnet_list(&mixed, &addr));
+        inet_pton(AF_INET6, "240e:fff:ffff::1", &addr6);
+        EXPECT_TRUE(ip6_in_subnet_list(&mixed, &addr6));
+        inet_pton(AF_INET6, "240e:1000::", &addr6);
+        EXPECT_FALSE(ip6_in_subnet_list(&mixed, &addr6));
+        inet_pton(AF_INET6, "2408:9fff:ffff:ffff:ffff:ffff:ffff:ffff", &addr6);
+        EXPECT_TRUE(ip6_in_subnet_list(&mixed, &addr6));
+        inet_pton(AF_INET6, "2408:a000::", &addr6);
+        EXPECT_FALSE(ip6_in_subnet_list(&mixed, &addr6));
+        inet_pton(AF_INET6, "2001:da8:8000:ffff::2", &addr6);
+        EXPECT_TRUE(ip6_in_subnet_list(&mixed, &addr6));
+        inet_pton(AF_INET6, "2001:da8:8001::", &addr6);
+        EXPECT_FALSE(ip6_in_subnet_list(&mixed, &addr6));
+        inet_pton(AF_INET6, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", &addr6);
+        EXPECT_TRUE(ip6_in_subnet_list(&mixed, &addr6));
+        inet_pton(AF_INET6, "::ffff:10.1.1.1", &addr6);
+        EXPECT_FALSE(ip6_in_subnet_list(&mixed, &addr6));
+
+        ASSERT_EQ(0, subnet_list_save(&mixed, "ipv6_subnets.bin"));
+        ASSERT_EQ(0, subnet_list_init("ipv6_subnets.bin", &compiled));
+        remove("ipv6_subnets.bin");
+        EXPECT_TRUE(compiled.map != NULL);
+        ASSERT_EQ(mixed.len6, compiled.len6);
+        EXPECT_EQ(0, memcmp(mixed.ends6, compiled.ends6, sizeof(ip6_t) * mixed.len6));
+        inet_pton(AF_INET6, "240e:fff:ffff::1", &addr6);
+        EXPECT_TRUE(ip6_in_subnet_list(&compiled, &addr6));
+        EXPECT_TRUE(ip_in_subnet_list(&compiled, &addr));
+
+        subnet_list_free(&compiled);
+        subnet_list_free(&mixed);
+    }
+
+    TEST_F(IPUtilityTest, CompiledMatchesText) {
+        const char *path = "compiled_subnets.bin";
+        subnet_list_t compiled;
+        struct in_addr addr;
+        int i;
+
+        ASSERT_EQ(0, subnet_list_save(&list, path));
+        ASSERT_EQ(0, subnet_list_init(path, &compiled));
+        remove(path);
+
+        EXPECT_TRUE(compiled.map != NULL);
+        ASSERT_EQ(list.len, compiled.len);
+        EXPECT_EQ(0, memcmp(list.starts, compiled.starts, sizeof(in_addr_t) * list.len));
+        EXPECT_EQ(0, memcmp(list.index, compiled.index, sizeof(uint32_t) * (SUBNET_INDEX_SIZE + 1)));
+        srand(7);
+        for (i = 0; i < 20000; ++i) {
+            addr.s_addr = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+            EXPECT_EQ(ip_in_subnet_list(&list, &addr), ip_in_subnet_list(&compiled, &addr));
+        }
+        subnet_list_free(&compiled);
+    }
+
+    TEST(IPUtilityCompiledTest, CompanionUnlessStale) {
+        const char *path = "companion_subnets.txt";
+        subnet_list_t list;
+        struct in_addr addr;
+        struct timeval times[2] = {{1000, 0}, {1000, 0}};
+        FILE *fp = fopen(path, "wb");
+
+        ASSERT_TRUE(fp != NULL);
+        fputs("10.0.0.0/8\n", fp);
+        fclose(fp);
+        ASSERT_EQ(0, subnet_list_parse(path, &list));
+        ASSERT_EQ(0, subnet_list_save(&list, "companion_subnets.txt.bin"));
+        subnet_list_free(&list);
+
+        // the text now says something else, but is older than the compiled file.
+        fp = fopen(path, "wb");
+        fputs("11.0.0.0/8\n", fp);
+        fclose(fp);
+        utimes(path, times);
+        inet_aton("10.1.1.1", &addr);
+        ASSERT_EQ(0, subnet_list_init(path, &list));
+        EXPECT_TRUE(list.map != NULL);
+        EXPECT_TRUE(ip_in_subnet_list(&list, &addr));
+        subnet_list_free(&list);
+
+        // edited after compiling, the text wins.
+        times[0].tv_sec = times[1].tv_sec = 2000000000;
+        utimes(path, times);
+        ASSERT_EQ(0, subnet_list_init(path, &list));
+        EXPECT_TRUE(list.map == NULL);
+        EXPECT_FALSE(ip_in_subnet_list(&list, &addr));
+        subnet_list_free(&list);
+
+        remove(path);
+        remove("companion_subnets.txt.bin");
+    }
+
+    TEST(IPUtilityCompiledTest, TruncatedFallsBackToText) {
+        const char *path = "truncated_subnets.txt";
+        subnet_list_t list;
+        struct in_addr addr;
+        FILE *fp = fopen(path, "wb");
+
+        ASSERT_TRUE(fp != NULL);
+        fputs("10.0.0.0/8\n", fp);
+        fclose(fp);
+        ASSERT_EQ(0, subnet_list_parse(path, &list));
+        ASSERT_EQ(0, subnet_list_save(&list, "truncated_subnets.txt.bin"));
+        subnet_list_free(&list);
+        ASSERT_EQ(0, truncate("truncated_subnets.txt.bin", 100));
+        EXPECT_NE(0, subnet_list_init("truncated_subnets.txt.bin", &list));
+
+        ASSERT_EQ(0, subnet_list_init(path, &list));
+        EXPECT_TRUE(list.map == NULL);
+        inet_aton("10.1.1.1", &addr);
+        EXPECT_TRUE(ip_in_subnet_list(&list, &addr));
+        subnet_list_free(&list);
+
+        remove(path);
+        remove("truncated_subnets.txt.bin");
+    }
 }
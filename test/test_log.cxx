@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+#include <string>
+extern "C" {
+#include "../src/common.h"
+}
+
+namespace TestLog {
+
+    static int count_lines(const std::string &text, const std::string &line) {
+        int count = 0;
+        size_t pos = 0;
+
+        while ((pos = text.find(line, pos)) != std::string::npos) {
+            count += 1;
+            pos += line.size();
+        }
+        return count;
+    }
+
+    class LogTest : public ::testing::Test {
+    protected:
+        virtual void TearDown() {
+            log_stop();
+            log_configure(LOG_LEVEL_INFO, 20);
+        }
+    };
+
+    TEST_F(LogTest, SkipsLinesBelowTheLevel) {
+        std::string out, err;
+
+        log_configure(LOG_LEVEL_WARN, 0);
+        testing::internal::CaptureStdout();
+        testing::internal::CaptureStderr();
+        log_start();
+        log_debug("debug %d", 1);
+        log_info("info %d", 2);
+        log_warn("warn %d", 3);
+        log_error("error %d", 4);
+        log_stop(); // writes what is queued.
+        out = testing::internal::GetCapturedStdout();
+        err = testing::internal::GetCapturedStderr();
+        EXPECT_EQ("", out);
+        EXPECT_EQ("warn: warn 3\nerror: error 4\n", err);
+    }
+
+    TEST_F(LogTest, KeepsTheOrderOfQueuedLines) {
+        std::string out;
+        uint64_t dropped = log_dropped();
+        size_t pos, last = 0;
+        char line[32];
+        int i;
+
+        log_configure(LOG_LEVEL_DEBUG, 0);
+        testing::internal::CaptureStdout();
+        log_start();
+        for (i = 0; i < 2000; ++i) {
+            log_debug("line %d", i);
+        }
+        log_stop();
+        out = testing::internal::GetCapturedStdout();
+        // a full ring drops lines, the ones kept are in order.
+        EXPECT_EQ(2000, count_lines(out, "debug: line ") + (int) (log_dropped() - dropped));
+        for (i = 0; i < 2000; ++i) {
+            snprintf(line, sizeof(line), "debug: line %d\n", i);
+            if ((pos = out.find(line)) != std::string::npos) {
+                EXPECT_LE(last, pos);
+                last = pos;
+            }
+        }
+    }
+
+    TEST_F(LogTest, SuppressesARepeatedMessage) {
+        std::string err;
+        int i;
+
+        log_configure(LOG_LEVEL_INFO, 5);
+        testing::internal::CaptureStderr();
+        for (i = 0; i < 30; ++i) {
+            log_warn("proxy %d unreachable", i);
+        }
+        log_warn("another message");
+        err = testing::internal::GetCapturedStderr();
+        EXPECT_EQ(5, count_lines(err, "unreachable"));
+        EXPECT_EQ(1, count_lines(err, "proxy 4 unreachable"));
+        EXPECT_EQ(0, count_lines(err, "proxy 5 unreachable"));
+        EXPECT_EQ(1, count_lines(err, "another message"));
+    }
+
+    TEST_F(LogTest, KeepsTheBurstsOfMessagesApart) {
+        static char formats[1024]; // the two formats hash to the same slot, 64 slots of 8 bytes apart.
+        std::string err;
+        int i;
+
+        strcpy(formats, "first %d");
+        strcpy(formats + 512, "second %d");
+        log_configure(LOG_LEVEL_INFO, 5);
+        testing::internal::CaptureStderr();
+        for (i = 0; i < 20; ++i) {
+            log_warn(formats, i);
+            log_warn(formats + 512, i);
+        }
+        err = testing::internal::GetCapturedStderr();
+        EXPECT_EQ(5, count_lines(err, "first "));
+        EXPECT_EQ(5, count_lines(err, "second "));
+        EXPECT_EQ(0, count_lines(err, "suppressed"));
+    }
+}
@@ -0,0 +1,206 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <resolv.h>
+#include <utility>
+extern "C" {
+#include "../src/persist.h"
+#include "../src/cache.h"
+#include "../src/verdict.h"
+#include "../src/proxy.h"
+}
+#include "test_util.h"
+
+namespace TestPersist {
+
+    class PersistTest : public ::testing::Test {
+    protected:
+        char path[32];
+        cache_t cache;
+        verdict_table_t verdicts;
+        persist_part_t part;
+        upstream_proxy_t proxies[2];
+        struct sockaddr_in addrs[2];
+        server_cfg_t cfg;
+
+        virtual void SetUp() {
+            strcpy(path, "/tmp/gdns_persist_XXXXXX");
+            close(mkstemp(path));
+            cache_init(&cache, 16);
+            verdict_init(&verdicts, 16, 3600);
+            memset(&part, 0, sizeof(part));
+            memset(proxies, 0, sizeof(proxies));
+            memset(&cfg, 0, sizeof(cfg));
+            uv_ip4_addr("10.0.0.1", 53, &addrs[0]);
+            uv_ip4_addr("10.0.0.2", 53, &addrs[1]);
+            proxies[0].addr = (struct sockaddr *) &addrs[0];
+            proxies[1].addr = (struct sockaddr *) &addrs[1];
+            cfg.proxies = proxies;
+            cfg.proxies_count = 2;
+        }
+
+        virtual void TearDown() {
+            persist_part_free(&part);
+            cache_free(&cache);
+            verdict_free(&verdicts);
+            unlink(path);
+        }
+
+        // store an A record answer for domain with ttl at now.
+        void store(const char *domain, uint32_t ttl, uint64_t now) {
+            unsigned char query[PACKETSZ], response[PACKETSZ];
+            ssize_t len = TestUtil::make_query(domain, 0, query);
+
+            cache_store(&cache, (char *) query, len, (char *) response,
+                        TestUtil::make_response(query, len, ttl, response), now);
+        }
+
+        // the ttl of the cached answer to domain at now, 0 when it is not cached.
+        uint32_t cached_ttl(cache_t *from, const char *domain, uint64_t now) {
+            unsigned char query[PACKETSZ];
+            char response[DNS_PACKET_SIZE];
+            ssize_t len;
+            ssize_t query_len = TestUtil::make_query(domain, 0, query);
+
+            if (!cache_lookup(from, (char *) query, query_len, now, response, &len, NULL)) {
+                return 0;
+            }
+            return ns_get32((const unsigned char *) response + len - 10);
+        }
+
+        void save(int64_t saved_at, uint64_t now) {
+            persist_collect(&part, &cache, &verdicts, now);
+            ASSERT_EQ(0, persist_write(path, &cfg, &part, 1, saved_at));
+        }
+
+        void corrupt(long offset) {
+            FILE *fp = fopen(path, "r+b");
+            int c;
+
+            fseek(fp, offset, SEEK_SET);
+            c = fgetc(fp);
+            fseek(fp, offset, SEEK_SET);
+            fputc(c ^ 0xff, fp);
+            fclose(fp);
+        }
+    };
+
+    TEST_F(PersistTest, RestartKeepsAnswersWithTheirTtlsAged) {
+        cache_t restored;
+        verdict_table_t restored_verdicts;
+
+        store("example.com", 300, 1000);
+        store("short.com", 20, 1000);
+        verdict_store(&verdicts, "www.example.com", VERDICT_FOREIGN, 1000);
+        save(1000, 5000); // 4 s after they were stored.
+
+        cache_init(&restored, 16);
+        verdict_init(&restored_verdicts, 16, 3600);
+        // 30 s later, on a loop that started again at 0.
+        ASSERT_EQ(0, persist_load(path, NULL, &restored, &restored_verdicts, 0, 1030));
+        EXPECT_EQ(1, restored.size);
+        EXPECT_EQ(266u, cached_ttl(&restored, "example.com", 0));
+        EXPECT_EQ(0u, cached_ttl(&restored, "short.com", 0)); // expired while gdns was away.
+        EXPECT_EQ(VERDICT_FOREIGN, verdict_lookup(&restored_verdicts, "example.com", 3600000 - 34000 - 1));
+        EXPECT_EQ(VERDICT_UNKNOWN, verdict_lookup(&restored_verdicts, "example.com", 3600000 - 34000));
+        cache_free(&restored);
+        verdict_free(&restored_verdicts);
+    }
+
+    TEST_F(PersistTest, RestartKeepsModelsOfConfiguredProxies) {
+        upstream_proxy_t restored_proxies[2];
+        struct sockaddr_in addr;
+        server_cfg_t restored_cfg;
+
+        latency_update(&proxies[0].genuine, 40);
+        latency_update(&proxies[0].fake, 20);
+        latency_update(&proxies[1].genuine, 80);
+        proxies[0].enabled = true;
+        save(1000, 0);
+
+        // the second proxy is gone, the first one moved to the second place.
+        memset(restored_proxies, 0, sizeof(restored_proxies));
+        memset(&restored_cfg, 0, sizeof(restored_cfg));
+        uv_ip4_addr("10.0.0.3", 53, &addr);
+        restored_proxies[0].addr = (struct sockaddr *) &addr;
+        restored_proxies[1].addr = (struct sockaddr *) &addrs[0];
+        restored_cfg.proxies = restored_proxies;
+        restored_cfg.proxies_count = 2;
+        ASSERT_EQ(0, persist_load(path, &restored_cfg, &cache, &verdicts, 0, 1000));
+        EXPECT_EQ(0, restored_proxies[0].genuine.samples);
+        EXPECT_EQ(40000, restored_proxies[1].genuine.mean);
+        EXPECT_EQ(20000, restored_proxies[1].fake.mean);
+        EXPECT_TRUE(restored_proxies[1].enabled);
+    }
+
+    TEST_F(PersistTest, WritesAQuestionOfSeveralWorkersOnce) {
+        persist_part_t parts[2];
+        cache_t other, restored;
+        verdict_table_t other_verdicts;
+        uint32_t answers, verdict_count;
+        FILE *fp;
+
+        // a second worker resolved example.com again later, both decided on www.example.com.
+        store("example.com", 300, 1000);
+        store("short.com", 20, 1000);
+        verdict_store(&verdicts, "www.example.com", VERDICT_FOREIGN, 1000);
+        cache_init(&other, 16);
+        verdict_init(&other_verdicts, 16, 3600);
+        std::swap(cache, other);
+        store("example.com", 300, 3000);
+        std::swap(cache, other);
+        verdict_store(&other_verdicts, "www.example.com", VERDICT_FOREIGN, 3000);
+
+        memset(parts, 0, sizeof(parts));
+        persist_collect(&parts[0], &cache, &verdicts, 5000);
+        persist_collect(&parts[1], &other, &other_verdicts, 5000);
+        ASSERT_EQ(0, persist_write(path, &cfg, parts, 2, 1000));
+        fp = fopen(path, "rb");
+        fseek(fp, 28, SEEK_SET); // the counts in the header.
+        ASSERT_EQ(1u, fread(&answers, sizeof(answers), 1, fp));
+        ASSERT_EQ(1u, fread(&verdict_count, sizeof(verdict_count), 1, fp));
+        fclose(fp);
+        EXPECT_EQ(2u, answers);
+        EXPECT_EQ(1u, verdict_count);
+
+        cache_init(&restored, 16);
+        ASSERT_EQ(0, persist_load(path, NULL, &restored, &other_verdicts, 0, 1030));
+        EXPECT_EQ(1, restored.size); // short.com expired while gdns was away.
+        EXPECT_EQ(268u, cached_ttl(&restored, "example.com", 0)); // the fresher answer.
+
+        persist_part_free(&parts[0]);
+        persist_part_free(&parts[1]);
+        cache_free(&other);
+        cache_free(&restored);
+        verdict_free(&other_verdicts);
+    }
+
+    TEST_F(PersistTest, DamagedFileLoadsNothing) {
+        cache_t restored;
+
+        store("example.com", 300, 0);
+        cache_init(&restored, 16);
+        save(1000, 0);
+        corrupt(60); // inside the proxies.
+        EXPECT_EQ(-1, persist_load(path, &cfg, &restored, &verdicts, 0, 1000));
+        EXPECT_EQ(0, restored.size);
+
+        persist_part_free(&part);
+        save(1000, 0);
+        corrupt(8); // the version.
+        EXPECT_EQ(-1, persist_load(path, &cfg, &restored, &verdicts, 0, 1000));
+        EXPECT_EQ(0, restored.size);
+
+        persist_part_free(&part);
+        save(1000, 0);
+        ASSERT_EQ(0, truncate(path, 100));
+        EXPECT_EQ(-1, persist_load(path, &cfg, &restored, &verdicts, 0, 1000));
+        EXPECT_EQ(0, restored.size);
+
+        unlink(path);
+        EXPECT_EQ(-1, persist_load(path, &cfg, &restored, &verdicts, 0, 1000));
+        cache_free(&restored);
+    }
+}
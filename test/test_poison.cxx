@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+#include <arpa/inet.h>
+extern "C" {
+#include "../src/poison.h"
+}
+
+namespace TestPoison {
+
+    static bool has(const poison_set_t *set, const char *ip) {
+        struct in_addr addr;
+        struct in6_addr addr6;
+
+        if (inet_pton(AF_INET, ip, &addr) == 1) {
+            return ip_in_poison_set(set, &addr);
+        }
+        inet_pton(AF_INET6, ip, &addr6);
+        return ip6_in_poison_set(set, &addr6);
+    }
+
+    static bool learn(poison_set_t *set, const char *ip) {
+        struct in_addr addr;
+
+        inet_pton(AF_INET, ip, &addr);
+        return poison_learn(set, &addr);
+    }
+
+    TEST(PoisonTest, HoldsConfiguredAddresses) {
+        char a[] = "243.185.187.39", b[] = "46.82.174.68", c[] = "2001::1", d[] = "2001:da8::666";
+        char *addresses[] = {a, b, c, d};
+        poison_set_t set;
+
+        ASSERT_EQ(0, poison_init(&set, addresses, 4, 0));
+        EXPECT_TRUE(has(&set, "243.185.187.39"));
+        EXPECT_TRUE(has(&set, "46.82.174.68"));
+        EXPECT_TRUE(has(&set, "2001::1"));
+        EXPECT_TRUE(has(&set, "2001:da8::666"));
+        EXPECT_FALSE(has(&set, "8.8.8.8"));
+        EXPECT_FALSE(has(&set, "0.0.0.0"));
+        EXPECT_FALSE(has(&set, "2001::2"));
+        EXPECT_FALSE(learn(&set, "1.2.3.4")); // nothing may be learned.
+        EXPECT_FALSE(has(&set, "1.2.3.4"));
+        poison_free(&set);
+    }
+
+    TEST(PoisonTest, RejectsInvalidAddresses) {
+        char a[] = "1.2.3.4", b[] = "1.2.3.4/24";
+        char *addresses[] = {a, b};
+        poison_set_t set;
+
+        EXPECT_EQ(-1, poison_init(&set, addresses, 2, 16));
+        EXPECT_EQ(0, poison_init(&set, NULL, 0, 16));
+        EXPECT_FALSE(has(&set, "1.2.3.4"));
+        EXPECT_FALSE(has(&set, "::1"));
+        poison_free(&set);
+    }
+
+    TEST(PoisonTest, LearnsUpToTheLimit) {
+        char a[] = "10.0.0.1";
+        char *addresses[] = {a};
+        char ip[INET_ADDRSTRLEN];
+        poison_set_t set;
+        int i;
+
+        ASSERT_EQ(0, poison_init(&set, addresses, 1, 100));
+        EXPECT_FALSE(learn(&set, "10.0.0.1")); // configured already.
+        for (i = 0; i < 150; ++i) {
+            snprintf(ip, sizeof(ip), "59.24.3.%d", i);
+            EXPECT_EQ(i < 100, learn(&set, ip));
+            EXPECT_FALSE(learn(&set, ip));
+        }
+        EXPECT_EQ(100, set.learned_len);
+        for (i = 0; i < 150; ++i) {
+            snprintf(ip, sizeof(ip), "59.24.3.%d", i);
+            EXPECT_EQ(i < 100, has(&set, ip));
+        }
+        EXPECT_TRUE(has(&set, "10.0.0.1"));
+        poison_free(&set);
+    }
+
+    TEST(PoisonTest, ReloadKeepsLearnedAddresses) {
+        char a[] = "10.0.0.1", b[] = "10.0.0.2";
+        char *addresses[] = {a, b};
+        poison_set_t running, set;
+
+        ASSERT_EQ(0, poison_init(&running, addresses, 1, 4));
+        learn(&running, "93.46.8.89");
+        learn(&running, "78.16.49.15");
+        ASSERT_EQ(0, poison_init(&set, addresses + 1, 1, 1));
+        poison_inherit(&set, &running);
+
+        EXPECT_FALSE(has(&set, "10.0.0.1")); // no longer configured.
+        EXPECT_TRUE(has(&set, "10.0.0.2"));
+        EXPECT_TRUE(has(&set, "93.46.8.89"));
+        EXPECT_FALSE(has(&set, "78.16.49.15")); // beyond the new limit.
+        poison_free(&running);
+        poison_free(&set);
+    }
+}
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <set>
+extern "C" {
+#include "../src/pool.h"
+}
+
+namespace TestPool {
+
+    class PoolTest : public ::testing::Test {
+    protected:
+        pool_t pool;
+
+        virtual void SetUp() {
+            pool_init(&pool, 24, 4);
+        }
+
+        virtual void TearDown() {
+            pool_destroy(&pool);
+        }
+    };
+
+    TEST_F(PoolTest, ObjectsAreDistinctAndAligned) {
+        std::set<void *> objects;
+        for (int i = 0; i < 10; ++i) {
+            void *ptr = pool_alloc(&pool);
+            EXPECT_EQ(0u, (uintptr_t) ptr % 16);
+            memset(ptr, 0xff, 24);
+            objects.insert(ptr);
+        }
+        EXPECT_EQ(10u, objects.size());
+        EXPECT_EQ(10, pool.in_use);
+        EXPECT_EQ(3, pool.slab_count);
+    }
+
+    TEST_F(PoolTest, FreedObjectsAreReused) {
+        void *first = pool_alloc(&pool);
+        void *second = pool_alloc(&pool);
+
+        pool_free(&pool, first);
+        EXPECT_EQ(first, pool_alloc(&pool));
+        pool_free(&pool, second);
+        pool_free(&pool, first);
+
+        for (int i = 0; i < 1000; ++i) {
+            void *ptr = pool_alloc(&pool);
+            pool_free(&pool, ptr);
+        }
+        EXPECT_EQ(1, pool.slab_count);
+        EXPECT_EQ(0, pool.in_use);
+    }
+
+}
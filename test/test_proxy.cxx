@@ -0,0 +1,76 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <string.h>
+extern "C" {
+#include "../src/proxy.h"
+}
+
+namespace TestProxy {
+
+    class ProxyTest : public ::testing::Test {
+    protected:
+        upstream_proxy_t proxy;
+
+        virtual void SetUp() {
+            memset(&proxy, 0, sizeof(proxy));
+        }
+    };
+
+    TEST_F(ProxyTest, ModelFollowsDrift) {
+        latency_update(&proxy.genuine, 60);
+        EXPECT_EQ(60000, proxy.genuine.mean);
+        for (int i = 0; i < 100; ++i) {
+            latency_update(&proxy.genuine, 120);
+        }
+        EXPECT_NEAR(120000, proxy.genuine.mean, 1000);
+        EXPECT_LT(proxy.genuine.dev, 2000);
+    }
+
+    TEST_F(ProxyTest, ThresholdTracksFakeSpread) {
+        for (int i = 0; i < 50; ++i) {
+            latency_update(&proxy.fake, 3 + i % 2);
+            latency_update(&proxy.genuine, 60);
+        }
+        // fake answers stay within a few ms, so a 20 ms answer is already genuine.
+        EXPECT_LT(proxy_confidence(&proxy, 4), 1.0);
+        EXPECT_GE(proxy_confidence(&proxy, 20), 1.0);
+
+        // with widely spread fake answers, the threshold moves towards the genuine mean.
+        for (int i = 0; i < 50; ++i) {
+            latency_update(&proxy.fake, i % 2 ? 2 : 40);
+        }
+        EXPECT_LT(proxy_confidence(&proxy, 20), 1.0);
+        EXPECT_GE(proxy_confidence(&proxy, 60), 1.0);
+    }
+
+    TEST_F(ProxyTest, ReloadInheritsModelsOfSameProxies) {
+        upstream_proxy_t running_proxies[2], proxies[2];
+        struct sockaddr_in addrs[3];
+        server_cfg_t running, cfg;
+
+        memset(running_proxies, 0, sizeof(running_proxies));
+        memset(proxies, 0, sizeof(proxies));
+        uv_ip4_addr("10.0.0.1", 53, &addrs[0]);
+        uv_ip4_addr("10.0.0.2", 53, &addrs[1]);
+        uv_ip4_addr("10.0.0.2", 53, &addrs[2]);
+        running_proxies[0].addr = (struct sockaddr *) &addrs[0];
+        running_proxies[1].addr = (struct sockaddr *) &addrs[1];
+        latency_update(&running_proxies[0].genuine, 40);
+        latency_update(&running_proxies[1].genuine, 80);
+        running.proxies = running_proxies;
+        running.proxies_count = 2;
+
+        // the same address, but now over tcp, is a different proxy.
+        proxies[0].addr = (struct sockaddr *) &addrs[2];
+        proxies[1].addr = (struct sockaddr *) &addrs[0];
+        proxies[0].tcp = true;
+        cfg.proxies = proxies;
+        cfg.proxies_count = 2;
+
+        proxies_inherit(&cfg, &running);
+        EXPECT_EQ(0, proxies[0].genuine.samples);
+        EXPECT_EQ(40000, proxies[1].genuine.mean);
+        EXPECT_EQ(1, proxies[1].genuine.samples);
+    }
+
+}
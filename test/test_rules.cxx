@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <stdio.h>
+#include <unistd.h>
+extern "C" {
+#include "../src/rules.h"
+}
+
+namespace TestRules {
+
+    class RulesTest : public ::testing::Test {
+    protected:
+        rules_t rules;
+
+        virtual void SetUp() {
+            rules_init(&rules);
+        }
+
+        virtual void TearDown() {
+            rules_free(&rules);
+        }
+    };
+
+    TEST_F(RulesTest, EmptyCoversNothing) {
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "www.google.com"));
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "."));
+    }
+
+    TEST_F(RulesTest, CoversDomainAndNamesUnderIt) {
+        ASSERT_EQ(0, rules_add(&rules, "google.com", VERDICT_FOREIGN));
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "google.com"));
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "www.google.com"));
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "a.b.c.google.com"));
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "notgoogle.com"));
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "com"));
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "google.com.hk"));
+    }
+
+    TEST_F(RulesTest, LongestMatchWins) {
+        rules_add(&rules, "cn", VERDICT_INTERNAL);
+        rules_add(&rules, "google.cn", VERDICT_FOREIGN);
+        rules_add(&rules, "maps.google.cn", VERDICT_INTERNAL);
+        EXPECT_EQ(VERDICT_INTERNAL, rules_lookup(&rules, "www.baidu.cn"));
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "www.google.cn"));
+        EXPECT_EQ(VERDICT_INTERNAL, rules_lookup(&rules, "a.maps.google.cn"));
+    }
+
+    TEST_F(RulesTest, BlockedWinsOverDomestic) {
+        rules_add(&rules, "example.com", VERDICT_FOREIGN);
+        rules_add(&rules, "example.com", VERDICT_INTERNAL);
+        rules_add(&rules, "example.net", VERDICT_INTERNAL);
+        rules_add(&rules, "example.net", VERDICT_FOREIGN);
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "example.com"));
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "example.net"));
+        EXPECT_EQ(2, rules.size);
+    }
+
+    TEST_F(RulesTest, NormalizesDomains) {
+        EXPECT_EQ(0, rules_add(&rules, "*.YouTube.com.", VERDICT_FOREIGN));
+        EXPECT_EQ(0, rules_add(&rules, ".twitter.com", VERDICT_FOREIGN));
+        EXPECT_EQ(-1, rules_add(&rules, "||facebook.com^", VERDICT_FOREIGN));
+        EXPECT_EQ(-1, rules_add(&rules, "a..b", VERDICT_FOREIGN));
+        EXPECT_EQ(-1, rules_add(&rules, "", VERDICT_FOREIGN));
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "www.youtube.com"));
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "twitter.com"));
+        EXPECT_EQ(2, rules.size);
+    }
+
+    TEST_F(RulesTest, EscapedDotIsNotABoundary) {
+        rules_add(&rules, "example.com", VERDICT_FOREIGN);
+        EXPECT_EQ(VERDICT_FOREIGN, rules_lookup(&rules, "a\\.b.example.com"));
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "a\\.example.com"));
+    }
+
+    TEST_F(RulesTest, GrowsPastManyRules) {
+        char name[64];
+        int i;
+
+        for (i = 0; i < 100000; ++i) {
+            snprintf(name, sizeof(name), "d%d.example%d.com", i, i % 7);
+            rules_add(&rules, name, i % 2 ? VERDICT_FOREIGN : VERDICT_INTERNAL);
+        }
+        EXPECT_EQ(100000, rules.size);
+        EXPECT_LE((uint32_t) rules.size * 2, rules.mask + 1);
+        for (i = 0; i < 100000; i += 997) {
+            snprintf(name, sizeof(name), "www.d%d.example%d.com", i, i % 7);
+            EXPECT_EQ(i % 2 ? VERDICT_FOREIGN : VERDICT_INTERNAL, rules_lookup(&rules, name));
+        }
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "example1.com"));
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "d1.example2.com"));
+    }
+
+    TEST_F(RulesTest, LoadsPlainAndDnsmasqLists) {
+        char path[] = "/tmp/gdns_rules_XXXXXX";
+        int fd = mkstemp(path);
+        FILE *fp;
+
+        ASSERT_GE(fd, 0);
+        fp = fdopen(fd, "w");
+        fputs("# comment\n"
+              "! gfwlist comment\n"
+              "\n"
+              "google.com\n"
+              "  youtube.com   # trailing comment\r\n"
+              "server=/baidu.com/qq.com/114.114.114.114\n"
+              "ipset=/taobao.com/china\n"
+              "||not-a-domain^\n", fp);
+        fclose(fp);
+
+        EXPECT_EQ(-1, rules_load(&rules, "/nonexistent/rules.txt", VERDICT_FOREIGN));
+        ASSERT_EQ(0, rules_load(&rules, path, VERDICT_INTERNAL));
+        unlink(path);
+
+        EXPECT_EQ(5, rules.size);
+        EXPECT_EQ(VERDICT_INTERNAL, rules_lookup(&rules, "www.google.com"));
+        EXPECT_EQ(VERDICT_INTERNAL, rules_lookup(&rules, "m.youtube.com"));
+        EXPECT_EQ(VERDICT_INTERNAL, rules_lookup(&rules, "baidu.com"));
+        EXPECT_EQ(VERDICT_INTERNAL, rules_lookup(&rules, "qq.com"));
+        EXPECT_EQ(VERDICT_INTERNAL, rules_lookup(&rules, "item.taobao.com"));
+        EXPECT_EQ(VERDICT_UNKNOWN, rules_lookup(&rules, "114.114.114.114"));
+    }
+}
@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <stdlib.h>
+#include <string.h>
+extern "C" {
+#include "../src/stats.h"
+#include "../src/histogram.h"
+#include "../src/cache.h"
+}
+
+namespace TestStats {
+
+    class StatsTest : public ::testing::Test {
+    protected:
+        server_cfg_t cfg;
+        upstream_proxy_t proxies[2];
+        struct sockaddr_in addrs[2];
+        server_ctx_t *workers[2];
+
+        virtual void SetUp() {
+            int i;
+
+            memset(&cfg, 0, sizeof(cfg));
+            memset(proxies, 0, sizeof(proxies));
+            uv_ip4_addr("10.0.0.1", 53, &addrs[0]);
+            uv_ip4_addr("10.0.0.2", 5353, &addrs[1]);
+            proxies[0].addr = (struct sockaddr *) &addrs[0];
+            proxies[0].internal = true;
+            proxies[1].addr = (struct sockaddr *) &addrs[1];
+            proxies[1].tcp = true;
+            cfg.proxies = proxies;
+            cfg.proxies_count = 2;
+            for (i = 0; i < 2; ++i) {
+                workers[i] = (server_ctx_t *) calloc(1, sizeof(server_ctx_t));
+                workers[i]->cfg = &cfg;
+                cache_init(&workers[i]->cache, 0);
+                stats_init(workers[i]);
+            }
+        }
+
+        virtual void TearDown() {
+            int i;
+
+            for (i = 0; i < 2; ++i) {
+                stats_free(workers[i]);
+                cache_free(&workers[i]->cache);
+                free(workers[i]);
+            }
+        }
+    };
+
+    TEST_F(StatsTest, SumsWorkers) {
+        size_t len;
+        char *text;
+
+        STAT_ADD(workers[0]->stats.queries, 3);
+        STAT_ADD(workers[1]->stats.queries, 4);
+        STAT_ADD(workers[1]->stats.answers[ANSWER_IN_SUBNET], 2);
+        STAT_ADD(workers[0]->stats.proxies[1].errors, 1);
+        histogram_add(&workers[0]->stats.proxies[0].latency, 8);
+        histogram_add(&workers[1]->stats.proxies[0].latency, 30);
+        STAT_ADD(workers[0]->client_count, 2);
+        STAT_ADD(workers[1]->client_count, 1);
+
+        text = stats_render(&cfg, &len);
+        ASSERT_TRUE(text != NULL);
+        EXPECT_EQ(strlen(text), len);
+        EXPECT_TRUE(strstr(text, "\ngdns_queries_total 7\n"));
+        EXPECT_TRUE(strstr(text, "gdns_answers_total{path=\"in_subnet\"} 2\n"));
+        EXPECT_TRUE(strstr(text, "gdns_answers_total{path=\"timeout_fallback\"} 0\n"));
+        EXPECT_TRUE(strstr(text, "\ngdns_tcp_clients 3\n"));
+        EXPECT_TRUE(strstr(text, "gdns_proxy_errors_total{proxy=\"10.0.0.2:5353\",transport=\"tcp\","
+                                 "kind=\"external\"} 1\n"));
+        EXPECT_TRUE(strstr(text, "gdns_proxy_latency_ms_bucket{proxy=\"10.0.0.1:53\",transport=\"udp\","
+                                 "kind=\"internal\",le=\"10\"} 1\n"));
+        EXPECT_TRUE(strstr(text, "gdns_proxy_latency_ms_bucket{proxy=\"10.0.0.1:53\",transport=\"udp\","
+                                 "kind=\"internal\",le=\"+Inf\"} 2\n"));
+        EXPECT_TRUE(strstr(text, "gdns_proxy_latency_ms_sum{proxy=\"10.0.0.1:53\",transport=\"udp\","
+                                 "kind=\"internal\"} 38\n"));
+        free(text);
+    }
+
+    TEST_F(StatsTest, ForgetsFreedWorker) {
+        size_t len;
+        char *text;
+
+        STAT_ADD(workers[1]->stats.queries, 5);
+        stats_free(workers[1]);
+        text = stats_render(&cfg, &len);
+        EXPECT_TRUE(strstr(text, "\ngdns_queries_total 0\n"));
+        free(text);
+        stats_init(workers[1]); // for TearDown.
+    }
+
+    TEST_F(StatsTest, SwapKeepsCountsOfSameProxies) {
+        server_cfg_t reloaded;
+        upstream_proxy_t reloaded_proxies[2];
+        struct sockaddr_in addr;
+        proxy_stats_t *replaced = workers[0]->stats.proxies;
+        proxy_stats_t *swapped;
+        size_t len;
+        char *text;
+
+        memset(&reloaded, 0, sizeof(reloaded));
+        memset(reloaded_proxies, 0, sizeof(reloaded_proxies));
+        uv_ip4_addr("10.0.0.3", 53, &addr);
+        reloaded_proxies[0] = proxies[1];
+        reloaded_proxies[1].addr = (struct sockaddr *) &addr;
+        reloaded.proxies = reloaded_proxies;
+        reloaded.proxies_count = 2;
+
+        STAT_ADD(workers[0]->stats.proxies[1].errors, 2);
+        STAT_ADD(workers[1]->stats.proxies[1].errors, 5);
+        swapped = stats_swap(workers[0], &reloaded);
+        EXPECT_EQ(swapped, workers[0]->stats.proxies);
+        EXPECT_EQ(2u, swapped[0].errors);
+        EXPECT_EQ(0u, swapped[1].errors);
+
+        // the second worker still serves the old proxies, they are left out.
+        text = stats_render(&reloaded, &len);
+        EXPECT_TRUE(strstr(text, "gdns_proxy_errors_total{proxy=\"10.0.0.2:5353\",transport=\"tcp\","
+                                 "kind=\"external\"} 2\n"));
+        EXPECT_TRUE(strstr(text, "gdns_proxy_errors_total{proxy=\"10.0.0.3:53\",transport=\"udp\","
+                                 "kind=\"external\"} 0\n"));
+        EXPECT_FALSE(strstr(text, "10.0.0.1:53"));
+        free(text);
+        free(replaced);
+    }
+
+}
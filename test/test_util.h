@@ -0,0 +1,34 @@
+#ifndef GDNS_TEST_UTIL_H
+#define GDNS_TEST_UTIL_H
+
+#include <string.h>
+#include <resolv.h>
+#include <sys/types.h>
+
+// messages the tests build and feed to the cache.
+namespace TestUtil {
+
+    // a query for the A record of domain with id.
+    static inline ssize_t make_query(const char *domain, uint16_t id, unsigned char *buf) {
+        int len = res_mkquery(QUERY, domain, C_IN, T_A, NULL, 0, NULL, buf, PACKETSZ);
+        ns_put16(id, buf);
+        return len;
+    }
+
+    // answer the query with a single A record.
+    static inline ssize_t make_response(const unsigned char *query, ssize_t len, uint32_t ttl, unsigned char *buf) {
+        unsigned char *p = buf + len;
+        memcpy(buf, query, (size_t) len);
+        buf[2] |= 0x80; // QR
+        ns_put16(1, buf + 6); // ANCOUNT
+        ns_put16(0xc00c, p);
+        ns_put16(ns_t_a, p + 2);
+        ns_put16(ns_c_in, p + 4);
+        ns_put32(ttl, p + 6);
+        ns_put16(4, p + 10);
+        ns_put32(0x01020304, p + 12);
+        return len + 16;
+    }
+}
+
+#endif //GDNS_TEST_UTIL_H
@@ -0,0 +1,52 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+extern "C" {
+#include "../src/verdict.h"
+}
+
+namespace TestVerdict {
+
+    class VerdictTest : public ::testing::Test {
+    protected:
+        verdict_table_t table;
+
+        virtual void SetUp() {
+            verdict_init(&table, 2, 60);
+        }
+
+        virtual void TearDown() {
+            verdict_free(&table);
+        }
+    };
+
+    TEST(RegistrableDomainTest, KeepsOwnerLabels) {
+        EXPECT_STREQ("example.com", registrable_domain("example.com"));
+        EXPECT_STREQ("example.com", registrable_domain("a.b.www.example.com"));
+        EXPECT_STREQ("sina.com.cn", registrable_domain("news.sina.com.cn"));
+        EXPECT_STREQ("bbc.co.uk", registrable_domain("www.bbc.co.uk"));
+        EXPECT_STREQ("com.cn", registrable_domain("com.cn"));
+        EXPECT_STREQ("localhost", registrable_domain("localhost"));
+    }
+
+    TEST_F(VerdictTest, SharedBySubdomainsUntilExpired) {
+        verdict_store(&table, "www.google.com", VERDICT_FOREIGN, 1000);
+        EXPECT_EQ(VERDICT_FOREIGN, verdict_lookup(&table, "mail.google.com", 2000));
+        EXPECT_EQ(VERDICT_UNKNOWN, verdict_lookup(&table, "google.com.hk", 2000));
+        EXPECT_EQ(VERDICT_UNKNOWN, verdict_lookup(&table, "google.com", 61000));
+    }
+
+    TEST_F(VerdictTest, ForgetAndEvictLeastRecentlyUsed) {
+        verdict_store(&table, "baidu.com", VERDICT_INTERNAL, 0);
+        verdict_store(&table, "youtube.com", VERDICT_FOREIGN, 0);
+        verdict_forget(&table, "www.youtube.com");
+        EXPECT_EQ(VERDICT_UNKNOWN, verdict_lookup(&table, "youtube.com", 0));
+
+        verdict_store(&table, "qq.com", VERDICT_INTERNAL, 0);
+        EXPECT_EQ(VERDICT_INTERNAL, verdict_lookup(&table, "baidu.com", 0));
+        verdict_store(&table, "twitter.com", VERDICT_FOREIGN, 0);
+        EXPECT_EQ(VERDICT_INTERNAL, verdict_lookup(&table, "baidu.com", 0));
+        EXPECT_EQ(VERDICT_UNKNOWN, verdict_lookup(&table, "qq.com", 0));
+        EXPECT_EQ(2, table.size);
+    }
+
+}
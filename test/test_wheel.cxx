@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+#include <uv.h>
+#include <vector>
+extern "C" {
+#include "../src/wheel.h"
+}
+
+namespace TestWheel {
+
+    struct fired_t {
+        intptr_t id;
+        uint64_t at; // wheel time, ms after start.
+    };
+
+    static std::vector<fired_t> fired;
+    static uint64_t start;
+
+    static void on_fire(wheel_timer_t *timer) {
+        fired.push_back({(intptr_t) timer->data, timer->wheel->now - start});
+    }
+
+    class WheelTest : public ::testing::Test {
+    protected:
+        uv_loop_t loop;
+        timer_wheel_t wheel;
+        wheel_timer_t timers[4];
+
+        virtual void SetUp() {
+            uv_loop_init(&loop);
+            wheel_init(&wheel, &loop);
+            start = uv_now(&loop); // stays put as long as the loop is not run.
+            fired.clear();
+            for (intptr_t i = 0; i < 4; ++i) {
+                wheel_timer_init(&timers[i], (void *) i);
+            }
+        }
+
+        virtual void TearDown() {
+            wheel_close(&wheel);
+            uv_run(&loop, UV_RUN_DEFAULT);
+            uv_loop_close(&loop);
+        }
+    };
+
+    TEST_F(WheelTest, FiresInOrderOnTime) {
+        wheel_timer_start(&wheel, &timers[0], on_fire, 5);
+        wheel_timer_start(&wheel, &timers[1], on_fire, 1);
+        wheel_timer_start(&wheel, &timers[2], on_fire, 3);
+        EXPECT_EQ(3, wheel.count);
+
+        wheel_advance(&wheel, start + 2);
+        ASSERT_EQ(1u, fired.size());
+        EXPECT_EQ(1, fired[0].id);
+        EXPECT_EQ(1u, fired[0].at);
+
+        wheel_advance(&wheel, start + 10);
+        ASSERT_EQ(3u, fired.size());
+        EXPECT_EQ(2, fired[1].id);
+        EXPECT_EQ(3u, fired[1].at);
+        EXPECT_EQ(0, fired[2].id);
+        EXPECT_EQ(5u, fired[2].at);
+        EXPECT_EQ(0, wheel.count);
+    }
+
+    TEST_F(WheelTest, StopAndRestart) {
+        wheel_timer_start(&wheel, &timers[0], on_fire, 10);
+        wheel_timer_start(&wheel, &timers[1], on_fire, 10);
+        wheel_timer_start(&wheel, &timers[2], on_fire, 10);
+        wheel_timer_stop(&timers[1]);
+        wheel_timer_stop(&timers[1]);
+        wheel_timer_start(&wheel, &timers[2], on_fire, 100);
+        EXPECT_EQ(2, wheel.count);
+
+        wheel_advance(&wheel, start + 50);
+        ASSERT_EQ(1u, fired.size());
+        EXPECT_EQ(0, fired[0].id);
+        wheel_advance(&wheel, start + 100);
+        ASSERT_EQ(2u, fired.size());
+        EXPECT_EQ(2, fired[1].id);
+        EXPECT_EQ(100u, fired[1].at);
+    }
+
+    TEST_F(WheelTest, CascadesDownTheLevels) {
+        uint64_t timeouts[4] = {70, 5000, 300000, 20000000}; // the last one lies beyond the wheel.
+
+        for (int i = 0; i < 4; ++i) {
+            wheel_timer_start(&wheel, &timers[i], on_fire, timeouts[i]);
+        }
+        for (int i = 0; i < 4; ++i) {
+            wheel_advance(&wheel, start + timeouts[i] - 1);
+            EXPECT_EQ((size_t) i, fired.size());
+            wheel_advance(&wheel, start + timeouts[i]);
+            ASSERT_EQ((size_t) i + 1, fired.size());
+            EXPECT_EQ(i, fired[i].id);
+            EXPECT_EQ(timeouts[i], fired[i].at);
+        }
+        EXPECT_EQ(0, wheel.count);
+    }
+
+    static wheel_timer_t *victim;
+
+    static void on_fire_stop_victim(wheel_timer_t *timer) {
+        on_fire(timer);
+        wheel_timer_stop(victim);
+        wheel_timer_start(timer->wheel, timer, on_fire, 0); // fires on the next ms, not again in this one.
+    }
+
+    TEST_F(WheelTest, CallbackStopsAndArmsTimers) {
+        wheel_timer_start(&wheel, &timers[0], on_fire, 4);
+        wheel_timer_start(&wheel, &timers[1], on_fire_stop_victim, 4);
+        victim = &timers[0];
+
+        wheel_advance(&wheel, start + 4);
+        ASSERT_EQ(1u, fired.size());
+        EXPECT_EQ(1, fired[0].id);
+        EXPECT_EQ(1, wheel.count);
+        wheel_advance(&wheel, start + 5);
+        ASSERT_EQ(2u, fired.size());
+        EXPECT_EQ(1, fired[1].id);
+        EXPECT_EQ(5u, fired[1].at);
+    }
+
+    TEST_F(WheelTest, RunsOnTheLoop) {
+        uint64_t begin = uv_hrtime();
+
+        wheel_timer_start(&wheel, &timers[0], on_fire, 30);
+        wheel_timer_start(&wheel, &timers[1], on_fire, 10);
+        uv_run(&loop, UV_RUN_DEFAULT); // returns once the handle stops with the last timer.
+        ASSERT_EQ(2u, fired.size());
+        EXPECT_EQ(1, fired[0].id);
+        EXPECT_EQ(0, fired[1].id);
+        EXPECT_GE(uv_hrtime() - begin, 29 * 1000000u); // the loop clock counts whole ms.
+    }
+}